@@ -281,6 +281,9 @@ class IMAGE_MT_layers(Menu):
         layout.menu("IMAGE_MT_layers_order", icon='SORTALPHA')
         layout.menu("IMAGE_MT_layers_transform", icon='MANIPUL')
         layout.menu("IMAGE_MT_layers_scale", icon='MAN_SCALE')
+        layout.separator()
+        layout.operator("image.layers_import", text="Import Layers...", icon='IMPORT')
+        layout.operator("image.layers_export", text="Export Layers...", icon='EXPORT')
 
 
 class IMAGE_MT_layers_new(Menu):
@@ -870,7 +873,15 @@ class IMAGE_UL_ima_layers(UIList):
         layer = item
         if self.layout_type in {'DEFAULT', 'COMPACT'}:
             split = layout.split()
-            split.label(text=layer.name, icon_value=icon)
+            row = split.row()
+            for i in range(layer.depth):
+                row.separator()
+            if layer.type == 'GROUP':
+                row.label(text=layer.name, icon='FILE_FOLDER')
+            elif layer.type == 'ADJUSTMENT':
+                row.label(text=layer.name, icon='COLOR')
+            else:
+                row.label(text=layer.name, icon_value=icon)
             row = split.row()
             row.alignment = 'RIGHT'
             row.prop(layer, "locked", text="", emboss=False)
@@ -917,6 +928,10 @@ class IMAGE_PT_image_layers(Panel, ImagePaintPanel):
                 sub.operator("image.layer_remove", text="", icon='CANCEL').action = 'SELECTED'
                 col.operator("image.layer_move", text="", icon='TRIA_UP').type = 'UP'
                 col.operator("image.layer_move", text="", icon='TRIA_DOWN').type = 'DOWN'
+                col.operator("image.layer_group", text="", icon='FILE_FOLDER')
+                col.operator_menu_enum("image.layer_adjustment_add", "type", text="", icon='COLOR')
+                if layers.active_image_layer.type == 'GROUP':
+                    col.operator("image.layer_ungroup", text="", icon='X')
                 split = layout.split(percentage=0.35)
                 col = split.column()
                 col.label(text="Name")
@@ -934,6 +949,38 @@ class IMAGE_PT_image_layers(Panel, ImagePaintPanel):
                 sub.prop(layers.active_image_layer, "opacity", text="")
                 sub.prop(layers.active_image_layer, "blend_type", text="")
 
+                layer = layers.active_image_layer
+                if ima.is_float and layer.type in {'BASE', 'LAYER'}:
+                    layout.prop(layer, "use_half_float")
+
+                adjustment = layer.adjustment
+                if layer.type == 'ADJUSTMENT' and adjustment:
+                    col = layout.column()
+                    col.prop(adjustment, "type", text="")
+                    if adjustment.type == 'CURVES':
+                        col.template_curve_mapping(adjustment, "curve", type='COLOR')
+                    elif adjustment.type == 'LEVELS':
+                        col.prop(adjustment, "levels_in")
+                        col.prop(adjustment, "levels_out")
+                        col.prop(adjustment, "levels_gamma")
+                    elif adjustment.type == 'HUE_SATURATION':
+                        col.prop(adjustment, "hue")
+                        col.prop(adjustment, "saturation")
+                        col.prop(adjustment, "value")
+                    elif adjustment.type == 'EXPOSURE':
+                        col.prop(adjustment, "exposure")
+                        col.prop(adjustment, "offset")
+
+                if layer.has_mask:
+                    row = layout.row(align=True)
+                    row.prop(layer, "use_mask", toggle=True)
+                    row.prop(layer, "edit_mask", toggle=True)
+                    row = layout.row(align=True)
+                    row.operator("image.layer_mask_remove", text="Apply Mask").apply = True
+                    row.operator("image.layer_mask_remove", text="Delete Mask").apply = False
+                elif layer.type != 'BASE':
+                    layout.operator_menu_enum("image.layer_mask_add", "type")
+
 
 class IMAGE_PT_paint(Panel, ImagePaintPanel):
     bl_space_type = 'IMAGE_EDITOR'
@@ -47,12 +47,16 @@ typedef struct Icon Icon;
 
 struct PreviewImage;
 struct ID;
+struct ImageLayer;
 
 void BKE_icons_init(int first_dyn_id);
 
 /* return icon id for library object or create new icon if not found */
 int BKE_icon_getid(struct ID *id);
 
+/* same for the thumbnail of an image layer, made with its preview */
+int BKE_icon_imalayer_getid(struct ImageLayer *layer);
+
 /* retrieve icon for id */
 struct Icon *BKE_icon_get(int icon_id);
 
@@ -62,6 +66,7 @@ void BKE_icon_set(int icon_id, struct Icon *icon);
 
 /* remove icon and free date if library object becomes invalid */
 void BKE_icon_delete(struct ID *id);
+void BKE_icon_imalayer_delete(struct ImageLayer *layer);
 
 /* report changes - icon needs to be recalculated */
 void BKE_icon_changed(int icon_id);
@@ -87,4 +92,7 @@ struct PreviewImage *BKE_previewimg_copy(struct PreviewImage *prv);
 /* retrieve existing or create new preview image */
 struct PreviewImage *BKE_previewimg_get(struct ID *id);
 
+/* preview image the icon draws */
+struct PreviewImage *BKE_icon_previewimg_get(struct Icon *icon);
+
 #endif /*  __BKE_ICONS_H__ */
@@ -39,7 +39,16 @@ extern "C" {
 
 struct Image;
 struct ImageLayer;
+struct ImageLayerAdjustment;
+struct ImageLayerMask;
+struct ImageLayerMip;
+struct ImageLayerStorage;
 struct ImBuf;
+struct ReportList;
+
+/* The composite is refreshed in tiles of this size, same as the paint undo tiles */
+#define IMA_LAYER_TILE_BITS		6
+#define IMA_LAYER_TILE_SIZE		(1 << IMA_LAYER_TILE_BITS)
 
 /* call from library */
 
@@ -63,6 +72,24 @@ struct ImageLayer *image_add_image_layer(struct Image *ima, const char *name, in
 
 /* Adds the base layer of images that points Image->ibufs.first */
 void image_add_image_layer_base(struct Image *ima);
+
+/* Layer groups: the layers following an IMA_LAYER_GROUP layer with a higher
+ * ImageLayer.depth are in it. A group is blended like a layer holding the
+ * composite of its layers, which is cached */
+bool imalayer_is_group(const struct ImageLayer *layer);
+/* Groups and adjustment layers have none, what they show comes from other layers */
+bool imalayer_has_pixels(const struct ImageLayer *layer);
+/* The last layer in a group, the layer itself when it isn't one */
+struct ImageLayer *imalayer_group_last(struct ImageLayer *layer);
+struct ImageLayer *imalayer_get_parent(struct ImageLayer *layer);
+/* Moves a layer, with its layers for a group, before "next" (NULL is the end) */
+void imalayer_move_block(struct Image *ima, struct ImageLayer *layer, struct ImageLayer *next);
+/* Puts the current layer in a new group */
+struct ImageLayer *image_add_layer_group(struct Image *ima);
+int image_ungroup_layer(struct Image *ima, struct ImageLayer *group);
+/* Replaces a group with a layer of its composite, NULL when it showed nothing */
+struct ImageLayer *image_merge_layer_group(struct Image *ima, struct ImageLayer *group);
+void image_merge_layer_groups(struct Image *ima);
  
 /* Returns the index of the currently selected image layer */
 short imalayer_get_current_act(struct Image *ima);
@@ -89,8 +116,200 @@ struct ImBuf *imalayer_blend(struct ImBuf *base, struct ImBuf *layer, float opac
 
 struct ImageLayer *merge_layers(struct Image *ima, struct ImageLayer *iml, struct ImageLayer *iml_next);
 
+/* Blends the visible layers into ima->ibufs.first, reusing the cached
+ * composite when no layer changed since the last call */
 void merge_layers_visible_nd(struct Image *ima);
 
+/* Marks the pixels of a layer as changed, the composite is rebuilt on next access */
+void imalayer_tag_dirty(struct ImageLayer *layer);
+void imalayer_tag_dirty_all(struct Image *ima);
+/* Same, but only the tiles of the composite touching the rectangle get re-blended */
+void imalayer_tag_dirty_region(struct Image *ima, struct ImageLayer *layer, int x, int y, int w, int h);
+
+/* Same for the mask of the layer only */
+void imalayer_mask_tag_dirty(struct ImageLayer *layer);
+
+/* Gives a layer read from file generations of this session, its storage stays clean */
+void imalayer_tag_loaded(struct ImageLayer *layer);
+
+/* Composite cache of Image->imlayers */
+void imalayer_cache_tag_dirty(struct Image *ima);
+void imalayer_cache_free(struct Image *ima);
+
+/* Tiled and compressed layer pixels, as written in files (layer_storage.c) */
+struct ImageLayerStorage *imalayer_storage_pack(struct ImBuf *ibuf, bool half_float);
+void imalayer_storage_free(struct ImageLayerStorage *storage);
+/* Copies the compressed tiles, for reading them outside the main thread */
+struct ImageLayerStorage *imalayer_storage_copy(const struct ImageLayerStorage *storage);
+/* Returns ImageLayer.storage, packed again if the layer changed since */
+struct ImageLayerStorage *imalayer_storage_ensure(struct ImageLayer *layer);
+/* Decodes the pixels of layers that are only in their storage (read from
+ * file, evicted or new) */
+void imalayer_ensure_layer_pixels(struct ImageLayer *layer);
+/* Frees the pixels of the layers that didn't change since they were stored
+ * and aren't acquired */
+void imalayer_evict_pixels(struct Image *ima);
+/* Tags the tiles of a painted rectangle, only they are packed again when the
+ * storage matched the pixels of "generation", the one before the change */
+void imalayer_storage_tag_region(struct ImageLayer *layer, int generation, int x, int y, int w, int h);
+/* Frees the pixels of a layer mostly made of uniform tiles, after a stroke.
+ * Returns true when the layer is sparse again */
+bool imalayer_make_sparse(struct Image *ima, struct ImageLayer *layer);
+/* Half float layers (IMA_LAYER_HALF_FLOAT) only keep their float pixels while
+ * they're the active layer, the other ones go back to their tiles. So do the
+ * inactive layers imalayer_make_sparse() accepts */
+void imalayer_storage_compact(struct ImageLayer *layer);
+void imalayer_storage_compact_inactive(struct Image *ima);
+void imalayer_set_half_float(struct Image *ima, struct ImageLayer *layer, bool half_float);
+/* Sparse layers have no pixels, only their storage. New layers of one color
+ * and evicted ones are composited straight from their tiles */
+struct ImageLayerStorage *imalayer_storage_new_uniform(int x, int y, const unsigned char rect_pixel[4],
+                                                       const float float_pixel[4]);
+struct ImageLayerStorage *imalayer_sparse_storage(struct ImageLayer *layer);
+/* Storage filled tile by tile, for layers read from other files. "pixels"
+ * are the rows of tile tx, ty, packed */
+struct ImageLayerStorage *imalayer_storage_new(int x, int y, bool use_rect, bool use_float, bool half_float);
+void imalayer_storage_pack_tile(struct ImageLayerStorage *storage, bool is_float, int tx, int ty, void *pixels);
+/* Pixels of tile tx, ty for reading, r_stride is 0 when its first row repeats.
+ * "buf" needs room for IMA_LAYER_TILE_SIZE^2 pixels */
+const void *imalayer_storage_tile_pixels(const struct ImageLayerStorage *storage, bool is_float, int tx, int ty,
+                                         void *buf, int *r_stride);
+/* The layer ImBuf with its pixels, decoded first for sparse layers. Use it
+ * instead of ImageLayer.ibufs.first for editing pixels, the storage is
+ * packed again afterwards */
+struct ImBuf *imalayer_get_ibuf(struct ImageLayer *layer);
+/* For reading: the pixels are only decoded, the storage stays a clean copy
+ * of them. A pending transform is left as it is, the pixels are the ones
+ * ImageLayer.transform maps to. Edits through it have to tag the layer */
+struct ImBuf *imalayer_get_ibuf_untransformed(struct ImageLayer *layer);
+
+/* Non destructive transforms (layer_transform.c). The operators only change
+ * ImageLayer.transform, the pixels are sampled through it while compositing
+ * and resampled once when the layer gets edited */
+bool imalayer_transform_is_set(const struct ImageLayer *layer);
+/* Size of the layer as it's shown, transformed */
+void imalayer_transform_get_size(const struct ImageLayer *layer, int *r_width, int *r_height);
+void imalayer_transform_rotate(struct ImageLayer *layer, float angle, bool lock, short filter, const float col[4]);
+void imalayer_transform_offset(struct ImageLayer *layer, int x, int y, bool half, bool wrap, const float col[4]);
+void imalayer_transform_scale(struct ImageLayer *layer, int width, int height);
+void imalayer_transform_size(struct ImageLayer *layer, int width, int height, int off_x, int off_y, bool centre,
+                             const float col[4]);
+void imalayer_transform_flip(struct ImageLayer *layer, bool flip_x, bool flip_y);
+/* Pixels x..x+len of row y of the transformed layer, sampled from "ibuf" */
+void imalayer_transform_sample_row(const struct ImageLayer *layer, const struct ImBuf *ibuf, bool is_float,
+                                   int x, int y, int len, void *r_row);
+/* A new buffer with the transform of the layer applied to "ibuf" */
+struct ImBuf *imalayer_transform_bake(const struct ImageLayer *layer, const struct ImBuf *ibuf);
+/* Resamples the pixels of the layer through its transform and clears it */
+void imalayer_transform_apply(struct ImageLayer *layer);
+
+/* Greyscale layer masks (layer_mask.c), sparse tiles of 8 bit values that
+ * scale the alpha of the layer while it's blended */
+#define IMA_LAYER_MASK_WHITE		0
+#define IMA_LAYER_MASK_BLACK		1
+#define IMA_LAYER_MASK_FROM_ALPHA	2
+
+struct ImageLayerMask *imalayer_mask_new(int x, int y, unsigned char value);
+struct ImageLayerMask *imalayer_mask_copy(const struct ImageLayerMask *mask);
+void imalayer_mask_free(struct ImageLayerMask *mask);
+bool imalayer_mask_equals(const struct ImageLayerMask *a, const struct ImageLayerMask *b);
+size_t imalayer_mask_mem_size(const struct ImageLayerMask *mask);
+/* The mask when it's enabled, NULL otherwise */
+struct ImageLayerMask *imalayer_mask_used(const struct ImageLayer *layer);
+bool imalayer_mask_is_edited(const struct ImageLayer *layer);
+/* Values of tile tx, ty in rows of IMA_LAYER_TILE_SIZE, NULL for tiles of a
+ * single value, which goes in r_uniform */
+const unsigned char *imalayer_mask_tile_values(const struct ImageLayerMask *mask, int tx, int ty,
+                                               unsigned char *r_uniform);
+/* Adds a mask of the size of the layer as it's shown, IMA_LAYER_MASK_WHITE... */
+bool imalayer_mask_add(struct Image *ima, struct ImageLayer *layer, int type);
+/* Removes the mask, baking it into the alpha of the pixels with "apply" */
+void imalayer_mask_remove(struct ImageLayer *layer, bool apply);
+void imalayer_mask_apply(struct ImageLayer *layer);
+/* The mask as a grey image for painting, while IMA_LAYER_MASK_EDIT is set.
+ * Edited regions are read back by imalayer_tag_dirty_region() */
+struct ImBuf *imalayer_mask_get_ibuf(struct ImageLayer *layer);
+/* The mask as a grey image for operators resampling the whole layer, which
+ * give the result back to imalayer_mask_from_ibuf(). It frees "ibuf", the
+ * mask takes its size */
+struct ImBuf *imalayer_mask_to_ibuf(const struct ImageLayerMask *mask);
+void imalayer_mask_from_ibuf(struct ImageLayer *layer, struct ImBuf *ibuf);
+/* Resamples the mask like IMB_transform(), outside of it the layer isn't masked */
+void imalayer_mask_transform(struct ImageLayer *layer, const float mat[2][3], int width, int height, short filter,
+                             bool wrap);
+void imalayer_mask_update(struct ImageLayerMask *mask, int x, int y, int w, int h);
+void imalayer_mask_end_edit(struct ImageLayerMask *mask);
+
+/* Adjustment layers (layer_adjustment.c) change the colors of the layers
+ * below them in their group while the composite is blended */
+struct ImageLayerAdjustment *imalayer_adjustment_new(int type);
+struct ImageLayerAdjustment *imalayer_adjustment_copy(const struct ImageLayerAdjustment *adjust);
+void imalayer_adjustment_free(struct ImageLayerAdjustment *adjust);
+bool imalayer_is_adjustment(const struct ImageLayer *layer);
+bool imalayer_adjustment_is_identity(const struct ImageLayerAdjustment *adjust);
+/* Makes the LUT of the settings, call it before imalayer_adjustment_row()
+ * from one thread only */
+void imalayer_adjustment_lut_ensure(struct ImageLayerAdjustment *adjust);
+/* Drops the LUT after the settings changed */
+void imalayer_adjustment_changed(struct ImageLayerAdjustment *adjust);
+/* Adjusted colors of "len" pixels of "src" into "dst", the alpha is copied */
+void imalayer_adjustment_row(const struct ImageLayerAdjustment *adjust, bool is_float, const void *src, void *dst,
+                             int len);
+/* The settings changed: the tiles of the composite the layer shows in get blended again */
+void imalayer_adjustment_tag_dirty(struct Image *ima, struct ImageLayer *layer);
+/* Adds an adjustment layer of ImageLayerAdjustment.type above the current layer */
+struct ImageLayer *image_add_layer_adjustment(struct Image *ima, int type);
+/* Bakes the visible adjustment layers into the layers below them, which are
+ * merged first. The groups have to be merged before */
+void image_merge_layer_adjustments(struct Image *ima);
+
+/* Mip pyramids (layer_mip.c) of the layers and of the composite, for zoomed
+ * out views. Level 0 is the full size buffer, each next level half the size
+ * of the previous one. Only the tiles tagged since are reduced again */
+#define IMA_LAYER_MIP_MAX	8
+
+typedef struct ImageLayerMip ImageLayerMip;
+
+struct ImageLayerMip *imalayer_mip_new(void);
+void imalayer_mip_free(struct ImageLayerMip *mip);
+void imalayer_mip_tag_all(struct ImageLayerMip *mip);
+void imalayer_mip_tag_region(struct ImageLayerMip *mip, int x, int y, int w, int h);
+/* Level with at least one pixel for each pixel on screen at "zoom" */
+int imalayer_mip_level_for_zoom(float zoom);
+/* Level of "ibuf", or of the storage of a sparse layer when it's given.
+ * Smaller when the buffer is too small for it */
+struct ImBuf *imalayer_mip_get(struct ImageLayerMip *mip, struct ImBuf *ibuf,
+                               const struct ImageLayerStorage *storage, int level);
+/* The pixels of the layer changed in the rectangle, "generation" is the one
+ * before the change */
+void imalayer_mip_layer_tag_region(struct ImageLayer *layer, int generation, int x, int y, int w, int h);
+/* NULL for layers without pixels and transformed ones */
+struct ImBuf *imalayer_get_mip(struct ImageLayer *layer, int level);
+/* The level when it's made and up to date already, NULL otherwise */
+struct ImBuf *imalayer_mip_peek(struct ImageLayer *layer, int level);
+void imalayer_mip_layer_free(struct ImageLayer *layer);
+/* Level of "composite", the image buffer acquired with IMA_IBUF_IMA */
+struct ImBuf *imalayer_composite_get_mip(struct Image *ima, struct ImBuf *composite, int level);
+
+/* Thumbnails of the layers (layer_thumb.c). The source is a small copy of
+ * the pixels taken on the main thread, the thumbnails are made from it in
+ * any thread */
+typedef struct ImageLayerThumbSource ImageLayerThumbSource;
+
+/* NULL for layers without pixels, "size" is the largest thumbnail */
+struct ImageLayerThumbSource *imalayer_thumb_source_new(struct ImageLayer *layer, int size);
+void imalayer_thumb_source_free(struct ImageLayerThumbSource *source);
+/* Premultiplied display bytes, sizes[a] x sizes[a] in rects[a]. False when
+ * stopped, the rects aren't filled then */
+bool imalayer_thumb_render(const struct ImageLayerThumbSource *source, int totsize, const int sizes[],
+                           unsigned int *rects[], short *stop);
+
+/* The layers with pixels in a tiled multilayer OpenEXR file and back
+ * (layer_exr.c), streamed one tile at a time. The read layers go on top of
+ * the ones of the image, they have to be as big as it is */
+bool image_save_layers_exr(struct Image *ima, const char *filepath, int compress, struct ReportList *reports);
+int image_import_layers_exr(struct Image *ima, const char *filepath, struct ReportList *reports);
+
 unsigned int IML_blend_color(unsigned int src1, unsigned int src2, int opacity, short mode);
 void IML_blend_color_float(float *dst, float *src1, float *src2, float opacity, short mode);
 
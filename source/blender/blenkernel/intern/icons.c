@@ -42,6 +42,7 @@
 #include "DNA_texture_types.h"
 #include "DNA_world_types.h"
 #include "DNA_brush_types.h"
+#include "DNA_image_types.h"
 
 #include "BLI_utildefines.h"
 #include "BLI_ghash.h"
@@ -258,7 +259,7 @@ void BKE_icon_changed(int id)
 	icon = BLI_ghash_lookup(gIcons, SET_INT_IN_POINTER(id));
 	
 	if (icon) {
-		PreviewImage *prv = BKE_previewimg_get((ID *)icon->obj);
+		PreviewImage *prv = BKE_icon_previewimg_get(icon);
 
 		/* all previews changed */
 		if (prv) {
@@ -302,6 +303,45 @@ int BKE_icon_getid(struct ID *id)
 	return id->icon_id;
 }
 
+/* Image layers aren't IDs, their icon has the ID_IL type */
+int BKE_icon_imalayer_getid(struct ImageLayer *layer)
+{
+	Icon *new_icon = NULL;
+
+	if (!layer || G.background)
+		return 0;
+
+	if (layer->icon_id)
+		return layer->icon_id;
+
+	layer->icon_id = get_next_free_id();
+
+	if (!layer->icon_id) {
+		printf("BKE_icon_imalayer_getid: Internal error - not enough IDs\n");
+		return 0;
+	}
+
+	if (!layer->preview)
+		layer->preview = BKE_previewimg_create();
+
+	new_icon = MEM_callocN(sizeof(Icon), "layericon");
+
+	new_icon->obj = layer;
+	new_icon->type = ID_IL;
+
+	BLI_ghash_insert(gIcons, SET_INT_IN_POINTER(layer->icon_id), new_icon);
+
+	return layer->icon_id;
+}
+
+PreviewImage *BKE_icon_previewimg_get(Icon *icon)
+{
+	if (icon->type == ID_IL)
+		return ((ImageLayer *)icon->obj)->preview;
+
+	return BKE_previewimg_get((ID *)icon->obj);
+}
+
 Icon *BKE_icon_get(int icon_id)
 {
 	Icon *icon = NULL;
@@ -338,3 +378,11 @@ void BKE_icon_delete(struct ID *id)
 	BLI_ghash_remove(gIcons, SET_INT_IN_POINTER(id->icon_id), NULL, icon_free);
 	id->icon_id = 0;
 }
+
+void BKE_icon_imalayer_delete(struct ImageLayer *layer)
+{
+	if (!layer->icon_id) return;
+
+	BLI_ghash_remove(gIcons, SET_INT_IN_POINTER(layer->icon_id), NULL, icon_free);
+	layer->icon_id = 0;
+}
@@ -285,8 +285,18 @@ static ImBuf *image_get_ibuf_layer(Image *ima)
 	//BLI_spin_lock(&image_spin);
 
 		layer = imalayer_get_current(ima);
-		if (layer && layer->ibufs.first)
-			ibuf = (ImBuf *)layer->ibufs.first;
+		if (imalayer_mask_is_edited(layer)) {
+			/* painted like the pixels, see imalayer_tag_dirty_region() */
+			ibuf = imalayer_mask_get_ibuf(layer);
+		}
+		else if (layer && layer->ibufs.first && !imalayer_transform_is_set(layer)) {
+			/* acquiring only reads the layer, under image_spin. A pending
+			 * transform is baked by the operators, with its undo step, see
+			 * ED_image_layer_apply_transform(), until then there are no
+			 * pixels to hand out */
+			ibuf = imalayer_get_ibuf_untransformed(layer);
+			BKE_image_tag_time(ima);
+		}
 
 	//BLI_spin_unlock(&image_spin);
 
@@ -305,7 +315,9 @@ static ImBuf *image_get_ibuf(Image *ima, int index, int frame)
 			if (ima->imlayers.first) {
 				BLI_lock_thread(LOCK_IMAGE);
 
+					/* sparse layers are composited from their tiles */
 					merge_layers_visible_nd(ima);
+					BKE_image_tag_time(ima);
 
 				BLI_unlock_thread(LOCK_IMAGE);
 			}
@@ -330,6 +342,7 @@ static void image_remove_ibuf(Image *ima, ImBuf *ibuf)
 	if (ibuf) {
 		BLI_remlink(&ima->ibufs, ibuf);
 		IMB_freeImBuf(ibuf);
+		imalayer_cache_tag_dirty(ima);
 	}
 }
 
@@ -919,8 +932,17 @@ void free_old_images(void)
 				ima->lastused = ctime;
 			}
 			/* Otherwise, just kill the buffers */
-			else if (ima->ibufs.first) {
-				image_free_buffers(ima);
+			else {
+				if (ima->ibufs.first)
+					image_free_buffers(ima);
+
+				/* unchanged layers go back to their compressed tiles,
+				 * the acquired ones are kept, see imalayer_evict_pixels() */
+				if (ima->imlayers.first) {
+					BLI_spin_lock(&image_spin);
+					imalayer_evict_pixels(ima);
+					BLI_spin_unlock(&image_spin);
+				}
 			}
 		}
 		ima = ima->id.next;
@@ -34,23 +34,444 @@
 #include "MEM_guardedalloc.h"
 #include "DNA_imbuf_types.h"
 #include "IMB_imbuf.h"
+#include "IMB_colormanagement.h"
 
 #include "DNA_userdef_types.h"
 
 #include "BLI_blenlib.h"
 #include "BLI_math_base.h"
 #include "BLI_math_vector.h"
-//#include "BLI_threads.h"
+#include "BLI_rect.h"
+#include "BLI_cpu.h"
+#include "BLI_task.h"
+#include "BLI_threads.h"
 #include "BLI_utildefines.h"
 
-//#include "BKE_icons.h"
+#include "BKE_icons.h"
 //#include "BKE_global.h"
 #include "BKE_image.h"
 #include "BKE_layer.h"
 //#include "BKE_library.h"
 
+#ifdef WITH_LAYER_BLEND_SIMD
+#  include "layer_blend_simd.h"
+#endif
+
 //static SpinLock image_spin;
- 
+
+/* Composite cache, one per Image and one per layer group.
+ * Stores the state every child layer had when the composite was last
+ * blended, so merge_layers_visible_nd() only has to re-blend when a layer's
+ * pixels (generation), mask, opacity, mode, visibility, transform or the
+ * stack itself changed. A group is blended into its parent like a layer holding
+ * the composite of its own cache, which changes its generation when it's
+ * blended again. */
+typedef struct ImageLayerCacheEntry {
+	ImageLayer *layer;
+	ImBuf *ibuf;
+	int generation;
+	float opacity;
+	short mode, visible;
+	short background, pad;
+	short transform_flag, transform_filter;
+	float transform[2][3];
+	int transform_x, transform_y;
+	float transform_color[4];
+	/* the mask in use, its values are told apart by their own generation */
+	const ImageLayerMask *mask;
+	int mask_generation, pad2;
+} ImageLayerCacheEntry;
+
+typedef struct ImageLayerCache {
+	ImageLayerCacheEntry *entries;
+	int totentry, flag;
+	/* ima->ibufs.first for the Image, owned by the cache for a group */
+	ImBuf *composite;
+
+	/* tiles of the composite painted since the last blend */
+	unsigned char *tiles;
+	int tiles_x, tiles_y;
+
+	ImageLayerMip *mip;		/* of the composite of the Image, made when drawn zoomed out */
+} ImageLayerCache;
+
+/* ImageLayerCache.flag */
+#define IMA_LAYER_CACHE_DIRTY	(1<<0)
+#define IMA_LAYER_CACHE_TILES	(1<<1)
+
+/* Global so a layer allocated at the address of a freed one never
+ * matches a stale cache entry. */
+static int imalayer_generation = 0;
+
+void imalayer_tag_dirty(ImageLayer *layer)
+{
+	if (layer == NULL)
+		return;
+
+	/* operators edit the mask through its ImBuf, like the pixels */
+	if (imalayer_mask_is_edited(layer) && layer->mask->ibuf) {
+		imalayer_mask_update(layer->mask, 0, 0, layer->mask->x, layer->mask->y);
+		imalayer_mask_tag_dirty(layer);
+	}
+
+	layer->generation = ++imalayer_generation;
+}
+
+void imalayer_mask_tag_dirty(ImageLayer *layer)
+{
+	if (layer && layer->mask)
+		layer->mask->generation = ++imalayer_generation;
+}
+
+void imalayer_tag_loaded(ImageLayer *layer)
+{
+	/* the saved generations come from the counter of another session */
+	layer->generation = ++imalayer_generation;
+
+	/* written by imalayer_storage_ensure(), so it holds the saved pixels */
+	if (layer->storage)
+		layer->storage->generation = layer->generation;
+
+	if (layer->mask)
+		layer->mask->generation = ++imalayer_generation;
+}
+
+void imalayer_tag_dirty_all(Image *ima)
+{
+	ImageLayer *layer;
+
+	if (ima == NULL)
+		return;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next)
+		imalayer_tag_dirty(layer);
+
+	imalayer_cache_tag_dirty(ima);
+}
+
+void imalayer_cache_tag_dirty(Image *ima)
+{
+	ImageLayer *layer;
+
+	if (ima == NULL)
+		return;
+
+	if (ima->layer_cache)
+		ima->layer_cache->flag |= IMA_LAYER_CACHE_DIRTY;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (layer->group_cache)
+			layer->group_cache->flag |= IMA_LAYER_CACHE_DIRTY;
+	}
+}
+
+static void imalayer_cache_free_ex(ImageLayerCache *cache)
+{
+	if (cache->entries)
+		MEM_freeN(cache->entries);
+	if (cache->tiles)
+		MEM_freeN(cache->tiles);
+	imalayer_mip_free(cache->mip);
+	MEM_freeN(cache);
+}
+
+void imalayer_cache_free(Image *ima)
+{
+	if (ima->layer_cache) {
+		imalayer_cache_free_ex(ima->layer_cache);
+		ima->layer_cache = NULL;
+	}
+}
+
+static void imalayer_group_cache_free(ImageLayer *layer)
+{
+	ImageLayerCache *cache = layer->group_cache;
+
+	if (cache) {
+		if (cache->composite)
+			IMB_freeImBuf(cache->composite);
+		imalayer_cache_free_ex(cache);
+		layer->group_cache = NULL;
+	}
+}
+
+/* ******************************** Groups ******************************** */
+
+bool imalayer_is_group(const ImageLayer *layer)
+{
+	return (layer->type & IMA_LAYER_GROUP) != 0;
+}
+
+bool imalayer_has_pixels(const ImageLayer *layer)
+{
+	return (layer->type & (IMA_LAYER_GROUP | IMA_LAYER_ADJUSTMENT)) == 0;
+}
+
+ImageLayer *imalayer_group_last(ImageLayer *layer)
+{
+	ImageLayer *last = layer;
+
+	if (imalayer_is_group(layer)) {
+		while (last->next && last->next->depth > layer->depth)
+			last = last->next;
+	}
+
+	return last;
+}
+
+ImageLayer *imalayer_get_parent(ImageLayer *layer)
+{
+	ImageLayer *parent;
+
+	for (parent = layer->prev; parent; parent = parent->prev) {
+		if (parent->depth < layer->depth)
+			return parent;
+	}
+
+	return NULL;
+}
+
+static ImageLayerCache **imalayer_cache_p(Image *ima, ImageLayer *group)
+{
+	return group ? &group->group_cache : &ima->layer_cache;
+}
+
+/* Next layer up among the children of "group", the root layers when it's
+ * NULL. Returns NULL past the top one */
+static ImageLayer *imalayer_child_above(ImageLayer *group, ImageLayer *layer)
+{
+	const short depth = group ? group->depth + 1 : 0;
+
+	for (layer = layer->prev; layer && layer != group; layer = layer->prev) {
+		if (layer->depth == depth)
+			return layer;
+	}
+
+	return NULL;
+}
+
+/* Lowest child of "group", NULL when it has none */
+static ImageLayer *imalayer_child_bottom(Image *ima, ImageLayer *group)
+{
+	ImageLayer *layer = group ? imalayer_group_last(group) : ima->imlayers.last;
+	const short depth = group ? group->depth + 1 : 0;
+
+	if (layer == NULL || layer == group)
+		return NULL;
+
+	return (layer->depth == depth) ? layer : imalayer_child_above(group, layer);
+}
+
+/* What a layer blends into its parent: its pixels, the composite for a group */
+static ImBuf *imalayer_stack_ibuf(ImageLayer *layer)
+{
+	if (imalayer_is_group(layer))
+		return layer->group_cache ? layer->group_cache->composite : NULL;
+
+	return layer->ibufs.first;
+}
+
+static void imalayer_group_update(Image *ima, ImageLayer *group, short background);
+
+/* ******************************** Cache ******************************** */
+
+static bool imalayer_cache_transform_equals(const ImageLayerCacheEntry *entry, const ImageLayer *layer)
+{
+	if (entry->transform_flag != layer->transform_flag)
+		return false;
+
+	if (!imalayer_transform_is_set(layer))
+		return true;
+
+	return (entry->transform_filter == layer->transform_filter &&
+	        entry->transform_x == layer->transform_x && entry->transform_y == layer->transform_y &&
+	        memcmp(entry->transform, layer->transform, sizeof(entry->transform)) == 0 &&
+	        equals_v4v4(entry->transform_color, layer->transform_color));
+}
+
+/* "composite" is the one of the children of "group" as they are now. A group
+ * without anything to show has none, it stays valid so its parent doesn't
+ * blend again */
+static int imalayer_cache_is_valid(Image *ima, ImageLayer *group, ImBuf *composite, short background)
+{
+	ImageLayerCache *cache = *imalayer_cache_p(ima, group);
+	ImageLayerCacheEntry *entry;
+	ImageLayer *layer;
+	int i;
+
+	if (cache == NULL || (cache->flag & IMA_LAYER_CACHE_DIRTY))
+		return FALSE;
+
+	if (cache->composite != composite || (group == NULL && composite == NULL))
+		return FALSE;
+
+	entry = cache->entries;
+	for (layer = imalayer_child_bottom(ima, group), i = 0; layer; layer = imalayer_child_above(group, layer), i++, entry++) {
+		if (i >= cache->totentry)
+			return FALSE;
+
+		if ((entry->layer != layer) ||
+		    (entry->ibuf != imalayer_stack_ibuf(layer)) ||
+		    (entry->generation != layer->generation) ||
+		    (entry->opacity != layer->opacity) ||
+		    (entry->mode != layer->mode) ||
+		    (entry->visible != (layer->visible & IMA_LAYER_VISIBLE)) ||
+		    (entry->background != background) ||
+		    (entry->mask != imalayer_mask_used(layer)) ||
+		    (entry->mask && entry->mask_generation != entry->mask->generation) ||
+		    !imalayer_cache_transform_equals(entry, layer))
+		{
+			return FALSE;
+		}
+	}
+
+	return (i == cache->totentry);
+}
+
+static void imalayer_cache_store(Image *ima, ImageLayer *group, ImBuf *composite, short background)
+{
+	ImageLayerCache **cache_p = imalayer_cache_p(ima, group);
+	ImageLayerCache *cache = *cache_p;
+	ImageLayerCacheEntry *entry;
+	ImageLayer *layer;
+	int totlayer = 0;
+
+	for (layer = imalayer_child_bottom(ima, group); layer; layer = imalayer_child_above(group, layer))
+		totlayer++;
+
+	if (cache == NULL)
+		cache = *cache_p = MEM_callocN(sizeof(ImageLayerCache), "ImageLayerCache");
+
+	if (cache->totentry != totlayer) {
+		if (cache->entries)
+			MEM_freeN(cache->entries);
+		cache->entries = totlayer ? MEM_callocN(sizeof(ImageLayerCacheEntry) * totlayer, "ImageLayerCacheEntry") : NULL;
+		cache->totentry = totlayer;
+	}
+
+	entry = cache->entries;
+	for (layer = imalayer_child_bottom(ima, group); layer; layer = imalayer_child_above(group, layer), entry++) {
+		entry->layer = layer;
+		entry->ibuf = imalayer_stack_ibuf(layer);
+		entry->generation = layer->generation;
+		entry->opacity = layer->opacity;
+		entry->mode = layer->mode;
+		entry->visible = layer->visible & IMA_LAYER_VISIBLE;
+		entry->background = background;
+		entry->transform_flag = layer->transform_flag;
+		entry->transform_filter = layer->transform_filter;
+		memcpy(entry->transform, layer->transform, sizeof(entry->transform));
+		entry->transform_x = layer->transform_x;
+		entry->transform_y = layer->transform_y;
+		copy_v4_v4(entry->transform_color, layer->transform_color);
+		entry->mask = imalayer_mask_used(layer);
+		entry->mask_generation = entry->mask ? entry->mask->generation : 0;
+	}
+
+	if (cache->tiles) {
+		MEM_freeN(cache->tiles);
+		cache->tiles = NULL;
+	}
+
+	if (composite) {
+		cache->tiles_x = (composite->x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+		cache->tiles_y = (composite->y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+		cache->tiles = MEM_callocN(sizeof(char) * cache->tiles_x * cache->tiles_y, "ImageLayerCache tiles");
+	}
+
+	cache->composite = composite;
+	cache->flag &= ~(IMA_LAYER_CACHE_DIRTY | IMA_LAYER_CACHE_TILES);
+
+	imalayer_mip_tag_all(cache->mip);
+}
+
+/* Tags the tiles of the composite of "cache" touching the rectangle, when
+ * the layer is up to date in it. With "mask" only the mask of the layer
+ * changed. */
+static void imalayer_cache_tag_region(ImageLayerCache *cache, ImageLayer *layer, bool mask,
+                                      int x, int y, int w, int h)
+{
+	ImageLayerCacheEntry *entry = NULL;
+	int i, tx, ty, tx_min, ty_min, tx_max, ty_max;
+
+	if (cache && cache->tiles && !(cache->flag & IMA_LAYER_CACHE_DIRTY)) {
+		for (i = 0; i < cache->totentry; i++) {
+			if (cache->entries[i].layer == layer) {
+				entry = &cache->entries[i];
+				break;
+			}
+		}
+	}
+
+	if (mask) {
+		/* a disabled mask doesn't change the composite */
+		const bool up_to_date = (entry && entry->mask == layer->mask &&
+		                         entry->mask_generation == layer->mask->generation);
+
+		imalayer_mask_tag_dirty(layer);
+
+		if (!up_to_date)
+			return;
+
+		entry->mask_generation = layer->mask->generation;
+	}
+	else {
+		/* composite is out of date already, it gets fully rebuilt anyway */
+		if (entry == NULL || entry->generation != layer->generation) {
+			imalayer_tag_dirty(layer);
+			return;
+		}
+
+		imalayer_tag_dirty(layer);
+		entry->generation = layer->generation;
+	}
+
+	x = max_ii(x, 0);
+	y = max_ii(y, 0);
+	w = min_ii(x + w, cache->composite->x) - x;
+	h = min_ii(y + h, cache->composite->y) - y;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	tx_min = x >> IMA_LAYER_TILE_BITS;
+	ty_min = y >> IMA_LAYER_TILE_BITS;
+	tx_max = (x + w - 1) >> IMA_LAYER_TILE_BITS;
+	ty_max = (y + h - 1) >> IMA_LAYER_TILE_BITS;
+
+	for (ty = ty_min; ty <= ty_max; ty++)
+		for (tx = tx_min; tx <= tx_max; tx++)
+			cache->tiles[ty * cache->tiles_x + tx] = 1;
+
+	cache->flag |= IMA_LAYER_CACHE_TILES;
+}
+
+/* The same tiles change in the composite of every group the layer is in.
+ * While the mask is edited, its ImBuf is what changed */
+void imalayer_tag_dirty_region(Image *ima, ImageLayer *layer, int x, int y, int w, int h)
+{
+	ImageLayer *parent, *changed = layer;
+	int generation;
+	bool mask;
+
+	if (layer == NULL)
+		return;
+
+	generation = layer->generation;
+
+	mask = imalayer_mask_is_edited(layer) && layer->mask->ibuf;
+	if (mask)
+		imalayer_mask_update(layer->mask, x, y, w, h);
+
+	for (; layer; layer = parent, mask = false) {
+		parent = imalayer_get_parent(layer);
+		imalayer_cache_tag_region(ima ? *imalayer_cache_p(ima, parent) : NULL, layer, mask, x, y, w, h);
+	}
+
+	imalayer_mip_layer_tag_region(changed, generation, x, y, w, h);
+	imalayer_storage_tag_region(changed, generation, x, y, w, h);
+}
+
 ImageLayer *layer_alloc(Image *ima, const char *name)
 {
 	ImageLayer *im_l;
@@ -69,6 +490,7 @@ ImageLayer *layer_alloc(Image *ima, const char *name)
 		im_l->select = IMA_LAYER_SEL_CURRENT;
 		im_l->locked = 0;
 		zero_v4(im_l->default_color);
+		imalayer_tag_dirty(im_l);
 	}
 	return im_l;
 }
@@ -96,6 +518,27 @@ void free_image_layer(ImageLayer *layer)
 		layer->preview_ibuf = NULL;
 	}
 
+	if (layer->storage) {
+		imalayer_storage_free(layer->storage);
+		layer->storage = NULL;
+	}
+
+	if (layer->mask) {
+		imalayer_mask_free(layer->mask);
+		layer->mask = NULL;
+	}
+
+	if (layer->adjustment) {
+		imalayer_adjustment_free(layer->adjustment);
+		layer->adjustment = NULL;
+	}
+
+	imalayer_group_cache_free(layer);
+	imalayer_mip_layer_free(layer);
+
+	BKE_icon_imalayer_delete(layer);
+	BKE_previewimg_free(&layer->preview);
+
 	MEM_freeN(layer);
 }
 
@@ -103,6 +546,8 @@ void image_free_image_layers(struct Image *ima)
 {
 	ImageLayer *img_lay;
  
+	imalayer_cache_free(ima);
+
 	if (ima->imlayers.first == NULL)
 		return;
 
@@ -224,56 +669,57 @@ void imalayer_fill_color(struct Image *ima, float color[4])
 			rect = (unsigned char*)ibuf->rect;
  
 		BKE_image_buf_fill_color(rect, rect_float, ibuf->x, ibuf->y, color);
+		imalayer_tag_dirty(imalayer_get_current(ima));
 	}
  
 	BKE_image_release_ibuf(ima, ibuf, lock);
 }
 
+static void imalayer_copy_transform(ImageLayer *dst, const ImageLayer *src)
+{
+	dst->transform_flag = src->transform_flag;
+	dst->transform_filter = src->transform_filter;
+	memcpy(dst->transform, src->transform, sizeof(dst->transform));
+	dst->transform_x = src->transform_x;
+	dst->transform_y = src->transform_y;
+	copy_v4_v4(dst->transform_color, src->transform_color);
+}
+
+static ImageLayer *image_duplicate_layer_group(Image *ima, ImageLayer *group);
+
 ImageLayer *image_duplicate_current_image_layer(Image *ima)
 {
 	ImageLayer *layer = NULL, *im_l = NULL;
-	char dup_name[sizeof(layer->name)];
-	ImBuf *ibuf, *new_ibuf;
-	void *lock;
  
 	if (ima == NULL)
 		return NULL;
  
 	layer = imalayer_get_current(ima);
 
-	if (!strstr(layer->name, "_copy"))
-		BLI_snprintf(dup_name, sizeof(dup_name), "%s_copy", layer->name);
-	else
-		BLI_snprintf(dup_name, sizeof(dup_name), "%s", layer->name);
+	if (!imalayer_has_pixels(layer))
+		return image_duplicate_layer_group(ima, layer);
 
-	im_l = layer_alloc(ima, dup_name);
-	if (im_l) {
-		ibuf = BKE_image_acquire_ibuf(ima, NULL, &lock, IMA_IBUF_LAYER);
-		if (ibuf) {
-			new_ibuf = IMB_dupImBuf(ibuf);
-			BLI_addtail(&im_l->ibufs, new_ibuf);
+	/* the copy gets the pending transform, the mask and the settings too */
+	im_l = image_duplicate_layer(ima, layer);
+	if (im_l == NULL)
+		return NULL;
 
-			im_l->next = im_l->prev = NULL;
+	if (im_l->ibufs.first == NULL) {
+		free_image_layer(im_l);
+		return NULL;
+	}
 
-			if (layer)
-				BLI_insertlinkbefore(&ima->imlayers, layer, im_l);
-			else
-				BLI_addhead(&ima->imlayers, layer);
+	if (!strstr(layer->name, "_copy"))
+		BLI_snprintf(im_l->name, sizeof(im_l->name), "%s_copy", layer->name);
 
-			imalayer_set_current_act(ima, imalayer_get_current_act(ima));
+	/* a copy of the background is an ordinary layer */
+	im_l->type = IMA_LAYER_LAYER;
+
+	BLI_insertlinkbefore(&ima->imlayers, layer, im_l);
+	imalayer_unique_name(im_l, ima);
+	imalayer_set_current_act(ima, imalayer_get_current_act(ima));
+	ima->Count_Layers += 1;
 
-			BLI_strncpy(im_l->file_path, layer->file_path, sizeof(layer->file_path));
-			im_l->opacity = layer->opacity;
-			im_l->background = layer->background;
-			im_l->mode = layer->mode;
-			im_l->type = IMA_LAYER_LAYER;
-			im_l->visible = layer->visible;
-			im_l->locked = layer->locked;
-			copy_v4_v4(im_l->default_color, layer->default_color);
-		}
-		BKE_image_release_ibuf(ima, ibuf, lock);
-		ima->Count_Layers += 1;
-	}
 	return im_l;
 }
 
@@ -285,13 +731,18 @@ ImageLayer *image_duplicate_layer(Image *ima, ImageLayer *layer)
 	if (ima == NULL)
 		return NULL;
 
+	imalayer_ensure_layer_pixels(layer);
+
 	im_l = layer_alloc(ima, layer->name);
 	if (im_l) {
 		ibuf = (ImBuf *)layer->ibufs.first;
 		if (ibuf) {
 			new_ibuf = IMB_dupImBuf(ibuf);
 			BLI_addtail(&im_l->ibufs, new_ibuf);
+		}
 
+		/* groups and adjustments have no pixels, only the settings */
+		if (ibuf || !imalayer_has_pixels(layer)) {
 			im_l->next = im_l->prev = NULL;
 
 			BLI_strncpy(im_l->name, layer->name, sizeof(layer->name));
@@ -300,91 +751,348 @@ ImageLayer *image_duplicate_layer(Image *ima, ImageLayer *layer)
 			im_l->background = layer->background;
 			im_l->mode = layer->mode;
 			im_l->type = layer->type;
+			im_l->depth = layer->depth;
+			im_l->flag = layer->flag;
 			im_l->visible = layer->visible;
 			im_l->select = layer->select;
 			im_l->locked = layer->locked;
 			copy_v4_v4(im_l->default_color, layer->default_color);
+			imalayer_copy_transform(im_l, layer);
+
+			/* the copy isn't edited, the values are in the tiles */
+			im_l->mask = imalayer_mask_copy(layer->mask);
+			if (im_l->mask) {
+				im_l->mask->flag &= ~IMA_LAYER_MASK_EDIT;
+				imalayer_mask_tag_dirty(im_l);
+			}
+			im_l->adjustment = imalayer_adjustment_copy(layer->adjustment);
 		}
 	}
 	return im_l;
 }
+
+/* Copies a group and its layers, or a layer without pixels, the copy goes above it */
+static ImageLayer *image_duplicate_layer_group(Image *ima, ImageLayer *group)
+{
+	ImageLayer *layer, *last = imalayer_group_last(group), *dup, *dup_group = NULL;
+
+	for (layer = group; layer; layer = (layer == last) ? NULL : layer->next) {
+		dup = image_duplicate_layer(ima, layer);
+		if (dup == NULL)
+			continue;
+
+		dup->select = !IMA_LAYER_SEL_CURRENT;
+		BLI_insertlinkbefore(&ima->imlayers, group, dup);
+		imalayer_unique_name(dup, ima);
+		ima->Count_Layers += 1;
+
+		if (dup_group == NULL)
+			dup_group = dup;
+	}
+
+	if (dup_group)
+		imalayer_set_current_act(ima, imalayer_get_index_layer(ima, dup_group));
+
+	imalayer_cache_tag_dirty(ima);
+
+	return dup_group;
+}
  
+/* Removes a layer, with its layers for a group. Returns how many were removed */
+static int imalayer_remove_block(Image *ima, ImageLayer *layer)
+{
+	ImageLayer *last = imalayer_group_last(layer), *stop = layer->prev, *prev;
+	int removed = 0;
+
+	for (; last != stop; last = prev) {
+		prev = last->prev;
+		BLI_remlink(&ima->imlayers, last);
+		free_image_layer(last);
+		removed++;
+	}
+
+	return removed;
+}
+
+/* Some layer with pixels stays when "layer" and its layers are removed */
+static bool imalayer_remove_block_keeps_pixels(Image *ima, ImageLayer *layer)
+{
+	ImageLayer *last = imalayer_group_last(layer), *iter;
+
+	for (iter = ima->imlayers.first; iter; iter = iter->next) {
+		if (iter == layer)
+			iter = last;
+		else if (imalayer_has_pixels(iter))
+			return true;
+	}
+
+	return false;
+}
+
 int image_remove_layer(Image *ima, const int action)
 {
-	ImageLayer *layer= NULL;
+	ImageLayer *layer= NULL, *prev;
 	 
 	if (ima == NULL)
 		return FALSE;
 
 	if (action & IMA_LAYER_DEL_SELECTED) {
-		if (ima->Count_Layers > 1) {
-			layer = imalayer_get_current(ima);
-			if (layer) {
-				BLI_remlink(&ima->imlayers, layer);
-				free_image_layer(layer);
-			}
+		layer = imalayer_get_current(ima);
+		if (ima->Count_Layers > 1 && (layer == NULL || imalayer_remove_block_keeps_pixels(ima, layer))) {
+			if (layer)
+				ima->Count_Layers -= imalayer_remove_block(ima, layer);
+
 			/* Ensure the first element in list gets selected (if any) */
 			if (ima->imlayers.first) {
 				if (imalayer_get_current_act(ima) != 1)
-					imalayer_set_current_act(ima, imalayer_get_current_act(ima));
+					imalayer_set_current_act(ima, min_ii(imalayer_get_current_act(ima), ima->Count_Layers - 1));
 				else
 					imalayer_set_current_act(ima, imalayer_get_current_act(ima) - 1);
 			}
-			ima->Count_Layers -= 1;
 		}
 		else
 			return -1;
 	}
 	else {
 		if (ima->Count_Layers > 1) {
-			for (layer = ima->imlayers.last; layer; layer = layer->prev) {
+			/* a hidden group goes with its layers, the ones below it are
+			 * checked first */
+			for (layer = ima->imlayers.last; layer; layer = prev) {
+				prev = layer->prev;
+
 				if (!(layer->visible & IMA_LAYER_VISIBLE)) {
-					BLI_remlink(&ima->imlayers, layer);
-					free_image_layer(layer);
+					ima->Count_Layers -= imalayer_remove_block(ima, layer);
 					if (ima->imlayers.first) {
 						if (imalayer_get_current_act(ima) != 1)
-							imalayer_set_current_act(ima, imalayer_get_current_act(ima));
+							imalayer_set_current_act(ima, min_ii(imalayer_get_current_act(ima), ima->Count_Layers - 1));
 						else
 							imalayer_set_current_act(ima, imalayer_get_current_act(ima) - 1);
 					}
-					ima->Count_Layers -= 1;
 				}
 			}
 		}
 		else
 			return -1;
 	}
+
+	imalayer_cache_tag_dirty(ima);
 	return TRUE;
 }
 
-static float blend_normal(float B, float L, float O)
+/* Moves "layer", with its layers for a group, before "next", at the end when
+ * it's NULL. "next" can't be in the moved layers */
+void imalayer_move_block(Image *ima, ImageLayer *layer, ImageLayer *next)
 {
-	return (O * (L) + (1.0f - O) * B);
-}
+	ImageLayer *last = imalayer_group_last(layer);
+	ListBase *lb = &ima->imlayers;
 
-static float blend_lighten(const float B, const float L, float O)
-{
-	return (O * ((L > B) ? L : B) + (1.0f - O) * B);
-}
+	if (next == layer || next == last->next)
+		return;
 
-static float blend_darken(const float B, const float L, float O)
-{
-	return (O * ((L > B) ? B : L) + (1.0f - O) * B);
-}
+	/* take out the block */
+	if (layer->prev)
+		layer->prev->next = last->next;
+	else
+		lb->first = last->next;
+	if (last->next)
+		last->next->prev = layer->prev;
+	else
+		lb->last = layer->prev;
 
-static float blend_multiply(const float B, const float L, float O)
-{
-	return (O * ((B * L) / 1.0f) + (1.0f - O) * B);
-}
+	/* and put it back before "next" */
+	layer->prev = next ? next->prev : lb->last;
+	last->next = next;
+	if (layer->prev)
+		layer->prev->next = layer;
+	else
+		lb->first = layer;
+	if (next)
+		next->prev = last;
+	else
+		lb->last = last;
 
-static float blend_average(const float B, const float L, float O)
-{
-	return (O * ((B + L) / 2) + (1.0f - O) * B);
+	imalayer_cache_tag_dirty(ima);
 }
 
-static float blend_add(const float B, const float L, float O)
+/* Puts the current layer, with its layers for a group, in a new group */
+ImageLayer *image_add_layer_group(Image *ima)
 {
-	return (O * (MIN2(1.0f, (B + L))) + (1.0f - O) * B);
+	ImageLayer *layer, *last, *iter, *group;
+
+	if (ima == NULL)
+		return NULL;
+
+	layer = imalayer_get_current(ima);
+
+	/* the base layer stays at the bottom */
+	if (layer == NULL || (layer->type & IMA_LAYER_BASE))
+		return NULL;
+
+	group = layer_alloc(ima, "Group");
+	if (group == NULL)
+		return NULL;
+
+	group->type = IMA_LAYER_GROUP;
+	group->depth = layer->depth;
+	group->background = layer->background;
+
+	last = imalayer_group_last(layer);
+	for (iter = layer; iter != last->next; iter = iter->next)
+		iter->depth++;
+
+	BLI_insertlinkbefore(&ima->imlayers, layer, group);
+	ima->Count_Layers += 1;
+
+	imalayer_set_current_act(ima, imalayer_get_index_layer(ima, group));
+	imalayer_cache_tag_dirty(ima);
+
+	return group;
+}
+
+/* Adds an adjustment layer above the current layer, in the same group */
+ImageLayer *image_add_layer_adjustment(Image *ima, int type)
+{
+	ImageLayer *layer, *adjust;
+
+	if (ima == NULL || (layer = imalayer_get_current(ima)) == NULL)
+		return NULL;
+
+	adjust = layer_alloc(ima, "Adjustment");
+	if (adjust == NULL)
+		return NULL;
+
+	adjust->type = IMA_LAYER_ADJUSTMENT;
+	adjust->depth = layer->depth;
+	adjust->background = layer->background;
+	adjust->adjustment = imalayer_adjustment_new(type);
+
+	BLI_insertlinkbefore(&ima->imlayers, layer, adjust);
+	ima->Count_Layers += 1;
+
+	imalayer_set_current_act(ima, imalayer_get_index_layer(ima, adjust));
+	imalayer_cache_tag_dirty(ima);
+
+	return adjust;
+}
+
+/* Removes a group, its layers go one level up. The first one gets selected */
+int image_ungroup_layer(Image *ima, ImageLayer *group)
+{
+	ImageLayer *last, *iter, *act;
+
+	if (ima == NULL || group == NULL || !imalayer_is_group(group) || ima->Count_Layers < 2)
+		return FALSE;
+
+	last = imalayer_group_last(group);
+	for (iter = group->next; iter && iter != last->next; iter = iter->next)
+		iter->depth--;
+
+	act = (last != group) ? group->next : (group->next ? group->next : group->prev);
+
+	BLI_remlink(&ima->imlayers, group);
+	free_image_layer(group);
+	ima->Count_Layers -= 1;
+
+	imalayer_set_current_act(ima, imalayer_get_index_layer(ima, act));
+	imalayer_cache_tag_dirty(ima);
+
+	return TRUE;
+}
+
+/* Replaces a group and its layers with a layer holding its composite, it
+ * blends the same. A group with nothing to show is only removed, then NULL
+ * is returned */
+ImageLayer *image_merge_layer_group(Image *ima, ImageLayer *group)
+{
+	ImageLayer *act = imalayer_get_current(ima);
+	ImageLayer *last, *prev;
+	ImageLayerCache *cache;
+	ImBuf *ibuf = NULL;
+	bool selected = false;
+
+	if (!imalayer_is_group(group))
+		return group;
+
+	imalayer_group_update(ima, group, ((ImageLayer *)ima->imlayers.last)->background);
+
+	cache = group->group_cache;
+	if (cache && cache->composite) {
+		ibuf = cache->composite;
+		cache->composite = NULL;
+	}
+
+	last = imalayer_group_last(group);
+	for (; last != group; last = prev) {
+		prev = last->prev;
+		selected |= (last == act);
+		BLI_remlink(&ima->imlayers, last);
+		free_image_layer(last);
+		ima->Count_Layers -= 1;
+	}
+
+	imalayer_group_cache_free(group);
+	group->type = IMA_LAYER_LAYER;
+	if (selected)
+		act = group;
+
+	if (ibuf) {
+		BLI_addtail(&group->ibufs, ibuf);
+		imalayer_tag_dirty(group);
+	}
+	else {
+		if (act == group)
+			act = group->next ? group->next : group->prev;
+		BLI_remlink(&ima->imlayers, group);
+		free_image_layer(group);
+		ima->Count_Layers -= 1;
+		group = NULL;
+	}
+
+	imalayer_set_current_act(ima, imalayer_get_index_layer(ima, act));
+	imalayer_cache_tag_dirty(ima);
+
+	return group;
+}
+
+/* Merges every group, the layers are all at the root after */
+void image_merge_layer_groups(Image *ima)
+{
+	ImageLayer *layer, *next;
+
+	for (layer = ima->imlayers.first; layer; layer = next) {
+		next = imalayer_group_last(layer)->next;
+		image_merge_layer_group(ima, layer);
+	}
+}
+
+static float blend_normal(float B, float L, float O)
+{
+	return (O * (L) + (1.0f - O) * B);
+}
+
+static float blend_lighten(const float B, const float L, float O)
+{
+	return (O * ((L > B) ? L : B) + (1.0f - O) * B);
+}
+
+static float blend_darken(const float B, const float L, float O)
+{
+	return (O * ((L > B) ? B : L) + (1.0f - O) * B);
+}
+
+static float blend_multiply(const float B, const float L, float O)
+{
+	return (O * ((B * L) / 1.0f) + (1.0f - O) * B);
+}
+
+static float blend_average(const float B, const float L, float O)
+{
+	return (O * ((B + L) / 2) + (1.0f - O) * B);
+}
+
+static float blend_add(const float B, const float L, float O)
+{
+	return (O * (MIN2(1.0f, (B + L))) + (1.0f - O) * B);
 }
 
 static float blend_subtract(const float B, const float L, float O)
@@ -521,136 +1229,77 @@ static void copy_co(int rect, float *fp, char *cp, float co)
 		*cp = FTOCHAR(co);
 }
 
-ImBuf *imalayer_blend(ImBuf *base, ImBuf *layer, float opacity, short mode, short background)
+typedef float (*ImageLayerBlendFunc)(float B, float L, float O);
+
+static ImageLayerBlendFunc imalayer_blend_func(short mode)
 {
-	ImBuf *dest;
-	int i, flag;
-	int bg_x, bg_y, diff_x;
-	float (*blend_callback)(float B, float L, float O) = NULL;	//Mode callback
+	switch (mode) {
+		case IMA_LAYER_NORMAL:
+			return blend_normal;
+		case IMA_LAYER_MULTIPLY:
+			return blend_multiply;
+		case IMA_LAYER_SCREEN:
+			return blend_screen;
+		case IMA_LAYER_OVERLAY:
+			return blend_overlay;
+		case IMA_LAYER_SOFT_LIGHT:
+			return blend_soft_light;
+		case IMA_LAYER_HARD_LIGHT:
+			return blend_hard_light;
+		case IMA_LAYER_COLOR_DODGE:
+			return blend_color_dodge;
+		case IMA_LAYER_LINEAR_DODGE:
+			return blend_linear_dodge;
+		case IMA_LAYER_COLOR_BURN:
+			return blend_color_burn;
+		case IMA_LAYER_LINEAR_BURN:
+			return blend_linear_burn;
+		case IMA_LAYER_AVERAGE:
+			return blend_average;
+		case IMA_LAYER_ADD:
+			return blend_add;
+		case IMA_LAYER_SUBTRACT:
+			return blend_subtract;
+		case IMA_LAYER_DIFFERENCE:
+			return blend_difference;
+		case IMA_LAYER_LIGHTEN:
+			return blend_lighten;
+		case IMA_LAYER_DARKEN:
+			return blend_darken;
+		case IMA_LAYER_NEGATION:
+			return blend_negation;
+		case IMA_LAYER_EXCLUSION:
+			return blend_exclusion;
+		case IMA_LAYER_LINEAR_LIGHT:
+			return blend_linear_light;
+		case IMA_LAYER_VIVID_LIGHT:
+			return blend_vivid_light;
+		case IMA_LAYER_PIN_LIGHT:
+			return blend_pin_light;
+		case IMA_LAYER_HARD_MIX:
+			return blend_hard_mix;
+		case IMA_LAYER_INVERSE_COLOR_BURN:
+			return blend_inverse_color_burn;
+		case IMA_LAYER_SOFT_BURN:
+			return blend_soft_burn;
+	}
+
+	return NULL;
+}
+
+/* Scalar reference of the kernels in layer_blend_kernel.h, blends "len"
+ * pixels starting at the given pointers. Byte pixels are used when "cp_b"
+ * is set, float pixels otherwise. The values of "mask" scale the alpha of
+ * the layer when it's given. */
+static void imalayer_blend_row_ref(float *fp_d, const float *fp_b, const float *fp_l,
+                                   char *cp_d, const char *cp_b, const char *cp_l, const unsigned char *mask,
+                                   int len, ImageLayerBlendFunc blend_callback, float opacity, short background)
+{
+	int x, flag;
 
 	float as, ab, ao, co, aoco;
-	float *fp_b, *fp_l, *fp_d;
-	char *cp_b, *cp_l, *cp_d;
 	float f_br, f_bg, f_bb, f_ba;
 	float f_lr, f_lg, f_lb, f_la;
-	//clock_t start,end;
-	//double tempo;
-	//start=clock();
-
-	flag = 0;
-
-	if (!base)
-		return IMB_dupImBuf(layer);
-
-	dest = IMB_dupImBuf(base);
-
-	if (opacity == 0.0f)
-		return dest;
-
-	bg_x = base->x;
-	bg_y = base->y;
-	if (base->x > layer->x)
-		bg_x = layer->x;
-	if (base->y > layer->y)
-		bg_y = layer->y;
-
-	diff_x = abs(base->x - layer->x);
-
-	switch(mode) {
-	case IMA_LAYER_NORMAL:
-		blend_callback = blend_normal;
-		break;
-
-	case IMA_LAYER_MULTIPLY:
-		blend_callback = blend_multiply;
-		break;
-
-	case IMA_LAYER_SCREEN:
-		blend_callback = blend_screen;
-		break;
-
-	case IMA_LAYER_OVERLAY:
-		blend_callback = blend_overlay;
-		break;
-
-	case IMA_LAYER_SOFT_LIGHT:
-		blend_callback = blend_soft_light;
-		break;
-
-	case IMA_LAYER_HARD_LIGHT:
-		blend_callback = blend_hard_light;
-		break;
-
-	case IMA_LAYER_COLOR_DODGE:
-		blend_callback = blend_color_dodge;
-		break;
-
-	case IMA_LAYER_LINEAR_DODGE:
-		blend_callback = blend_linear_dodge;
-		break;
-		
-	case IMA_LAYER_COLOR_BURN:
-		blend_callback = blend_color_burn;
-		break;
-
-	case IMA_LAYER_LINEAR_BURN:
-		blend_callback = blend_linear_burn;
-		break;
-
-	case IMA_LAYER_AVERAGE:
-		blend_callback = blend_average;
-		break;
-
-	case IMA_LAYER_ADD:
-		blend_callback = blend_add;
-		break;
-
-	case IMA_LAYER_SUBTRACT:
-		blend_callback = blend_subtract;
-		break;
-
-	case IMA_LAYER_DIFFERENCE:
-		blend_callback = blend_difference;
-		break;
-	
-	case IMA_LAYER_LIGHTEN:
-		blend_callback = blend_lighten;
-		break;
-
-	case IMA_LAYER_DARKEN:
-		blend_callback = blend_darken;
-		break;
-	
-	case IMA_LAYER_NEGATION:
-		blend_callback = blend_negation;
-		break;
-
-	case IMA_LAYER_EXCLUSION:
-		blend_callback = blend_exclusion;
-		break;
-	
-	case IMA_LAYER_LINEAR_LIGHT:
-		blend_callback = blend_linear_light;
-		break;
-
-	case IMA_LAYER_VIVID_LIGHT:
-		blend_callback = blend_vivid_light;
-		break;
-	
-	case IMA_LAYER_PIN_LIGHT:
-		blend_callback = blend_pin_light;
-		break;
-
-	case IMA_LAYER_HARD_MIX:
-		blend_callback = blend_hard_mix;
-		break;
-	case IMA_LAYER_INVERSE_COLOR_BURN:
-		blend_callback = blend_inverse_color_burn;
-		break;
-	case IMA_LAYER_SOFT_BURN:
-		blend_callback = blend_soft_burn;
-		break;
-	}
 
 	/* 
 	* Ao*Co = As * (1 - Ab) * Cs + As * Ab * B(Cb, Cs) + (1 - As) * Ab * Cb
@@ -658,63 +1307,44 @@ ImBuf *imalayer_blend(ImBuf *base, ImBuf *layer, float opacity, short mode, shor
 	* Co = Co / Ao
 	*/
 
-	fp_b = NULL;
-	fp_l = fp_d = fp_b;
-	cp_b = NULL;
-	cp_l = cp_d = cp_b;
+	flag = cp_b ? 1 : 0;
 
-	if (base->rect_float) {
-		flag = 0;
-		fp_b = (float *) base->rect_float;
-		fp_l = (float *) layer->rect_float;
-		fp_d = (float *) dest->rect_float;
-	}
-
-	if (base->rect) {
-		flag = 1;
-		cp_b = (char *) base->rect;
-		cp_l = (char *) layer->rect;
-		cp_d = (char *) dest->rect;
-	}
-
-	for (i = bg_x * bg_y; i > 0; i--) {
-		if (base->rect_float) {
+	for (x = 0; x < len; x++) {
+		if (flag) {
+			f_ba = ((float)cp_b[3]) / 255.0f;
+			f_la = ((float)cp_l[3]) / 255.0f;
+		}
+		else {
 			f_ba = fp_b[3];
 			f_la = fp_l[3];
 		}
 
-		if (base->rect) {
-			f_ba = ((float)cp_b[3]) / 255.0f;
-			f_la = ((float)cp_l[3]) / 255.0f;
-		}
+		if (mask)
+			f_la *= (float)mask[x] / 255.0f;
 
 		if (((background & IMA_LAYER_BG_ALPHA) && ((f_la != 0.0f) || (f_ba != 0.0f))) ||
-		   ((!(background & IMA_LAYER_BG_ALPHA)) && ((f_la != 0.0f) && (f_ba != 0.0f)))) {
-		//if ((f_la != 0.0f) && (f_ba != 0.0f)) {
-			if (base->rect_float) {
-				f_br = fp_b[0];
-				f_bg = fp_b[1];
-				f_bb = fp_b[2];
-			
-				f_lr = fp_l[0];
-				f_lg = fp_l[1];
-				f_lb = fp_l[2];
-			}
-
-			if (base->rect) {
+		    ((!(background & IMA_LAYER_BG_ALPHA)) && ((f_la != 0.0f) && (f_ba != 0.0f))))
+		{
+			if (flag) {
 				f_br = (((float)cp_b[0]) / 255.0f);
 				f_bg = (((float)cp_b[1]) / 255.0f);
 				f_bb = (((float)cp_b[2]) / 255.0f);
-			
+
 				f_lr = (((float)cp_l[0]) / 255.0f);
 				f_lg = (((float)cp_l[1]) / 255.0f);
 				f_lb = (((float)cp_l[2]) / 255.0f);
-				//printf("base: %d %d %d %d\n", cp_b[0], cp_b[1], cp_b[2], cp_b[3]);
-				//printf("layer: %d %d %d %d\n", cp_l[0], cp_l[1], cp_l[2], cp_l[3]);
+			}
+			else {
+				f_br = fp_b[0];
+				f_bg = fp_b[1];
+				f_bb = fp_b[2];
+
+				f_lr = fp_l[0];
+				f_lg = fp_l[1];
+				f_lb = fp_l[2];
 			}
 
 			if ((f_la != 0.0f) && (f_ba != 0.0f)) {
-				//printf("1\n");
 				as = f_la;
 				ab = f_ba;
 				ao = as + ab * (1 - as);
@@ -734,69 +1364,644 @@ ImBuf *imalayer_blend(ImBuf *base, ImBuf *layer, float opacity, short mode, shor
 				aoco = as * (1 - ab) * f_lb + as * ab * blend_callback(f_bb, f_lb, opacity) + (1 - as) * ab * f_bb;
 				co = clipcolour(aoco / ao);
 				copy_co(flag, &fp_d[2], &cp_d[2], co);
-				//printf("blend: %d %d %d %d\n\n", cp_d[0], cp_d[1], cp_d[2], cp_d[3]);
 			}
 			else {
-				if (background & IMA_LAYER_BG_ALPHA) {
-					/*if (f_ba != 0.0f) {
-						printf("2\n");
-						copy_co(flag, &fp_d[0], &cp_d[0], f_br);
-						copy_co(flag, &fp_d[1], &cp_d[1], f_bg);
-						copy_co(flag, &fp_d[2], &cp_d[2], f_bb);
-						copy_co(flag, &fp_d[3], &cp_d[3], f_ba);
-					}*/
-					//else {
-					if (f_la != 0.0f) {
-						//printf("3\n");
-						copy_co(flag, &fp_d[0], &cp_d[0], f_lr);
-						copy_co(flag, &fp_d[1], &cp_d[1], f_lg);
-						copy_co(flag, &fp_d[2], &cp_d[2], f_lb);
-						copy_co(flag, &fp_d[3], &cp_d[3], f_la);
-					}
+				if ((background & IMA_LAYER_BG_ALPHA) && (f_la != 0.0f)) {
+					copy_co(flag, &fp_d[0], &cp_d[0], f_lr);
+					copy_co(flag, &fp_d[1], &cp_d[1], f_lg);
+					copy_co(flag, &fp_d[2], &cp_d[2], f_lb);
+					copy_co(flag, &fp_d[3], &cp_d[3], f_la);
 				}
 			}
 		}
 
-		if (base->rect_float) {
-			if (((i % bg_x) == 0) && (i != (bg_x * bg_y))) {
-				if (base->x > layer->x) {
-					fp_b = fp_b + diff_x * 4;
-					fp_d = fp_d + diff_x * 4;
-				}
-				else
-					fp_l = fp_l + diff_x * 4;
-			}
+		if (flag) {
+			cp_b += 4;
+			cp_l += 4;
+			cp_d += 4;
+		}
+		else {
 			fp_b += 4;
-			fp_l += 4; 
+			fp_l += 4;
 			fp_d += 4;
 		}
+	}
+}
+
+#ifdef WITH_LAYER_BLEND_SIMD
+typedef struct ImageLayerBlendKernel {
+	ImageLayerBlendRowByte row_byte;
+	ImageLayerBlendRowFloat row_float;
+} ImageLayerBlendKernel;
+
+/* widest kernel this CPU runs, NULL to use the scalar code only */
+static const ImageLayerBlendKernel *imalayer_blend_kernel_get(void)
+{
+	static const ImageLayerBlendKernel kernel_sse2 = {imalayer_blend_row_byte_sse2, imalayer_blend_row_float_sse2};
+	static const ImageLayerBlendKernel kernel_sse41 = {imalayer_blend_row_byte_sse41, imalayer_blend_row_float_sse41};
+	static const ImageLayerBlendKernel kernel_avx2 = {imalayer_blend_row_byte_avx2, imalayer_blend_row_float_avx2};
+	static const ImageLayerBlendKernel *kernel = NULL;
+	static bool initialized = false;
+
+	/* the result is the same for every thread, no need to lock */
+	if (!initialized) {
+		if (BLI_cpu_support_avx2())
+			kernel = &kernel_avx2;
+		else if (BLI_cpu_support_sse41())
+			kernel = &kernel_sse41;
+		else if (BLI_cpu_support_sse2())
+			kernel = &kernel_sse2;
+		initialized = true;
+	}
+
+	return kernel;
+}
+
+#ifndef NDEBUG
+/* Debug builds check every kernel row against the scalar reference. "ref_d"
+ * holds a copy of the row taken before the kernel ran, since "dest" may be
+ * "base". */
+static void imalayer_blend_row_verify(const void *dest, void *ref_d, const void *ref_b, const void *layer,
+                                      const unsigned char *mask, size_t size, int len, bool is_float,
+                                      ImageLayerBlendFunc blend_callback, float opacity, short background)
+{
+	if (is_float)
+		imalayer_blend_row_ref(ref_d, ref_b, layer, NULL, NULL, NULL, mask, len, blend_callback, opacity, background);
+	else
+		imalayer_blend_row_ref(NULL, NULL, NULL, ref_d, ref_b, layer, mask, len, blend_callback, opacity, background);
+
+	if (is_float) {
+		/* NaN may come out with either sign, the compiler is free to swap operands */
+		const float *fp_d = dest, *fp_ref = ref_d;
+		int i;
+
+		for (i = 0; i < len * 4; i++) {
+			BLI_assert(memcmp(&fp_d[i], &fp_ref[i], sizeof(float)) == 0 ||
+			           (isnan(fp_d[i]) && isnan(fp_ref[i])));
+		}
+	}
+	else {
+		BLI_assert(memcmp(dest, ref_d, size) == 0);
+	}
+}
+#endif  /* NDEBUG */
+#endif  /* WITH_LAYER_BLEND_SIMD */
+
+typedef struct ImageLayerBlendState {
+	ImBuf *dest, *base, *layer;
+	/* tiles of a sparse layer, "layer" has no pixels then */
+	const ImageLayerStorage *storage;
+	/* the pixels of "layer" are sampled through the transform of it */
+	const ImageLayer *transform;
+	/* scales the alpha of "layer", read in the same loop */
+	const ImageLayerMask *mask;
+	/* adjusts "base" in place instead, there's no "layer" then */
+	const ImageLayerAdjustment *adjustment;
+	ImageLayerBlendFunc blend_callback;
+	float opacity;
+	short mode, background;
+	int xmin, ymin, xmax, ymax;
+	bool is_float;
+} ImageLayerBlendState;
+
+/* Scratch memory of one thread: a decoded tile of a sparse layer, then one
+ * row of a transformed layer or of adjusted colors, then one row for checking
+ * the kernels in debug builds. Only what the blended layers need is there. */
+#define IMA_LAYER_SCRATCH_TILE_SIZE		(IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE * sizeof(float[4]))
+
+#if defined(WITH_LAYER_BLEND_SIMD) && !defined(NDEBUG)
+#  define IMA_LAYER_SCRATCH_ROW_SIZE(len, pixel_size)	((size_t)(len) * (pixel_size))
+#else
+#  define IMA_LAYER_SCRATCH_ROW_SIZE(len, pixel_size)	0
+#endif
+
+/* Sets up blending "layer" over "base" into "dest" inside the rectangle
+ * xmin..xmax, ymin..ymax, clipped to the buffers. The pixels of "layer" are
+ * read from "storage" when it's given, or through the transform of the
+ * layer "transform", and masked by "mask" when there's one. Returns false
+ * when there's nothing to blend. */
+static bool imalayer_blend_state_init(ImageLayerBlendState *state, ImBuf *dest, ImBuf *base, ImBuf *layer,
+                                      const ImageLayerStorage *storage, const ImageLayer *transform,
+                                      const ImageLayerMask *mask, float opacity, short mode, short background,
+                                      int xmin, int ymin, int xmax, int ymax)
+{
+	int layer_x = layer->x, layer_y = layer->y;
+	bool has_layer;
+
+	state->blend_callback = imalayer_blend_func(mode);
+	state->is_float = (base->rect == NULL);
+
+	if (state->blend_callback == NULL)
+		return false;
+
+	if (storage)
+		has_layer = state->is_float ? (storage->rect_float != NULL) : (storage->rect != NULL);
+	else
+		has_layer = state->is_float ? (layer->rect_float != NULL) : (layer->rect != NULL);
+
+	if (!has_layer || (state->is_float ? !(base->rect_float && dest->rect_float) : !dest->rect))
+		return false;
+
+	state->dest = dest;
+	state->base = base;
+	state->layer = layer;
+	state->storage = storage;
+	state->transform = transform;
+	state->mask = mask;
+	state->adjustment = NULL;
+	state->opacity = opacity;
+	state->mode = mode;
+	state->background = background;
+	state->xmin = max_ii(xmin, 0);
+	state->ymin = max_ii(ymin, 0);
+	if (transform)
+		imalayer_transform_get_size(transform, &layer_x, &layer_y);
+
+	state->xmax = min_iii(xmax, base->x, layer_x);
+	state->ymax = min_iii(ymax, base->y, layer_y);
+
+	return (state->xmin < state->xmax) && (state->ymin < state->ymax);
+}
+
+/* Sets up adjusting the colors of "dest" in place inside the rectangle, with
+ * the mode, opacity and mask of the adjustment layer. Returns false when
+ * there's nothing to change. */
+static bool imalayer_blend_state_init_adjustment(ImageLayerBlendState *state, ImBuf *dest,
+                                                 ImageLayerAdjustment *adjustment, const ImageLayerMask *mask,
+                                                 float opacity, short mode, int xmin, int ymin, int xmax, int ymax)
+{
+	state->blend_callback = imalayer_blend_func(mode);
+	state->is_float = (dest->rect == NULL);
+
+	if (state->blend_callback == NULL || (state->is_float && !dest->rect_float) ||
+	    imalayer_adjustment_is_identity(adjustment))
+	{
+		return false;
+	}
+
+	imalayer_adjustment_lut_ensure(adjustment);
+
+	state->dest = state->base = dest;
+	state->layer = NULL;
+	state->storage = NULL;
+	state->transform = NULL;
+	state->mask = mask;
+	state->adjustment = adjustment;
+	state->opacity = opacity;
+	state->mode = mode;
+	state->background = 0;
+	state->xmin = max_ii(xmin, 0);
+	state->ymin = max_ii(ymin, 0);
+	state->xmax = min_ii(xmax, dest->x);
+	state->ymax = min_ii(ymax, dest->y);
+
+	return (state->xmin < state->xmax) && (state->ymin < state->ymax);
+}
+
+static char *imalayer_ibuf_row(ImBuf *ibuf, bool is_float, int x, int y)
+{
+	if (is_float)
+		return (char *)(ibuf->rect_float + ((size_t)y * ibuf->x + x) * 4);
+	else
+		return (char *)ibuf->rect + ((size_t)y * ibuf->x + x) * 4;
+}
+
+/* Blends "len" pixels of one row, "scratch" as in imalayer_blend_rows().
+ * "row_m" are the mask values of the pixels, NULL when they aren't masked */
+static void imalayer_blend_span(const ImageLayerBlendState *state, char *row_d, char *row_b, const char *row_l,
+                                const unsigned char *row_m, int len, void *scratch)
+{
+	const size_t pixel_size = state->is_float ? sizeof(float[4]) : sizeof(char[4]);
+	int done = 0;
+#ifdef WITH_LAYER_BLEND_SIMD
+	const ImageLayerBlendKernel *kernel = imalayer_blend_kernel_get();
+
+	if (kernel) {
+#ifndef NDEBUG
+		void *ref_d = scratch;
+		void *ref_b = (row_b == row_d) ? ref_d : row_b;
+		memcpy(ref_d, row_d, len * pixel_size);
+#endif
+
+		if (state->is_float)
+			done = kernel->row_float((float *)row_d, (const float *)row_b, (const float *)row_l, row_m,
+			                         len, state->opacity, state->mode, state->background);
+		else
+			done = kernel->row_byte((unsigned char *)row_d, (const unsigned char *)row_b, (const unsigned char *)row_l,
+			                        row_m, len, state->opacity, state->mode, state->background);
+
+#ifndef NDEBUG
+		imalayer_blend_row_verify(row_d, ref_d, ref_b, row_l, row_m, done * pixel_size, done,
+		                          state->is_float, state->blend_callback, state->opacity, state->background);
+#endif
+	}
+#endif
+
+	if (done < len) {
+		row_d += done * pixel_size;
+		row_b += done * pixel_size;
+		row_l += done * pixel_size;
+		if (row_m)
+			row_m += done;
+
+		if (state->is_float)
+			imalayer_blend_row_ref((float *)row_d, (const float *)row_b, (const float *)row_l, NULL, NULL, NULL,
+			                       row_m, len - done, state->blend_callback, state->opacity, state->background);
+		else
+			imalayer_blend_row_ref(NULL, NULL, NULL, row_d, row_b, row_l,
+			                       row_m, len - done, state->blend_callback, state->opacity, state->background);
+	}
+
+	(void)scratch;
+}
+
+/* Blends "len" pixels of row "y" starting at "x", reading the mask of the
+ * layer a tile at a time: tiles that show the layer as it is go through the
+ * blend without values, the ones that hide it are skipped. */
+static void imalayer_blend_span_masked(const ImageLayerBlendState *state, char *row_d, char *row_b, const char *row_l,
+                                       int x, int y, int len, void *scratch)
+{
+	const size_t pixel_size = state->is_float ? sizeof(float[4]) : sizeof(char[4]);
+	unsigned char uniform_row[IMA_LAYER_TILE_SIZE];
+	const unsigned char *values, *row_m;
+	unsigned char uniform;
+	int n;
+
+	if (state->mask == NULL) {
+		imalayer_blend_span(state, row_d, row_b, row_l, NULL, len, scratch);
+		return;
+	}
+
+	while (len > 0) {
+		n = min_ii(len, IMA_LAYER_TILE_SIZE - (x & (IMA_LAYER_TILE_SIZE - 1)));
+		values = imalayer_mask_tile_values(state->mask, x >> IMA_LAYER_TILE_BITS, y >> IMA_LAYER_TILE_BITS, &uniform);
+
+		if (values) {
+			row_m = values + ((y & (IMA_LAYER_TILE_SIZE - 1)) << IMA_LAYER_TILE_BITS) + (x & (IMA_LAYER_TILE_SIZE - 1));
+		}
+		else if (uniform == 255) {
+			row_m = NULL;
+		}
+		else {
+			memset(uniform_row, uniform, n);
+			row_m = uniform_row;
+		}
+
+		/* a hidden layer leaves the base as it is */
+		if (row_m != uniform_row || uniform != 0 || state->dest != state->base)
+			imalayer_blend_span(state, row_d, row_b, row_l, row_m, n, scratch);
+
+		row_d += n * pixel_size;
+		row_b += n * pixel_size;
+		row_l += n * pixel_size;
+		x += n;
+		len -= n;
+	}
+}
+
+/* pixels that leave the base as it is, when blended over it in place */
+static bool imalayer_pixel_is_clear(const void *pixel, bool is_float)
+{
+	return is_float ? (((const float *)pixel)[3] == 0.0f) : (((const unsigned char *)pixel)[3] == 0);
+}
+
+/* the mask hides the layer in the whole tile */
+static bool imalayer_mask_tile_is_clear(const ImageLayerMask *mask, int tx, int ty)
+{
+	unsigned char uniform;
+
+	return (mask && imalayer_mask_tile_values(mask, tx, ty, &uniform) == NULL && uniform == 0);
+}
+
+/* Blends the rows of a sparse layer tile by tile. Tiles of a single clear
+ * color are skipped, the scalar code doesn't write pixels the layer doesn't
+ * cover either, and so are the ones the mask hides, before decoding them. */
+static void imalayer_blend_rows_sparse(const ImageLayerBlendState *state, int ymin, int ymax, void *scratch)
+{
+	const size_t pixel_size = state->is_float ? sizeof(float[4]) : sizeof(char[4]);
+	void *tile_scratch = scratch;
+	void *row_scratch = (char *)scratch + IMA_LAYER_SCRATCH_TILE_SIZE;
+	const char *pixels, *row_l;
+	int tx, ty, x0, x1, y0, y1, y, stride;
+
+	for (ty = ymin >> IMA_LAYER_TILE_BITS; (ty << IMA_LAYER_TILE_BITS) < ymax; ty++) {
+		y0 = max_ii(ymin, ty << IMA_LAYER_TILE_BITS);
+		y1 = min_ii(ymax, (ty + 1) << IMA_LAYER_TILE_BITS);
+
+		for (tx = state->xmin >> IMA_LAYER_TILE_BITS; (tx << IMA_LAYER_TILE_BITS) < state->xmax; tx++) {
+			x0 = max_ii(state->xmin, tx << IMA_LAYER_TILE_BITS);
+			x1 = min_ii(state->xmax, (tx + 1) << IMA_LAYER_TILE_BITS);
+
+			if (state->dest == state->base && imalayer_mask_tile_is_clear(state->mask, tx, ty))
+				continue;
+
+			pixels = imalayer_storage_tile_pixels(state->storage, state->is_float, tx, ty, tile_scratch, &stride);
+
+			if (stride == 0 && state->dest == state->base && imalayer_pixel_is_clear(pixels, state->is_float))
+				continue;
+
+			for (y = y0; y < y1; y++) {
+				row_l = pixels + ((size_t)(y - (ty << IMA_LAYER_TILE_BITS)) * stride +
+				                  (x0 - (tx << IMA_LAYER_TILE_BITS))) * pixel_size;
+
+				imalayer_blend_span_masked(state, imalayer_ibuf_row(state->dest, state->is_float, x0, y),
+				                           imalayer_ibuf_row(state->base, state->is_float, x0, y),
+				                           row_l, x0, y, x1 - x0, row_scratch);
+			}
+		}
+	}
+}
+
+/* Blends the rows of a transformed layer, sampled into the scratch row */
+static void imalayer_blend_rows_transform(const ImageLayerBlendState *state, int ymin, int ymax, void *scratch)
+{
+	const size_t pixel_size = state->is_float ? sizeof(float[4]) : sizeof(char[4]);
+	const int xmin = state->xmin, len = state->xmax - state->xmin;
+	char *row_l = scratch;
+	int y;
 
-		if (base->rect) {
-			if (((i % bg_x) == 0) && (i != (bg_x * bg_y))) {
-				if (base->x > layer->x) {
-					cp_b = cp_b + diff_x * 4;
-					cp_d = cp_d + diff_x * 4;
+	for (y = ymin; y < ymax; y++) {
+		imalayer_transform_sample_row(state->transform, state->layer, state->is_float, xmin, y, len, row_l);
+
+		imalayer_blend_span_masked(state, imalayer_ibuf_row(state->dest, state->is_float, xmin, y),
+		                           imalayer_ibuf_row(state->base, state->is_float, xmin, y),
+		                           row_l, xmin, y, len, row_l + len * pixel_size);
+	}
+}
+
+/* Blends the adjusted colors of "len" pixels over the ones in "row_d", the
+ * alpha stays. "row_m" are the mask values, NULL when they aren't masked */
+static void imalayer_adjust_span(const ImageLayerBlendState *state, char *row_d, const char *row_a,
+                                 const unsigned char *row_m, int len)
+{
+	const size_t pixel_size = state->is_float ? sizeof(float[4]) : sizeof(char[4]);
+	float fac;
+	int x, c;
+
+	/* the adjusted colors as they are */
+	if (row_m == NULL && state->opacity == 1.0f && state->mode == IMA_LAYER_NORMAL) {
+		memcpy(row_d, row_a, len * pixel_size);
+		return;
+	}
+
+	for (x = 0; x < len; x++) {
+		fac = row_m ? state->opacity * ((float)row_m[x] / 255.0f) : state->opacity;
+
+		if (state->is_float) {
+			float *fp_d = (float *)row_d + x * 4;
+			const float *fp_a = (const float *)row_a + x * 4;
+
+			for (c = 0; c < 3; c++)
+				fp_d[c] = state->blend_callback(fp_d[c], fp_a[c], fac);
+		}
+		else {
+			unsigned char *cp_d = (unsigned char *)row_d + x * 4;
+			const unsigned char *cp_a = (const unsigned char *)row_a + x * 4;
+
+			for (c = 0; c < 3; c++)
+				cp_d[c] = FTOCHAR(state->blend_callback((float)cp_d[c] / 255.0f, (float)cp_a[c] / 255.0f, fac));
+		}
+	}
+}
+
+/* Adjusts the rows of "dest" in place, a tile of the mask at a time: tiles
+ * it hides are skipped, the colors of the other ones are adjusted into the
+ * scratch row and blended back. */
+static void imalayer_blend_rows_adjustment(const ImageLayerBlendState *state, int ymin, int ymax, void *scratch)
+{
+	unsigned char uniform_row[IMA_LAYER_TILE_SIZE];
+	const unsigned char *values, *row_m;
+	unsigned char uniform;
+	char *row_d;
+	int x, y, n;
+
+	for (y = ymin; y < ymax; y++) {
+		for (x = state->xmin; x < state->xmax; x += n) {
+			n = min_ii(state->xmax - x, IMA_LAYER_TILE_SIZE - (x & (IMA_LAYER_TILE_SIZE - 1)));
+			row_m = NULL;
+
+			if (state->mask) {
+				values = imalayer_mask_tile_values(state->mask, x >> IMA_LAYER_TILE_BITS, y >> IMA_LAYER_TILE_BITS,
+				                                   &uniform);
+
+				if (values) {
+					row_m = values + ((y & (IMA_LAYER_TILE_SIZE - 1)) << IMA_LAYER_TILE_BITS) +
+					        (x & (IMA_LAYER_TILE_SIZE - 1));
+				}
+				else if (uniform == 0) {
+					continue;
+				}
+				else if (uniform != 255) {
+					memset(uniform_row, uniform, n);
+					row_m = uniform_row;
 				}
-				else
-					cp_l = cp_l + diff_x * 4;
 			}
-			cp_b += 4;
-			cp_l += 4; 
-			cp_d += 4;
+
+			row_d = imalayer_ibuf_row(state->dest, state->is_float, x, y);
+			imalayer_adjustment_row(state->adjustment, state->is_float, row_d, scratch, n);
+			imalayer_adjust_span(state, row_d, scratch, row_m, n);
 		}
 	}
+}
+
+/* Blends the rows ymin..ymax that are inside the rectangle of "state".
+ * "scratch" is laid out as described at IMA_LAYER_SCRATCH_TILE_SIZE, without
+ * the tile when the layer isn't sparse and without the row when it isn't
+ * transformed or an adjustment. */
+static void imalayer_blend_rows(const ImageLayerBlendState *state, int ymin, int ymax, void *scratch)
+{
+	const int xmin = state->xmin, len = state->xmax - state->xmin;
+	int y;
+
+	ymin = max_ii(ymin, state->ymin);
+	ymax = min_ii(ymax, state->ymax);
+
+	if (ymin >= ymax)
+		return;
+
+	if (state->adjustment) {
+		imalayer_blend_rows_adjustment(state, ymin, ymax, scratch);
+		return;
+	}
+
+	if (state->storage) {
+		imalayer_blend_rows_sparse(state, ymin, ymax, scratch);
+		return;
+	}
+
+	if (state->transform) {
+		imalayer_blend_rows_transform(state, ymin, ymax, scratch);
+		return;
+	}
+
+	for (y = ymin; y < ymax; y++) {
+		imalayer_blend_span_masked(state, imalayer_ibuf_row(state->dest, state->is_float, xmin, y),
+		                           imalayer_ibuf_row(state->base, state->is_float, xmin, y),
+		                           imalayer_ibuf_row(state->layer, state->is_float, xmin, y), xmin, y, len, scratch);
+	}
+}
+
+/* rectangles with fewer pixels are done on the calling thread */
+#define IMA_LAYER_BANDS_THREADED_MIN	(256 * 256)
+/* a band should stay in the CPU cache while all layers are blended over it */
+#define IMA_LAYER_BANDS_BYTES			(256 * 1024)
+
+typedef void (*ImageLayerBandFunc)(void *userdata, int ymin, int ymax, void *scratch);
+
+typedef struct ImageLayerBands {
+	ImageLayerBandFunc band_func;
+	void *userdata;
+	int ymax, band_rows;
+	void **scratch;
+} ImageLayerBands;
+
+static void imalayer_bands_task(TaskPool *pool, void *taskdata, int threadid)
+{
+	ImageLayerBands *bands = (ImageLayerBands *)BLI_task_pool_userdata(pool);
+	int ymin = GET_INT_FROM_POINTER(taskdata);
+	int ymax = ymin - ymin % bands->band_rows + bands->band_rows;
+
+	bands->band_func(bands->userdata, ymin, min_ii(ymax, bands->ymax), bands->scratch[threadid]);
+}
+
+/* Calls "band_func" for bands of rows covering ymin..ymax, in parallel on the
+ * task scheduler for large rectangles. Every pixel only depends on the pixels
+ * at the same position, so the result is the same as doing it in one go.
+ * Bands start at multiples of "row_align" rows, and every call gets
+ * "scratch_size" bytes of its own. */
+static void imalayer_bands_run(ImageLayerBandFunc band_func, void *userdata, size_t pixel_size,
+                               size_t scratch_size, int row_align, int xmin, int ymin, int xmax, int ymax)
+{
+	TaskScheduler *task_scheduler = BLI_task_scheduler_get();
+	TaskPool *task_pool;
+	ImageLayerBands bands;
+	const size_t row_size = (size_t)(xmax - xmin) * pixel_size;
+	int i, num_threads, band_rows, y;
+
+	num_threads = BLI_task_scheduler_num_threads(task_scheduler);
+
+	/* MEM_mallocN() isn't thread safe unless threaded malloc is on, so the
+	 * scratch memory is allocated here, one per thread (the caller is 0) */
+	bands.band_func = band_func;
+	bands.userdata = userdata;
+	bands.ymax = ymax;
+	bands.scratch = MEM_callocN(sizeof(void *) * (num_threads + 1), "imalayer_bands_run scratch");
+	for (i = 0; scratch_size && i <= num_threads; i++)
+		bands.scratch[i] = MEM_mallocN(scratch_size, "imalayer_bands_run scratch");
+
+	if ((size_t)(xmax - xmin) * (size_t)(ymax - ymin) < IMA_LAYER_BANDS_THREADED_MIN || num_threads < 2) {
+		band_func(userdata, ymin, ymax, bands.scratch[0]);
+	}
+	else {
+		/* a few bands per thread so threads that finish early pick up more work,
+		 * fewer rows when the rows are long */
+		band_rows = (ymax - ymin + num_threads * 4 - 1) / (num_threads * 4);
+		band_rows = max_ii(1, min_ii(band_rows, (int)(IMA_LAYER_BANDS_BYTES / row_size)));
+		band_rows = (band_rows + row_align - 1) / row_align * row_align;
+		bands.band_rows = band_rows;
+
+		task_pool = BLI_task_pool_create(task_scheduler, &bands);
+
+		for (y = ymin; y < ymax; y = y - y % band_rows + band_rows)
+			BLI_task_pool_push(task_pool, imalayer_bands_task, SET_INT_IN_POINTER(y), false, TASK_PRIORITY_LOW);
+
+		BLI_task_pool_work_and_wait(task_pool);
+		BLI_task_pool_free(task_pool);
+	}
+
+	for (i = 0; scratch_size && i <= num_threads; i++)
+		MEM_freeN(bands.scratch[i]);
+	MEM_freeN(bands.scratch);
+}
+
+static void imalayer_blend_band(void *userdata, int ymin, int ymax, void *scratch)
+{
+	imalayer_blend_rows((ImageLayerBlendState *)userdata, ymin, ymax, scratch);
+}
+
+/* Blends "layer" over "base" into "dest" inside the rectangle xmin..xmax, ymin..ymax.
+ * "dest" has the size of "base" and may be "base" itself, every pixel only
+ * depends on the pixel at the same position. Byte buffers win when "base"
+ * has both, like they always did. */
+static void imalayer_blend_rect(ImBuf *dest, ImBuf *base, ImBuf *layer, float opacity, short mode, short background,
+                                int xmin, int ymin, int xmax, int ymax)
+{
+	ImageLayerBlendState state;
+	size_t pixel_size;
+
+	if (!imalayer_blend_state_init(&state, dest, base, layer, NULL, NULL, NULL, opacity, mode, background,
+	                               xmin, ymin, xmax, ymax))
+	{
+		return;
+	}
+
+	pixel_size = state.is_float ? sizeof(float[4]) : sizeof(char[4]);
+	imalayer_bands_run(imalayer_blend_band, &state, pixel_size,
+	                   IMA_LAYER_SCRATCH_ROW_SIZE(state.xmax - state.xmin, pixel_size), 1,
+	                   state.xmin, state.ymin, state.xmax, state.ymax);
+}
+
+ImBuf *imalayer_blend(ImBuf *base, ImBuf *layer, float opacity, short mode, short background)
+{
+	ImBuf *dest;
+
+	if (!base)
+		return IMB_dupImBuf(layer);
+
+	dest = IMB_dupImBuf(base);
+
+	if (opacity == 0.0f)
+		return dest;
+
+	imalayer_blend_rect(dest, base, layer, opacity, mode, background, 0, 0, base->x, base->y);
 
-	//end=clock();
-	//tempo=((double)(end-start))/CLOCKS_PER_SEC;
-	//printf("Elapsed time: %f seconds.\n", tempo);
 	return dest;
 }
 
+/* Bakes an adjustment layer into the pixels of "ibuf", the layer below it */
+static void imalayer_adjustment_apply_ibuf(ImageLayer *layer, ImBuf *ibuf)
+{
+	ImageLayerBlendState state;
+	size_t pixel_size;
+
+	if (!imalayer_blend_state_init_adjustment(&state, ibuf, layer->adjustment, imalayer_mask_used(layer),
+	                                          layer->opacity, layer->mode, 0, 0, ibuf->x, ibuf->y))
+	{
+		return;
+	}
+
+	pixel_size = state.is_float ? sizeof(float[4]) : sizeof(char[4]);
+	imalayer_bands_run(imalayer_blend_band, &state, pixel_size, (size_t)(state.xmax - state.xmin) * pixel_size, 1,
+	                   state.xmin, state.ymin, state.xmax, state.ymax);
+
+	ibuf->userflags |= IB_BITMAPDIRTY | IB_DISPLAY_BUFFER_INVALID;
+}
+
 struct ImageLayer *merge_layers(Image *ima, ImageLayer *iml, ImageLayer *iml_next)
 {
 	ImBuf *ibuf, *result_ibuf;
+
+	/* an adjustment only changes the colors of the layer below, its mask stays */
+	if (imalayer_is_adjustment(iml)) {
+		ibuf = imalayer_get_ibuf(iml_next);
+		if (ibuf && (iml->visible & IMA_LAYER_VISIBLE) && iml->opacity != 0.0f)
+			imalayer_adjustment_apply_ibuf(iml, ibuf);
+
+		BLI_remlink(&ima->imlayers, iml);
+		free_image_layer(iml);
+
+		imalayer_tag_dirty(iml_next);
+		imalayer_cache_tag_dirty(ima);
+
+		return iml_next;
+	}
+
+	/* the result has no mask, both are baked into the pixels first */
+	imalayer_mask_apply(iml);
+	imalayer_mask_apply(iml_next);
+
 	 /* merge layers */
-	result_ibuf = imalayer_blend((ImBuf*)((ImageLayer*)iml_next->ibufs.first), (ImBuf*)((ImageLayer*)iml->ibufs.first),
+	result_ibuf = imalayer_blend(imalayer_get_ibuf(iml_next), imalayer_get_ibuf(iml),
 								 iml->opacity, iml->mode, ((ImageLayer*)iml_next->ibufs.first)->background);
 	
 	iml_next->background = IMA_LAYER_BG_RGB;
@@ -822,42 +2027,521 @@ struct ImageLayer *merge_layers(Image *ima, ImageLayer *iml, ImageLayer *iml_nex
 	/* delete the layer merge */
 	BLI_remlink(&ima->imlayers, iml);
 	free_image_layer(iml);
-	
+
+	imalayer_tag_dirty(iml_next);
+	imalayer_cache_tag_dirty(ima);
+
 	return iml_next;
 }
 
-/* Non distruttivo */
-void merge_layers_visible_nd(Image *ima)
+/* Bakes every visible adjustment layer at the root, the lowest first: the
+ * visible layers below it are merged into the lowest one, which then gets
+ * the adjustment, so it changes what it changed in the composite. Hidden
+ * ones stay as they are */
+void image_merge_layer_adjustments(Image *ima)
+{
+	ImageLayer *act = imalayer_get_current(ima);
+	ImageLayer *layer, *prev, *lowest, *iter, *iter_prev;
+
+	for (layer = ima->imlayers.last; layer; layer = prev) {
+		prev = layer->prev;
+
+		if (!imalayer_is_adjustment(layer) || !(layer->visible & IMA_LAYER_VISIBLE))
+			continue;
+
+		for (lowest = ima->imlayers.last; lowest != layer; lowest = lowest->prev) {
+			if (lowest->visible & IMA_LAYER_VISIBLE)
+				break;
+		}
+
+		if (act == layer)
+			act = (lowest != layer) ? lowest : (prev ? prev : layer->next);
+
+		if (lowest != layer) {
+			for (iter = lowest->prev; iter != layer; iter = iter_prev) {
+				iter_prev = iter->prev;
+				if (iter->visible & IMA_LAYER_VISIBLE) {
+					if (act == iter)
+						act = lowest;
+					merge_layers(ima, iter, lowest);
+					ima->Count_Layers -= 1;
+				}
+			}
+
+			merge_layers(ima, layer, lowest);
+		}
+		else {
+			BLI_remlink(&ima->imlayers, layer);
+			free_image_layer(layer);
+		}
+
+		ima->Count_Layers -= 1;
+	}
+
+	if (act)
+		imalayer_set_current_act(ima, imalayer_get_index_layer(ima, act));
+	imalayer_cache_tag_dirty(ima);
+}
+
+/* The visible layers, bottom to top, composited band by band. */
+typedef struct ImageLayerStack {
+	ImBuf *composite;
+	/* lowest visible layer, copied into the band first, NULL when the
+	 * composite already holds it */
+	ImBuf *lowest;
+	/* its tiles when it's sparse */
+	const ImageLayerStorage *lowest_storage;
+	/* the layer, when "lowest" is sampled through its transform */
+	const ImageLayer *lowest_transform;
+	/* the mask of the lowest layer, applied after copying it */
+	const ImageLayerMask *lowest_mask;
+	ImageLayerBlendState *blends;
+	int totblend;
+	int xmin, xmax;
+	/* bytes of scratch memory before the row, see IMA_LAYER_SCRATCH_TILE_SIZE */
+	size_t scratch_tile_size;
+} ImageLayerStack;
+
+/* Copies the rows ymin..ymax of a sparse layer into "dest", both buffers
+ * when they're there */
+static void imalayer_copy_rows_sparse(ImBuf *dest, const ImageLayerStorage *storage, int xmin, int xmax,
+                                      int ymin, int ymax, void *tile_scratch)
+{
+	const char *pixels, *src;
+	size_t pixel_size;
+	int tx, ty, x0, x1, y, stride, pass;
+	bool is_float;
+
+	for (pass = 0; pass < 2; pass++) {
+		is_float = (pass == 1);
+
+		if (is_float ? !(dest->rect_float && storage->rect_float) : !(dest->rect && storage->rect))
+			continue;
+
+		pixel_size = is_float ? sizeof(float[4]) : sizeof(char[4]);
+
+		for (ty = ymin >> IMA_LAYER_TILE_BITS; (ty << IMA_LAYER_TILE_BITS) < ymax; ty++) {
+			for (tx = xmin >> IMA_LAYER_TILE_BITS; (tx << IMA_LAYER_TILE_BITS) < xmax; tx++) {
+				x0 = max_ii(xmin, tx << IMA_LAYER_TILE_BITS);
+				x1 = min_ii(xmax, (tx + 1) << IMA_LAYER_TILE_BITS);
+
+				pixels = imalayer_storage_tile_pixels(storage, is_float, tx, ty, tile_scratch, &stride);
+
+				for (y = max_ii(ymin, ty << IMA_LAYER_TILE_BITS); y < min_ii(ymax, (ty + 1) << IMA_LAYER_TILE_BITS); y++) {
+					src = pixels + ((size_t)(y - (ty << IMA_LAYER_TILE_BITS)) * stride +
+					                (x0 - (tx << IMA_LAYER_TILE_BITS))) * pixel_size;
+					memcpy(imalayer_ibuf_row(dest, is_float, x0, y), src, (x1 - x0) * pixel_size);
+				}
+			}
+		}
+	}
+}
+
+/* Samples the rows ymin..ymax of a transformed layer into "dest", both
+ * buffers when they're there */
+static void imalayer_copy_rows_transform(ImBuf *dest, const ImageLayer *layer, ImBuf *ibuf, int xmin, int xmax,
+                                         int ymin, int ymax)
+{
+	int y;
+
+	for (y = ymin; y < ymax; y++) {
+		if (dest->rect && ibuf->rect)
+			imalayer_transform_sample_row(layer, ibuf, false, xmin, y, xmax - xmin,
+			                              imalayer_ibuf_row(dest, false, xmin, y));
+		if (dest->rect_float && ibuf->rect_float)
+			imalayer_transform_sample_row(layer, ibuf, true, xmin, y, xmax - xmin,
+			                              imalayer_ibuf_row(dest, true, xmin, y));
+	}
+}
+
+/* Scales the alpha of the rows ymin..ymax of "dest" by the mask values,
+ * both buffers when they're there */
+static void imalayer_mask_rows(ImBuf *dest, const ImageLayerMask *mask, int xmin, int xmax, int ymin, int ymax)
+{
+	const unsigned char *values;
+	unsigned char uniform, m, *cp;
+	float *fp;
+	int tx, x, y;
+
+	xmax = min_ii(xmax, mask->x);
+	ymax = min_ii(ymax, mask->y);
+
+	for (y = ymin; y < ymax; y++) {
+		for (x = xmin; x < xmax; x++) {
+			tx = x >> IMA_LAYER_TILE_BITS;
+			values = imalayer_mask_tile_values(mask, tx, y >> IMA_LAYER_TILE_BITS, &uniform);
+
+			/* whole tiles that show the layer as it is */
+			if (values == NULL && uniform == 255) {
+				x = ((tx + 1) << IMA_LAYER_TILE_BITS) - 1;
+				continue;
+			}
+
+			m = values ? values[((y & (IMA_LAYER_TILE_SIZE - 1)) << IMA_LAYER_TILE_BITS) + (x & (IMA_LAYER_TILE_SIZE - 1))] :
+			             uniform;
+
+			if (dest->rect) {
+				cp = (unsigned char *)imalayer_ibuf_row(dest, false, x, y);
+				cp[3] = (unsigned char)FTOCHAR((float)cp[3] / 255.0f * ((float)m / 255.0f));
+			}
+			if (dest->rect_float) {
+				fp = (float *)imalayer_ibuf_row(dest, true, x, y);
+				fp[3] *= (float)m / 255.0f;
+			}
+		}
+	}
+}
+
+static void imalayer_stack_band(void *userdata, int ymin, int ymax, void *scratch)
+{
+	ImageLayerStack *stack = (ImageLayerStack *)userdata;
+	int i;
+
+	if (stack->lowest_transform) {
+		imalayer_copy_rows_transform(stack->composite, stack->lowest_transform, stack->lowest,
+		                             stack->xmin, stack->xmax, ymin, ymax);
+	}
+	else if (stack->lowest_storage) {
+		imalayer_copy_rows_sparse(stack->composite, stack->lowest_storage, stack->xmin, stack->xmax,
+		                          ymin, ymax, scratch);
+	}
+	else if (stack->lowest) {
+		IMB_rectcpy(stack->composite, stack->lowest, stack->xmin, ymin, stack->xmin, ymin,
+		            stack->xmax - stack->xmin, ymax - ymin);
+	}
+
+	if (stack->lowest_mask)
+		imalayer_mask_rows(stack->composite, stack->lowest_mask, stack->xmin, stack->xmax, ymin, ymax);
+
+	for (i = 0; i < stack->totblend; i++) {
+		imalayer_blend_rows(&stack->blends[i], ymin, ymax,
+		                    stack->blends[i].storage ? scratch : (char *)scratch + stack->scratch_tile_size);
+	}
+}
+
+static ImageLayer *imalayer_lowest_visible(Image *ima, ImageLayer *group)
 {
 	ImageLayer *layer;
-	ImBuf *ibuf, *result_ibuf, *next_ibuf;
-	short background;
 
-	result_ibuf = NULL;
-	background = ((ImageLayer *)ima->imlayers.last)->background;
-	
-	for (layer = (ImageLayer *)ima->imlayers.last; layer; layer = layer->prev) {
-		if (layer->visible & IMA_LAYER_VISIBLE) {
-			ibuf = (ImBuf*)((ImageLayer*)layer->ibufs.first);
-				
-			if (ibuf) {
-				next_ibuf = imalayer_blend(result_ibuf, ibuf, layer->opacity, layer->mode, background);
-				
-				if (result_ibuf)
-					IMB_freeImBuf(result_ibuf);
-				
-				result_ibuf = next_ibuf;
-				next_ibuf = NULL;
+	for (layer = imalayer_child_bottom(ima, group); layer; layer = imalayer_child_above(group, layer)) {
+		if ((layer->visible & IMA_LAYER_VISIBLE) && imalayer_stack_ibuf(layer))
+			return layer;
+	}
+
+	return NULL;
+}
+
+/* Composites the visible children of "group", the root layers when it's
+ * NULL, into "composite" inside the rectangle, in place. Each band of rows
+ * goes through the whole stack while it's in the cache and is written once,
+ * no intermediate buffers are allocated. With "copy_lowest" false the
+ * composite already holds the lowest layer. */
+static void merge_layers_visible_rect(Image *ima, ImageLayer *group, ImBuf *composite, short background,
+                                      bool copy_lowest, int xmin, int ymin, int xmax, int ymax)
+{
+	ImageLayerStack stack;
+	ImageLayer *layer, *lowest, *transform;
+	ImageLayerStorage *storage;
+	ImBuf *ibuf;
+	size_t pixel_size, transform_row_size;
+	bool sparse, transformed, adjusted;
+
+	lowest = imalayer_lowest_visible(ima, group);
+
+	if (lowest == NULL)
+		return;
+
+	xmin = max_ii(xmin, 0);
+	ymin = max_ii(ymin, 0);
+	xmax = min_ii(xmax, composite->x);
+	ymax = min_ii(ymax, composite->y);
+
+	if ((xmin >= xmax) || (ymin >= ymax))
+		return;
+
+	/* transformed layers are sampled from their pixels, not from tiles */
+	stack.composite = composite;
+	stack.lowest_transform = (copy_lowest && imalayer_transform_is_set(lowest)) ? lowest : NULL;
+	if (stack.lowest_transform)
+		imalayer_ensure_layer_pixels(lowest);
+	stack.lowest = copy_lowest ? imalayer_stack_ibuf(lowest) : NULL;
+	stack.lowest_storage = (copy_lowest && !stack.lowest_transform) ? imalayer_sparse_storage(lowest) : NULL;
+	stack.lowest_mask = imalayer_mask_used(lowest);
+	stack.xmin = xmin;
+	stack.xmax = xmax;
+	stack.totblend = 0;
+	stack.blends = MEM_mallocN(sizeof(*stack.blends) * BLI_countlist(&ima->imlayers), "ImageLayerStack blends");
+
+	sparse = (stack.lowest_storage != NULL);
+	transformed = adjusted = false;
+
+	for (layer = imalayer_child_above(group, lowest); layer; layer = imalayer_child_above(group, layer)) {
+		/* adjusts what's blended so far, in the same band */
+		if (imalayer_is_adjustment(layer)) {
+			if ((layer->visible & IMA_LAYER_VISIBLE) && layer->opacity != 0.0f &&
+			    imalayer_blend_state_init_adjustment(&stack.blends[stack.totblend], composite, layer->adjustment,
+			                                         imalayer_mask_used(layer), layer->opacity, layer->mode,
+			                                         xmin, ymin, xmax, ymax))
+			{
+				stack.totblend++;
+				adjusted = true;
+			}
+			continue;
+		}
+
+		ibuf = imalayer_stack_ibuf(layer);
+
+		if (ibuf && (layer->visible & IMA_LAYER_VISIBLE) && layer->opacity != 0.0f) {
+			transform = imalayer_transform_is_set(layer) ? layer : NULL;
+			if (transform)
+				imalayer_ensure_layer_pixels(layer);
+			storage = transform ? NULL : imalayer_sparse_storage(layer);
+
+			if (imalayer_blend_state_init(&stack.blends[stack.totblend], composite, composite, ibuf, storage,
+			                              transform, imalayer_mask_used(layer), layer->opacity, layer->mode,
+			                              background, xmin, ymin, xmax, ymax))
+			{
+				stack.totblend++;
+				sparse |= (storage != NULL);
+				transformed |= (transform != NULL);
 			}
 		}
 	}
-	if (ima->ibufs.first) {
-		IMB_freeImBuf((ImBuf *)ima->ibufs.first);
-		ima->ibufs.first = NULL;
-		ima->ibufs.last = NULL;
+
+	/* sparse layers are read a tile at a time, bands don't split tiles */
+	pixel_size = composite->rect ? sizeof(char[4]) : sizeof(float[4]);
+	stack.scratch_tile_size = sparse ? IMA_LAYER_SCRATCH_TILE_SIZE : 0;
+	transform_row_size = (transformed || adjusted) ? (size_t)(xmax - xmin) * pixel_size : 0;
+
+	imalayer_bands_run(imalayer_stack_band, &stack, pixel_size,
+	                   stack.scratch_tile_size + transform_row_size + IMA_LAYER_SCRATCH_ROW_SIZE(xmax - xmin, pixel_size),
+	                   sparse ? IMA_LAYER_TILE_SIZE : 1, xmin, ymin, xmax, ymax);
+
+	MEM_freeN(stack.blends);
+}
+
+/* Re-blends the tiles tagged by imalayer_tag_dirty_region() */
+static void imalayer_cache_update_tiles(Image *ima, ImageLayer *group, short background)
+{
+	ImageLayerCache *cache = *imalayer_cache_p(ima, group);
+	ImBuf *composite = cache->composite;
+	unsigned char *tile;
+	int tx, ty, tx_end;
+	rcti rect, span;
+	int first = TRUE;
+
+	for (ty = 0; ty < cache->tiles_y; ty++) {
+		tile = cache->tiles + ty * cache->tiles_x;
+
+		for (tx = 0; tx < cache->tiles_x; tx++) {
+			int xmin, ymin, xmax, ymax;
+
+			if (!tile[tx])
+				continue;
+
+			/* blend runs of dirty tiles in a row at once */
+			for (tx_end = tx; tx_end < cache->tiles_x && tile[tx_end]; tx_end++)
+				tile[tx_end] = 0;
+
+			xmin = tx << IMA_LAYER_TILE_BITS;
+			ymin = ty << IMA_LAYER_TILE_BITS;
+			xmax = min_ii(tx_end << IMA_LAYER_TILE_BITS, composite->x);
+			ymax = min_ii((ty + 1) << IMA_LAYER_TILE_BITS, composite->y);
+
+			merge_layers_visible_rect(ima, group, composite, background, true, xmin, ymin, xmax, ymax);
+			imalayer_mip_tag_region(cache->mip, xmin, ymin, xmax - xmin, ymax - ymin);
+
+			BLI_rcti_init(&span, xmin, xmax, ymin, ymax);
+			if (first) {
+				rect = span;
+				first = FALSE;
+			}
+			else {
+				BLI_rcti_union(&rect, &span);
+			}
+
+			tx = tx_end;
+		}
+	}
+
+	cache->flag &= ~IMA_LAYER_CACHE_TILES;
+
+	if (first)
+		return;
+
+	IMB_partial_display_buffer_update_delayed(composite, rect.xmin, rect.ymin, rect.xmax, rect.ymax);
+
+	if (composite->mipmap[0])
+		composite->userflags |= IB_MIPMAP_INVALID;
+}
+
+/* The previous composite can be overwritten when it looks like a copy of the
+ * lowest layer, otherwise it's replaced by one. Not when it holds both buffers:
+ * invalidating its display would rebuild the blended bytes from the float.
+ * A sparse lowest layer counts with the buffers of its storage, a
+ * transformed one with its transformed size. */
+static bool imalayer_composite_reusable(ImBuf *composite, ImageLayer *lowest_layer)
+{
+	ImBuf *lowest = imalayer_stack_ibuf(lowest_layer);
+	ImageLayerStorage *storage = imalayer_sparse_storage(lowest_layer);
+	const bool has_rect = storage ? (storage->rect != NULL) : (lowest->rect != NULL);
+	const bool has_rect_float = storage ? (storage->rect_float != NULL) : (lowest->rect_float != NULL);
+	int lowest_x = lowest->x, lowest_y = lowest->y;
+
+	if (imalayer_transform_is_set(lowest_layer))
+		imalayer_transform_get_size(lowest_layer, &lowest_x, &lowest_y);
+
+	return (!(has_rect && has_rect_float) &&
+	        composite->x == lowest_x && composite->y == lowest_y &&
+	        composite->planes == lowest->planes && composite->channels == lowest->channels &&
+	        (composite->flags & IB_fields) == (lowest->flags & IB_fields) &&
+	        (composite->rect != NULL) == has_rect &&
+	        (composite->rect_float != NULL) == has_rect_float &&
+	        composite->rect_colorspace == lowest->rect_colorspace &&
+	        composite->float_colorspace == lowest->float_colorspace);
+}
+
+/* A new composite holding the lowest layer, "r_copy_lowest" tells when its
+ * pixels still have to be copied in */
+static ImBuf *imalayer_composite_new(ImageLayer *lowest_layer, bool *r_copy_lowest)
+{
+	ImageLayerStorage *storage = imalayer_sparse_storage(lowest_layer);
+	ImBuf *lowest = imalayer_stack_ibuf(lowest_layer);
+	ImBuf *composite;
+	int flags = 0;
+
+	if (imalayer_transform_is_set(lowest_layer)) {
+		/* sampled in by merge_layers_visible_rect() */
+		if ((storage && storage->rect) || lowest->rect)
+			flags |= IB_rect;
+		if ((storage && storage->rect_float) || lowest->rect_float)
+			flags |= IB_rectfloat;
+
+		composite = IMB_allocImBuf(lowest_layer->transform_x, lowest_layer->transform_y, lowest->planes, flags);
+		if (composite) {
+			composite->ftype = lowest->ftype;
+			composite->rect_colorspace = lowest->rect_colorspace;
+			composite->float_colorspace = lowest->float_colorspace;
+		}
+
+		*r_copy_lowest = true;
+		return composite;
+	}
+
+	composite = IMB_dupImBuf(lowest);
+
+	*r_copy_lowest = (storage != NULL);
+
+	if (composite && storage) {
+		if (storage->rect)
+			imb_addrectImBuf(composite);
+		if (storage->rect_float)
+			imb_addrectfloatImBuf(composite);
+	}
+
+	return composite;
+}
+
+/* Brings the composite of the children of "group", the root layers when
+ * it's NULL, up to date. "*r_composite" is overwritten when it can be reused,
+ * replaced otherwise. Returns true when it was blended again from scratch */
+static bool imalayer_children_update(Image *ima, ImageLayer *group, ImBuf **r_composite, short background)
+{
+	ImageLayerCache *cache;
+	ImageLayer *layer, *lowest;
+	ImBuf *result_ibuf = *r_composite;
+	bool copy_lowest;
+
+	/* groups first, the hidden ones are left as they are until shown */
+	for (layer = imalayer_child_bottom(ima, group); layer; layer = imalayer_child_above(group, layer)) {
+		if (imalayer_is_group(layer) && (layer->visible & IMA_LAYER_VISIBLE))
+			imalayer_group_update(ima, layer, background);
+	}
+
+	/* nothing changed since the last blend, the composite is up to date
+	 * apart from the tiles painted since */
+	if (imalayer_cache_is_valid(ima, group, result_ibuf, background)) {
+		cache = *imalayer_cache_p(ima, group);
+		if (cache->flag & IMA_LAYER_CACHE_TILES)
+			imalayer_cache_update_tiles(ima, group, background);
+		return false;
+	}
+
+	lowest = imalayer_lowest_visible(ima, group);
+
+	if (result_ibuf && lowest && imalayer_composite_reusable(result_ibuf, lowest)) {
+		/* overwrite the previous composite, no allocation at all */
+		merge_layers_visible_rect(ima, group, result_ibuf, background, true, 0, 0, result_ibuf->x, result_ibuf->y);
+
+		result_ibuf->userflags |= IB_DISPLAY_BUFFER_INVALID;
+		if (result_ibuf->mipmap[0])
+			result_ibuf->userflags |= IB_MIPMAP_INVALID;
+	}
+	else {
+		/* free the previous composite first, so only one is ever allocated */
+		if (result_ibuf)
+			IMB_freeImBuf(result_ibuf);
+
+		result_ibuf = lowest ? imalayer_composite_new(lowest, &copy_lowest) : NULL;
+
+		if (result_ibuf)
+			merge_layers_visible_rect(ima, group, result_ibuf, background, copy_lowest, 0, 0, result_ibuf->x, result_ibuf->y);
+	}
+
+	*r_composite = result_ibuf;
+	imalayer_cache_store(ima, group, result_ibuf, background);
+
+	return true;
+}
+
+static void imalayer_group_update(Image *ima, ImageLayer *group, short background)
+{
+	ImBuf *composite = group->group_cache ? group->group_cache->composite : NULL;
+
+	/* the parent blends it again, whole */
+	if (imalayer_children_update(ima, group, &composite, background))
+		imalayer_tag_dirty(group);
+}
+
+ImBuf *imalayer_composite_get_mip(Image *ima, ImBuf *composite, int level)
+{
+	ImageLayerCache *cache;
+	ImBuf *mip_ibuf = composite;
+
+	if (level <= 0)
+		return composite;
+
+	BLI_lock_thread(LOCK_IMAGE);
+
+	/* only while the cache holds the composite as it's drawn */
+	cache = ima->layer_cache;
+	if (cache && cache->composite && cache->composite == composite &&
+	    !(cache->flag & (IMA_LAYER_CACHE_DIRTY | IMA_LAYER_CACHE_TILES)))
+	{
+		if (cache->mip == NULL)
+			cache->mip = imalayer_mip_new();
+
+		mip_ibuf = imalayer_mip_get(cache->mip, composite, NULL, level);
+	}
+
+	BLI_unlock_thread(LOCK_IMAGE);
+
+	return mip_ibuf;
+}
+
+/* Non distruttivo */
+void merge_layers_visible_nd(Image *ima)
+{
+	ImBuf *composite = (ImBuf *)ima->ibufs.first;
+	short background;
+
+	background = ((ImageLayer *)ima->imlayers.last)->background;
+
+	if (imalayer_children_update(ima, NULL, &composite, background)) {
+		ima->ibufs.first = ima->ibufs.last = NULL;
+		if (composite)
+			BLI_addtail(&ima->ibufs, composite);
 	}
-	
-	BLI_addtail(&ima->ibufs, result_ibuf);
 }
 
 static int imlayer_find_name_dupe(const char *name, ImageLayer *iml, Image *ima)
@@ -890,6 +2574,27 @@ void imalayer_unique_name(ImageLayer *iml, Image *ima)
 	BLI_uniquename_cb(imlayer_unique_check, &data, "Layer", '.', iml->name, sizeof(iml->name));
 }
 
+/* The ImBuf of a new layer filled with "color", without pixels: the layer
+ * is sparse, made of uniform tiles, until something needs its buffer */
+static ImBuf *imalayer_add_ibuf_sparse(ImageLayer *layer, int width, int height, int depth, int floatbuf,
+                                       const float color[4], ColorManagedColorspaceSettings *colorspace_settings)
+{
+	ImBuf *ibuf;
+
+	/* one pixel gets the color converted the way a full buffer would be */
+	ibuf = add_ibuf_size(1, 1, layer->name, depth, floatbuf, 0, color, colorspace_settings);
+
+	layer->storage = imalayer_storage_new_uniform(width, height, (unsigned char *)ibuf->rect, ibuf->rect_float);
+	layer->storage->generation = layer->generation;
+
+	imb_freerectImBuf(ibuf);
+	imb_freerectfloatImBuf(ibuf);
+	ibuf->x = width;
+	ibuf->y = height;
+
+	return ibuf;
+}
+
 ImageLayer *image_add_image_layer(Image *ima, const char *name, int depth, float color[4], int order)
 {
 	ImageLayer *layer_act, *im_l = NULL;
@@ -906,7 +2611,7 @@ ImageLayer *image_add_image_layer(Image *ima, const char *name, int depth, float
 	im_l = layer_alloc(ima, name);
 	if (im_l) {
 		imaibuf = (ImBuf*)ima->ibufs.first;
-		ibuf = add_ibuf_size(imaibuf->x, imaibuf->y, im_l->name, depth, ima->gen_flag, 0, color, &ima->colorspace_settings);
+		ibuf = imalayer_add_ibuf_sparse(im_l, imaibuf->x, imaibuf->y, depth, ima->gen_flag, color, &ima->colorspace_settings);
 
 		BLI_addtail(&im_l->ibufs, ibuf);
 		if (order == 2) { /*Head*/
@@ -916,7 +2621,9 @@ ImageLayer *image_add_image_layer(Image *ima, const char *name, int depth, float
 		else if (order == -1) { /*Before*/
 			/* Layer Act
 			 * --> Add Layer
+			 * right below a group, the layer goes in it
 			 */
+			im_l->depth = layer_act->depth + (imalayer_is_group(layer_act) ? 1 : 0);
 			BLI_insertlinkafter(&ima->imlayers, layer_act , im_l);
 			ima->Act_Layers += 1;
 			imalayer_set_current_act(ima, ima->Act_Layers);
@@ -925,6 +2632,7 @@ ImageLayer *image_add_image_layer(Image *ima, const char *name, int depth, float
 			/* --> Add Layer
 			 * Layer Act
 			 */
+			im_l->depth = layer_act->depth;
 			BLI_insertlinkbefore(&ima->imlayers, layer_act , im_l);
 			//ima->Act_Layers -= 1;
 			imalayer_set_current_act(ima, ima->Act_Layers);
@@ -934,6 +2642,7 @@ ImageLayer *image_add_image_layer(Image *ima, const char *name, int depth, float
 		if (color[3] == 1.0f)
 			im_l->background = IMA_LAYER_BG_RGB;
 		copy_v4_v4(im_l->default_color, color);
+		imalayer_cache_tag_dirty(ima);
 	}
  
 	return im_l;
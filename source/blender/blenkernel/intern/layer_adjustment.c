@@ -0,0 +1,295 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_adjustment.c
+ *  \ingroup bke
+ *
+ * Adjustment layers (IMA_LAYER_ADJUSTMENT) have no pixels, they change the
+ * colors of the composite of the layers below them in their group while it's
+ * blended, see imalayer_blend_rows() in layer.c. Nothing is stored for the
+ * adjusted pixels: the tiles the layer shows in are blended again when its
+ * settings change.
+ *
+ * Curves, levels and exposure change every channel on its own, so they go
+ * through a LUT made once after each change: one entry per value for bytes
+ * and a table with linear interpolation for floats inside 0..1. Hue and
+ * saturation are done per pixel.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_color_types.h"
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_math_base.h"
+#include "BLI_math_color.h"
+#include "BLI_math_vector.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_colortools.h"
+#include "BKE_layer.h"
+
+/* entries of the float tables, over 0..1 */
+#define IMA_LAYER_ADJUST_LUT_LEN	1024
+
+typedef struct ImageLayerAdjustmentLUT {
+	unsigned char rect[3][256];
+	float rect_float[3][IMA_LAYER_ADJUST_LUT_LEN + 1];
+	float exposure_mul;
+} ImageLayerAdjustmentLUT;
+
+ImageLayerAdjustment *imalayer_adjustment_new(int type)
+{
+	ImageLayerAdjustment *adjust = MEM_callocN(sizeof(ImageLayerAdjustment), "ImageLayerAdjustment");
+
+	adjust->type = type;
+	adjust->curve = curvemapping_add(4, 0.0f, 0.0f, 1.0f, 1.0f);
+	adjust->levels_in[1] = 1.0f;
+	adjust->levels_out[1] = 1.0f;
+	adjust->levels_gamma = 1.0f;
+	adjust->saturation = 1.0f;
+	adjust->value = 1.0f;
+
+	return adjust;
+}
+
+ImageLayerAdjustment *imalayer_adjustment_copy(const ImageLayerAdjustment *adjust)
+{
+	ImageLayerAdjustment *copy;
+
+	if (adjust == NULL)
+		return NULL;
+
+	copy = MEM_dupallocN(adjust);
+	copy->curve = adjust->curve ? curvemapping_copy(adjust->curve) : NULL;
+	copy->lut = NULL;
+
+	return copy;
+}
+
+void imalayer_adjustment_free(ImageLayerAdjustment *adjust)
+{
+	if (adjust == NULL)
+		return;
+
+	if (adjust->curve)
+		curvemapping_free(adjust->curve);
+	if (adjust->lut)
+		MEM_freeN(adjust->lut);
+	MEM_freeN(adjust);
+}
+
+bool imalayer_is_adjustment(const ImageLayer *layer)
+{
+	return (layer->type & IMA_LAYER_ADJUSTMENT) && layer->adjustment;
+}
+
+bool imalayer_adjustment_is_identity(const ImageLayerAdjustment *adjust)
+{
+	switch (adjust->type) {
+		case IMA_LAYER_ADJUST_CURVES:
+			return (adjust->curve == NULL || !curvemapping_RGBA_does_something(adjust->curve));
+		case IMA_LAYER_ADJUST_LEVELS:
+			return (adjust->levels_in[0] == 0.0f && adjust->levels_in[1] == 1.0f &&
+			        adjust->levels_out[0] == 0.0f && adjust->levels_out[1] == 1.0f &&
+			        adjust->levels_gamma == 1.0f);
+		case IMA_LAYER_ADJUST_HUE_SATURATION:
+			return (adjust->hue == 0.0f && adjust->saturation == 1.0f && adjust->value == 1.0f);
+		case IMA_LAYER_ADJUST_EXPOSURE:
+			return (adjust->exposure == 0.0f && adjust->offset == 0.0f);
+	}
+
+	return true;
+}
+
+/* One channel of a separable adjustment */
+static float imalayer_adjustment_channel(const ImageLayerAdjustment *adjust, int channel, float value)
+{
+	float range;
+
+	switch (adjust->type) {
+		case IMA_LAYER_ADJUST_CURVES:
+			return curvemap_evaluateF(&adjust->curve->cm[channel], curvemap_evaluateF(&adjust->curve->cm[3], value));
+		case IMA_LAYER_ADJUST_LEVELS:
+			range = adjust->levels_in[1] - adjust->levels_in[0];
+			if (range > 0.0f)
+				value = (value - adjust->levels_in[0]) / range;
+			else
+				value = (value >= adjust->levels_in[0]) ? 1.0f : 0.0f;
+			CLAMP(value, 0.0f, 1.0f);
+			if (adjust->levels_gamma > 0.0f && adjust->levels_gamma != 1.0f)
+				value = powf(value, 1.0f / adjust->levels_gamma);
+			return adjust->levels_out[0] + (adjust->levels_out[1] - adjust->levels_out[0]) * value;
+		case IMA_LAYER_ADJUST_EXPOSURE:
+			return value * powf(2.0f, adjust->exposure) + adjust->offset;
+	}
+
+	return value;
+}
+
+void imalayer_adjustment_lut_ensure(ImageLayerAdjustment *adjust)
+{
+	ImageLayerAdjustmentLUT *lut;
+	int c, i;
+
+	if (adjust->lut)
+		return;
+
+	lut = MEM_mallocN(sizeof(ImageLayerAdjustmentLUT), "ImageLayerAdjustmentLUT");
+	lut->exposure_mul = powf(2.0f, adjust->exposure);
+
+	/* the curve tables are made here too, evaluating them is thread safe after */
+	if (adjust->type == IMA_LAYER_ADJUST_CURVES) {
+		if (adjust->curve == NULL)
+			adjust->curve = curvemapping_add(4, 0.0f, 0.0f, 1.0f, 1.0f);
+		curvemapping_initialize(adjust->curve);
+	}
+
+	if (adjust->type != IMA_LAYER_ADJUST_HUE_SATURATION) {
+		for (c = 0; c < 3; c++) {
+			for (i = 0; i < 256; i++)
+				lut->rect[c][i] = FTOCHAR(imalayer_adjustment_channel(adjust, c, (float)i / 255.0f));
+			for (i = 0; i <= IMA_LAYER_ADJUST_LUT_LEN; i++)
+				lut->rect_float[c][i] = imalayer_adjustment_channel(adjust, c, (float)i / IMA_LAYER_ADJUST_LUT_LEN);
+		}
+	}
+
+	adjust->lut = lut;
+}
+
+void imalayer_adjustment_changed(ImageLayerAdjustment *adjust)
+{
+	if (adjust && adjust->lut) {
+		MEM_freeN(adjust->lut);
+		adjust->lut = NULL;
+	}
+}
+
+/* Values outside 0..1 aren't in the table */
+BLI_INLINE float imalayer_adjustment_lut_float(const ImageLayerAdjustment *adjust, int channel, float value)
+{
+	const float *table = adjust->lut->rect_float[channel];
+	float f;
+	int i;
+
+	if (!(value >= 0.0f && value < 1.0f))
+		return imalayer_adjustment_channel(adjust, channel, value);
+
+	f = value * IMA_LAYER_ADJUST_LUT_LEN;
+	i = (int)f;
+	f -= (float)i;
+
+	return table[i] + (table[i + 1] - table[i]) * f;
+}
+
+static void imalayer_adjustment_hsv(const ImageLayerAdjustment *adjust, float col[3])
+{
+	float hsv[3];
+
+	rgb_to_hsv_v(col, hsv);
+
+	hsv[0] += adjust->hue;
+	hsv[0] -= floorf(hsv[0]);
+	hsv[1] = min_ff(hsv[1] * adjust->saturation, 1.0f);
+	hsv[2] *= adjust->value;
+
+	hsv_to_rgb_v(hsv, col);
+}
+
+void imalayer_adjustment_row(const ImageLayerAdjustment *adjust, bool is_float, const void *src, void *dst, int len)
+{
+	const ImageLayerAdjustmentLUT *lut = adjust->lut;
+	float col[4];
+	int x, c;
+
+	if (is_float) {
+		const float *fp_s = src;
+		float *fp_d = dst;
+
+		for (x = 0; x < len; x++, fp_s += 4, fp_d += 4) {
+			if (adjust->type == IMA_LAYER_ADJUST_HUE_SATURATION) {
+				copy_v3_v3(fp_d, fp_s);
+				imalayer_adjustment_hsv(adjust, fp_d);
+			}
+			else if (adjust->type == IMA_LAYER_ADJUST_EXPOSURE) {
+				for (c = 0; c < 3; c++)
+					fp_d[c] = fp_s[c] * lut->exposure_mul + adjust->offset;
+			}
+			else {
+				for (c = 0; c < 3; c++)
+					fp_d[c] = imalayer_adjustment_lut_float(adjust, c, fp_s[c]);
+			}
+			fp_d[3] = fp_s[3];
+		}
+	}
+	else {
+		const unsigned char *cp_s = src;
+		unsigned char *cp_d = dst;
+
+		for (x = 0; x < len; x++, cp_s += 4, cp_d += 4) {
+			if (adjust->type == IMA_LAYER_ADJUST_HUE_SATURATION) {
+				rgba_uchar_to_float(col, cp_s);
+				imalayer_adjustment_hsv(adjust, col);
+				for (c = 0; c < 3; c++)
+					cp_d[c] = FTOCHAR(col[c]);
+			}
+			else {
+				for (c = 0; c < 3; c++)
+					cp_d[c] = lut->rect[c][cp_s[c]];
+			}
+			cp_d[3] = cp_s[3];
+		}
+	}
+}
+
+/* Tiles of the composite the layer doesn't show in stay as they are, the
+ * other ones are blended again with a new LUT */
+void imalayer_adjustment_tag_dirty(Image *ima, ImageLayer *layer)
+{
+	ImBuf *composite = ima ? ima->ibufs.first : NULL;
+	ImageLayerMask *mask = imalayer_mask_used(layer);
+	unsigned char uniform;
+	int tx, ty;
+
+	imalayer_adjustment_changed(layer->adjustment);
+
+	if (composite == NULL) {
+		imalayer_tag_dirty(layer);
+		return;
+	}
+
+	if (mask == NULL) {
+		imalayer_tag_dirty_region(ima, layer, 0, 0, composite->x, composite->y);
+		return;
+	}
+
+	for (ty = 0; (ty << IMA_LAYER_TILE_BITS) < composite->y; ty++) {
+		for (tx = 0; (tx << IMA_LAYER_TILE_BITS) < composite->x; tx++) {
+			if (imalayer_mask_tile_values(mask, tx, ty, &uniform) == NULL || uniform != 0) {
+				imalayer_tag_dirty_region(ima, layer, tx << IMA_LAYER_TILE_BITS, ty << IMA_LAYER_TILE_BITS,
+				                          IMA_LAYER_TILE_SIZE, IMA_LAYER_TILE_SIZE);
+			}
+		}
+	}
+}
@@ -0,0 +1,476 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_blend_kernel.h
+ *  \ingroup bke
+ *
+ * Layer blend kernel, included once per instruction set by layer_blend_sse2.c,
+ * layer_blend_sse41.c and layer_blend_avx2.c which define one of
+ * LAYER_BLEND_SSE2, LAYER_BLEND_SSE41 or LAYER_BLEND_AVX2 first.
+ *
+ * Every formula repeats the scalar code in layer.c operation by operation,
+ * including its quirks (signed char pixels, integer abs(), the operator
+ * precedence of linear and pin light), so the output is bit-exact (only the
+ * sign of NaN may differ, compilers swap the operands of scalar + and *):
+ * - no reciprocals or fused multiply-add, the files are built without -mfma,
+ * - comparisons + selects instead of min/max, so NaN takes the same branch,
+ * - truncating conversions like the C casts.
+ */
+
+#include <string.h>
+
+#include "DNA_image_types.h"
+
+#include "BLI_utildefines.h"
+
+#include "layer_blend_simd.h"
+
+#if defined(LAYER_BLEND_AVX2)
+#  include <immintrin.h>
+#  define KERNEL_SUFFIX avx2
+#  define VEC_WIDTH 8
+typedef __m256 vfloat;
+typedef __m256i vint;
+#  define vf_set1 _mm256_set1_ps
+#  define vf_zero _mm256_setzero_ps
+#  define vf_add _mm256_add_ps
+#  define vf_sub _mm256_sub_ps
+#  define vf_mul _mm256_mul_ps
+#  define vf_div _mm256_div_ps
+#  define vf_and _mm256_and_ps
+#  define vf_or _mm256_or_ps
+#  define vf_andnot _mm256_andnot_ps
+#  define vf_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#  define vf_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#  define vf_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#  define vf_neq(a, b) _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#  define vf_select(m, a, b) _mm256_blendv_ps(b, a, m)
+#  define vf_any(m) _mm256_movemask_ps(m)
+#  define vf_unpacklo _mm256_unpacklo_ps
+#  define vf_unpackhi _mm256_unpackhi_ps
+#  define vf_shuffle _mm256_shuffle_ps
+#  define vf_to_vi _mm256_cvttps_epi32
+#  define vi_to_vf _mm256_cvtepi32_ps
+#  define vf_as_vi _mm256_castps_si256
+#  define vi_set1 _mm256_set1_epi32
+#  define vi_and _mm256_and_si256
+#  define vi_or _mm256_or_si256
+#  define vi_slli _mm256_slli_epi32
+#  define vi_srai _mm256_srai_epi32
+#  define vi_abs _mm256_abs_epi32
+#  define vi_select(m, a, b) _mm256_blendv_epi8(b, a, m)
+#  define vi_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#  define vi_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#  define vi_load_u8(p) _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p)))
+#elif defined(LAYER_BLEND_SSE2) || defined(LAYER_BLEND_SSE41)
+#  ifdef LAYER_BLEND_SSE41
+#    include <smmintrin.h>
+#    define KERNEL_SUFFIX sse41
+#  else
+#    include <emmintrin.h>
+#    define KERNEL_SUFFIX sse2
+#  endif
+#  define VEC_WIDTH 4
+typedef __m128 vfloat;
+typedef __m128i vint;
+#  define vf_set1 _mm_set1_ps
+#  define vf_zero _mm_setzero_ps
+#  define vf_add _mm_add_ps
+#  define vf_sub _mm_sub_ps
+#  define vf_mul _mm_mul_ps
+#  define vf_div _mm_div_ps
+#  define vf_and _mm_and_ps
+#  define vf_or _mm_or_ps
+#  define vf_andnot _mm_andnot_ps
+#  define vf_lt _mm_cmplt_ps
+#  define vf_le _mm_cmple_ps
+#  define vf_gt _mm_cmpgt_ps
+#  define vf_neq _mm_cmpneq_ps
+#  define vf_any(m) _mm_movemask_ps(m)
+#  define vf_unpacklo _mm_unpacklo_ps
+#  define vf_unpackhi _mm_unpackhi_ps
+#  define vf_shuffle _mm_shuffle_ps
+#  define vf_to_vi _mm_cvttps_epi32
+#  define vi_to_vf _mm_cvtepi32_ps
+#  define vf_as_vi _mm_castps_si128
+#  define vi_set1 _mm_set1_epi32
+#  define vi_and _mm_and_si128
+#  define vi_or _mm_or_si128
+#  define vi_slli _mm_slli_epi32
+#  define vi_srai _mm_srai_epi32
+#  define vi_load(p) _mm_loadu_si128((const __m128i *)(p))
+#  define vi_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#  define vi_load_u8(p) vi_load_u8_sse((const unsigned char *)(p))
+#  ifdef LAYER_BLEND_SSE41
+#    define vf_select(m, a, b) _mm_blendv_ps(b, a, m)
+#    define vi_select(m, a, b) _mm_blendv_epi8(b, a, m)
+#    define vi_abs _mm_abs_epi32
+#  else
+#    define vf_select(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#    define vi_select(m, a, b) _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b))
+BLI_INLINE __m128i vi_abs(__m128i a)
+{
+	/* same as abs() on INT_MIN */
+	__m128i sign = _mm_srai_epi32(a, 31);
+	return _mm_sub_epi32(_mm_xor_si128(a, sign), sign);
+}
+#  endif
+/* four unsigned bytes, one per lane */
+BLI_INLINE __m128i vi_load_u8_sse(const unsigned char *p)
+{
+	int bytes;
+
+	memcpy(&bytes, p, sizeof(bytes));
+#  ifdef LAYER_BLEND_SSE41
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+#  else
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), _mm_setzero_si128()), _mm_setzero_si128());
+#  endif
+}
+#else
+#  error "define the instruction set before including layer_blend_kernel.h"
+#endif
+
+#define KERNEL_FUNC_EX(name, suffix) name ## _ ## suffix
+#define KERNEL_FUNC_EXPAND(name, suffix) KERNEL_FUNC_EX(name, suffix)
+#define KERNEL_FUNC(name) KERNEL_FUNC_EXPAND(name, KERNEL_SUFFIX)
+
+/* (float)abs((int)f), the scalar code calls integer abs() on floats */
+BLI_INLINE vfloat vf_abs_int(vfloat f)
+{
+	return vi_to_vf(vi_abs(vf_to_vi(f)));
+}
+
+/* (cond) ? a : b with float 1.0f/0.0f instead of the comparison mask */
+BLI_INLINE vfloat vf_bool(vfloat mask)
+{
+	return vf_and(mask, vf_set1(1.0f));
+}
+
+/* O * X + (1.0f - O) * B, the tail of nearly every mode */
+BLI_INLINE vfloat vf_mix(vfloat B, vfloat X, vfloat O)
+{
+	return vf_add(vf_mul(O, X), vf_mul(vf_sub(vf_set1(1.0f), O), B));
+}
+
+BLI_INLINE vfloat vf_blend_screen(vfloat B, vfloat L, vfloat O)
+{
+	const vfloat one = vf_set1(1.0f);
+	return vf_mix(B, vf_sub(one, vf_mul(vf_sub(one, B), vf_sub(one, L))), O);
+}
+
+BLI_INLINE vfloat vf_blend_color_dodge(vfloat B, vfloat L, vfloat O)
+{
+	return vf_mix(B, vf_div(B, vf_sub(vf_set1(1.0f), L)), O);
+}
+
+BLI_INLINE vfloat vf_blend_color_burn(vfloat B, vfloat L, vfloat O)
+{
+	const vfloat one = vf_set1(1.0f);
+	return vf_mix(B, vf_sub(one, vf_div(vf_sub(one, B), L)), O);
+}
+
+BLI_INLINE vfloat vf_blend_vivid_light(vfloat B, vfloat L, vfloat O)
+{
+	const vfloat half = vf_set1(0.5f);
+	const vfloat two = vf_set1(2.0f);
+	vfloat burn = vf_blend_color_burn(vf_mul(B, two), L, O);
+	vfloat dodge = vf_blend_color_dodge(vf_mul(two, vf_sub(B, half)), L, O);
+
+	return vf_mix(B, vf_select(vf_lt(B, half), burn, dodge), O);
+}
+
+/* the caller only passes modes known to imalayer_blend_func() */
+BLI_INLINE vfloat vf_blend(short mode, vfloat B, vfloat L, vfloat O)
+{
+	const vfloat zero = vf_zero();
+	const vfloat half = vf_set1(0.5f);
+	const vfloat one = vf_set1(1.0f);
+	const vfloat two = vf_set1(2.0f);
+	vfloat s, t, a, b;
+
+	switch (mode) {
+		case IMA_LAYER_NORMAL:
+			return vf_mix(B, L, O);
+		case IMA_LAYER_LIGHTEN:
+			return vf_mix(B, vf_select(vf_gt(L, B), L, B), O);
+		case IMA_LAYER_DARKEN:
+			return vf_mix(B, vf_select(vf_gt(L, B), B, L), O);
+		case IMA_LAYER_MULTIPLY:
+			/* (B * L) / 1.0f */
+			return vf_mix(B, vf_mul(B, L), O);
+		case IMA_LAYER_AVERAGE:
+			/* (B + L) / 2, halving is exact either way */
+			return vf_mix(B, vf_mul(vf_add(B, L), half), O);
+		case IMA_LAYER_ADD:
+		case IMA_LAYER_LINEAR_DODGE:
+			s = vf_add(B, L);
+			return vf_mix(B, vf_select(vf_lt(one, s), one, s), O);
+		case IMA_LAYER_SUBTRACT:
+		case IMA_LAYER_LINEAR_BURN:
+			s = vf_add(B, L);
+			return vf_mix(B, vf_select(vf_lt(s, one), zero, vf_sub(s, one)), O);
+		case IMA_LAYER_DIFFERENCE:
+			return vf_mix(B, vf_abs_int(vf_sub(B, L)), O);
+		case IMA_LAYER_NEGATION:
+			return vf_mix(B, vf_sub(one, vf_abs_int(vf_sub(vf_sub(one, B), L))), O);
+		case IMA_LAYER_SCREEN:
+			return vf_blend_screen(B, L, O);
+		case IMA_LAYER_EXCLUSION:
+			return vf_mix(B, vf_sub(vf_add(B, L), vf_mul(vf_mul(two, B), L)), O);
+		case IMA_LAYER_OVERLAY:
+			a = vf_mul(vf_mul(two, B), L);
+			b = vf_sub(one, vf_mul(vf_mul(two, vf_sub(one, B)), vf_sub(one, L)));
+			return vf_mix(B, vf_select(vf_lt(L, half), a, b), O);
+		case IMA_LAYER_SOFT_LIGHT:
+			a = vf_mix(B, vf_mul(B, L), O);
+			b = vf_blend_screen(B, L, O);
+			return vf_mix(B, vf_add(vf_mul(vf_sub(one, B), a), vf_mul(B, b)), O);
+		case IMA_LAYER_HARD_LIGHT:
+			a = vf_mul(vf_mul(two, L), B);
+			b = vf_sub(one, vf_mul(vf_mul(two, vf_sub(one, L)), vf_sub(one, B)));
+			return vf_mix(B, vf_select(vf_lt(B, half), a, b), O);
+		case IMA_LAYER_COLOR_DODGE:
+			return vf_blend_color_dodge(B, L, O);
+		case IMA_LAYER_COLOR_BURN:
+			return vf_blend_color_burn(B, L, O);
+		case IMA_LAYER_INVERSE_COLOR_BURN:
+			return vf_mix(B, vf_sub(one, vf_div(vf_sub(one, L), B)), O);
+		case IMA_LAYER_SOFT_BURN:
+			a = vf_mix(B, vf_div(vf_mul(half, L), vf_sub(one, B)), O);
+			b = vf_mix(B, vf_sub(one, vf_div(vf_mul(half, vf_sub(one, B)), L)), O);
+			return vf_select(vf_lt(vf_add(B, L), one), a, b);
+		case IMA_LAYER_LINEAR_LIGHT:
+			/* parsed as (O * cond) ? a : (b + (1.0f - O) * B) */
+			t = vf_neq(vf_mul(O, vf_bool(vf_lt(vf_mul(two, L), half))), zero);
+			s = vf_add(B, vf_mul(two, L));
+			a = vf_select(vf_lt(s, one), zero, vf_sub(s, one));
+			s = vf_add(B, vf_mul(two, vf_sub(L, half)));
+			b = vf_add(vf_select(vf_lt(one, s), one, s), vf_mul(vf_sub(one, O), B));
+			return vf_select(t, a, b);
+		case IMA_LAYER_VIVID_LIGHT:
+			return vf_blend_vivid_light(B, L, O);
+		case IMA_LAYER_PIN_LIGHT:
+			/* parsed as (O * cond) ? a : (b + (1.0f - O) * B) */
+			t = vf_neq(vf_mul(O, vf_bool(vf_lt(L, half))), zero);
+			s = vf_mul(two, L);
+			a = vf_select(vf_gt(s, B), B, s);
+			s = vf_mul(two, vf_sub(L, half));
+			b = vf_add(vf_select(vf_gt(s, B), s, B), vf_mul(vf_sub(one, O), B));
+			return vf_select(t, a, b);
+		case IMA_LAYER_HARD_MIX:
+			s = vf_blend_vivid_light(B, L, O);
+			return vf_mix(B, vf_select(vf_lt(s, half), zero, one), O);
+	}
+
+	return B;
+}
+
+BLI_INLINE vfloat vf_clipcolour(vfloat col)
+{
+	const vfloat zero = vf_zero();
+	const vfloat one = vf_set1(1.0f);
+
+	col = vf_select(vf_lt(col, zero), zero, col);
+	return vf_select(vf_gt(col, one), one, col);
+}
+
+/* FTOCHAR(), as an integer 0..255 per lane */
+BLI_INLINE vint vf_ftochar(vfloat val)
+{
+	/* The saturated case converts 255.0f to (signed) char, which is out of range
+	 * and folded at compile time (GCC stores 127). Take the value from the same
+	 * macro so the kernel agrees with copy_co() whatever the compiler does. */
+	const vint max = vi_set1((unsigned char)FTOCHAR(1.0f));
+	vint r;
+
+	/* the (char) cast keeps the low byte */
+	r = vf_to_vi(vf_add(vf_mul(vf_set1(255.0f), val), vf_set1(0.5f)));
+	r = vi_and(r, vi_set1(0xff));
+	r = vi_select(vf_as_vi(vf_gt(val, vf_set1(1.0f - 0.5f / 255.0f))), max, r);
+	return vi_select(vf_as_vi(vf_le(val, vf_zero())), vi_set1(0), r);
+}
+
+/* one channel of packed RGBA bytes, read as signed char / 255.0f */
+BLI_INLINE vfloat vi_channel(vint px, int shift)
+{
+	return vf_div(vi_to_vf(vi_srai(vi_slli(px, 24 - shift), 24)), vf_set1(255.0f));
+}
+
+BLI_INLINE vint vi_pack(vfloat r, vfloat g, vfloat b, vfloat a)
+{
+	return vi_or(vi_or(vf_ftochar(r), vi_slli(vf_ftochar(g), 8)),
+	             vi_or(vi_slli(vf_ftochar(b), 16), vi_slli(vf_ftochar(a), 24)));
+}
+
+/* 4x4 transposes within each 128 bit lane, RGBA pixels <-> channels */
+#define VF_TRANSPOSE4(v0, v1, v2, v3)  {                                      \
+	vfloat t0_ = vf_unpacklo(v0, v1), t1_ = vf_unpackhi(v0, v1);              \
+	vfloat t2_ = vf_unpacklo(v2, v3), t3_ = vf_unpackhi(v2, v3);              \
+	v0 = vf_shuffle(t0_, t2_, _MM_SHUFFLE(1, 0, 1, 0));                       \
+	v1 = vf_shuffle(t0_, t2_, _MM_SHUFFLE(3, 2, 3, 2));                       \
+	v2 = vf_shuffle(t1_, t3_, _MM_SHUFFLE(1, 0, 1, 0));                       \
+	v3 = vf_shuffle(t1_, t3_, _MM_SHUFFLE(3, 2, 3, 2));                       \
+} (void)0
+
+#ifdef LAYER_BLEND_AVX2
+/* lane 0 holds pixels 0..3, lane 1 pixels 4..7 */
+#  define VF_LOAD_PIXEL(p, i) \
+	_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps((p) + (i) * 4)), _mm_loadu_ps((p) + (i) * 4 + 16), 1)
+#  define VF_STORE_PIXEL(p, i, v) { \
+	_mm_storeu_ps((p) + (i) * 4, _mm256_castps256_ps128(v)); \
+	_mm_storeu_ps((p) + (i) * 4 + 16, _mm256_extractf128_ps(v, 1)); \
+} (void)0
+#else
+#  define VF_LOAD_PIXEL(p, i) _mm_loadu_ps((p) + (i) * 4)
+#  define VF_STORE_PIXEL(p, i, v) _mm_storeu_ps((p) + (i) * 4, v)
+#endif
+
+/* alpha of the layer scaled by the mask values, as f_la *= m / 255.0f */
+BLI_INLINE vfloat vf_mask_alpha(vfloat la, const unsigned char *mask)
+{
+	return vf_mul(la, vf_div(vi_to_vf(vi_load_u8(mask)), vf_set1(255.0f)));
+}
+
+/* the alpha tests of imalayer_blend_rect(): "both" blends, "copy" takes the layer */
+BLI_INLINE int vf_blend_masks(vfloat ba, vfloat la, short background, vfloat *r_both, vfloat *r_copy)
+{
+	vfloat nz_b = vf_neq(ba, vf_zero());
+	vfloat nz_l = vf_neq(la, vf_zero());
+
+	*r_both = vf_and(nz_l, nz_b);
+
+	if (background & IMA_LAYER_BG_ALPHA) {
+		*r_copy = vf_andnot(*r_both, nz_l);
+		return vf_any(vf_or(nz_l, nz_b));
+	}
+
+	*r_copy = vf_zero();
+	return vf_any(*r_both);
+}
+
+int KERNEL_FUNC(imalayer_blend_row_byte)(unsigned char *dest, const unsigned char *base, const unsigned char *layer,
+                                         const unsigned char *mask, int len, float opacity, short mode,
+                                         short background)
+{
+	const vfloat one = vf_set1(1.0f);
+	const vfloat O = vf_set1(opacity);
+	int x;
+
+	for (x = 0; x + VEC_WIDTH <= len; x += VEC_WIDTH) {
+		vint px_b = vi_load(base + x * 4);
+		vint px_l = vi_load(layer + x * 4);
+		vfloat ba = vi_channel(px_b, 24), la = vi_channel(px_l, 24);
+		vfloat both, copy;
+		vfloat br, bg, bb, lr, lg, lb;
+		vfloat ao, k1, k2, k3;
+		vint px_d, px_both, px_copy;
+
+		if (mask)
+			la = vf_mask_alpha(la, mask + x);
+
+		if (!vf_blend_masks(ba, la, background, &both, &copy))
+			continue;
+
+		br = vi_channel(px_b, 0);
+		bg = vi_channel(px_b, 8);
+		bb = vi_channel(px_b, 16);
+		lr = vi_channel(px_l, 0);
+		lg = vi_channel(px_l, 8);
+		lb = vi_channel(px_l, 16);
+
+		ao = vf_add(la, vf_mul(ba, vf_sub(one, la)));
+		k1 = vf_mul(la, vf_sub(one, ba));
+		k2 = vf_mul(la, ba);
+		k3 = vf_mul(vf_sub(one, la), ba);
+
+#define CO(b, l) vf_clipcolour(vf_div(vf_add(vf_add(vf_mul(k1, l), vf_mul(k2, vf_blend(mode, b, l, O))), \
+                                             vf_mul(k3, b)), ao))
+		px_both = vi_pack(CO(br, lr), CO(bg, lg), CO(bb, lb), ao);
+#undef CO
+		px_copy = vi_pack(lr, lg, lb, la);
+
+		px_d = vi_load(dest + x * 4);
+		px_d = vi_select(vf_as_vi(copy), px_copy, px_d);
+		px_d = vi_select(vf_as_vi(both), px_both, px_d);
+		vi_store(dest + x * 4, px_d);
+	}
+
+	return x;
+}
+
+int KERNEL_FUNC(imalayer_blend_row_float)(float *dest, const float *base, const float *layer,
+                                          const unsigned char *mask, int len, float opacity, short mode,
+                                          short background)
+{
+	const vfloat one = vf_set1(1.0f);
+	const vfloat O = vf_set1(opacity);
+	int x;
+
+	for (x = 0; x + VEC_WIDTH <= len; x += VEC_WIDTH) {
+		const float *fp_b = base + x * 4, *fp_l = layer + x * 4;
+		float *fp_d = dest + x * 4;
+		vfloat br = VF_LOAD_PIXEL(fp_b, 0), bg = VF_LOAD_PIXEL(fp_b, 1);
+		vfloat bb = VF_LOAD_PIXEL(fp_b, 2), ba = VF_LOAD_PIXEL(fp_b, 3);
+		vfloat lr = VF_LOAD_PIXEL(fp_l, 0), lg = VF_LOAD_PIXEL(fp_l, 1);
+		vfloat lb = VF_LOAD_PIXEL(fp_l, 2), la = VF_LOAD_PIXEL(fp_l, 3);
+		vfloat dr, dg, db, da;
+		vfloat both, copy;
+		vfloat ao, k1, k2, k3;
+
+		VF_TRANSPOSE4(br, bg, bb, ba);
+		VF_TRANSPOSE4(lr, lg, lb, la);
+
+		if (mask)
+			la = vf_mask_alpha(la, mask + x);
+
+		if (!vf_blend_masks(ba, la, background, &both, &copy))
+			continue;
+
+		dr = VF_LOAD_PIXEL(fp_d, 0);
+		dg = VF_LOAD_PIXEL(fp_d, 1);
+		db = VF_LOAD_PIXEL(fp_d, 2);
+		da = VF_LOAD_PIXEL(fp_d, 3);
+		VF_TRANSPOSE4(dr, dg, db, da);
+
+		ao = vf_add(la, vf_mul(ba, vf_sub(one, la)));
+		k1 = vf_mul(la, vf_sub(one, ba));
+		k2 = vf_mul(la, ba);
+		k3 = vf_mul(vf_sub(one, la), ba);
+
+#define CO(b, l, d) vf_select(both,                                                              \
+	vf_clipcolour(vf_div(vf_add(vf_add(vf_mul(k1, l), vf_mul(k2, vf_blend(mode, b, l, O))),      \
+	                            vf_mul(k3, b)), ao)),                                            \
+	vf_select(copy, l, d))
+		dr = CO(br, lr, dr);
+		dg = CO(bg, lg, dg);
+		db = CO(bb, lb, db);
+#undef CO
+		da = vf_select(both, ao, vf_select(copy, la, da));
+
+		VF_TRANSPOSE4(dr, dg, db, da);
+		VF_STORE_PIXEL(fp_d, 0, dr);
+		VF_STORE_PIXEL(fp_d, 1, dg);
+		VF_STORE_PIXEL(fp_d, 2, db);
+		VF_STORE_PIXEL(fp_d, 3, da);
+	}
+
+	return x;
+}
@@ -0,0 +1,58 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef __LAYER_BLEND_SIMD_H__
+#define __LAYER_BLEND_SIMD_H__
+
+/** \file blender/blenkernel/intern/layer_blend_simd.h
+ *  \ingroup bke
+ *
+ * Vectorized versions of the layer blend modes, one set per instruction set.
+ * Each file is compiled with its own flags and only called after checking
+ * the CPU at runtime, see imalayer_blend_kernel_get() in layer.c.
+ *
+ * The kernels blend a row of "len" RGBA pixels and return how many pixels
+ * they handled (a multiple of their vector width), the caller finishes the
+ * row with the scalar code. The results are bit-exact with the scalar code.
+ * "mask", when it's there, holds a layer mask value per pixel that scales the
+ * alpha of the layer, see layer_mask.c.
+ */
+
+typedef int (*ImageLayerBlendRowByte)(unsigned char *dest, const unsigned char *base, const unsigned char *layer,
+                                      const unsigned char *mask, int len, float opacity, short mode, short background);
+typedef int (*ImageLayerBlendRowFloat)(float *dest, const float *base, const float *layer,
+                                       const unsigned char *mask, int len, float opacity, short mode, short background);
+
+int imalayer_blend_row_byte_sse2(unsigned char *dest, const unsigned char *base, const unsigned char *layer,
+                                 const unsigned char *mask, int len, float opacity, short mode, short background);
+int imalayer_blend_row_float_sse2(float *dest, const float *base, const float *layer,
+                                  const unsigned char *mask, int len, float opacity, short mode, short background);
+
+int imalayer_blend_row_byte_sse41(unsigned char *dest, const unsigned char *base, const unsigned char *layer,
+                                  const unsigned char *mask, int len, float opacity, short mode, short background);
+int imalayer_blend_row_float_sse41(float *dest, const float *base, const float *layer,
+                                   const unsigned char *mask, int len, float opacity, short mode, short background);
+
+int imalayer_blend_row_byte_avx2(unsigned char *dest, const unsigned char *base, const unsigned char *layer,
+                                 const unsigned char *mask, int len, float opacity, short mode, short background);
+int imalayer_blend_row_float_avx2(float *dest, const float *base, const float *layer,
+                                  const unsigned char *mask, int len, float opacity, short mode, short background);
+
+#endif  /* __LAYER_BLEND_SIMD_H__ */
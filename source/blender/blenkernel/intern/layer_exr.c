@@ -0,0 +1,432 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_exr.c
+ *  \ingroup bke
+ *
+ * Image layers in a tiled multilayer OpenEXR file. Every layer with pixels
+ * is an EXR layer, "<name>.Combined.R/G/B/A", so the image loader and other
+ * applications see them as render layers. Their settings are in the header,
+ * "BlenderImageLayer<index>.opacity" and so on, from the top layer down.
+ * Groups, adjustment layers and masks aren't written.
+ *
+ * Both ways go one tile of IMA_LAYER_TILE_SIZE at a time: writing reads the
+ * tiles of the layers as the composite does, reading packs them straight
+ * into the storage of new sparse layers (see layer_storage.c), which are only
+ * decoded when they're painted. The pixels of the stack are never all in
+ * memory at once.
+ */
+
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_listbase.h"
+#include "BLI_math_base.h"
+#include "BLI_math_color.h"
+#include "BLI_string.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_layer.h"
+#include "BKE_report.h"
+
+#include "IMB_imbuf.h"
+
+#include "intern/openexr/openexr_multi.h"
+
+#define IMA_LAYER_EXR_PASS		"Combined"
+/* longest layer name used in the channel names, "<name>.Combined.R" */
+#define IMA_LAYER_EXR_MAXNAME	(EXR_TOT_MAXNAME - 16)
+
+typedef struct ImageLayerExr {
+	ImageLayer *layer;
+	char channels[EXR_LAY_MAXNAME + 1];	/* "<name>.Combined" */
+
+	/* the pixels are read from the tiles of sparse layers, else from the
+	 * buffer, sampled through the transform when there's one */
+	const ImageLayerStorage *storage;
+	ImBuf *ibuf;
+	bool is_float;
+	int width, height;	/* the rest of the image is empty */
+
+	float *rect;		/* one tile, RGBA rows going up */
+} ImageLayerExr;
+
+static void imalayer_exr_attribute_name(char *name, int index, const char *setting)
+{
+	BLI_snprintf(name, EXR_TOT_MAXNAME + 1, "BlenderImageLayer%d.%s", index, setting);
+}
+
+static void imalayer_exr_set_channels(void *handle, ImageLayerExr *el, float *rect, int ystride)
+{
+	IMB_exr_set_channel(handle, el->channels, "R", 4, ystride, rect);
+	IMB_exr_set_channel(handle, el->channels, "G", 4, ystride, rect + 1);
+	IMB_exr_set_channel(handle, el->channels, "B", 4, ystride, rect + 2);
+	IMB_exr_set_channel(handle, el->channels, "A", 4, ystride, rect + 3);
+}
+
+/* ******************************** Writing ******************************* */
+
+static void imalayer_exr_row_from_bytes(float *dst, const unsigned char *src, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++, dst += 4, src += 4)
+		srgb_to_linearrgb_uchar4(dst, src);
+}
+
+static void imalayer_exr_source_init(ImageLayerExr *el, ImageLayer *layer)
+{
+	el->layer = layer;
+
+	if (imalayer_transform_is_set(layer)) {
+		el->ibuf = imalayer_get_ibuf_untransformed(layer);
+		imalayer_transform_get_size(layer, &el->width, &el->height);
+	}
+	else if ((el->storage = imalayer_sparse_storage(layer))) {
+		el->width = el->storage->x;
+		el->height = el->storage->y;
+	}
+	else {
+		el->ibuf = layer->ibufs.first;
+		el->width = el->ibuf->x;
+		el->height = el->ibuf->y;
+	}
+
+	if (el->storage)
+		el->is_float = (el->storage->rect_float != NULL);
+	else
+		el->is_float = (el->ibuf->rect_float != NULL);
+}
+
+/* The EXR layer names are unique, the layer names may be too long for them */
+static void imalayer_exr_channels_init(ImageLayerExr *els, int index)
+{
+	ImageLayerExr *el = &els[index];
+	int a;
+
+	BLI_snprintf(el->channels, sizeof(el->channels), "%.*s.%s", IMA_LAYER_EXR_MAXNAME, el->layer->name,
+	             IMA_LAYER_EXR_PASS);
+
+	for (a = 0; a < index; a++) {
+		if (STREQ(els[a].channels, el->channels)) {
+			BLI_snprintf(el->channels, sizeof(el->channels), "%.*s.%d.%s", IMA_LAYER_EXR_MAXNAME - 8,
+			             el->layer->name, index, IMA_LAYER_EXR_PASS);
+			break;
+		}
+	}
+}
+
+/* Pixels x..x + w, y..y + h of the layer in el->rect. "x" is at the start
+ * of a tile of the layer, "scratch" holds one tile */
+static void imalayer_exr_read_tile(ImageLayerExr *el, int x, int y, int w, int h, void *scratch)
+{
+	const int len = min_ii(w, el->width - x);
+	const char *pixels = NULL, *src;
+	float *row;
+	int j, ty, stride, ly;
+
+	memset(el->rect, 0, sizeof(float[4]) * w * h);
+
+	if (len <= 0)
+		return;
+
+	for (j = 0; j < h && y + j < el->height; j++) {
+		ly = y + j;
+		row = el->rect + (size_t)j * w * 4;
+
+		if (el->storage) {
+			/* rows of the tile, decoded once for all the rows in it */
+			ty = ly >> IMA_LAYER_TILE_BITS;
+			if (j == 0 || (ly & (IMA_LAYER_TILE_SIZE - 1)) == 0) {
+				pixels = imalayer_storage_tile_pixels(el->storage, el->is_float, x >> IMA_LAYER_TILE_BITS, ty,
+				                                      scratch, &stride);
+			}
+
+			src = pixels + (size_t)(ly - (ty << IMA_LAYER_TILE_BITS)) * stride *
+			      (el->is_float ? sizeof(float[4]) : sizeof(char[4]));
+		}
+		else if (imalayer_transform_is_set(el->layer)) {
+			imalayer_transform_sample_row(el->layer, el->ibuf, el->is_float, x, ly, len, scratch);
+			src = scratch;
+		}
+		else if (el->is_float) {
+			src = (const char *)(el->ibuf->rect_float + ((size_t)ly * el->ibuf->x + x) * 4);
+		}
+		else {
+			src = (const char *)(el->ibuf->rect + (size_t)ly * el->ibuf->x + x);
+		}
+
+		if (el->is_float)
+			memcpy(row, src, sizeof(float[4]) * len);
+		else
+			imalayer_exr_row_from_bytes(row, (const unsigned char *)src, len);
+	}
+}
+
+static void imalayer_exr_write_attributes(void *handle, ImageLayerExr *els, int totlayer)
+{
+	char name[EXR_TOT_MAXNAME + 1];
+	ImageLayer *layer;
+	int a;
+
+	IMB_exr_add_attribute_int(handle, "BlenderImageLayers", totlayer);
+
+	for (a = 0; a < totlayer; a++) {
+		layer = els[a].layer;
+
+		imalayer_exr_attribute_name(name, a, "name");
+		IMB_exr_add_attribute_string(handle, name, layer->name);
+		imalayer_exr_attribute_name(name, a, "channels");
+		IMB_exr_add_attribute_string(handle, name, els[a].channels);
+		imalayer_exr_attribute_name(name, a, "opacity");
+		IMB_exr_add_attribute_float(handle, name, layer->opacity);
+		imalayer_exr_attribute_name(name, a, "blend");
+		IMB_exr_add_attribute_int(handle, name, layer->mode);
+		imalayer_exr_attribute_name(name, a, "visible");
+		IMB_exr_add_attribute_int(handle, name, (layer->visible & IMA_LAYER_VISIBLE) != 0);
+	}
+}
+
+bool image_save_layers_exr(Image *ima, const char *filepath, int compress, ReportList *reports)
+{
+	ImBuf *composite = ima->ibufs.first;
+	ImageLayerExr *els;
+	ImageLayer *layer;
+	void *handle, *scratch;
+	int totlayer = 0, a, width, height, x, y, w, h;
+	bool ok;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (imalayer_has_pixels(layer) && layer->ibufs.first)
+			totlayer++;
+	}
+
+	if (composite == NULL || totlayer == 0) {
+		BKE_report(reports, RPT_ERROR, "The image has no layers with pixels");
+		return false;
+	}
+
+	width = composite->x;
+	height = composite->y;
+
+	els = MEM_callocN(sizeof(ImageLayerExr) * totlayer, "ImageLayerExr");
+	handle = IMB_exr_get_handle();
+
+	for (layer = ima->imlayers.first, a = 0; layer; layer = layer->next) {
+		if (imalayer_has_pixels(layer) && layer->ibufs.first) {
+			imalayer_exr_source_init(&els[a], layer);
+			imalayer_exr_channels_init(els, a);
+			els[a].rect = MEM_mapallocN(sizeof(float[4]) * IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, __func__);
+
+			IMB_exr_add_channel(handle, els[a].channels, "R", 0, 0, NULL);
+			IMB_exr_add_channel(handle, els[a].channels, "G", 0, 0, NULL);
+			IMB_exr_add_channel(handle, els[a].channels, "B", 0, 0, NULL);
+			IMB_exr_add_channel(handle, els[a].channels, "A", 0, 0, NULL);
+			a++;
+		}
+	}
+
+	imalayer_exr_write_attributes(handle, els, totlayer);
+
+	ok = IMB_exrtile_begin_write_image(handle, filepath, width, height, IMA_LAYER_TILE_SIZE, IMA_LAYER_TILE_SIZE,
+	                                   compress) != 0;
+
+	if (ok) {
+		scratch = MEM_mallocN(sizeof(float[4]) * IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, __func__);
+
+		/* tiles of the file, their rows go down */
+		for (y = 0; y < height; y += IMA_LAYER_TILE_SIZE) {
+			h = min_ii(IMA_LAYER_TILE_SIZE, height - y);
+
+			for (x = 0; x < width; x += IMA_LAYER_TILE_SIZE) {
+				w = min_ii(IMA_LAYER_TILE_SIZE, width - x);
+
+				for (a = 0; a < totlayer; a++) {
+					imalayer_exr_read_tile(&els[a], x, height - y - h, w, h, scratch);
+					/* from the top row down */
+					imalayer_exr_set_channels(handle, &els[a], els[a].rect + (size_t)(h - 1) * w * 4, -4 * w);
+				}
+
+				IMB_exrtile_write_channels(handle, x, y, 0);
+			}
+		}
+
+		MEM_freeN(scratch);
+	}
+	else {
+		BKE_reportf(reports, RPT_ERROR, "Can't write \"%s\"", filepath);
+	}
+
+	IMB_exr_close(handle);
+
+	for (a = 0; a < totlayer; a++)
+		MEM_freeN(els[a].rect);
+	MEM_freeN(els);
+
+	return ok;
+}
+
+/* ******************************** Reading ******************************* */
+
+static ImageLayer *imalayer_exr_layer_new(Image *ima, void *handle, ImageLayerExr *el, int index,
+                                          int width, int height, bool use_float)
+{
+	char attr[EXR_TOT_MAXNAME + 1], name[IMA_LAYER_MAX_LEN];
+	ImageLayer *layer;
+	float opacity;
+	int mode, visible;
+
+	imalayer_exr_attribute_name(attr, index, "channels");
+	if (!IMB_exr_get_attribute_string(handle, attr, el->channels, sizeof(el->channels)))
+		return NULL;
+
+	imalayer_exr_attribute_name(attr, index, "name");
+	if (!IMB_exr_get_attribute_string(handle, attr, name, sizeof(name)))
+		BLI_strncpy(name, "Layer", sizeof(name));
+
+	layer = layer_alloc(ima, name);
+	layer->select = !IMA_LAYER_SEL_CURRENT;
+
+	imalayer_exr_attribute_name(attr, index, "opacity");
+	if (IMB_exr_get_attribute_float(handle, attr, &opacity))
+		layer->opacity = CLAMPIS(opacity, 0.0f, 1.0f);
+	imalayer_exr_attribute_name(attr, index, "blend");
+	if (IMB_exr_get_attribute_int(handle, attr, &mode))
+		layer->mode = (short)CLAMPIS(mode, IMA_LAYER_NORMAL, IMA_LAYER_SOFT_BURN);
+	imalayer_exr_attribute_name(attr, index, "visible");
+	if (IMB_exr_get_attribute_int(handle, attr, &visible) && !visible)
+		layer->visible &= ~IMA_LAYER_VISIBLE;
+
+	/* sparse, the pixels are only in the storage */
+	BLI_addtail(&layer->ibufs, IMB_allocImBuf(width, height, 32, 0));
+	layer->storage = imalayer_storage_new(width, height, !use_float, use_float, false);
+
+	el->layer = layer;
+	el->is_float = use_float;
+	el->width = width;
+	el->height = height;
+	el->rect = MEM_mapallocN(sizeof(float[4]) * IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, __func__);
+
+	return layer;
+}
+
+static void imalayer_exr_pack_tile(ImageLayerExr *el, int tx, int ty, int w, int h, unsigned char *scratch)
+{
+	const float *fp;
+	unsigned char *cp;
+	int i;
+
+	if (el->is_float) {
+		imalayer_storage_pack_tile(el->layer->storage, true, tx, ty, el->rect);
+		return;
+	}
+
+	for (i = 0, fp = el->rect, cp = scratch; i < w * h; i++, fp += 4, cp += 4)
+		linearrgb_to_srgb_uchar4(cp, fp);
+
+	imalayer_storage_pack_tile(el->layer->storage, false, tx, ty, scratch);
+}
+
+int image_import_layers_exr(Image *ima, const char *filepath, ReportList *reports)
+{
+	ImBuf *composite = ima->ibufs.first;
+	ImageLayerExr *els;
+	void *handle;
+	unsigned char *scratch;
+	bool use_float;
+	int width, height, totlayer = 0, totadded = 0, a, tx, ty, x, y, w, h;
+
+	handle = IMB_exr_get_handle();
+
+	if (!IMB_exrtile_begin_read(handle, filepath, &width, &height)) {
+		BKE_reportf(reports, RPT_ERROR, "Can't read \"%s\", it isn't a tiled OpenEXR file", filepath);
+		IMB_exr_close(handle);
+		return 0;
+	}
+
+	if (!IMB_exr_get_attribute_int(handle, "BlenderImageLayers", &totlayer) || totlayer <= 0) {
+		BKE_reportf(reports, RPT_ERROR, "\"%s\" has no image layers", filepath);
+		IMB_exr_close(handle);
+		return 0;
+	}
+
+	if (composite == NULL || composite->x != width || composite->y != height) {
+		BKE_reportf(reports, RPT_ERROR, "The layers are %d x %d, they don't match the image", width, height);
+		IMB_exr_close(handle);
+		return 0;
+	}
+
+	use_float = (composite->rect_float != NULL);
+	els = MEM_callocN(sizeof(ImageLayerExr) * totlayer, "ImageLayerExr");
+
+	for (a = 0; a < totlayer; a++) {
+		if (imalayer_exr_layer_new(ima, handle, &els[totadded], a, width, height, use_float))
+			totadded++;
+	}
+
+	scratch = MEM_mallocN(sizeof(char[4]) * IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, __func__);
+
+	for (ty = 0; (ty << IMA_LAYER_TILE_BITS) < height; ty++) {
+		y = ty << IMA_LAYER_TILE_BITS;
+		h = min_ii(IMA_LAYER_TILE_SIZE, height - y);
+
+		for (tx = 0; (tx << IMA_LAYER_TILE_BITS) < width; tx++) {
+			x = tx << IMA_LAYER_TILE_BITS;
+			w = min_ii(IMA_LAYER_TILE_SIZE, width - x);
+
+			/* missing channels read as transparent black */
+			for (a = 0; a < totadded; a++) {
+				memset(els[a].rect, 0, sizeof(float[4]) * w * h);
+				imalayer_exr_set_channels(handle, &els[a], els[a].rect, 4 * w);
+			}
+
+			IMB_exrtile_read_channels(handle, x, y, w, h);
+
+			for (a = 0; a < totadded; a++)
+				imalayer_exr_pack_tile(&els[a], tx, ty, w, h, scratch);
+		}
+	}
+
+	MEM_freeN(scratch);
+	IMB_exr_close(handle);
+
+	/* the first layer of the file goes on top */
+	for (a = totadded - 1; a >= 0; a--) {
+		els[a].layer->storage->generation = els[a].layer->generation;
+		BLI_addhead(&ima->imlayers, els[a].layer);
+		MEM_freeN(els[a].rect);
+	}
+	MEM_freeN(els);
+
+	if (totadded) {
+		ima->Count_Layers += totadded;
+		imalayer_set_current_act(ima, 0);
+		imalayer_cache_tag_dirty(ima);
+	}
+	else {
+		BKE_reportf(reports, RPT_ERROR, "\"%s\" has no image layers", filepath);
+	}
+
+	return totadded;
+}
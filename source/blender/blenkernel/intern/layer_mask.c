@@ -0,0 +1,511 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_mask.c
+ *  \ingroup bke
+ *
+ * Greyscale masks of image layers. A mask scales the alpha of its layer
+ * while the composite is blended, in the same loop as the opacity, see
+ * imalayer_blend_rows() in layer.c. It covers the layer as it's shown,
+ * after its transform, pixels outside of it aren't masked. Transforms are
+ * resampled into it as they're composed, see layer_transform.c, operators
+ * resampling the layer pixels do the same to imalayer_mask_to_ibuf().
+ *
+ * The values are kept in tiles of IMA_LAYER_TILE_SIZE like the composite
+ * cache. Tiles of a single value only store it, so a mask that hides or
+ * shows most of the layer costs next to nothing, and the blend skips the
+ * hidden tiles and doesn't look at the values of the shown ones.
+ *
+ * Masks are edited through a grey ImBuf that takes the place of the layer
+ * pixels while ImageLayerMask.flag has IMA_LAYER_MASK_EDIT, the regions
+ * tagged with imalayer_tag_dirty_region() are read back into the tiles.
+ */
+
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_math_base.h"
+#include "BLI_math_color.h"
+#include "BLI_string.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_layer.h"
+
+#include "IMB_imbuf.h"
+
+#define IMA_LAYER_MASK_TILE_LEN		(IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE)
+
+ImageLayerMask *imalayer_mask_new(int x, int y, unsigned char value)
+{
+	ImageLayerMask *mask;
+	int a, tottile;
+
+	if (x <= 0 || y <= 0)
+		return NULL;
+
+	mask = MEM_callocN(sizeof(ImageLayerMask), "image layer mask");
+	mask->x = x;
+	mask->y = y;
+	mask->xtiles = (x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	mask->ytiles = (y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	tottile = mask->xtiles * mask->ytiles;
+
+	mask->tiles = MEM_callocN(sizeof(ImageLayerMaskTile) * tottile, "image layer mask tiles");
+	for (a = 0; a < tottile; a++) {
+		mask->tiles[a].flag = IMA_LAYER_TILE_UNIFORM;
+		mask->tiles[a].uniform = (char)value;
+	}
+
+	return mask;
+}
+
+ImageLayerMask *imalayer_mask_copy(const ImageLayerMask *mask)
+{
+	ImageLayerMask *copy;
+	int a, tottile;
+
+	if (mask == NULL)
+		return NULL;
+
+	tottile = mask->xtiles * mask->ytiles;
+
+	copy = MEM_dupallocN(mask);
+	copy->ibuf = NULL;
+	copy->tiles = MEM_dupallocN(mask->tiles);
+
+	for (a = 0; a < tottile; a++) {
+		if (copy->tiles[a].data)
+			copy->tiles[a].data = MEM_dupallocN(copy->tiles[a].data);
+	}
+
+	return copy;
+}
+
+void imalayer_mask_free(ImageLayerMask *mask)
+{
+	int a, tottile;
+
+	if (mask == NULL)
+		return;
+
+	tottile = mask->xtiles * mask->ytiles;
+
+	for (a = 0; a < tottile; a++) {
+		if (mask->tiles[a].data)
+			MEM_freeN(mask->tiles[a].data);
+	}
+
+	if (mask->ibuf)
+		IMB_freeImBuf(mask->ibuf);
+
+	MEM_freeN(mask->tiles);
+	MEM_freeN(mask);
+}
+
+bool imalayer_mask_equals(const ImageLayerMask *a, const ImageLayerMask *b)
+{
+	const ImageLayerMaskTile *ta, *tb;
+	int i, tottile;
+
+	if (a == NULL || b == NULL)
+		return (a == b);
+
+	if (a->x != b->x || a->y != b->y || a->flag != b->flag)
+		return false;
+
+	tottile = a->xtiles * a->ytiles;
+
+	for (i = 0; i < tottile; i++) {
+		ta = &a->tiles[i];
+		tb = &b->tiles[i];
+
+		if (ta->flag != tb->flag)
+			return false;
+
+		if (ta->flag & IMA_LAYER_TILE_UNIFORM) {
+			if (ta->uniform != tb->uniform)
+				return false;
+		}
+		else if (memcmp(ta->data, tb->data, IMA_LAYER_MASK_TILE_LEN) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t imalayer_mask_mem_size(const ImageLayerMask *mask)
+{
+	size_t size;
+	int a, tottile;
+
+	if (mask == NULL)
+		return 0;
+
+	tottile = mask->xtiles * mask->ytiles;
+	size = sizeof(ImageLayerMask) + sizeof(ImageLayerMaskTile) * tottile;
+
+	for (a = 0; a < tottile; a++) {
+		if (mask->tiles[a].data)
+			size += IMA_LAYER_MASK_TILE_LEN;
+	}
+
+	return size;
+}
+
+ImageLayerMask *imalayer_mask_used(const ImageLayer *layer)
+{
+	ImageLayerMask *mask = layer->mask;
+
+	return (mask && !(mask->flag & IMA_LAYER_MASK_DISABLED)) ? mask : NULL;
+}
+
+bool imalayer_mask_is_edited(const ImageLayer *layer)
+{
+	return (layer && layer->mask && (layer->mask->flag & IMA_LAYER_MASK_EDIT));
+}
+
+const unsigned char *imalayer_mask_tile_values(const ImageLayerMask *mask, int tx, int ty, unsigned char *r_uniform)
+{
+	const ImageLayerMaskTile *tile;
+
+	/* outside of the mask the layer shows as it is */
+	if (tx >= mask->xtiles || ty >= mask->ytiles) {
+		*r_uniform = 255;
+		return NULL;
+	}
+
+	tile = &mask->tiles[ty * mask->xtiles + tx];
+
+	if (tile->flag & IMA_LAYER_TILE_UNIFORM) {
+		*r_uniform = (unsigned char)tile->uniform;
+		return NULL;
+	}
+
+	return tile->data;
+}
+
+/* Tiles that ended up with a single value drop their values again */
+static void imalayer_mask_tile_compact(ImageLayerMaskTile *tile)
+{
+	int i;
+
+	for (i = 1; i < IMA_LAYER_MASK_TILE_LEN; i++) {
+		if (tile->data[i] != tile->data[0])
+			return;
+	}
+
+	tile->flag = IMA_LAYER_TILE_UNIFORM;
+	tile->uniform = (char)tile->data[0];
+	MEM_freeN(tile->data);
+	tile->data = NULL;
+}
+
+static unsigned char imalayer_mask_pixel_value(const ImBuf *ibuf, size_t offset, bool alpha)
+{
+	if (ibuf->rect) {
+		const unsigned char *cp = (const unsigned char *)(ibuf->rect + offset);
+		return alpha ? cp[3] : rgb_to_grayscale_byte(cp);
+	}
+	else {
+		const float *fp = ibuf->rect_float + offset * 4;
+		return (unsigned char)FTOCHAR(alpha ? fp[3] : rgb_to_grayscale(fp));
+	}
+}
+
+/* Reads the values of the pixels of "ibuf" inside the rectangle into the
+ * tiles, their grey or their alpha. Tiles that don't change stay shared. */
+static void imalayer_mask_read_ibuf(ImageLayerMask *mask, const ImBuf *ibuf, int x, int y, int w, int h, bool alpha)
+{
+	ImageLayerMaskTile *tile;
+	unsigned char value;
+	int tx, ty, px, py, x0, x1, y0, y1;
+
+	if (ibuf == NULL || (ibuf->rect == NULL && ibuf->rect_float == NULL))
+		return;
+
+	x0 = max_ii(x, 0);
+	y0 = max_ii(y, 0);
+	x1 = min_iii(x + w, mask->x, ibuf->x);
+	y1 = min_iii(y + h, mask->y, ibuf->y);
+
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	for (ty = y0 >> IMA_LAYER_TILE_BITS; (ty << IMA_LAYER_TILE_BITS) < y1; ty++) {
+		for (tx = x0 >> IMA_LAYER_TILE_BITS; (tx << IMA_LAYER_TILE_BITS) < x1; tx++) {
+			tile = &mask->tiles[ty * mask->xtiles + tx];
+
+			for (py = max_ii(y0, ty << IMA_LAYER_TILE_BITS); py < min_ii(y1, (ty + 1) << IMA_LAYER_TILE_BITS); py++) {
+				for (px = max_ii(x0, tx << IMA_LAYER_TILE_BITS); px < min_ii(x1, (tx + 1) << IMA_LAYER_TILE_BITS); px++) {
+					value = imalayer_mask_pixel_value(ibuf, (size_t)py * ibuf->x + px, alpha);
+
+					if (tile->flag & IMA_LAYER_TILE_UNIFORM) {
+						if (value == (unsigned char)tile->uniform)
+							continue;
+
+						tile->data = MEM_mallocN(IMA_LAYER_MASK_TILE_LEN, "image layer mask tile");
+						memset(tile->data, (unsigned char)tile->uniform, IMA_LAYER_MASK_TILE_LEN);
+						tile->flag &= ~IMA_LAYER_TILE_UNIFORM;
+					}
+
+					tile->data[((py & (IMA_LAYER_TILE_SIZE - 1)) << IMA_LAYER_TILE_BITS) +
+					           (px & (IMA_LAYER_TILE_SIZE - 1))] = value;
+				}
+			}
+
+			if (tile->data)
+				imalayer_mask_tile_compact(tile);
+		}
+	}
+}
+
+/* Size of the layer as it's shown, the composite for groups and adjustments */
+static bool imalayer_mask_layer_size(Image *ima, ImageLayer *layer, int *r_x, int *r_y)
+{
+	ImBuf *composite = ima->ibufs.first;
+
+	if (layer->ibufs.first) {
+		imalayer_transform_get_size(layer, r_x, r_y);
+	}
+	else if (composite) {
+		*r_x = composite->x;
+		*r_y = composite->y;
+	}
+	else {
+		return false;
+	}
+
+	return (*r_x > 0 && *r_y > 0);
+}
+
+bool imalayer_mask_add(Image *ima, ImageLayer *layer, int type)
+{
+	ImageLayerMask *mask;
+	ImBuf *ibuf;
+	int x, y;
+
+	if (layer->mask || layer->type == IMA_LAYER_BASE || !imalayer_mask_layer_size(ima, layer, &x, &y))
+		return false;
+
+	if (type == IMA_LAYER_MASK_FROM_ALPHA) {
+		if (!imalayer_has_pixels(layer))
+			return false;
+
+		/* in the layer as it's shown, a pending transform is applied */
+		ibuf = imalayer_get_ibuf(layer);
+		if (ibuf == NULL)
+			return false;
+
+		mask = imalayer_mask_new(ibuf->x, ibuf->y, 255);
+		imalayer_mask_read_ibuf(mask, ibuf, 0, 0, ibuf->x, ibuf->y, true);
+	}
+	else {
+		mask = imalayer_mask_new(x, y, (type == IMA_LAYER_MASK_BLACK) ? 0 : 255);
+	}
+
+	if (mask == NULL)
+		return false;
+
+	layer->mask = mask;
+	imalayer_mask_tag_dirty(layer);
+
+	return true;
+}
+
+/* Bakes the mask into the alpha of the pixels */
+static void imalayer_mask_apply_ibuf(const ImageLayerMask *mask, ImBuf *ibuf)
+{
+	const unsigned char *values;
+	unsigned char uniform, *cp;
+	float *fp, m;
+	int x, y, w, h;
+
+	w = min_ii(mask->x, ibuf->x);
+	h = min_ii(mask->y, ibuf->y);
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			values = imalayer_mask_tile_values(mask, x >> IMA_LAYER_TILE_BITS, y >> IMA_LAYER_TILE_BITS, &uniform);
+			if (values)
+				uniform = values[((y & (IMA_LAYER_TILE_SIZE - 1)) << IMA_LAYER_TILE_BITS) + (x & (IMA_LAYER_TILE_SIZE - 1))];
+
+			if (uniform == 255)
+				continue;
+
+			m = (float)uniform / 255.0f;
+
+			if (ibuf->rect) {
+				cp = (unsigned char *)(ibuf->rect + (size_t)y * ibuf->x + x);
+				cp[3] = (unsigned char)FTOCHAR((float)cp[3] / 255.0f * m);
+			}
+			if (ibuf->rect_float) {
+				fp = ibuf->rect_float + ((size_t)y * ibuf->x + x) * 4;
+				fp[3] *= m;
+			}
+		}
+	}
+
+	ibuf->userflags |= IB_BITMAPDIRTY | IB_DISPLAY_BUFFER_INVALID;
+}
+
+void imalayer_mask_remove(ImageLayer *layer, bool apply)
+{
+	ImBuf *ibuf;
+
+	if (layer->mask == NULL)
+		return;
+
+	if (apply && imalayer_mask_used(layer) && imalayer_has_pixels(layer)) {
+		ibuf = imalayer_get_ibuf(layer);
+		if (ibuf)
+			imalayer_mask_apply_ibuf(layer->mask, ibuf);
+		imalayer_tag_dirty(layer);
+	}
+
+	imalayer_mask_free(layer->mask);
+	layer->mask = NULL;
+}
+
+void imalayer_mask_apply(ImageLayer *layer)
+{
+	imalayer_mask_remove(layer, true);
+}
+
+ImBuf *imalayer_mask_to_ibuf(const ImageLayerMask *mask)
+{
+	const unsigned char *values;
+	unsigned char uniform, *cp;
+	ImBuf *ibuf;
+	int x, y;
+
+	ibuf = IMB_allocImBuf(mask->x, mask->y, 32, IB_rect);
+	if (ibuf == NULL)
+		return NULL;
+
+	for (y = 0; y < mask->y; y++) {
+		cp = (unsigned char *)(ibuf->rect + (size_t)y * mask->x);
+
+		for (x = 0; x < mask->x; x++, cp += 4) {
+			values = imalayer_mask_tile_values(mask, x >> IMA_LAYER_TILE_BITS, y >> IMA_LAYER_TILE_BITS, &uniform);
+			if (values)
+				uniform = values[((y & (IMA_LAYER_TILE_SIZE - 1)) << IMA_LAYER_TILE_BITS) + (x & (IMA_LAYER_TILE_SIZE - 1))];
+
+			cp[0] = cp[1] = cp[2] = uniform;
+			cp[3] = 255;
+		}
+	}
+
+	return ibuf;
+}
+
+void imalayer_mask_from_ibuf(ImageLayer *layer, ImBuf *ibuf)
+{
+	ImageLayerMask *mask = layer->mask, *result;
+	ImageLayerMaskTile *tiles;
+
+	if (ibuf == NULL)
+		return;
+
+	result = imalayer_mask_new(ibuf->x, ibuf->y, 255);
+
+	if (result) {
+		imalayer_mask_read_ibuf(result, ibuf, 0, 0, ibuf->x, ibuf->y, false);
+
+		/* the new tiles take the place of the old ones, the settings stay */
+		tiles = mask->tiles;
+		mask->tiles = result->tiles;
+		result->tiles = tiles;
+		SWAP(int, mask->x, result->x);
+		SWAP(int, mask->y, result->y);
+		SWAP(int, mask->xtiles, result->xtiles);
+		SWAP(int, mask->ytiles, result->ytiles);
+
+		imalayer_mask_free(result);
+
+		/* edited masks get an ImBuf of the new size */
+		if (mask->ibuf) {
+			IMB_freeImBuf(mask->ibuf);
+			mask->ibuf = NULL;
+		}
+
+		imalayer_mask_tag_dirty(layer);
+	}
+
+	IMB_freeImBuf(ibuf);
+}
+
+void imalayer_mask_transform(ImageLayer *layer, const float mat[2][3], int width, int height, short filter,
+                             bool wrap)
+{
+	static const float unmasked[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+	ImBuf *ibuf, *result;
+
+	if (layer->mask == NULL)
+		return;
+
+	ibuf = imalayer_mask_to_ibuf(layer->mask);
+	if (ibuf == NULL)
+		return;
+
+	result = IMB_allocImBuf(max_ii(width, 1), max_ii(height, 1), 32, IB_rect);
+
+	if (result) {
+		IMB_transform(result, ibuf, mat, filter, wrap ? IMB_TRANSFORM_WRAP : IMB_TRANSFORM_FILL, unmasked);
+		imalayer_mask_from_ibuf(layer, result);
+	}
+
+	IMB_freeImBuf(ibuf);
+}
+
+ImBuf *imalayer_mask_get_ibuf(ImageLayer *layer)
+{
+	ImageLayerMask *mask = layer->mask;
+
+	if (mask->ibuf == NULL) {
+		mask->ibuf = imalayer_mask_to_ibuf(mask);
+
+		/* told apart from the layer pixels by the paint undo */
+		if (mask->ibuf)
+			BLI_strncpy(mask->ibuf->name, "layer mask", sizeof(mask->ibuf->name));
+	}
+
+	return mask->ibuf;
+}
+
+void imalayer_mask_update(ImageLayerMask *mask, int x, int y, int w, int h)
+{
+	imalayer_mask_read_ibuf(mask, mask->ibuf, x, y, w, h, false);
+}
+
+void imalayer_mask_end_edit(ImageLayerMask *mask)
+{
+	mask->flag &= ~IMA_LAYER_MASK_EDIT;
+
+	/* the tiles were kept up to date */
+	if (mask->ibuf) {
+		IMB_freeImBuf(mask->ibuf);
+		mask->ibuf = NULL;
+	}
+}
@@ -0,0 +1,360 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_mip.c
+ *  \ingroup bke
+ *
+ * Mip pyramids of layers and of the composite, so zoomed out views draw and
+ * blend about as many pixels as there are on screen. Level 0 is the buffer
+ * itself, every next level is half the size of the previous one (as made by
+ * IMB_onehalf()). The levels are made the first time they're asked for.
+ *
+ * Changes are tagged in tiles of IMA_LAYER_TILE_SIZE pixels of level 0, each
+ * tile has one bit per level: only the part of a level under the changed
+ * tiles is reduced again, when it's asked for next.
+ */
+
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_math_base.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_layer.h"
+
+#include "IMB_imbuf.h"
+#include "IMB_colormanagement.h"
+
+struct ImageLayerMip {
+	struct ImBuf *levels[IMA_LAYER_MIP_MAX + 1];	/* levels[0] is unused, it's the source */
+	int x, y;			/* size of level 0 */
+	int totlevel;		/* levels smaller than a pixel aren't made */
+	int generation;		/* of the layer the levels match */
+
+	/* per tile of level 0, bit "level - 1" is set while that level is out of date */
+	unsigned char *tiles;
+	int tiles_x, tiles_y;
+};
+
+#define IMA_LAYER_MIP_ALL	0xff
+
+ImageLayerMip *imalayer_mip_new(void)
+{
+	return MEM_callocN(sizeof(ImageLayerMip), "ImageLayerMip");
+}
+
+static void imalayer_mip_free_levels(ImageLayerMip *mip)
+{
+	int level;
+
+	for (level = 1; level <= IMA_LAYER_MIP_MAX; level++) {
+		if (mip->levels[level]) {
+			IMB_freeImBuf(mip->levels[level]);
+			mip->levels[level] = NULL;
+		}
+	}
+
+	if (mip->tiles) {
+		MEM_freeN(mip->tiles);
+		mip->tiles = NULL;
+	}
+
+	mip->x = mip->y = 0;
+}
+
+void imalayer_mip_free(ImageLayerMip *mip)
+{
+	if (mip == NULL)
+		return;
+
+	imalayer_mip_free_levels(mip);
+	MEM_freeN(mip);
+}
+
+void imalayer_mip_tag_all(ImageLayerMip *mip)
+{
+	if (mip && mip->tiles)
+		memset(mip->tiles, IMA_LAYER_MIP_ALL, sizeof(char) * mip->tiles_x * mip->tiles_y);
+}
+
+void imalayer_mip_tag_region(ImageLayerMip *mip, int x, int y, int w, int h)
+{
+	int tx, ty, tx_max, ty_max;
+
+	if (mip == NULL || mip->tiles == NULL)
+		return;
+
+	x = max_ii(x, 0);
+	y = max_ii(y, 0);
+	w = min_ii(x + w, mip->x) - x;
+	h = min_ii(y + h, mip->y) - y;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	tx_max = (x + w - 1) >> IMA_LAYER_TILE_BITS;
+	ty_max = (y + h - 1) >> IMA_LAYER_TILE_BITS;
+
+	for (ty = y >> IMA_LAYER_TILE_BITS; ty <= ty_max; ty++)
+		for (tx = x >> IMA_LAYER_TILE_BITS; tx <= tx_max; tx++)
+			mip->tiles[ty * mip->tiles_x + tx] = IMA_LAYER_MIP_ALL;
+}
+
+int imalayer_mip_level_for_zoom(float zoom)
+{
+	int level = 0;
+
+	/* the level keeps at least as many pixels as it covers on screen */
+	while (level < IMA_LAYER_MIP_MAX && zoom * (float)(2 << level) <= 1.0f)
+		level++;
+
+	return level;
+}
+
+/* Levels of a new size, all out of date */
+static void imalayer_mip_init(ImageLayerMip *mip, int x, int y)
+{
+	imalayer_mip_free_levels(mip);
+
+	mip->x = x;
+	mip->y = y;
+
+	for (mip->totlevel = 0; mip->totlevel < IMA_LAYER_MIP_MAX; mip->totlevel++) {
+		if ((x >> (mip->totlevel + 1)) < 1 || (y >> (mip->totlevel + 1)) < 1)
+			break;
+	}
+
+	mip->tiles_x = (x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	mip->tiles_y = (y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	mip->tiles = MEM_mallocN(sizeof(char) * mip->tiles_x * mip->tiles_y, "ImageLayerMip tiles");
+	memset(mip->tiles, IMA_LAYER_MIP_ALL, sizeof(char) * mip->tiles_x * mip->tiles_y);
+}
+
+static ImBuf *imalayer_mip_level_ensure(ImageLayerMip *mip, int level, bool is_float, const ImBuf *colorspace)
+{
+	ImBuf *ibuf = mip->levels[level];
+
+	if (ibuf && (is_float ? ibuf->rect_float == NULL : ibuf->rect == NULL)) {
+		IMB_freeImBuf(ibuf);
+		ibuf = NULL;
+	}
+
+	if (ibuf == NULL) {
+		ibuf = IMB_allocImBuf(mip->x >> level, mip->y >> level, 32, is_float ? IB_rectfloat : IB_rect);
+		mip->levels[level] = ibuf;
+	}
+
+	/* drawn the way the source is */
+	ibuf->rect_colorspace = colorspace->rect_colorspace;
+	ibuf->float_colorspace = colorspace->float_colorspace;
+
+	return ibuf;
+}
+
+/* Reduces the part of "level" under the tiles of level 0 tx..tx_end in row ty */
+static void imalayer_mip_reduce_span(ImageLayerMip *mip, ImBuf *src, int level, int tx, int tx_end, int ty)
+{
+	ImBuf *dst = mip->levels[level];
+	const int shift = IMA_LAYER_TILE_BITS - level;
+	const int xmin = (shift >= 0) ? tx << shift : tx >> -shift;
+	const int ymin = (shift >= 0) ? ty << shift : ty >> -shift;
+	/* tiles smaller than a pixel of the level share it with their neighbours */
+	const int xmax = min_ii((shift >= 0) ? tx_end << shift : (tx_end + (1 << -shift) - 1) >> -shift, dst->x);
+	const int ymax = min_ii((shift >= 0) ? (ty + 1) << shift : (ty + (1 << -shift)) >> -shift, dst->y);
+
+	if (xmin >= xmax || ymin >= ymax)
+		return;
+
+	IMB_onehalf_rect(dst, src, xmin, ymin, xmax, ymax);
+	IMB_partial_display_buffer_update_delayed(dst, xmin, ymin, xmax, ymax);
+}
+
+/* Level 1 of a sparse layer, reduced from the tiles of its storage */
+static void imalayer_mip_reduce_storage_tile(ImageLayerMip *mip, const ImageLayerStorage *storage, bool is_float,
+                                             int tx, int ty, void *buf)
+{
+	ImBuf *dst = mip->levels[1];
+	const int ox = tx << IMA_LAYER_TILE_BITS, oy = ty << IMA_LAYER_TILE_BITS;
+	const int xmin = ox >> 1, ymin = oy >> 1;
+	const int xmax = min_ii((ox + IMA_LAYER_TILE_SIZE) >> 1, dst->x);
+	const int ymax = min_ii((oy + IMA_LAYER_TILE_SIZE) >> 1, dst->y);
+	const void *pixels;
+	ImBuf tile;
+	int stride, x, y;
+
+	if (xmin >= xmax || ymin >= ymax)
+		return;
+
+	pixels = imalayer_storage_tile_pixels(storage, is_float, tx, ty, buf, &stride);
+
+	if (stride == 0) {
+		/* uniform, the pixel stays as it is */
+		for (y = ymin; y < ymax; y++) {
+			for (x = xmin; x < xmax; x++) {
+				if (is_float)
+					memcpy(dst->rect_float + ((size_t)y * dst->x + x) * 4, pixels, sizeof(float[4]));
+				else
+					dst->rect[(size_t)y * dst->x + x] = *(const unsigned int *)pixels;
+			}
+		}
+	}
+	else {
+		/* the tile as an ImBuf placed where it is in the layer */
+		memset(&tile, 0, sizeof(tile));
+		tile.x = stride;
+		if (is_float)
+			tile.rect_float = (float *)pixels - ((size_t)oy * stride + ox) * 4;
+		else
+			tile.rect = (unsigned int *)pixels - ((size_t)oy * stride + ox);
+
+		IMB_onehalf_rect(dst, &tile, xmin, ymin, xmax, ymax);
+	}
+
+	IMB_partial_display_buffer_update_delayed(dst, xmin, ymin, xmax, ymax);
+}
+
+ImBuf *imalayer_mip_get(ImageLayerMip *mip, ImBuf *ibuf, const ImageLayerStorage *storage, int level)
+{
+	const bool is_float = storage ? (storage->rect_float != NULL) : (ibuf->rect_float != NULL);
+	void *buf = NULL;
+	unsigned char *tile;
+	int l, tx, tx_end, ty;
+
+	if (level <= 0)
+		return ibuf;
+
+	if (mip->tiles == NULL || mip->x != ibuf->x || mip->y != ibuf->y)
+		imalayer_mip_init(mip, ibuf->x, ibuf->y);
+
+	level = min_ii(level, mip->totlevel);
+
+	if (level <= 0)
+		return ibuf;
+
+	if (storage)
+		buf = MEM_mallocN(sizeof(float[4]) * IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, __func__);
+
+	/* from the largest level down, each one is made from the previous */
+	for (l = 1; l <= level; l++) {
+		const unsigned char bit = (unsigned char)(1 << (l - 1));
+
+		imalayer_mip_level_ensure(mip, l, is_float, ibuf);
+
+		for (ty = 0; ty < mip->tiles_y; ty++) {
+			tile = mip->tiles + ty * mip->tiles_x;
+
+			for (tx = 0; tx < mip->tiles_x; tx++) {
+				if (!(tile[tx] & bit))
+					continue;
+
+				/* runs of tiles in a row at once */
+				for (tx_end = tx; tx_end < mip->tiles_x && (tile[tx_end] & bit); tx_end++)
+					tile[tx_end] &= ~bit;
+
+				if (l == 1 && storage) {
+					for (; tx < tx_end; tx++)
+						imalayer_mip_reduce_storage_tile(mip, storage, is_float, tx, ty, buf);
+				}
+				else {
+					imalayer_mip_reduce_span(mip, (l == 1) ? ibuf : mip->levels[l - 1], l, tx, tx_end, ty);
+				}
+
+				tx = tx_end;
+			}
+		}
+	}
+
+	if (buf)
+		MEM_freeN(buf);
+
+	return mip->levels[level];
+}
+
+/* ******************************** Layers ******************************** */
+
+void imalayer_mip_layer_tag_region(ImageLayer *layer, int generation, int x, int y, int w, int h)
+{
+	ImageLayerMip *mip = layer->mip;
+
+	/* out of date already, it's made again whole. Mips don't have the
+	 * mask, they stay as they are when only it changed */
+	if (mip == NULL || mip->generation != generation || layer->generation == generation)
+		return;
+
+	imalayer_mip_tag_region(mip, x, y, w, h);
+	mip->generation = layer->generation;
+}
+
+ImBuf *imalayer_get_mip(ImageLayer *layer, int level)
+{
+	ImageLayerStorage *storage;
+	ImBuf *ibuf = layer->ibufs.first;
+
+	if (ibuf == NULL || !imalayer_has_pixels(layer) || imalayer_transform_is_set(layer))
+		return NULL;
+
+	if (level <= 0)
+		return imalayer_get_ibuf_untransformed(layer);
+
+	storage = imalayer_sparse_storage(layer);
+
+	if (layer->mip == NULL)
+		layer->mip = imalayer_mip_new();
+
+	if (layer->mip->generation != layer->generation) {
+		imalayer_mip_tag_all(layer->mip);
+		layer->mip->generation = layer->generation;
+	}
+
+	return imalayer_mip_get(layer->mip, ibuf, storage, level);
+}
+
+ImBuf *imalayer_mip_peek(ImageLayer *layer, int level)
+{
+	ImageLayerMip *mip = layer->mip;
+	ImBuf *ibuf = layer->ibufs.first;
+	const unsigned char bits = (unsigned char)((1 << level) - 1);
+	int a;
+
+	if (mip == NULL || mip->tiles == NULL || ibuf == NULL || mip->x != ibuf->x || mip->y != ibuf->y ||
+	    level <= 0 || level > mip->totlevel || mip->levels[level] == NULL || mip->generation != layer->generation)
+	{
+		return NULL;
+	}
+
+	for (a = 0; a < mip->tiles_x * mip->tiles_y; a++) {
+		if (mip->tiles[a] & bits)
+			return NULL;
+	}
+
+	return mip->levels[level];
+}
+
+void imalayer_mip_layer_free(ImageLayer *layer)
+{
+	if (layer->mip) {
+		imalayer_mip_free(layer->mip);
+		layer->mip = NULL;
+	}
+}
@@ -0,0 +1,881 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_storage.c
+ *  \ingroup bke
+ *
+ * Tiled, compressed copy of the image layer pixels, used to write them in
+ * .blend files (saving, autosave and undo). Layers read from a file keep
+ * their ImageLayerStorage and only get their pixels back when some code
+ * needs the whole buffer, see imalayer_get_ibuf(). Pending transforms of
+ * the layer apply to these pixels, see layer_transform.c.
+ *
+ * The storage stays around while the layer isn't edited, so unchanged layers
+ * are written without packing them again, and the pixels of images nobody
+ * used for a while can be dropped, see imalayer_evict_pixels(). Painting only
+ * gets the tiles under the brush packed again, see imalayer_storage_tag_region(),
+ * and a layer with little painted on it goes back to being sparse once the
+ * stroke is done, see imalayer_make_sparse().
+ *
+ * Until then the layer is sparse: the composite reads its tiles directly,
+ * so tiles of a single color cost nothing. New layers start out that way.
+ *
+ * The float tiles of IMA_LAYER_HALF_FLOAT layers hold half floats, converted
+ * while packing and reading them. Only the layer being edited has its float
+ * buffer, see imalayer_storage_compact().
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_math_base.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_layer.h"
+
+#include "IMB_imbuf.h"
+
+#ifdef WITH_LZO
+#  include "minilzo.h"
+#endif
+
+/* Layers keep their pixels after a stroke when more than this fraction of
+ * their tiles aren't uniform, see imalayer_make_sparse() */
+#define IMA_LAYER_SPARSE_DENSE_FRACTION	4
+
+typedef struct ImageLayerTileBuffer {
+	char *rect;				/* ImBuf.rect or ImBuf.rect_float */
+	size_t pixel_size;
+	size_t tile_pixel_size;	/* of the packed pixels, half floats are smaller */
+	int x, y;
+	char *buf;				/* one tile, rows packed */
+#ifdef WITH_LZO
+	char *out;
+	void *wrkmem;
+#endif
+} ImageLayerTileBuffer;
+
+typedef union ImageLayerFloatBits {
+	unsigned int u;
+	float f;
+} ImageLayerFloatBits;
+
+/* IEEE half floats, rounded to the nearest even. Values out of range become
+ * infinite, NaN stays NaN */
+BLI_INLINE unsigned short imalayer_float_to_half(float value)
+{
+	const ImageLayerFloatBits f32infty = {255u << 23};
+	const ImageLayerFloatBits f16max = {(127u + 16u) << 23};
+	const ImageLayerFloatBits denorm_magic = {((127u - 15u) + (23u - 10u) + 1u) << 23};
+	ImageLayerFloatBits f;
+	unsigned int sign, half;
+
+	f.f = value;
+	sign = f.u & 0x80000000u;
+	f.u ^= sign;
+
+	if (f.u >= f16max.u) {
+		half = (f.u > f32infty.u) ? 0x7e00u : 0x7c00u;
+	}
+	else if (f.u < (113u << 23)) {
+		/* denormals, the add does the rounding */
+		f.f += denorm_magic.f;
+		half = f.u - denorm_magic.u;
+	}
+	else {
+		const unsigned int mant_odd = (f.u >> 13) & 1u;
+
+		f.u += (unsigned int)((15 - 127) << 23) + 0xfffu + mant_odd;
+		half = f.u >> 13;
+	}
+
+	return (unsigned short)(half | (sign >> 16));
+}
+
+BLI_INLINE float imalayer_half_to_float(unsigned short half)
+{
+	const ImageLayerFloatBits magic = {113u << 23};
+	const unsigned int shifted_exp = 0x7c00u << 13;
+	ImageLayerFloatBits o;
+	unsigned int exp;
+
+	o.u = (unsigned int)(half & 0x7fffu) << 13;
+	exp = shifted_exp & o.u;
+	o.u += (127u - 15u) << 23;
+
+	if (exp == shifted_exp) {
+		/* Inf and NaN */
+		o.u += (128u - 16u) << 23;
+	}
+	else if (exp == 0) {
+		/* zero and denormals */
+		o.u += 1u << 23;
+		o.f -= magic.f;
+	}
+
+	o.u |= (unsigned int)(half & 0x8000u) << 16;
+
+	return o.f;
+}
+
+static void imalayer_half_from_float_v(unsigned short *dst, const float *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = imalayer_float_to_half(src[i]);
+}
+
+/* "src" can be the second half of "dst", the floats don't overwrite
+ * halves that weren't read yet */
+static void imalayer_half_to_float_v(float *dst, const unsigned short *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = imalayer_half_to_float(src[i]);
+}
+
+static bool imalayer_ibuf_has_pixels(ImBuf *ibuf)
+{
+	return (ibuf->rect || ibuf->rect_float);
+}
+
+/* One row of w pixels from the ImBuf to the tile, or back */
+static void imalayer_tile_row_pack(ImageLayerTileBuffer *tb, char *dst, const char *src, int w)
+{
+	if (tb->tile_pixel_size != tb->pixel_size)
+		imalayer_half_from_float_v((unsigned short *)dst, (const float *)src, (size_t)w * 4);
+	else
+		memcpy(dst, src, (size_t)w * tb->pixel_size);
+}
+
+static void imalayer_tile_row_unpack(ImageLayerTileBuffer *tb, char *dst, const char *src, int w)
+{
+	if (tb->tile_pixel_size != tb->pixel_size)
+		imalayer_half_to_float_v((float *)dst, (const unsigned short *)src, (size_t)w * 4);
+	else
+		memcpy(dst, src, (size_t)w * tb->pixel_size);
+}
+
+static size_t imalayer_tile_rect(ImageLayerTileBuffer *tb, int tx, int ty, int *r_x, int *r_y, int *r_w, int *r_h)
+{
+	*r_x = tx << IMA_LAYER_TILE_BITS;
+	*r_y = ty << IMA_LAYER_TILE_BITS;
+	*r_w = min_ii(IMA_LAYER_TILE_SIZE, tb->x - *r_x);
+	*r_h = min_ii(IMA_LAYER_TILE_SIZE, tb->y - *r_y);
+
+	return (size_t)*r_w * (size_t)*r_h * tb->tile_pixel_size;
+}
+
+static void imalayer_tile_pack(ImageLayerTileBuffer *tb, ImageLayerTile *tile, int tx, int ty)
+{
+	const size_t row_size = (size_t)tb->x * tb->pixel_size;
+	const size_t tile_pixel_size = tb->tile_pixel_size;
+	size_t len, tile_row_size;
+	char *src, *dst;
+	int x, y, w, h, i;
+
+	len = imalayer_tile_rect(tb, tx, ty, &x, &y, &w, &h);
+	tile_row_size = (size_t)w * tile_pixel_size;
+
+	src = tb->rect + y * row_size + x * tb->pixel_size;
+	for (i = 0, dst = tb->buf; i < h; i++, src += row_size, dst += tile_row_size)
+		imalayer_tile_row_pack(tb, dst, src, w);
+
+	for (i = 1; i < w * h; i++) {
+		if (memcmp(tb->buf, tb->buf + i * tile_pixel_size, tile_pixel_size) != 0)
+			break;
+	}
+
+	if (i == w * h) {
+		tile->flag = IMA_LAYER_TILE_UNIFORM;
+		memcpy(tile->uniform, tb->buf, tile_pixel_size);
+		return;
+	}
+
+#ifdef WITH_LZO
+	{
+		lzo_uint out_len = LZO_OUT_LEN(len);
+
+		if (lzo1x_1_compress((lzo_bytep)tb->buf, (lzo_uint)len, (lzo_bytep)tb->out, &out_len, tb->wrkmem) == LZO_E_OK &&
+		    out_len < len)
+		{
+			tile->flag = IMA_LAYER_TILE_LZO;
+			tile->size = (int)out_len;
+			tile->data = MEM_mallocN(out_len, "image layer tile");
+			memcpy(tile->data, tb->out, out_len);
+			return;
+		}
+	}
+#endif
+
+	tile->size = (int)len;
+	tile->data = MEM_mallocN(len, "image layer tile");
+	memcpy(tile->data, tb->buf, len);
+}
+
+/* Pixels of a w x h tile, rows packed. Uniform tiles give a single row and a
+ * stride of 0, compressed ones are decoded into "buf". NULL on errors. */
+static const char *imalayer_tile_read(const ImageLayerTile *tile, char *buf, size_t pixel_size, int w, int h,
+                                      int *r_stride)
+{
+	const size_t len = (size_t)w * (size_t)h * pixel_size;
+	int i;
+
+	if (tile->flag & IMA_LAYER_TILE_UNIFORM) {
+		for (i = 0; i < w; i++)
+			memcpy(buf + i * pixel_size, tile->uniform, pixel_size);
+		*r_stride = 0;
+		return buf;
+	}
+
+	*r_stride = w;
+
+	if (tile->data == NULL)
+		return NULL;
+
+	if (tile->flag & IMA_LAYER_TILE_LZO) {
+#ifdef WITH_LZO
+		lzo_uint out_len = len;
+
+		if (lzo1x_decompress_safe((lzo_bytep)tile->data, (lzo_uint)tile->size, (lzo_bytep)buf, &out_len, NULL) != LZO_E_OK ||
+		    out_len != len)
+		{
+			return NULL;
+		}
+
+		return buf;
+#else
+		return NULL;
+#endif
+	}
+
+	return ((size_t)tile->size == len) ? tile->data : NULL;
+}
+
+static void imalayer_tile_decode(ImageLayerTileBuffer *tb, ImageLayerTile *tile, int tx, int ty)
+{
+	const size_t row_size = (size_t)tb->x * tb->pixel_size;
+	const char *src;
+	char *dst;
+	int x, y, w, h, i, stride;
+
+	imalayer_tile_rect(tb, tx, ty, &x, &y, &w, &h);
+	dst = tb->rect + y * row_size + x * tb->pixel_size;
+
+	src = imalayer_tile_read(tile, tb->buf, tb->tile_pixel_size, w, h, &stride);
+
+	if (src == NULL) {
+		printf("%s: can't decode image layer tile %d, %d\n", __func__, tx, ty);
+		return;
+	}
+
+	for (i = 0; i < h; i++, src += stride * tb->tile_pixel_size, dst += row_size)
+		imalayer_tile_row_unpack(tb, dst, src, w);
+}
+
+static void imalayer_tile_buffer_pack_init(ImageLayerTileBuffer *tb, void *rect, size_t pixel_size,
+                                           size_t tile_pixel_size, int x, int y)
+{
+	tb->rect = rect;
+	tb->pixel_size = pixel_size;
+	tb->tile_pixel_size = tile_pixel_size;
+	tb->x = x;
+	tb->y = y;
+	tb->buf = MEM_mallocN(IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE * tile_pixel_size, __func__);
+#ifdef WITH_LZO
+	tb->out = MEM_mallocN(LZO_OUT_LEN(IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE * tile_pixel_size), __func__);
+	tb->wrkmem = MEM_mallocN(LZO1X_1_MEM_COMPRESS, __func__);
+#endif
+}
+
+static void imalayer_tile_buffer_pack_free(ImageLayerTileBuffer *tb)
+{
+	MEM_freeN(tb->buf);
+#ifdef WITH_LZO
+	MEM_freeN(tb->out);
+	MEM_freeN(tb->wrkmem);
+#endif
+}
+
+static void imalayer_tiles_pack(ImageLayerTile *tiles, ImageLayerStorage *storage, void *rect, size_t pixel_size,
+                                size_t tile_pixel_size)
+{
+	ImageLayerTileBuffer tb;
+	int tx, ty;
+
+	imalayer_tile_buffer_pack_init(&tb, rect, pixel_size, tile_pixel_size, storage->x, storage->y);
+
+	for (ty = 0; ty < storage->ytiles; ty++)
+		for (tx = 0; tx < storage->xtiles; tx++)
+			imalayer_tile_pack(&tb, &tiles[ty * storage->xtiles + tx], tx, ty);
+
+	imalayer_tile_buffer_pack_free(&tb);
+}
+
+/* Only the tiles tagged in "dirty" */
+static void imalayer_tiles_pack_dirty(ImageLayerTile *tiles, ImageLayerStorage *storage, void *rect, size_t pixel_size,
+                                      size_t tile_pixel_size)
+{
+	ImageLayerTileBuffer tb;
+	ImageLayerTile *tile;
+	int tx, ty;
+
+	imalayer_tile_buffer_pack_init(&tb, rect, pixel_size, tile_pixel_size, storage->x, storage->y);
+
+	for (ty = 0; ty < storage->ytiles; ty++) {
+		for (tx = 0; tx < storage->xtiles; tx++) {
+			if (!storage->dirty[ty * storage->xtiles + tx])
+				continue;
+
+			tile = &tiles[ty * storage->xtiles + tx];
+			if (tile->data)
+				MEM_freeN(tile->data);
+			memset(tile, 0, sizeof(*tile));
+
+			imalayer_tile_pack(&tb, tile, tx, ty);
+		}
+	}
+
+	imalayer_tile_buffer_pack_free(&tb);
+}
+
+static void imalayer_tiles_decode(ImageLayerTile *tiles, ImageLayerStorage *storage, void *rect, size_t pixel_size,
+                                  size_t tile_pixel_size)
+{
+	ImageLayerTileBuffer tb;
+	int tx, ty;
+
+	tb.rect = rect;
+	tb.pixel_size = pixel_size;
+	tb.tile_pixel_size = tile_pixel_size;
+	tb.x = storage->x;
+	tb.y = storage->y;
+	tb.buf = MEM_mallocN(IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE * tile_pixel_size, __func__);
+
+	for (ty = 0; ty < storage->ytiles; ty++)
+		for (tx = 0; tx < storage->xtiles; tx++)
+			imalayer_tile_decode(&tb, &tiles[ty * storage->xtiles + tx], tx, ty);
+
+	MEM_freeN(tb.buf);
+}
+
+/* Pixel size of the packed float tiles */
+static size_t imalayer_storage_float_size(const ImageLayerStorage *storage)
+{
+	return (storage->flag & IMA_LAYER_STORAGE_HALF) ? sizeof(unsigned short[4]) : sizeof(float[4]);
+}
+
+ImageLayerStorage *imalayer_storage_pack(ImBuf *ibuf, bool half_float)
+{
+	ImageLayerStorage *storage;
+	int tottile;
+
+	if (ibuf == NULL || (ibuf->rect == NULL && ibuf->rect_float == NULL) || ibuf->x <= 0 || ibuf->y <= 0)
+		return NULL;
+
+	/* decoding allocates RGBA float buffers, others are written as they are */
+	if (ibuf->rect_float && ibuf->channels != 4)
+		return NULL;
+
+	storage = MEM_callocN(sizeof(ImageLayerStorage), "image layer storage");
+	storage->x = ibuf->x;
+	storage->y = ibuf->y;
+	storage->xtiles = (ibuf->x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	storage->ytiles = (ibuf->y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	tottile = storage->xtiles * storage->ytiles;
+
+	if (ibuf->rect) {
+		storage->rect = MEM_callocN(sizeof(ImageLayerTile) * tottile, "image layer tiles");
+		imalayer_tiles_pack(storage->rect, storage, ibuf->rect, sizeof(char[4]), sizeof(char[4]));
+	}
+
+	if (ibuf->rect_float) {
+		if (half_float)
+			storage->flag |= IMA_LAYER_STORAGE_HALF;
+
+		storage->rect_float = MEM_callocN(sizeof(ImageLayerTile) * tottile, "image layer tiles");
+		imalayer_tiles_pack(storage->rect_float, storage, ibuf->rect_float, sizeof(float[4]),
+		                    imalayer_storage_float_size(storage));
+	}
+
+	return storage;
+}
+
+ImageLayerStorage *imalayer_storage_new(int x, int y, bool use_rect, bool use_float, bool half_float)
+{
+	ImageLayerStorage *storage = MEM_callocN(sizeof(ImageLayerStorage), "image layer storage");
+	int tottile;
+
+	storage->x = x;
+	storage->y = y;
+	storage->xtiles = (x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	storage->ytiles = (y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	tottile = storage->xtiles * storage->ytiles;
+
+	if (use_rect)
+		storage->rect = MEM_callocN(sizeof(ImageLayerTile) * tottile, "image layer tiles");
+
+	if (use_float) {
+		if (half_float)
+			storage->flag |= IMA_LAYER_STORAGE_HALF;
+		storage->rect_float = MEM_callocN(sizeof(ImageLayerTile) * tottile, "image layer tiles");
+	}
+
+	return storage;
+}
+
+void imalayer_storage_pack_tile(ImageLayerStorage *storage, bool is_float, int tx, int ty, void *pixels)
+{
+	ImageLayerTile *tile = &(is_float ? storage->rect_float : storage->rect)[ty * storage->xtiles + tx];
+	const int w = min_ii(IMA_LAYER_TILE_SIZE, storage->x - (tx << IMA_LAYER_TILE_BITS));
+	const int h = min_ii(IMA_LAYER_TILE_SIZE, storage->y - (ty << IMA_LAYER_TILE_BITS));
+	ImageLayerTileBuffer tb;
+
+	if (tile->data) {
+		MEM_freeN(tile->data);
+		memset(tile, 0, sizeof(*tile));
+	}
+
+	/* the pixels are a buffer of one tile */
+	if (is_float)
+		imalayer_tile_buffer_pack_init(&tb, pixels, sizeof(float[4]), imalayer_storage_float_size(storage), w, h);
+	else
+		imalayer_tile_buffer_pack_init(&tb, pixels, sizeof(char[4]), sizeof(char[4]), w, h);
+
+	imalayer_tile_pack(&tb, tile, 0, 0);
+
+	imalayer_tile_buffer_pack_free(&tb);
+}
+
+static ImageLayerTile *imalayer_tiles_new_uniform(int tottile, const void *pixel, size_t pixel_size)
+{
+	ImageLayerTile *tiles = MEM_callocN(sizeof(ImageLayerTile) * tottile, "image layer tiles");
+	int a;
+
+	for (a = 0; a < tottile; a++) {
+		tiles[a].flag = IMA_LAYER_TILE_UNIFORM;
+		memcpy(tiles[a].uniform, pixel, pixel_size);
+	}
+
+	return tiles;
+}
+
+ImageLayerStorage *imalayer_storage_new_uniform(int x, int y, const unsigned char rect_pixel[4], const float float_pixel[4])
+{
+	ImageLayerStorage *storage = MEM_callocN(sizeof(ImageLayerStorage), "image layer storage");
+	int tottile;
+
+	storage->x = x;
+	storage->y = y;
+	storage->xtiles = (x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	storage->ytiles = (y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	tottile = storage->xtiles * storage->ytiles;
+
+	if (rect_pixel)
+		storage->rect = imalayer_tiles_new_uniform(tottile, rect_pixel, sizeof(char[4]));
+	if (float_pixel)
+		storage->rect_float = imalayer_tiles_new_uniform(tottile, float_pixel, sizeof(float[4]));
+
+	return storage;
+}
+
+/* Half float tiles are read in the second half of "buf" and converted to
+ * floats in the whole of it */
+static const void *imalayer_storage_tile_pixels_half(const ImageLayerTile *tile, void *buf, int w, int h,
+                                                    int *r_stride)
+{
+	const int totpixel = (tile->flag & IMA_LAYER_TILE_UNIFORM) ? w : w * h;
+	char *half_buf = (char *)buf + (size_t)totpixel * sizeof(unsigned short[4]);
+	const char *halves;
+
+	halves = imalayer_tile_read(tile, half_buf, sizeof(unsigned short[4]), w, h, r_stride);
+
+	if (halves == NULL)
+		return NULL;
+
+	imalayer_half_to_float_v(buf, (const unsigned short *)halves, (size_t)totpixel * 4);
+
+	return buf;
+}
+
+const void *imalayer_storage_tile_pixels(const ImageLayerStorage *storage, bool is_float, int tx, int ty,
+                                         void *buf, int *r_stride)
+{
+	const ImageLayerTile *tiles = is_float ? storage->rect_float : storage->rect;
+	const size_t pixel_size = is_float ? sizeof(float[4]) : sizeof(char[4]);
+	const int w = min_ii(IMA_LAYER_TILE_SIZE, storage->x - (tx << IMA_LAYER_TILE_BITS));
+	const int h = min_ii(IMA_LAYER_TILE_SIZE, storage->y - (ty << IMA_LAYER_TILE_BITS));
+	const ImageLayerTile *tile = &tiles[ty * storage->xtiles + tx];
+	const char *pixels;
+
+	if (is_float && (storage->flag & IMA_LAYER_STORAGE_HALF))
+		pixels = imalayer_storage_tile_pixels_half(tile, buf, w, h, r_stride);
+	else
+		pixels = imalayer_tile_read(tile, buf, pixel_size, w, h, r_stride);
+
+	/* broken tiles read as empty */
+	if (pixels == NULL) {
+		memset(buf, 0, w * pixel_size);
+		*r_stride = 0;
+		pixels = buf;
+	}
+
+	return pixels;
+}
+
+ImageLayerStorage *imalayer_sparse_storage(ImageLayer *layer)
+{
+	ImBuf *ibuf = layer->ibufs.first;
+
+	return (ibuf && layer->storage && !imalayer_ibuf_has_pixels(ibuf)) ? layer->storage : NULL;
+}
+
+static void imalayer_tiles_free(ImageLayerTile *tiles, int tottile)
+{
+	int a;
+
+	for (a = 0; a < tottile; a++) {
+		if (tiles[a].data)
+			MEM_freeN(tiles[a].data);
+	}
+
+	MEM_freeN(tiles);
+}
+
+void imalayer_storage_free(ImageLayerStorage *storage)
+{
+	const int tottile = storage->xtiles * storage->ytiles;
+
+	if (storage->rect)
+		imalayer_tiles_free(storage->rect, tottile);
+	if (storage->rect_float)
+		imalayer_tiles_free(storage->rect_float, tottile);
+	if (storage->dirty)
+		MEM_freeN(storage->dirty);
+
+	MEM_freeN(storage);
+}
+
+static ImageLayerTile *imalayer_tiles_copy(const ImageLayerTile *tiles, int tottile)
+{
+	ImageLayerTile *copy = MEM_dupallocN(tiles);
+	int a;
+
+	for (a = 0; a < tottile; a++) {
+		if (tiles[a].data)
+			copy[a].data = MEM_dupallocN(tiles[a].data);
+	}
+
+	return copy;
+}
+
+ImageLayerStorage *imalayer_storage_copy(const ImageLayerStorage *storage)
+{
+	const int tottile = storage->xtiles * storage->ytiles;
+	ImageLayerStorage *copy = MEM_dupallocN(storage);
+
+	if (storage->rect)
+		copy->rect = imalayer_tiles_copy(storage->rect, tottile);
+	if (storage->rect_float)
+		copy->rect_float = imalayer_tiles_copy(storage->rect_float, tottile);
+	if (storage->dirty)
+		copy->dirty = MEM_dupallocN(storage->dirty);
+
+	return copy;
+}
+
+/* the storage holds the pixels of the layer, apart from its dirty tiles */
+static bool imalayer_storage_matches(ImageLayer *layer, ImBuf *ibuf)
+{
+	ImageLayerStorage *storage = layer->storage;
+
+	return (storage->generation == layer->generation &&
+	        storage->x == ibuf->x && storage->y == ibuf->y &&
+	        (ibuf->rect_float == NULL ||
+	         ((storage->flag & IMA_LAYER_STORAGE_HALF) != 0) == ((layer->flag & IMA_LAYER_HALF_FLOAT) != 0)));
+}
+
+/* the storage still holds the pixels of the layer */
+static bool imalayer_storage_is_clean(ImageLayer *layer, ImBuf *ibuf)
+{
+	return (layer->storage->dirty == NULL && imalayer_storage_matches(layer, ibuf));
+}
+
+/* Packs the dirty tiles again, when the rest of the storage is still good */
+static bool imalayer_storage_update_dirty(ImageLayer *layer, ImBuf *ibuf)
+{
+	ImageLayerStorage *storage = layer->storage;
+
+	if (!imalayer_storage_matches(layer, ibuf) ||
+	    (storage->rect != NULL) != (ibuf->rect != NULL) ||
+	    (storage->rect_float != NULL) != (ibuf->rect_float != NULL))
+	{
+		return false;
+	}
+
+	if (storage->rect)
+		imalayer_tiles_pack_dirty(storage->rect, storage, ibuf->rect, sizeof(char[4]), sizeof(char[4]));
+
+	if (storage->rect_float) {
+		imalayer_tiles_pack_dirty(storage->rect_float, storage, ibuf->rect_float, sizeof(float[4]),
+		                          imalayer_storage_float_size(storage));
+	}
+
+	MEM_freeN(storage->dirty);
+	storage->dirty = NULL;
+
+	return true;
+}
+
+void imalayer_storage_tag_region(ImageLayer *layer, int generation, int x, int y, int w, int h)
+{
+	ImageLayerStorage *storage = layer->storage;
+	ImBuf *ibuf = layer->ibufs.first;
+	int tx, ty, tx_min, ty_min, tx_max, ty_max;
+
+	/* only a storage matching the pixels before the change is kept */
+	if (storage == NULL || ibuf == NULL || !imalayer_ibuf_has_pixels(ibuf) ||
+	    layer->generation == generation || storage->generation != generation ||
+	    storage->x != ibuf->x || storage->y != ibuf->y)
+	{
+		return;
+	}
+
+	storage->generation = layer->generation;
+
+	x = max_ii(x, 0);
+	y = max_ii(y, 0);
+	w = min_ii(x + w, storage->x) - x;
+	h = min_ii(y + h, storage->y) - y;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	if (storage->dirty == NULL)
+		storage->dirty = MEM_callocN(sizeof(char) * storage->xtiles * storage->ytiles, "image layer storage dirty");
+
+	tx_min = x >> IMA_LAYER_TILE_BITS;
+	ty_min = y >> IMA_LAYER_TILE_BITS;
+	tx_max = (x + w - 1) >> IMA_LAYER_TILE_BITS;
+	ty_max = (y + h - 1) >> IMA_LAYER_TILE_BITS;
+
+	for (ty = ty_min; ty <= ty_max; ty++)
+		for (tx = tx_min; tx <= tx_max; tx++)
+			storage->dirty[ty * storage->xtiles + tx] = 1;
+}
+
+ImageLayerStorage *imalayer_storage_ensure(ImageLayer *layer)
+{
+	ImBuf *ibuf = layer->ibufs.first;
+
+	if (ibuf == NULL)
+		return layer->storage;
+
+	/* paged out, or still matching the pixels */
+	if (layer->storage && (!imalayer_ibuf_has_pixels(ibuf) || imalayer_storage_is_clean(layer, ibuf)))
+		return layer->storage;
+
+	/* painted, the tiles under the brush are packed again */
+	if (layer->storage && layer->storage->dirty && imalayer_storage_update_dirty(layer, ibuf))
+		return layer->storage;
+
+	if (layer->storage)
+		imalayer_storage_free(layer->storage);
+
+	layer->storage = imalayer_storage_pack(ibuf, (layer->flag & IMA_LAYER_HALF_FLOAT) != 0);
+	if (layer->storage)
+		layer->storage->generation = layer->generation;
+
+	return layer->storage;
+}
+
+void imalayer_ensure_layer_pixels(ImageLayer *layer)
+{
+	ImageLayerStorage *storage = layer->storage;
+	ImBuf *ibuf = layer->ibufs.first;
+
+	if (storage == NULL || ibuf == NULL || imalayer_ibuf_has_pixels(ibuf))
+		return;
+
+	if (ibuf->x != storage->x || ibuf->y != storage->y) {
+		imalayer_storage_free(storage);
+		layer->storage = NULL;
+		return;
+	}
+
+	if (storage->rect && imb_addrectImBuf(ibuf))
+		imalayer_tiles_decode(storage->rect, storage, ibuf->rect, sizeof(char[4]), sizeof(char[4]));
+
+	if (storage->rect_float && imb_addrectfloatImBuf(ibuf)) {
+		imalayer_tiles_decode(storage->rect_float, storage, ibuf->rect_float, sizeof(float[4]),
+		                      imalayer_storage_float_size(storage));
+	}
+
+	/* the storage is kept as a clean copy, until the layer is edited. The
+	 * composite read the same pixels from it, it stays valid */
+	storage->generation = layer->generation;
+}
+
+ImBuf *imalayer_get_ibuf_untransformed(ImageLayer *layer)
+{
+	/* reading leaves the storage a clean copy, edits tag the layer */
+	imalayer_ensure_layer_pixels(layer);
+
+	return layer->ibufs.first;
+}
+
+ImBuf *imalayer_get_ibuf(ImageLayer *layer)
+{
+	/* the pixels are edited as they're shown, a pending transform is
+	 * resampled into them once */
+	imalayer_transform_apply(layer);
+	imalayer_ensure_layer_pixels(layer);
+
+	/* the caller may change the pixels or replace the buffer without tagging
+	 * the layer, don't trust the storage as a copy of them anymore */
+	if (layer->storage && layer->storage->generation == layer->generation)
+		layer->storage->generation = layer->generation - 1;
+
+	return layer->ibufs.first;
+}
+
+bool imalayer_make_sparse(Image *ima, ImageLayer *layer)
+{
+	ImBuf *ibuf = layer ? layer->ibufs.first : NULL;
+	ImageLayerStorage *storage;
+	int a, tottile, totdense = 0;
+
+	if (ibuf == NULL || !imalayer_ibuf_has_pixels(ibuf) || imalayer_mask_is_edited(layer))
+		return false;
+
+	storage = imalayer_storage_ensure(layer);
+	if (storage == NULL)
+		return false;
+
+	tottile = storage->xtiles * storage->ytiles;
+	for (a = 0; a < tottile; a++) {
+		if ((storage->rect && !(storage->rect[a].flag & IMA_LAYER_TILE_UNIFORM)) ||
+		    (storage->rect_float && !(storage->rect_float[a].flag & IMA_LAYER_TILE_UNIFORM)))
+		{
+			totdense++;
+		}
+	}
+
+	/* mostly painted, blending straight from the pixels is cheaper */
+	if (totdense > tottile / IMA_LAYER_SPARSE_DENSE_FRACTION)
+		return false;
+
+	imb_freerectImBuf(ibuf);
+	imb_freerectfloatImBuf(ibuf);
+
+	/* the composite reads the half floats from now on */
+	if (storage->flag & IMA_LAYER_STORAGE_HALF)
+		imalayer_cache_tag_dirty(ima);
+
+	return true;
+}
+
+void imalayer_evict_pixels(Image *ima)
+{
+	ImageLayer *layer;
+	ImBuf *ibuf;
+	bool evicted = false;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		ibuf = layer->ibufs.first;
+
+		/* still acquired, a reader holds on to the pixels */
+		if (ibuf && ibuf->refcounter > 0)
+			continue;
+
+		if (ibuf && imalayer_ibuf_has_pixels(ibuf) && layer->storage && imalayer_storage_is_clean(layer, ibuf)) {
+			imb_freerectImBuf(ibuf);
+			imb_freerectfloatImBuf(ibuf);
+			evicted = true;
+		}
+	}
+
+	if (evicted)
+		imalayer_cache_tag_dirty(ima);
+}
+
+void imalayer_storage_compact(ImageLayer *layer)
+{
+	ImBuf *ibuf = layer->ibufs.first;
+	ImageLayerStorage *storage = layer->storage;
+
+	if (ibuf == NULL || !(layer->flag & IMA_LAYER_HALF_FLOAT))
+		return;
+
+	/* float tiles of a full float layer, packed again */
+	if (storage && storage->rect_float && !(storage->flag & IMA_LAYER_STORAGE_HALF))
+		imalayer_ensure_layer_pixels(layer);
+
+	if (ibuf->rect_float == NULL)
+		return;
+
+	/* the pixels change to what the half floats hold */
+	if (layer->storage == NULL || !imalayer_storage_is_clean(layer, ibuf))
+		imalayer_tag_dirty(layer);
+
+	if (imalayer_storage_ensure(layer)) {
+		imb_freerectImBuf(ibuf);
+		imb_freerectfloatImBuf(ibuf);
+	}
+}
+
+void imalayer_storage_compact_inactive(Image *ima)
+{
+	ImageLayer *layer;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (!(layer->select & IMA_LAYER_SEL_CURRENT)) {
+			imalayer_storage_compact(layer);
+			imalayer_make_sparse(ima, layer);
+		}
+	}
+}
+
+void imalayer_set_half_float(Image *ima, ImageLayer *layer, bool half_float)
+{
+	if (half_float == ((layer->flag & IMA_LAYER_HALF_FLOAT) != 0))
+		return;
+
+	if (half_float) {
+		layer->flag |= IMA_LAYER_HALF_FLOAT;
+
+		/* the active layer is compacted once another one is */
+		if (!(layer->select & IMA_LAYER_SEL_CURRENT))
+			imalayer_storage_compact(layer);
+	}
+	else {
+		/* the tiles keep their precision until the layer is packed again */
+		layer->flag &= ~IMA_LAYER_HALF_FLOAT;
+	}
+
+	imalayer_cache_tag_dirty(ima);
+}
@@ -0,0 +1,359 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_thumb.c
+ *  \ingroup bke
+ *
+ * Thumbnails of layers for the layer list. The main thread only takes a
+ * small source of the pixels: a mip level that's up to date, a strided copy
+ * of the layer or, for sparse layers, a copy of their compressed tiles. The
+ * thumbnails are averaged from it in a job, see ED_image_layer_icon_get().
+ */
+
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_math_base.h"
+#include "BLI_math_color.h"
+#include "BLI_math_vector.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_layer.h"
+
+#include "IMB_imbuf.h"
+
+/* source pixels per thumbnail pixel along the longest side */
+#define IMA_LAYER_THUMB_OVERSAMPLE	2
+
+struct ImageLayerThumbSource {
+	struct ImBuf *ibuf;				/* strided copy of the layer or a copy of a mip level */
+	struct ImageLayerStorage *storage;	/* copy of the tiles of a sparse layer */
+	int size;						/* of the largest thumbnail the source is for */
+};
+
+/* One thumbnail being averaged */
+typedef struct ImageLayerThumbAccum {
+	float (*sum)[4];	/* premultiplied */
+	int *count;
+	int size;
+	int x, y;			/* source size */
+	int width, height;	/* of the thumbnail, centered in size x size */
+	int ofs_x, ofs_y;
+} ImageLayerThumbAccum;
+
+static int imalayer_thumb_step(int x, int y, int size)
+{
+	return max_ii(1, max_ii(x, y) / (size * IMA_LAYER_THUMB_OVERSAMPLE));
+}
+
+/* The pixel in the middle of every step x step block */
+static ImBuf *imalayer_thumb_sample(ImBuf *ibuf, int step)
+{
+	const bool is_float = (ibuf->rect_float != NULL);
+	ImBuf *result;
+	int x, y, sx, sy;
+
+	if (ibuf->rect == NULL && ibuf->rect_float == NULL)
+		return NULL;
+
+	result = IMB_allocImBuf(max_ii(ibuf->x / step, 1), max_ii(ibuf->y / step, 1), 32,
+	                        is_float ? IB_rectfloat : IB_rect);
+
+	for (y = 0; y < result->y; y++) {
+		sy = min_ii(y * step + step / 2, ibuf->y - 1);
+
+		for (x = 0; x < result->x; x++) {
+			sx = min_ii(x * step + step / 2, ibuf->x - 1);
+
+			if (is_float)
+				copy_v4_v4(result->rect_float + ((size_t)y * result->x + x) * 4,
+				           ibuf->rect_float + ((size_t)sy * ibuf->x + sx) * 4);
+			else
+				result->rect[(size_t)y * result->x + x] = ibuf->rect[(size_t)sy * ibuf->x + sx];
+		}
+	}
+
+	return result;
+}
+
+/* Same for a transformed layer, sampled through its transform */
+static ImBuf *imalayer_thumb_sample_transform(ImageLayer *layer, ImBuf *ibuf, int width, int height, int step)
+{
+	const bool is_float = (ibuf->rect_float != NULL);
+	ImBuf *result;
+	int x, y;
+
+	if (ibuf->rect == NULL && ibuf->rect_float == NULL)
+		return NULL;
+
+	result = IMB_allocImBuf(max_ii(width / step, 1), max_ii(height / step, 1), 32,
+	                        is_float ? IB_rectfloat : IB_rect);
+
+	for (y = 0; y < result->y; y++) {
+		for (x = 0; x < result->x; x++) {
+			void *pixel = is_float ? (void *)(result->rect_float + ((size_t)y * result->x + x) * 4) :
+			                         (void *)(result->rect + (size_t)y * result->x + x);
+
+			imalayer_transform_sample_row(layer, ibuf, is_float, min_ii(x * step + step / 2, width - 1),
+			                              min_ii(y * step + step / 2, height - 1), 1, pixel);
+		}
+	}
+
+	return result;
+}
+
+ImageLayerThumbSource *imalayer_thumb_source_new(ImageLayer *layer, int size)
+{
+	ImageLayerThumbSource *source;
+	ImageLayerStorage *storage;
+	ImBuf *ibuf = layer->ibufs.first, *mip = NULL;
+	int width, height, step, level;
+
+	if (ibuf == NULL || !imalayer_has_pixels(layer))
+		return NULL;
+
+	source = MEM_callocN(sizeof(ImageLayerThumbSource), "ImageLayerThumbSource");
+	source->size = size;
+
+	imalayer_transform_get_size(layer, &width, &height);
+	step = imalayer_thumb_step(width, height, size);
+
+	if (imalayer_transform_is_set(layer)) {
+		ibuf = imalayer_get_ibuf_untransformed(layer);
+		if (ibuf)
+			source->ibuf = imalayer_thumb_sample_transform(layer, ibuf, width, height, step);
+	}
+	else if ((storage = imalayer_sparse_storage(layer))) {
+		/* decoding all tiles is the slow part, it's left to the job */
+		source->storage = imalayer_storage_copy(storage);
+	}
+	else {
+		/* a level made for drawing zoomed out is as good as the strided copy */
+		for (level = IMA_LAYER_MIP_MAX; level > 0 && mip == NULL; level--) {
+			if ((1 << level) <= step)
+				mip = imalayer_mip_peek(layer, level);
+		}
+
+		source->ibuf = mip ? IMB_dupImBuf(mip) : imalayer_thumb_sample(ibuf, step);
+	}
+
+	if (source->ibuf == NULL && source->storage == NULL) {
+		MEM_freeN(source);
+		return NULL;
+	}
+
+	return source;
+}
+
+void imalayer_thumb_source_free(ImageLayerThumbSource *source)
+{
+	if (source == NULL)
+		return;
+
+	if (source->ibuf)
+		IMB_freeImBuf(source->ibuf);
+	if (source->storage)
+		imalayer_storage_free(source->storage);
+
+	MEM_freeN(source);
+}
+
+static void imalayer_thumb_accum_init(ImageLayerThumbAccum *acc, int size, int x, int y)
+{
+	/* the thumbnail fills the longest side, small layers repeat their pixels */
+	const int fit = size;
+
+	acc->size = size;
+	acc->x = x;
+	acc->y = y;
+	acc->width = max_ii(1, (int)(((long long)x * fit) / max_ii(x, y)));
+	acc->height = max_ii(1, (int)(((long long)y * fit) / max_ii(x, y)));
+	acc->ofs_x = (size - acc->width) / 2;
+	acc->ofs_y = (size - acc->height) / 2;
+	acc->sum = MEM_callocN(sizeof(float[4]) * size * size, "ImageLayerThumbAccum sum");
+	acc->count = MEM_callocN(sizeof(int) * size * size, "ImageLayerThumbAccum count");
+}
+
+static void imalayer_thumb_accum_free(ImageLayerThumbAccum *acc)
+{
+	MEM_freeN(acc->sum);
+	MEM_freeN(acc->count);
+}
+
+/* Adds every step'th pixel of "row", pixels x..x+len of row y of the source */
+static void imalayer_thumb_accum_row(ImageLayerThumbAccum *acc, const void *row, bool is_float,
+                                     int x, int y, int len, int step)
+{
+	const int ty = acc->ofs_y + (int)(((long long)y * acc->height) / acc->y);
+	float *sum;
+	int i, tx;
+
+	for (i = (step - x % step) % step; i < len; i += step) {
+		tx = acc->ofs_x + (int)(((long long)(x + i) * acc->width) / acc->x);
+		sum = acc->sum[ty * acc->size + tx];
+
+		if (is_float) {
+			add_v4_v4(sum, (const float *)row + (size_t)i * 4);
+		}
+		else {
+			const unsigned char *cp = (const unsigned char *)row + (size_t)i * 4;
+			const float alpha = cp[3] * (1.0f / 255.0f);
+
+			sum[0] += cp[0] * (1.0f / 255.0f) * alpha;
+			sum[1] += cp[1] * (1.0f / 255.0f) * alpha;
+			sum[2] += cp[2] * (1.0f / 255.0f) * alpha;
+			sum[3] += alpha;
+		}
+
+		acc->count[ty * acc->size + tx]++;
+	}
+}
+
+/* Averages into premultiplied display bytes, floats are scene linear */
+static void imalayer_thumb_accum_finish(ImageLayerThumbAccum *acc, bool is_float, unsigned int *rect)
+{
+	float col[4];
+	int x, y, a;
+
+	memset(rect, 0, sizeof(unsigned int) * acc->size * acc->size);
+
+	for (y = acc->ofs_y; y < acc->ofs_y + acc->height; y++) {
+		bool has_samples = false;
+
+		for (x = acc->ofs_x; x < acc->ofs_x + acc->width; x++) {
+			a = y * acc->size + x;
+
+			/* between the pixels of a smaller source, the previous one repeats */
+			if (acc->count[a] == 0) {
+				if (x > acc->ofs_x)
+					rect[a] = rect[a - 1];
+				continue;
+			}
+
+			mul_v4_v4fl(col, acc->sum[a], 1.0f / (float)acc->count[a]);
+
+			if (is_float && col[3] > 0.0f) {
+				premul_to_straight_v4(col);
+				linearrgb_to_srgb_v3_v3(col, col);
+				CLAMP(col[3], 0.0f, 1.0f);
+				straight_to_premul_v4(col);
+			}
+
+			rgba_float_to_uchar((unsigned char *)&rect[a], col);
+			has_samples = true;
+		}
+
+		if (!has_samples && y > acc->ofs_y) {
+			memcpy(rect + y * acc->size + acc->ofs_x, rect + (y - 1) * acc->size + acc->ofs_x,
+			       sizeof(unsigned int) * acc->width);
+		}
+	}
+}
+
+static bool imalayer_thumb_render_storage(const ImageLayerThumbSource *source, ImageLayerThumbAccum *acc,
+                                          int totacc, short *stop)
+{
+	const ImageLayerStorage *storage = source->storage;
+	const bool is_float = (storage->rect_float != NULL);
+	const size_t pixel_size = is_float ? sizeof(float[4]) : sizeof(char[4]);
+	const int step = imalayer_thumb_step(storage->x, storage->y, source->size);
+	void *buf = MEM_mallocN(sizeof(float[4]) * IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, __func__);
+	const char *pixels;
+	int tx, ty, ox, oy, w, h, r, stride, a;
+
+	for (ty = 0; ty < storage->ytiles; ty++) {
+		for (tx = 0; tx < storage->xtiles; tx++) {
+			if (*stop) {
+				MEM_freeN(buf);
+				return false;
+			}
+
+			ox = tx << IMA_LAYER_TILE_BITS;
+			oy = ty << IMA_LAYER_TILE_BITS;
+			w = min_ii(IMA_LAYER_TILE_SIZE, storage->x - ox);
+			h = min_ii(IMA_LAYER_TILE_SIZE, storage->y - oy);
+
+			/* tiles without a sampled row aren't decoded */
+			r = (step - oy % step) % step;
+			if (r >= h || (step - ox % step) % step >= w)
+				continue;
+
+			pixels = imalayer_storage_tile_pixels(storage, is_float, tx, ty, buf, &stride);
+
+			for (; r < h; r += step) {
+				for (a = 0; a < totacc; a++)
+					imalayer_thumb_accum_row(&acc[a], pixels + (size_t)r * stride * pixel_size, is_float,
+					                         ox, oy + r, w, step);
+			}
+		}
+	}
+
+	MEM_freeN(buf);
+
+	return true;
+}
+
+bool imalayer_thumb_render(const ImageLayerThumbSource *source, int totsize, const int sizes[],
+                           unsigned int *rects[], short *stop)
+{
+	ImageLayerThumbAccum *acc = MEM_mallocN(sizeof(ImageLayerThumbAccum) * totsize, __func__);
+	const ImBuf *ibuf = source->ibuf;
+	const bool is_float = ibuf ? (ibuf->rect_float != NULL) : (source->storage->rect_float != NULL);
+	const int x = ibuf ? ibuf->x : source->storage->x;
+	const int y = ibuf ? ibuf->y : source->storage->y;
+	bool done = true;
+	int a, row;
+
+	for (a = 0; a < totsize; a++)
+		imalayer_thumb_accum_init(&acc[a], sizes[a], x, y);
+
+	if (ibuf) {
+		/* the source is small already, every pixel is used */
+		for (row = 0; row < ibuf->y && !*stop; row++) {
+			for (a = 0; a < totsize; a++) {
+				if (is_float)
+					imalayer_thumb_accum_row(&acc[a], ibuf->rect_float + (size_t)row * ibuf->x * 4, true,
+					                         0, row, ibuf->x, 1);
+				else
+					imalayer_thumb_accum_row(&acc[a], ibuf->rect + (size_t)row * ibuf->x, false,
+					                         0, row, ibuf->x, 1);
+			}
+		}
+
+		done = !*stop;
+	}
+	else {
+		done = imalayer_thumb_render_storage(source, acc, totsize, stop);
+	}
+
+	for (a = 0; a < totsize; a++) {
+		if (done)
+			imalayer_thumb_accum_finish(&acc[a], is_float, rects[a]);
+		imalayer_thumb_accum_free(&acc[a]);
+	}
+
+	MEM_freeN(acc);
+
+	return done;
+}
@@ -0,0 +1,328 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/blenkernel/intern/layer_transform.c
+ *  \ingroup bke
+ *
+ * Non destructive transforms of image layers. Rotating, offsetting, scaling,
+ * resizing or flipping a layer only composes an affine transform into
+ * ImageLayer.transform, the pixels stay as they are. The composite samples
+ * them through it, row by row of the bands it blends, so a transform costs
+ * nothing until it's shown and only the shown rows are resampled.
+ *
+ * Operators in a row are composed, the pixels are resampled once from the
+ * untouched ones when the layer gets edited, see imalayer_get_ibuf().
+ *
+ * The transform maps the center of a pixel of the transformed layer to
+ * a position in the untransformed pixels, pixel i covering i..i+1, the
+ * way IMB_transform() takes it.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BLI_listbase.h"
+#include "BLI_math_base.h"
+#include "BLI_math_color.h"
+#include "BLI_math_vector.h"
+#include "BLI_utildefines.h"
+
+#include "BKE_layer.h"
+
+#include "IMB_imbuf.h"
+
+/* composed matrices this close to whole numbers are snapped, so turning
+ * forth and back ends up where it started */
+#define IMA_LAYER_TRANSFORM_EPSILON		1e-5f
+
+bool imalayer_transform_is_set(const ImageLayer *layer)
+{
+	return (layer->transform_flag & IMA_LAYER_TRANSFORM) != 0;
+}
+
+void imalayer_transform_get_size(const ImageLayer *layer, int *r_width, int *r_height)
+{
+	const ImBuf *ibuf = layer->ibufs.first;
+
+	if (imalayer_transform_is_set(layer)) {
+		*r_width = layer->transform_x;
+		*r_height = layer->transform_y;
+	}
+	else if (ibuf) {
+		*r_width = ibuf->x;
+		*r_height = ibuf->y;
+	}
+	else {
+		*r_width = *r_height = 0;
+	}
+}
+
+static float imalayer_transform_snap(float value, float epsilon)
+{
+	const float value_round = floorf(value + 0.5f);
+
+	return (fabsf(value - value_round) < epsilon) ? value_round : value;
+}
+
+/* Pending transforms a new one can't be composed with are applied first:
+ * wrapping only repeats the untransformed pixels */
+static void imalayer_transform_prepare(ImageLayer *layer, bool wrap)
+{
+	if (!imalayer_transform_is_set(layer))
+		return;
+
+	if (wrap != ((layer->transform_flag & IMA_LAYER_TRANSFORM_WRAP) != 0))
+		imalayer_transform_apply(layer);
+}
+
+/* Composes "mat", mapping the new transformed layer to the current one, into
+ * the transform of "layer", which then has width x height pixels. "col"
+ * replaces the color outside the pixels when it's given */
+static void imalayer_transform_compose(ImageLayer *layer, float mat[2][3], int width, int height, short filter,
+                                       const float col[4], short flag)
+{
+	const ImBuf *ibuf = layer->ibufs.first;
+	float cur[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+	int r;
+
+	/* the mask covers the layer as it's shown, it follows it right away */
+	imalayer_mask_transform(layer, mat, width, height, filter, (flag & IMA_LAYER_TRANSFORM_WRAP) != 0);
+
+	if (imalayer_transform_is_set(layer)) {
+		memcpy(cur, layer->transform, sizeof(cur));
+		filter = max_ii(filter, layer->transform_filter);
+	}
+	else {
+		zero_v4(layer->transform_color);
+	}
+
+	for (r = 0; r < 2; r++) {
+		layer->transform[r][0] = cur[r][0] * mat[0][0] + cur[r][1] * mat[1][0];
+		layer->transform[r][1] = cur[r][0] * mat[0][1] + cur[r][1] * mat[1][1];
+		layer->transform[r][2] = cur[r][0] * mat[0][2] + cur[r][1] * mat[1][2] + cur[r][2];
+
+		layer->transform[r][0] = imalayer_transform_snap(layer->transform[r][0], IMA_LAYER_TRANSFORM_EPSILON);
+		layer->transform[r][1] = imalayer_transform_snap(layer->transform[r][1], IMA_LAYER_TRANSFORM_EPSILON);
+		layer->transform[r][2] = imalayer_transform_snap(layer->transform[r][2], IMA_LAYER_TRANSFORM_EPSILON * 100.0f);
+	}
+
+	layer->transform_x = max_ii(width, 1);
+	layer->transform_y = max_ii(height, 1);
+	layer->transform_filter = filter;
+	layer->transform_flag = IMA_LAYER_TRANSFORM | flag;
+
+	if (col)
+		copy_v4_v4(layer->transform_color, col);
+
+	/* back where it started, e.g. rotated forth and back */
+	if (ibuf && layer->transform_x == ibuf->x && layer->transform_y == ibuf->y &&
+	    layer->transform[0][0] == 1.0f && layer->transform[0][1] == 0.0f && layer->transform[0][2] == 0.0f &&
+	    layer->transform[1][0] == 0.0f && layer->transform[1][1] == 1.0f && layer->transform[1][2] == 0.0f)
+	{
+		layer->transform_flag = 0;
+		layer->transform_filter = IMA_LAYER_FILTER_NEAREST;
+	}
+}
+
+/* "angle" turns the layer the way IMB_rotation() does. With "lock" it
+ * rotates around the center and keeps its size, otherwise it grows to
+ * hold the whole rotated layer */
+void imalayer_transform_rotate(ImageLayer *layer, float angle, bool lock, short filter, const float col[4])
+{
+	float mat[2][3];
+	int w, h, width, height;
+
+	imalayer_transform_prepare(layer, false);
+	imalayer_transform_get_size(layer, &w, &h);
+
+	IMB_transform_rotation_matrix(w, h, angle, lock, mat, &width, &height);
+
+	imalayer_transform_compose(layer, mat, width, height, filter, col, 0);
+}
+
+/* Moves the layer like IMB_offset(), "col" is used when it doesn't wrap */
+void imalayer_transform_offset(ImageLayer *layer, int x, int y, bool half, bool wrap, const float col[4])
+{
+	float mat[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+	int w, h;
+
+	imalayer_transform_prepare(layer, wrap);
+	imalayer_transform_get_size(layer, &w, &h);
+
+	if (half) {
+		x = w / 2;
+		y = h / 2;
+	}
+
+	mat[0][2] = -x;
+	mat[1][2] = -y;
+
+	imalayer_transform_compose(layer, mat, w, h, IMA_LAYER_FILTER_NEAREST, wrap ? NULL : col,
+	                           wrap ? IMA_LAYER_TRANSFORM_WRAP : 0);
+}
+
+/* Stretches the layer to width x height, like IMB_scaleImBuf() */
+void imalayer_transform_scale(ImageLayer *layer, int width, int height)
+{
+	float mat[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+	int w, h;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	imalayer_transform_prepare(layer, false);
+	imalayer_transform_get_size(layer, &w, &h);
+
+	mat[0][0] = (float)w / width;
+	mat[1][1] = (float)h / height;
+
+	imalayer_transform_compose(layer, mat, width, height, IMA_LAYER_FILTER_BILINEAR, NULL, 0);
+}
+
+/* Changes the canvas of the layer like IMB_size(), the layer is put at
+ * off_x, off_y or in the middle */
+void imalayer_transform_size(ImageLayer *layer, int width, int height, int off_x, int off_y, bool centre,
+                             const float col[4])
+{
+	float mat[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+	int w, h;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	imalayer_transform_prepare(layer, false);
+	imalayer_transform_get_size(layer, &w, &h);
+
+	if (centre) {
+		off_x = (width - w) / 2;
+		off_y = (height - h) / 2;
+	}
+
+	mat[0][2] = -off_x;
+	mat[1][2] = -off_y;
+
+	imalayer_transform_compose(layer, mat, width, height, IMA_LAYER_FILTER_NEAREST, col, 0);
+}
+
+void imalayer_transform_flip(ImageLayer *layer, bool flip_x, bool flip_y)
+{
+	float mat[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+	int w, h;
+
+	imalayer_transform_prepare(layer, false);
+	imalayer_transform_get_size(layer, &w, &h);
+
+	if (flip_x) {
+		mat[0][0] = -1.0f;
+		mat[0][2] = w;
+	}
+
+	if (flip_y) {
+		mat[1][1] = -1.0f;
+		mat[1][2] = h;
+	}
+
+	imalayer_transform_compose(layer, mat, w, h, IMA_LAYER_FILTER_NEAREST, NULL, 0);
+}
+
+/* The layer filters are the IMB_FILTER_ ones */
+void imalayer_transform_sample_row(const ImageLayer *layer, const ImBuf *ibuf, bool is_float,
+                                   int x, int y, int len, void *r_row)
+{
+	const int extend = (layer->transform_flag & IMA_LAYER_TRANSFORM_WRAP) ? IMB_TRANSFORM_WRAP : IMB_TRANSFORM_FILL;
+	unsigned char col_byte[4];
+	const void *col;
+
+	if (is_float) {
+		col = layer->transform_color;
+	}
+	else {
+		rgba_float_to_uchar(col_byte, layer->transform_color);
+		col = col_byte;
+	}
+
+	IMB_transform_sample_row(ibuf, is_float, layer->transform, layer->transform_filter, extend, col,
+	                         x, y, len, r_row);
+}
+
+ImBuf *imalayer_transform_bake(const ImageLayer *layer, const ImBuf *ibuf)
+{
+	ImBuf *result;
+	int flags = 0;
+
+	if (ibuf->rect)
+		flags |= IB_rect;
+	if (ibuf->rect_float)
+		flags |= IB_rectfloat;
+
+	result = IMB_allocImBuf(layer->transform_x, layer->transform_y, ibuf->planes, flags);
+
+	if (result == NULL)
+		return NULL;
+
+	result->ftype = ibuf->ftype;
+	result->rect_colorspace = ibuf->rect_colorspace;
+	result->float_colorspace = ibuf->float_colorspace;
+
+	IMB_transform(result, ibuf, layer->transform, layer->transform_filter,
+	              (layer->transform_flag & IMA_LAYER_TRANSFORM_WRAP) ? IMB_TRANSFORM_WRAP : IMB_TRANSFORM_FILL,
+	              layer->transform_color);
+
+	return result;
+}
+
+void imalayer_transform_apply(ImageLayer *layer)
+{
+	ImBuf *ibuf, *result;
+
+	if (!imalayer_transform_is_set(layer))
+		return;
+
+	ibuf = imalayer_get_ibuf_untransformed(layer);
+
+	if (ibuf == NULL || !(ibuf->rect || ibuf->rect_float)) {
+		layer->transform_flag = 0;
+		return;
+	}
+
+	/* kept pending when there's no memory for the result */
+	result = imalayer_transform_bake(layer, ibuf);
+	if (result == NULL)
+		return;
+
+	BLI_remlink(&layer->ibufs, ibuf);
+
+	if (ibuf->userdata) {
+		MEM_freeN(ibuf->userdata);
+		ibuf->userdata = NULL;
+	}
+	IMB_freeImBuf(ibuf);
+
+	BLI_addhead(&layer->ibufs, result);
+
+	layer->transform_flag = 0;
+	layer->transform_filter = IMA_LAYER_FILTER_NEAREST;
+	imalayer_tag_dirty(layer);
+}
@@ -26,6 +26,8 @@
  */
 
 int BLI_cpu_support_sse2(void);
+int BLI_cpu_support_sse41(void);
+int BLI_cpu_support_avx2(void);
 
 #endif
 
@@ -25,6 +25,14 @@
 
 #include "BLI_cpu.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <cpuid.h>
+#  define CPU_HAS_CPUID
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h>
+#  define CPU_HAS_CPUID
+#endif
+
 int BLI_cpu_support_sse2(void)
 {
 #if defined(__x86_64__) || defined(_M_X64)
@@ -57,3 +65,68 @@ int BLI_cpu_support_sse2(void)
 	return 0;
 }
 
+
+#ifdef CPU_HAS_CPUID
+static void cpu_cpuid(unsigned int leaf, unsigned int subleaf, unsigned int r[4])
+{
+#ifdef _MSC_VER
+	int data[4];
+	__cpuidex(data, (int)leaf, (int)subleaf);
+	r[0] = data[0]; r[1] = data[1]; r[2] = data[2]; r[3] = data[3];
+#else
+	if (leaf > __get_cpuid_max(leaf & 0x80000000, 0)) {
+		r[0] = r[1] = r[2] = r[3] = 0;
+		return;
+	}
+	__cpuid_count(leaf, subleaf, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+/* the OS saves the YMM registers on context switches, needed for any AVX code */
+static int cpu_os_support_avx(void)
+{
+	unsigned int r[4], xcr0;
+
+	cpu_cpuid(1, 0, r);
+	/* OSXSAVE and AVX */
+	if ((r[2] & 0x18000000) != 0x18000000)
+		return 0;
+
+#ifdef _MSC_VER
+	xcr0 = (unsigned int)_xgetbv(0);
+#else
+	{
+		unsigned int edx;
+		/* xgetbv, spelled out for assemblers that don't know it */
+		__asm__ __volatile__(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0), "=d" (edx) : "c" (0));
+		(void)edx;
+	}
+#endif
+
+	return (xcr0 & 0x6) == 0x6;
+}
+#endif
+
+int BLI_cpu_support_sse41(void)
+{
+#ifdef CPU_HAS_CPUID
+	unsigned int r[4];
+	cpu_cpuid(1, 0, r);
+	return (r[2] & 0x00080000) != 0;
+#else
+	return 0;
+#endif
+}
+
+int BLI_cpu_support_avx2(void)
+{
+#ifdef CPU_HAS_CPUID
+	unsigned int r[4];
+	if (!cpu_os_support_avx())
+		return 0;
+	cpu_cpuid(7, 0, r);
+	return (r[1] & 0x00000020) != 0;
+#else
+	return 0;
+#endif
+}
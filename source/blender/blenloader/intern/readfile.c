@@ -132,6 +132,7 @@
 #include "BKE_group.h"
 #include "BKE_image.h"
 #include "BKE_lattice.h"
+#include "BKE_layer.h"
 #include "BKE_library.h" // for which_libbase
 #include "BKE_idcode.h"
 #include "BKE_idprop.h"
@@ -3302,6 +3303,60 @@ static void link_ibuf_list(FileData *fd, ListBase *lb)
 	lb->last = prev;
 }
 
+static ImageLayerTile *direct_link_imalayer_tiles(FileData *fd, ImageLayerTile *tiles, int tottile)
+{
+	int a;
+
+	tiles = newdataadr(fd, tiles);
+	if (tiles) {
+		for (a = 0; a < tottile; a++)
+			tiles[a].data = newdataadr(fd, tiles[a].data);
+	}
+
+	return tiles;
+}
+
+static void direct_link_imalayer_storage(FileData *fd, ImageLayerStorage *storage)
+{
+	const int tottile = storage->xtiles * storage->ytiles;
+
+	storage->rect = direct_link_imalayer_tiles(fd, storage->rect, tottile);
+	storage->rect_float = direct_link_imalayer_tiles(fd, storage->rect_float, tottile);
+	storage->dirty = NULL;
+}
+
+static void direct_link_imalayer_mask(FileData *fd, ImageLayerMask *mask)
+{
+	const int tottile = mask->xtiles * mask->ytiles;
+	int a;
+
+	mask->ibuf = NULL;
+	mask->tiles = newdataadr(fd, mask->tiles);
+
+	if (mask->tiles == NULL) {
+		mask->xtiles = mask->ytiles = 0;
+		return;
+	}
+
+	for (a = 0; a < tottile; a++) {
+		mask->tiles[a].data = newdataadr(fd, mask->tiles[a].data);
+
+		/* lost tiles show the layer */
+		if (mask->tiles[a].data == NULL && !(mask->tiles[a].flag & IMA_LAYER_TILE_UNIFORM)) {
+			mask->tiles[a].flag = IMA_LAYER_TILE_UNIFORM;
+			mask->tiles[a].uniform = (char)255;
+		}
+	}
+}
+
+static void direct_link_imalayer_adjustment(FileData *fd, ImageLayerAdjustment *adjust)
+{
+	adjust->lut = NULL;
+	adjust->curve = newdataadr(fd, adjust->curve);
+	if (adjust->curve)
+		direct_link_curvemapping(fd, adjust->curve);
+}
+
 static void direct_link_image(FileData *fd, Image *ima)
 {
 	ImageLayer *iml;
@@ -3338,9 +3393,34 @@ static void direct_link_image(FileData *fd, Image *ima)
 	ima->packedfile = direct_link_packedfile(fd, ima->packedfile);
 	//ima->colorspace_settings = newdataadr(fd, &ima->colorspace_settings);
 	link_list(fd, &ima->imlayers);
+	ima->layer_cache = NULL;
+	ima->preview_ibuf = NULL;
+	ima->preview_scale = 0.0f;
 
-	for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next)
+	for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next) {
 		link_list(fd, &iml->ibufs);
+		iml->preview_ibuf = NULL;
+		iml->group_cache = NULL;
+		iml->mip = NULL;
+		iml->preview = NULL;
+		iml->icon_id = 0;
+		iml->thumb_generation = 0;
+
+		/* pixels stay compressed until the image is used, see imalayer_get_ibuf() */
+		iml->storage = newdataadr(fd, iml->storage);
+		if (iml->storage)
+			direct_link_imalayer_storage(fd, iml->storage);
+
+		iml->mask = newdataadr(fd, iml->mask);
+		if (iml->mask)
+			direct_link_imalayer_mask(fd, iml->mask);
+
+		iml->adjustment = newdataadr(fd, iml->adjustment);
+		if (iml->adjustment)
+			direct_link_imalayer_adjustment(fd, iml->adjustment);
+
+		imalayer_tag_loaded(iml);
+	}
 
 	for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next) {
 		for (ibuf = (ImBuf *)iml->ibufs.first; ibuf; ibuf = ibuf->next) {
@@ -158,6 +158,7 @@
 #include "BKE_constraint.h"
 #include "BKE_global.h" // for G
 #include "BKE_idprop.h"
+#include "BKE_layer.h"
 #include "BKE_library.h" // for  set_listbasepointers
 #include "BKE_main.h"
 #include "BKE_node.h"
@@ -1971,6 +1972,49 @@ static void write_previews(WriteData *wd, PreviewImage *prv)
 	}
 }
 
+static void write_imalayer_tiles(WriteData *wd, ImageLayerTile *tiles, int tottile)
+{
+	int a;
+
+	writestruct(wd, DATA, "ImageLayerTile", tottile, tiles);
+
+	for (a = 0; a < tottile; a++)
+		writedata(wd, DATA, tiles[a].size, tiles[a].data);
+}
+
+static void write_imalayer_storage(WriteData *wd, ImageLayerStorage *storage)
+{
+	const int tottile = storage->xtiles * storage->ytiles;
+
+	writestruct(wd, DATA, "ImageLayerStorage", 1, storage);
+
+	if (storage->rect)
+		write_imalayer_tiles(wd, storage->rect, tottile);
+	if (storage->rect_float)
+		write_imalayer_tiles(wd, storage->rect_float, tottile);
+}
+
+static void write_imalayer_mask(WriteData *wd, ImageLayerMask *mask)
+{
+	const int tottile = mask->xtiles * mask->ytiles;
+	int a;
+
+	writestruct(wd, DATA, "ImageLayerMask", 1, mask);
+	writestruct(wd, DATA, "ImageLayerMaskTile", tottile, mask->tiles);
+
+	for (a = 0; a < tottile; a++) {
+		if (mask->tiles[a].data)
+			writedata(wd, DATA, IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE, mask->tiles[a].data);
+	}
+}
+
+static void write_imalayer_adjustment(WriteData *wd, ImageLayerAdjustment *adjust)
+{
+	writestruct(wd, DATA, "ImageLayerAdjustment", 1, adjust);
+	if (adjust->curve)
+		write_curvemapping(wd, adjust->curve);
+}
+
 static void write_images(WriteData *wd, ListBase *idbase)
 {
 	Image *ima;
@@ -1998,16 +2042,40 @@ static void write_images(WriteData *wd, ListBase *idbase)
 			//}
 
 			if (ima->imlayers.last) {
+				/* only layers edited since the last write get packed again */
+				for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next)
+					imalayer_storage_ensure(iml);
+
 				for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next)
 					writestruct(wd, DATA, "ImageLayer", 1, iml); 
 
 				for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next) {
-					for (ibuf = (ImBuf *)iml->ibufs.first; ibuf; ibuf = ibuf->next)
-						writestruct(wd, DATA, "ImBuf", 1, ibuf);
+					for (ibuf = (ImBuf *)iml->ibufs.first; ibuf; ibuf = ibuf->next) {
+						if (iml->storage && ibuf == iml->ibufs.first) {
+							/* pixels are in the storage */
+							ImBuf ibuf_tmp = *ibuf;
+							ibuf_tmp.rect = NULL;
+							ibuf_tmp.rect_float = NULL;
+							writestruct_at_address(wd, DATA, "ImBuf", 1, ibuf, &ibuf_tmp);
+						}
+						else {
+							writestruct(wd, DATA, "ImBuf", 1, ibuf);
+						}
+					}
 				}
 
 				for (iml = (ImageLayer *)ima->imlayers.first; iml; iml = iml->next) {
+					if (iml->storage)
+						write_imalayer_storage(wd, iml->storage);
+					if (iml->mask)
+						write_imalayer_mask(wd, iml->mask);
+					if (iml->adjustment)
+						write_imalayer_adjustment(wd, iml->adjustment);
+
 					for (ibuf = (ImBuf *)iml->ibufs.first; ibuf; ibuf = ibuf->next) {
+						if (iml->storage && ibuf == iml->ibufs.first)
+							continue;
+
 						writedata(wd, DATA, ibuf->x * ibuf->y * sizeof(float) * 4, ibuf->rect_float);
 						writedata(wd, DATA, ibuf->x * ibuf->y * sizeof(char) * 4, ibuf->rect);
 					}
@@ -40,6 +40,7 @@ struct uiBlock;
 struct wmWindowManager;
 struct ARegion;
 struct Scene;
+struct ImageLayer;
 
 /* image_edit.c, exported for transform */
 struct Image *ED_space_image(struct SpaceImage *sima);
@@ -75,6 +76,9 @@ int ED_space_image_check_show_maskedit(struct Scene *scene, struct SpaceImage *s
 int ED_space_image_maskedit_poll(struct bContext *C);
 int ED_space_image_maskedit_mask_poll(struct bContext *C);
 
+/* image_edit.c, thumbnail icon of a layer, made again in a job when the layer changed */
+int ED_image_layer_icon_get(const struct bContext *C, struct Image *ima, struct ImageLayer *layer);
+
 void ED_image_draw_info(struct Scene *scene, struct ARegion *ar, int color_manage, int use_default_view, int channels, int x, int y,
                         const unsigned char cp[4], const float fp[4], const float linearcol[4], int *zp, float *zpf, const char type);
 
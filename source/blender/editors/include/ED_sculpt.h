@@ -32,6 +32,9 @@
 
 struct ARegion;
 struct bContext;
+struct Image;
+struct ImageLayer;
+struct ImBuf;
 struct MultiresModifierData;
 struct Object;
 struct RegionView3D;
@@ -79,6 +82,13 @@ void ED_image_undo_restore(struct bContext *C, struct ListBase *lb);
 void ED_image_undo_free(struct ListBase *lb);
 void ED_imapaint_clear_partial_redraw(void);
 void ED_imapaint_dirty_region(struct Image *ima, struct ImBuf *ibuf, int x, int y, int w, int h);
+void ED_imapaint_proj_cache_free(void);
+
+/* paint_image_layer_undo.c, push the layers an operator changes between begin and end */
+void ED_image_layer_undo_push_begin(const char *name, struct Image *ima);
+void ED_image_layer_undo_push_layer(struct Image *ima, struct ImageLayer *layer);
+void ED_image_layer_undo_push_end(struct Image *ima);
+void ED_image_layer_apply_transform(const char *name, struct Image *ima);
 
 
 #endif
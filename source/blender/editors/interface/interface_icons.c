@@ -69,6 +69,7 @@
 #include "BIF_glutil.h"
 
 #include "ED_datafiles.h"
+#include "ED_image.h"
 #include "ED_render.h"
 
 #include "UI_interface.h"
@@ -1142,7 +1143,7 @@ static void icon_draw_size(float x, float y, int icon_id, float aspect, float al
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else if (di->type == ICON_TYPE_PREVIEW) {
-		PreviewImage *pi = BKE_previewimg_get((ID *)icon->obj);
+		PreviewImage *pi = BKE_icon_previewimg_get(icon);
 
 		if (pi) {
 			/* no create icon on this level in code */
@@ -1305,6 +1306,11 @@ int UI_rnaptr_icon_get(bContext *C, PointerRNA *ptr, int rnaicon, const bool big
 		else if (surface->format == MOD_DPAINT_SURFACE_F_IMAGESEQ)
 			return ICON_FILE_IMAGE;
 	}
+	else if (RNA_struct_is_a(ptr->type, &RNA_ImageLayer)) {
+		int icon = ED_image_layer_icon_get(C, ptr->id.data, ptr->data);
+
+		return icon ? icon : rnaicon;
+	}
 
 	/* get icon from ID */
 	if (id) {
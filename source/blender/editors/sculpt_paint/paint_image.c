@@ -169,7 +169,8 @@ void *image_undo_find_tile(Image *ima, ImBuf *ibuf, int x_tile, int y_tile, unsi
 	UndoImageTile *tile;
 	short use_float = ibuf->rect_float ? 1 : 0;
 
-	for (tile = lb->first; tile; tile = tile->next) {
+	/* newest first, a dab mostly touches the tiles of the previous ones */
+	for (tile = lb->last; tile; tile = tile->prev) {
 		if (tile->x == x_tile && tile->y == y_tile && ima->gen_type == tile->gen_type && ima->source == tile->source) {
 			if (tile->use_float == use_float) {
 				if (strcmp(tile->idname, ima->id.name) == 0 && strcmp(tile->ibufname, ibuf->name) == 0) {
@@ -299,6 +300,8 @@ void ED_image_undo_restore(bContext *C, ListBase *lb)
 		}
 
 		undo_copy_tile(tile, tmpibuf, ibuf, 1);
+		imalayer_tag_dirty_region(ima, imalayer_get_current(ima), tile->x * IMAPAINT_TILE_SIZE,
+		                          tile->y * IMAPAINT_TILE_SIZE, IMAPAINT_TILE_SIZE, IMAPAINT_TILE_SIZE);
 
 		GPU_free_image(ima); /* force OpenGL reload */
 		if (ibuf->rect_float)
@@ -372,6 +375,7 @@ void ED_imapaint_dirty_region(Image *ima, ImBuf *ibuf, int x, int y, int w, int
 			image_undo_push_tile(ima, ibuf, &tmpibuf, tx, ty);
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	imalayer_tag_dirty_region(ima, imalayer_get_current(ima), x, y, w, h);
 	
 	if (tmpibuf)
 		IMB_freeImBuf(tmpibuf);
@@ -389,6 +393,19 @@ void imapaint_image_update(SpaceImage *sima, Image *image, ImBuf *ibuf, short te
 	if (ibuf->mipmap[0])
 		ibuf->userflags |= IB_MIPMAP_INVALID;
 
+	/* the composite of the layers has to pick up the new pixels. 2D painting
+	 * tagged the tiles under each dab already, in ED_imapaint_dirty_region(),
+	 * the bounds of all of them would re-blend much more */
+	if (texpaint && imapaintpartial.x1 != imapaintpartial.x2 &&
+	    imapaintpartial.y1 != imapaintpartial.y2)
+	{
+		imalayer_tag_dirty_region(image, imalayer_get_current(image), imapaintpartial.x1, imapaintpartial.y1,
+		                          imapaintpartial.x2 - imapaintpartial.x1, imapaintpartial.y2 - imapaintpartial.y1);
+	}
+	else if (texpaint) {
+		imalayer_tag_dirty(imalayer_get_current(image));
+	}
+
 	/* todo: should set_tpage create ->rect? */
 	if (texpaint || (sima && sima->lock)) {
 		int w = imapaintpartial.x2 - imapaintpartial.x1;
@@ -506,9 +523,19 @@ static PaintOperation *texture_paint_init(bContext *C, wmOperator *op, float mou
 	/* initialize from context */
 	if (CTX_wm_region_view3d(C)) {
 		pop->mode = PAINT_MODE_3D_PROJECT;
-		pop->custom_paint = paint_proj_new_stroke(C, OBACT, pop->prevmouse, mode);
+		pop->custom_paint = paint_proj_new_stroke(C, op, OBACT, pop->prevmouse, mode);
 	}
 	else {
+		SpaceImage *sima = CTX_wm_space_image(C);
+		Brush *brush = BKE_paint_brush(&settings->imapaint.paint);
+
+		if (sima && sima->image)
+			ED_image_layer_apply_transform(op->type->name, sima->image);
+
+		/* the clone source is read through its layer too */
+		if (brush && brush->imagepaint_tool == PAINT_TOOL_CLONE && brush->clone.image)
+			ED_image_layer_apply_transform(op->type->name, brush->clone.image);
+
 		pop->mode = PAINT_MODE_2D;
 		pop->custom_paint = paint_2d_new_stroke(C, op);
 	}
@@ -1300,6 +1327,8 @@ static int texture_paint_toggle_exec(bContext *C, wmOperator *op)
 			GPU_free_images();
 		GPU_paint_set_mipmap(1);
 
+		ED_imapaint_proj_cache_free();
+
 		toggle_paint_cursor(C, 0);
 	}
 	else {
@@ -125,6 +125,7 @@ typedef struct ImagePaintState {
 	Brush *brush;
 	short tool, blend;
 	Image *image;
+	ImageLayer *layer;		/* active layer of the stroke, the canvas is its ImBuf or the one of its mask */
 	ImBuf *canvas;
 	ImBuf *clonecanvas;
 	char *warnpackedfile;
@@ -864,6 +865,7 @@ static int paint_2d_op(void *state, ImBuf *ibufb, unsigned short *maskb, const f
 	float liftpos[2];
 	float brush_alpha = BKE_brush_alpha_get(s->scene, s->brush);
 	unsigned short mask_max = (unsigned short)(brush_alpha * 65535.0f);
+	short lock_alpha = s->layer->locked;
 	int bpos[2], blastpos[2], bliftpos[2];
 	int a, tot;
 	
@@ -878,14 +880,14 @@ static int paint_2d_op(void *state, ImBuf *ibufb, unsigned short *maskb, const f
 			return 0;
 
 		paint_2d_convert_brushco(ibufb, lastpos, blastpos);
-		paint_2d_lift_smear(s->canvas, ibufb, blastpos, ((ImageLayer *)imalayer_get_current(s->image))->locked);
+		paint_2d_lift_smear(s->canvas, ibufb, blastpos, lock_alpha);
 	}
 	else if (s->tool == PAINT_TOOL_CLONE && s->clonecanvas) {
 		liftpos[0] = pos[0] - offset[0] * s->canvas->x;
 		liftpos[1] = pos[1] - offset[1] * s->canvas->y;
 
 		paint_2d_convert_brushco(ibufb, liftpos, bliftpos);
-		clonebuf = paint_2d_lift_clone(s->clonecanvas, ibufb, bliftpos, ((ImageLayer *)imalayer_get_current(s->image))->locked);
+		clonebuf = paint_2d_lift_clone(s->clonecanvas, ibufb, bliftpos, lock_alpha);
 	}
 
 	frombuf = (clonebuf) ? clonebuf : ibufb;
@@ -902,7 +904,8 @@ static int paint_2d_op(void *state, ImBuf *ibufb, unsigned short *maskb, const f
 	if (s->do_masking)
 		tmpbuf = IMB_allocImBuf(IMAPAINT_TILE_SIZE, IMAPAINT_TILE_SIZE, 32, 0);
 	
-	/* blend into canvas */
+	/* blend into canvas, only the tiles of the layer under the brush are
+	 * tagged, the redraw re-blends those through the layer stack */
 	for (a = 0; a < tot; a++) {
 		ED_imapaint_dirty_region(s->image, s->canvas,
 		                      region[a].destx, region[a].desty,
@@ -933,7 +936,7 @@ static int paint_2d_op(void *state, ImBuf *ibufb, unsigned short *maskb, const f
 					              region[a].destx, region[a].desty,
 					              origx, origy,
 					              region[a].srcx, region[a].srcy,
-								  region[a].width, region[a].height, blend, ((ImageLayer *)imalayer_get_current(s->image))->locked);
+								  region[a].width, region[a].height, blend, lock_alpha);
 				}
 			}
 		}
@@ -943,7 +946,7 @@ static int paint_2d_op(void *state, ImBuf *ibufb, unsigned short *maskb, const f
 			              region[a].destx, region[a].desty,
 			              region[a].destx, region[a].desty,
 			              region[a].srcx, region[a].srcy,
-			              region[a].width, region[a].height, blend, ((ImageLayer *)imalayer_get_current(s->image))->locked);
+			              region[a].width, region[a].height, blend, lock_alpha);
 		}
 	}
 
@@ -974,6 +977,7 @@ static int paint_2d_canvas_set(ImagePaintState *s, Image *ima)
 		return 0;
 
 	s->image = ima;
+	s->layer = imalayer_get_current(ima);
 	s->canvas = ibuf;
 
 	/* set clone canvas */
@@ -1020,11 +1024,9 @@ void paint_2d_stroke(void *ps, const float prev_mval[2], const float mval[2], in
 	float newuv[2], olduv[2];
 	ImagePaintState *s = ps;
 	BrushPainter *painter = s->painter;
-	ImBuf *ibuf = BKE_image_acquire_ibuf(s->image, s->sima ? &s->sima->iuser : NULL, NULL, IMA_IBUF_LAYER);
-	const bool is_data = (ibuf && ibuf->colormanage_flag & IMB_COLORMANAGE_IS_DATA);
-
-	if (!ibuf)
-		return;
+	/* acquired for the whole stroke, dabs only touch the tiles under them */
+	ImBuf *ibuf = s->canvas;
+	const bool is_data = (ibuf->colormanage_flag & IMB_COLORMANAGE_IS_DATA) != 0;
 
 	s->blend = s->brush->blend;
 	if (eraser)
@@ -1069,7 +1071,6 @@ void paint_2d_stroke(void *ps, const float prev_mval[2], const float mval[2], in
 
 	if (paint_2d_op(s, painter->cache.ibuf, painter->cache.mask, olduv, newuv))
 		s->need_redraw = true;
-	BKE_image_release_ibuf(s->image, ibuf, NULL);
 }
 
 void *paint_2d_new_stroke(bContext *C, wmOperator *op)
@@ -1114,13 +1115,9 @@ void paint_2d_redraw(const bContext *C, void *ps, bool final)
 	ImagePaintState *s = ps;
 
 	if (s->need_redraw) {
-		ImBuf *ibuf = BKE_image_acquire_ibuf(s->image, s->sima ? &s->sima->iuser : NULL, NULL, IMA_IBUF_LAYER);
-
-		imapaint_image_update(s->sima, s->image, ibuf, false);
+		imapaint_image_update(s->sima, s->image, s->canvas, false);
 		ED_imapaint_clear_partial_redraw();
 
-		BKE_image_release_ibuf(s->image, ibuf, NULL);
-
 		s->need_redraw = false;
 	}
 	else if (!final) {
@@ -0,0 +1,758 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/editors/sculpt_paint/paint_image_layer_undo.c
+ *  \ingroup edsculpt
+ *  \brief Undo of the image layer operators.
+ *
+ * Merging, flipping, rotating, offsetting and resizing layers replace whole
+ * buffers or add and remove layers, which the tile undo of painting can't
+ * follow. Their undo step goes on the same image undo stack and maps the
+ * layers after the operator to the ones before. Only what changed is kept:
+ * the tiles that differ, the settings when they differ, the mask when it
+ * differs (it's sparse already), and whole layers (packed in their
+ * ImageLayerStorage) when they were removed or their size changed.
+ *
+ * Like the paint tiles, every step holds the other state: restoring swaps
+ * it with the image, so the same step does undo and redo.
+ *
+ * The pixels are compared as they are under a pending transform, operators
+ * that only change ImageLayer.transform just keep the settings.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "MEM_guardedalloc.h"
+
+#include "BLI_blenlib.h"
+#include "BLI_math_base.h"
+#include "BLI_math_vector.h"
+#include "BLI_utildefines.h"
+
+#include "IMB_imbuf.h"
+
+#include "DNA_image_types.h"
+#include "DNA_imbuf_types.h"
+
+#include "BKE_context.h"
+#include "BKE_layer.h"
+#include "BKE_main.h"
+
+#include "ED_sculpt.h"
+
+#include "GPU_draw.h"
+
+#include "paint_intern.h"
+
+/* Pixels of one tile in the other state, both buffers when the layer has them */
+typedef struct UndoImageLayerTile {
+	struct UndoImageLayerTile *next, *prev;
+	int x, y, w, h;
+	unsigned int *rect;
+	float *rect_float;
+} UndoImageLayerTile;
+
+typedef struct UndoImageLayer {
+	struct UndoImageLayer *next, *prev;
+	/* position in Image.imlayers now and in the other state, -1 when the
+	 * layer isn't there */
+	int index, other_index;
+	/* name of the layer at "index" and of its ImBuf, layer operators without
+	 * this undo may have moved the layers around since */
+	char name[64];
+	char ibufname[IB_FILENAME_SIZE];
+	/* the whole layer in the other state, when it's missing now or had
+	 * another size */
+	ImageLayer *layer;
+	/* settings in the other state, when they differ */
+	ImageLayer *settings;
+	/* UndoImageLayerTile, the tiles that differ */
+	ListBase tiles;
+	/* mask in the other state when "swap_mask" is set, it may be none */
+	ImageLayerMask *mask;
+	bool swap_mask;
+
+	/* the layer before the operator, only while it runs */
+	ImageLayer *orig;
+} UndoImageLayer;
+
+typedef struct UndoImageLayers {
+	struct UndoImageLayers *next, *prev;
+	char idname[MAX_ID_NAME];
+	int totlayer, other_totlayer;
+	int act_layers, count_layers;			/* Image.Act_Layers and Count_Layers in the other state */
+	ListBase layers;					/* UndoImageLayer */
+} UndoImageLayers;
+
+/* ************************ Layers out of the image ************************ */
+
+static void undo_layer_identity_get(ImageLayer *layer, char name[64], char ibufname[IB_FILENAME_SIZE])
+{
+	ImBuf *ibuf = layer->ibufs.first;
+
+	BLI_strncpy(name, layer->name, 64);
+	BLI_strncpy(ibufname, ibuf ? ibuf->name : "", IB_FILENAME_SIZE);
+}
+
+static bool undo_layer_identity_equals(ImageLayer *layer, const char *name, const char *ibufname)
+{
+	ImBuf *ibuf = layer->ibufs.first;
+
+	return (STREQ(layer->name, name) && STREQ(ibuf ? ibuf->name : "", ibufname));
+}
+
+static bool undo_layer_settings_equal(const ImageLayer *a, const ImageLayer *b)
+{
+	return (STREQ(a->name, b->name) && STREQ(a->file_path, b->file_path) &&
+	        a->opacity == b->opacity && a->background == b->background && a->mode == b->mode &&
+	        a->type == b->type && a->depth == b->depth && a->visible == b->visible && a->select == b->select &&
+	        a->locked == b->locked && equals_v4v4(a->default_color, b->default_color) &&
+	        a->transform_flag == b->transform_flag && a->transform_filter == b->transform_filter &&
+	        a->transform_x == b->transform_x && a->transform_y == b->transform_y &&
+	        memcmp(a->transform, b->transform, sizeof(a->transform)) == 0 &&
+	        equals_v4v4(a->transform_color, b->transform_color));
+}
+
+/* clears the parts of a layer copy it doesn't own */
+static void undo_layer_clear_links(ImageLayer *layer)
+{
+	layer->next = layer->prev = NULL;
+	layer->ibufs.first = layer->ibufs.last = NULL;
+	layer->preview_ibuf = NULL;
+	layer->storage = NULL;
+	layer->group_cache = NULL;
+	layer->mip = NULL;
+	layer->preview = NULL;
+	layer->icon_id = 0;
+	layer->mask = NULL;
+	layer->adjustment = NULL;
+}
+
+/* Swaps the settings, the pixels stay where they are */
+static void undo_layer_swap_settings(ImageLayer *layer, ImageLayer *settings)
+{
+	ImageLayer tmp = *layer;
+
+	*layer = *settings;
+	layer->next = tmp.next;
+	layer->prev = tmp.prev;
+	layer->ibufs = tmp.ibufs;
+	layer->preview_ibuf = tmp.preview_ibuf;
+	layer->storage = tmp.storage;
+	layer->group_cache = tmp.group_cache;
+	layer->mip = tmp.mip;
+	layer->preview = tmp.preview;
+	layer->icon_id = tmp.icon_id;
+	layer->thumb_generation = tmp.thumb_generation;
+	layer->mask = tmp.mask;
+	layer->adjustment = tmp.adjustment;
+	layer->generation = tmp.generation;
+
+	*settings = tmp;
+	undo_layer_clear_links(settings);
+}
+
+/* Drops the pixels of a layer kept by the undo, it stays sparse in its
+ * storage. Layers the storage can't hold keep their pixels. */
+static void undo_layer_compact(ImageLayer *layer)
+{
+	ImBuf *ibuf = layer->ibufs.first;
+
+	if (layer->preview_ibuf) {
+		IMB_freeImBuf(layer->preview_ibuf);
+		layer->preview_ibuf = NULL;
+	}
+
+	if (ibuf && (ibuf->rect || ibuf->rect_float)) {
+		/* the storage may come from another layer, never trust it */
+		if (layer->storage) {
+			imalayer_storage_free(layer->storage);
+			layer->storage = NULL;
+		}
+
+		if (imalayer_storage_ensure(layer)) {
+			imb_freerectImBuf(ibuf);
+			imb_freerectfloatImBuf(ibuf);
+		}
+	}
+}
+
+/* A copy of the layer as it is before the operator, compacted */
+static ImageLayer *undo_layer_copy(ImageLayer *layer)
+{
+	ImageLayer *copy = MEM_dupallocN(layer);
+	ImBuf *ibuf = imalayer_get_ibuf_untransformed(layer);
+
+	undo_layer_clear_links(copy);
+	copy->mask = imalayer_mask_copy(layer->mask);
+	copy->adjustment = imalayer_adjustment_copy(layer->adjustment);
+
+	if (ibuf) {
+		BLI_addtail(&copy->ibufs, IMB_dupImBuf(ibuf));
+		undo_layer_compact(copy);
+	}
+
+	return copy;
+}
+
+static size_t undo_layer_tiles_size(ImageLayerTile *tiles, int tottile)
+{
+	size_t size = 0;
+	int a;
+
+	if (tiles) {
+		size += sizeof(ImageLayerTile) * tottile;
+		for (a = 0; a < tottile; a++)
+			size += tiles[a].size;
+	}
+
+	return size;
+}
+
+static size_t undo_layer_size(ImageLayer *layer)
+{
+	ImBuf *ibuf = layer->ibufs.first;
+	size_t size = sizeof(ImageLayer);
+
+	if (ibuf) {
+		size += sizeof(ImBuf);
+		if (ibuf->rect)
+			size += (size_t)ibuf->x * ibuf->y * sizeof(char[4]);
+		if (ibuf->rect_float)
+			size += (size_t)ibuf->x * ibuf->y * sizeof(float[4]);
+	}
+
+	if (layer->storage) {
+		const int tottile = layer->storage->xtiles * layer->storage->ytiles;
+
+		size += sizeof(ImageLayerStorage);
+		size += undo_layer_tiles_size(layer->storage->rect, tottile);
+		size += undo_layer_tiles_size(layer->storage->rect_float, tottile);
+	}
+
+	size += imalayer_mask_mem_size(layer->mask);
+	if (layer->adjustment)
+		size += sizeof(ImageLayerAdjustment);
+
+	return size;
+}
+
+/* ******************************** Tiles ******************************** */
+
+static bool undo_layer_has_buffer(ImageLayer *layer, bool is_float)
+{
+	ImageLayerStorage *storage = imalayer_sparse_storage(layer);
+	ImBuf *ibuf = layer->ibufs.first;
+
+	if (storage)
+		return is_float ? (storage->rect_float != NULL) : (storage->rect != NULL);
+	else
+		return is_float ? (ibuf->rect_float != NULL) : (ibuf->rect != NULL);
+}
+
+/* Rows of tile tx, ty of a layer kept by the undo, see imalayer_storage_tile_pixels() */
+static const char *undo_ibuf_tile_pixels(ImBuf *ibuf, bool is_float, int tx, int ty)
+{
+	const size_t offset = (size_t)(ty << IMA_LAYER_TILE_BITS) * ibuf->x + (tx << IMA_LAYER_TILE_BITS);
+
+	return is_float ? (const char *)(ibuf->rect_float + offset * 4) : (const char *)(ibuf->rect + offset);
+}
+
+static const char *undo_layer_tile_pixels(ImageLayer *layer, bool is_float, int tx, int ty, void *buf, int *r_stride)
+{
+	ImageLayerStorage *storage = imalayer_sparse_storage(layer);
+	ImBuf *ibuf = layer->ibufs.first;
+
+	if (storage)
+		return imalayer_storage_tile_pixels(storage, is_float, tx, ty, buf, r_stride);
+
+	*r_stride = ibuf->x;
+	return undo_ibuf_tile_pixels(ibuf, is_float, tx, ty);
+}
+
+static void undo_layer_tile_copy(char *dst, const char *src, int stride, size_t pixel_size, int w, int h)
+{
+	const size_t row_size = (size_t)w * pixel_size;
+	int y;
+
+	for (y = 0; y < h; y++, dst += row_size, src += stride * pixel_size)
+		memcpy(dst, src, row_size);
+}
+
+static bool undo_layer_tile_equal(const char *a, int a_stride, const char *b, int b_stride, size_t pixel_size,
+                                  int w, int h)
+{
+	const size_t row_size = (size_t)w * pixel_size;
+	int y;
+
+	for (y = 0; y < h; y++, a += a_stride * pixel_size, b += b_stride * pixel_size) {
+		if (memcmp(a, b, row_size) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* Keeps the tiles of "copy" that differ from "ibuf", both the same size */
+static size_t undo_layer_diff_tiles(UndoImageLayer *uil, ImageLayer *copy, ImBuf *ibuf)
+{
+	const int xtiles = (ibuf->x + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	const int ytiles = (ibuf->y + IMA_LAYER_TILE_SIZE - 1) >> IMA_LAYER_TILE_BITS;
+	UndoImageLayerTile *tile;
+	const char *pixels;
+	void *buf;
+	size_t size = 0, pixel_size;
+	int tx, ty, w, h, stride, pass;
+	bool changed, is_float;
+
+	buf = MEM_mallocN(IMA_LAYER_TILE_SIZE * IMA_LAYER_TILE_SIZE * sizeof(float[4]), "undo_layer_diff_tiles");
+
+	for (ty = 0; ty < ytiles; ty++) {
+		for (tx = 0; tx < xtiles; tx++) {
+			w = min_ii(IMA_LAYER_TILE_SIZE, ibuf->x - (tx << IMA_LAYER_TILE_BITS));
+			h = min_ii(IMA_LAYER_TILE_SIZE, ibuf->y - (ty << IMA_LAYER_TILE_BITS));
+			changed = false;
+
+			/* the tile after the operator against the one before */
+			for (pass = 0; pass < 2 && !changed; pass++) {
+				is_float = (pass == 1);
+
+				if (is_float ? !ibuf->rect_float : !ibuf->rect)
+					continue;
+
+				pixel_size = is_float ? sizeof(float[4]) : sizeof(char[4]);
+				pixels = undo_layer_tile_pixels(copy, is_float, tx, ty, buf, &stride);
+				changed = !undo_layer_tile_equal(undo_ibuf_tile_pixels(ibuf, is_float, tx, ty), ibuf->x,
+				                                 pixels, stride, pixel_size, w, h);
+			}
+
+			if (!changed)
+				continue;
+
+			tile = MEM_callocN(sizeof(UndoImageLayerTile), "UndoImageLayerTile");
+			tile->x = tx << IMA_LAYER_TILE_BITS;
+			tile->y = ty << IMA_LAYER_TILE_BITS;
+			tile->w = w;
+			tile->h = h;
+
+			if (ibuf->rect) {
+				tile->rect = MEM_mapallocN((size_t)w * h * sizeof(char[4]), "UndoImageLayerTile.rect");
+				pixels = undo_layer_tile_pixels(copy, false, tx, ty, buf, &stride);
+				undo_layer_tile_copy((char *)tile->rect, pixels, stride, sizeof(char[4]), w, h);
+				size += (size_t)w * h * sizeof(char[4]);
+			}
+
+			if (ibuf->rect_float) {
+				tile->rect_float = MEM_mapallocN((size_t)w * h * sizeof(float[4]), "UndoImageLayerTile.rect_float");
+				pixels = undo_layer_tile_pixels(copy, true, tx, ty, buf, &stride);
+				undo_layer_tile_copy((char *)tile->rect_float, pixels, stride, sizeof(float[4]), w, h);
+				size += (size_t)w * h * sizeof(float[4]);
+			}
+
+			BLI_addtail(&uil->tiles, tile);
+		}
+	}
+
+	MEM_freeN(buf);
+
+	return size;
+}
+
+static void undo_layer_swap_rows(char *rect, int stride, char *tile_rect, size_t pixel_size, int w, int h)
+{
+	char tmp[IMA_LAYER_TILE_SIZE * sizeof(float[4])];
+	const size_t row_size = (size_t)w * pixel_size;
+	int y;
+
+	for (y = 0; y < h; y++, rect += (size_t)stride * pixel_size, tile_rect += row_size) {
+		memcpy(tmp, rect, row_size);
+		memcpy(rect, tile_rect, row_size);
+		memcpy(tile_rect, tmp, row_size);
+	}
+}
+
+static bool undo_layer_swap_tiles(ImageLayer *layer, ListBase *tiles)
+{
+	UndoImageLayerTile *tile;
+	ImBuf *ibuf;
+
+	if (tiles->first == NULL)
+		return false;
+
+	ibuf = imalayer_get_ibuf_untransformed(layer);
+
+	for (tile = tiles->first; tile; tile = tile->next) {
+		if (!ibuf || tile->x + tile->w > ibuf->x || tile->y + tile->h > ibuf->y)
+			continue;
+
+		if (tile->rect && ibuf->rect) {
+			undo_layer_swap_rows((char *)(ibuf->rect + (size_t)tile->y * ibuf->x + tile->x), ibuf->x,
+			                     (char *)tile->rect, sizeof(char[4]), tile->w, tile->h);
+		}
+
+		if (tile->rect_float && ibuf->rect_float) {
+			undo_layer_swap_rows((char *)(ibuf->rect_float + ((size_t)tile->y * ibuf->x + tile->x) * 4), ibuf->x,
+			                     (char *)tile->rect_float, sizeof(float[4]), tile->w, tile->h);
+		}
+	}
+
+	if (ibuf) {
+		ibuf->userflags |= IB_BITMAPDIRTY | IB_DISPLAY_BUFFER_INVALID;
+		if (ibuf->mipmap[0])
+			ibuf->userflags |= IB_MIPMAP_INVALID;
+	}
+
+	return true;
+}
+
+/* ******************************** Steps ******************************** */
+
+static void undo_layer_free(UndoImageLayer *uil)
+{
+	UndoImageLayerTile *tile;
+
+	for (tile = uil->tiles.first; tile; tile = tile->next) {
+		if (tile->rect)
+			MEM_freeN(tile->rect);
+		if (tile->rect_float)
+			MEM_freeN(tile->rect_float);
+	}
+	BLI_freelistN(&uil->tiles);
+
+	imalayer_mask_free(uil->mask);
+	uil->mask = NULL;
+
+	if (uil->settings)
+		MEM_freeN(uil->settings);
+	if (uil->layer)
+		free_image_layer(uil->layer);
+
+	uil->settings = NULL;
+	uil->layer = NULL;
+}
+
+static void image_layer_undo_free(ListBase *lb)
+{
+	UndoImageLayers *ul;
+	UndoImageLayer *uil;
+
+	for (ul = lb->first; ul; ul = ul->next) {
+		for (uil = ul->layers.first; uil; uil = uil->next)
+			undo_layer_free(uil);
+		BLI_freelistN(&ul->layers);
+	}
+}
+
+/* the layers of the other state can be put back */
+static bool undo_layers_valid(UndoImageLayers *ul, Image *ima)
+{
+	UndoImageLayer *uil;
+	ImageLayer **layers, *layer;
+	char *used;
+	bool valid = true;
+	int i;
+
+	if (BLI_countlist(&ima->imlayers) != ul->totlayer)
+		return false;
+
+	layers = MEM_callocN(sizeof(ImageLayer *) * (ul->totlayer + 1), "undo_layers_valid");
+	for (layer = ima->imlayers.first, i = 0; layer; layer = layer->next, i++)
+		layers[i] = layer;
+
+	used = MEM_callocN(ul->other_totlayer + 1, "undo_layers_valid");
+
+	for (uil = ul->layers.first; uil; uil = uil->next) {
+		if (uil->index >= ul->totlayer || uil->other_index >= ul->other_totlayer ||
+		    (uil->index < 0 && (uil->other_index < 0 || uil->layer == NULL)))
+		{
+			valid = false;
+		}
+		else if (uil->index >= 0 && !undo_layer_identity_equals(layers[uil->index], uil->name, uil->ibufname)) {
+			/* another layer is there now */
+			valid = false;
+		}
+		else if (uil->other_index >= 0) {
+			if (used[uil->other_index])
+				valid = false;
+			used[uil->other_index] = 1;
+		}
+	}
+
+	MEM_freeN(layers);
+	MEM_freeN(used);
+
+	return valid;
+}
+
+static void image_layer_undo_restore(bContext *C, ListBase *lb)
+{
+	Main *bmain = CTX_data_main(C);
+	UndoImageLayers *ul;
+	UndoImageLayer *uil;
+	ImageLayer **layers, **other_layers, *layer;
+	Image *ima;
+	int i;
+	bool changed;
+
+	for (ul = lb->first; ul; ul = ul->next) {
+		/* find image based on name, pointer becomes invalid with global undo */
+		ima = BLI_findstring(&bmain->image, ul->idname, offsetof(ID, name));
+
+		if (!ima || !undo_layers_valid(ul, ima))
+			continue;
+
+		layers = MEM_callocN(sizeof(ImageLayer *) * (ul->totlayer + 1), "image_layer_undo_restore");
+		other_layers = MEM_callocN(sizeof(ImageLayer *) * (ul->other_totlayer + 1), "image_layer_undo_restore");
+
+		for (layer = ima->imlayers.first, i = 0; layer; layer = layer->next, i++)
+			layers[i] = layer;
+
+		for (uil = ul->layers.first; uil; uil = uil->next) {
+			if (uil->index < 0) {
+				/* put back a layer that's missing now */
+				layer = uil->layer;
+				uil->layer = NULL;
+				imalayer_tag_dirty(layer);
+			}
+			else {
+				layer = layers[uil->index];
+				changed = false;
+
+				if (uil->settings) {
+					undo_layer_swap_settings(layer, uil->settings);
+					changed = true;
+				}
+
+				if (uil->other_index < 0) {
+					/* the layer goes out, kept whole */
+					undo_layer_compact(layer);
+					uil->layer = layer;
+				}
+				else if (uil->layer) {
+					/* the size changed, swap the pixels */
+					SWAP(ListBase, layer->ibufs, uil->layer->ibufs);
+					SWAP(ImageLayerStorage *, layer->storage, uil->layer->storage);
+					undo_layer_compact(uil->layer);
+					changed = true;
+				}
+
+				if (uil->swap_mask) {
+					SWAP(ImageLayerMask *, layer->mask, uil->mask);
+					/* the grey image of an edited mask is made again when needed */
+					if (uil->mask && uil->mask->ibuf) {
+						IMB_freeImBuf(uil->mask->ibuf);
+						uil->mask->ibuf = NULL;
+					}
+					imalayer_mask_tag_dirty(layer);
+					changed = true;
+				}
+
+				if (undo_layer_swap_tiles(layer, &uil->tiles))
+					changed = true;
+
+				if (changed)
+					imalayer_tag_dirty(layer);
+			}
+
+			if (uil->other_index >= 0) {
+				other_layers[uil->other_index] = layer;
+				undo_layer_identity_get(layer, uil->name, uil->ibufname);
+			}
+
+			SWAP(int, uil->index, uil->other_index);
+		}
+
+		ima->imlayers.first = ima->imlayers.last = NULL;
+		for (i = 0; i < ul->other_totlayer; i++)
+			BLI_addtail(&ima->imlayers, other_layers[i]);
+
+		SWAP(int, ul->totlayer, ul->other_totlayer);
+		SWAP(int, ima->Act_Layers, ul->act_layers);
+		SWAP(int, ima->Count_Layers, ul->count_layers);
+
+		imalayer_cache_tag_dirty(ima);
+		GPU_free_image(ima); /* force OpenGL reload */
+
+		MEM_freeN(layers);
+		MEM_freeN(other_layers);
+	}
+}
+
+static UndoImageLayers *undo_layers_find(Image *ima)
+{
+	ListBase *lb = undo_paint_push_get_list(UNDO_PAINT_IMAGE);
+	UndoImageLayers *ul;
+
+	if (lb == NULL)
+		return NULL;
+
+	for (ul = lb->last; ul; ul = ul->prev) {
+		if (STREQ(ul->idname, ima->id.name))
+			return ul;
+	}
+
+	return NULL;
+}
+
+void ED_image_layer_undo_push_begin(const char *name, Image *ima)
+{
+	UndoImageLayers *ul;
+	UndoImageLayer *uil;
+	ImageLayer *layer;
+	int i;
+
+	ED_undo_paint_push_begin(UNDO_PAINT_IMAGE, name, image_layer_undo_restore, image_layer_undo_free);
+
+	ul = MEM_callocN(sizeof(UndoImageLayers), "UndoImageLayers");
+	BLI_strncpy(ul->idname, ima->id.name, sizeof(ul->idname));
+	ul->act_layers = ima->Act_Layers;
+	ul->count_layers = ima->Count_Layers;
+
+	for (layer = ima->imlayers.first, i = 0; layer; layer = layer->next, i++) {
+		uil = MEM_callocN(sizeof(UndoImageLayer), "UndoImageLayer");
+		uil->index = -1;
+		uil->other_index = i;
+		uil->orig = layer;
+		BLI_addtail(&ul->layers, uil);
+	}
+	ul->other_totlayer = i;
+
+	BLI_addtail(undo_paint_push_get_list(UNDO_PAINT_IMAGE), ul);
+}
+
+void ED_image_layer_undo_push_layer(Image *ima, ImageLayer *layer)
+{
+	UndoImageLayers *ul = undo_layers_find(ima);
+	UndoImageLayer *uil;
+
+	if (ul == NULL)
+		return;
+
+	for (uil = ul->layers.first; uil; uil = uil->next) {
+		if (uil->orig == layer && uil->layer == NULL) {
+			uil->layer = undo_layer_copy(layer);
+			return;
+		}
+	}
+}
+
+void ED_image_layer_undo_push_end(Image *ima)
+{
+	UndoImageLayers *ul = undo_layers_find(ima);
+	UndoImageLayer *uil;
+	ImageLayer *layer, *copy;
+	ImBuf *ibuf, *before;
+	size_t size = 0;
+	int i;
+
+	if (ul == NULL)
+		return;
+
+	for (layer = ima->imlayers.first, i = 0; layer; layer = layer->next, i++) {
+		for (uil = ul->layers.first; uil; uil = uil->next) {
+			if (uil->orig == layer && uil->index == -1)
+				break;
+		}
+
+		if (uil == NULL) {
+			/* added by the operator, undo takes it out */
+			uil = MEM_callocN(sizeof(UndoImageLayer), "UndoImageLayer");
+			uil->other_index = -1;
+			BLI_addtail(&ul->layers, uil);
+			imalayer_tag_dirty(layer);
+		}
+		else if ((copy = uil->layer)) {
+			/* changed by the operator, keep what differs */
+			if (!undo_layer_settings_equal(copy, layer)) {
+				uil->settings = MEM_dupallocN(copy);
+				undo_layer_clear_links(uil->settings);
+				size += sizeof(ImageLayer);
+			}
+
+			if (!imalayer_mask_equals(copy->mask, layer->mask)) {
+				uil->mask = copy->mask;
+				uil->swap_mask = true;
+				size += imalayer_mask_mem_size(uil->mask);
+			}
+			else {
+				imalayer_mask_free(copy->mask);
+			}
+			copy->mask = NULL;
+
+			before = copy->ibufs.first;
+			ibuf = imalayer_get_ibuf_untransformed(layer);
+
+			if (before == NULL && ibuf == NULL) {
+				/* groups and adjustments, only settings */
+				free_image_layer(copy);
+				uil->layer = NULL;
+			}
+			else if (before && ibuf && before->x == ibuf->x && before->y == ibuf->y &&
+			    undo_layer_has_buffer(copy, false) == (ibuf->rect != NULL) &&
+			    undo_layer_has_buffer(copy, true) == (ibuf->rect_float != NULL))
+			{
+				size += undo_layer_diff_tiles(uil, copy, ibuf);
+				free_image_layer(copy);
+				uil->layer = NULL;
+			}
+			else {
+				size += undo_layer_size(copy);
+			}
+
+			/* transforms alone leave the pixels as they were */
+			if (uil->layer || uil->tiles.first)
+				imalayer_tag_dirty(layer);
+		}
+
+		uil->index = i;
+		undo_layer_identity_get(layer, uil->name, uil->ibufname);
+	}
+
+	ul->totlayer = i;
+
+	/* layers the operator removed are only kept when they were pushed */
+	for (uil = ul->layers.first; uil; uil = uil->next) {
+		if (uil->index == -1 && uil->layer)
+			size += undo_layer_size(uil->layer);
+
+		uil->orig = NULL;
+	}
+
+	undo_paint_push_count_alloc(UNDO_PAINT_IMAGE, (int)size);
+	ED_undo_paint_push_end(UNDO_PAINT_IMAGE);
+
+	imalayer_cache_tag_dirty(ima);
+}
+
+/* Painting edits the pixels of the active layer as they're shown. Its pending
+ * transform is resampled into them first, in an undo step of its own */
+void ED_image_layer_apply_transform(const char *name, Image *ima)
+{
+	ImageLayer *layer = ima ? imalayer_get_current(ima) : NULL;
+
+	if (layer == NULL || !imalayer_transform_is_set(layer))
+		return;
+
+	ED_image_layer_undo_push_begin(name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+	imalayer_transform_apply(layer);
+	ED_image_layer_undo_push_end(ima);
+}
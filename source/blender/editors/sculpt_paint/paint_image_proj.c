@@ -45,9 +45,12 @@
 #include "BLI_math.h"
 #include "BLI_math_color_blend.h"
 #include "BLI_memarena.h"
+#include "BLI_task.h"
 #include "BLI_threads.h"
 #include "BLI_utildefines.h"
 
+#include "atomic_ops.h"
+
 #include "PIL_time.h"
 
 #include "IMB_imbuf.h"
@@ -65,6 +68,7 @@
 #include "BKE_idprop.h"
 #include "BKE_brush.h"
 #include "BKE_image.h"
+#include "BKE_layer.h"
 #include "BKE_library.h"
 #include "BKE_main.h"
 #include "BKE_mesh.h"
@@ -169,6 +173,10 @@ BLI_INLINE unsigned char f_to_char(const float val)
 /* vert flags */
 #define PROJ_VERT_CULL 1
 
+/* face flags, while binning the faces into the buckets */
+#define PROJ_FACE_BIN           (1 << 0)
+#define PROJ_FACE_BIN_CHANGED   (1 << 1)
+
 /* This is mainly a convenience struct used so we can keep an array of images we use
  * Thir imbufs, etc, in 1 array, When using threads this array is copied for each thread
  * because 'partRedrawRect' and 'touch' values would not be thread safe */
@@ -180,6 +188,41 @@ typedef struct ProjPaintImage {
 	int touch;
 } ProjPaintImage;
 
+/* The contents of one screen bucket, stored as arrays so painting streams
+ * through them. The pixels are found the first time the brush touches the
+ * bucket: the ProjPixel's (ps->pixel_sizeof bytes each) are back to back and
+ * their screen coordinates are kept apart as well, so every dab can look for
+ * the pixels under the brush without loading the rest. */
+typedef struct ProjPaintBucket {
+	char *pixels;
+	float (*pixels_co)[2];
+	int pixels_tot;
+	int *faces;                 /* the faces overlapping the bucket */
+	int faces_tot;
+} ProjPaintBucket;
+
+#define PROJ_BUCKET_PIXEL(ps, bucket, i) ((ProjPixel *)((bucket)->pixels + (size_t)(i) * (ps)->pixel_sizeof))
+
+/* The faces of each bucket, kept from one stroke to the next together with
+ * what they were binned with, see project_paint_bucket_faces_init() */
+typedef struct ProjPaintBucketCache {
+	Object *ob;
+	int totvert, totface;
+	unsigned int (*faceVerts)[4];   /* MFace v1..v4 of the faces, the topology they were binned with */
+	int buckets_x, buckets_y;
+	float screenMin[2], screenMax[2];
+
+	float (*screenCoords)[2];       /* 2D screen coords of the verts the faces were binned with */
+	char *faceFlags;                /* PROJ_FACE_BIN of the faces that were binned */
+	int **bucketFaces;              /* per bucket, the faces in descending order */
+	int *bucketFaces_tot;
+
+	bool in_use;                    /* a stroke borrows the bucket faces */
+} ProjPaintBucketCache;
+
+/* used by painting from the 3D view, other projections get their own */
+static ProjPaintBucketCache proj_bucket_cache = {NULL};
+
 /* Main projection painting struct passed to all projection painting functions */
 typedef struct ProjPaintState {
 	View3D *v3d;
@@ -207,8 +250,9 @@ typedef struct ProjPaintState {
 
 	/* projection painting only */
 	MemArena *arena_mt[BLENDER_MAX_THREADS]; /* for multithreading, the first item is sometimes used for non threaded cases too */
-	LinkNode **bucketRect;              /* screen sized 2D array, each pixel has a linked list of ProjPixel's */
-	LinkNode **bucketFaces;             /* bucketRect aligned array linkList of faces overlapping each bucket */
+	MemArena *arena_bucket_mt[BLENDER_MAX_THREADS]; /* scratch of project_bucket_init(), cleared after each bucket */
+	ProjPaintBucket *bucketRect;        /* screen sized 2D array, the pixels and faces of each bucket */
+	ProjPaintBucketCache *bucket_cache; /* owns the faces of the buckets */
 	unsigned char *bucketFlags;         /* store if the bucks have been initialized  */
 #ifndef PROJ_DEBUG_NOSEAMBLEED
 	char *faceSeamFlags;                /* store info about faces, if they are initialized etc*/
@@ -271,7 +315,12 @@ typedef struct ProjPaintState {
 	int thread_tot;
 	int bucketMin[2];
 	int bucketMax[2];
-	int context_bucket_x, context_bucket_y; /* must lock threads while accessing these */
+	/* the buckets under the brush, claimed by the threads with an atomic add of "bucket_claim" */
+	int *bucket_order;
+	int bucket_order_tot;
+	unsigned int bucket_claim;
+	/* copies of projImages with the partial redraws of each thread, kept for the whole stroke */
+	ProjPaintImage *projImages_mt[BLENDER_MAX_THREADS];
 
 	/* redraw */
 	bool need_redraw;
@@ -441,11 +490,11 @@ static float VecZDepthPersp(const float pt[2],
 /* Return the top-most face index that the screen space coord 'pt' touches (or -1) */
 static int project_paint_PickFace(const ProjPaintState *ps, const float pt[2], float w[3], int *side)
 {
-	LinkNode *node;
+	const ProjPaintBucket *bucket;
 	float w_tmp[3];
 	float *v1, *v2, *v3, *v4;
 	int bucket_index;
-	int face_index;
+	int face_index, i;
 	int best_side = -1;
 	int best_face_index = -1;
 	float z_depth_best = FLT_MAX, z_depth;
@@ -460,8 +509,10 @@ static int project_paint_PickFace(const ProjPaintState *ps, const float pt[2], f
 	/* we could return 0 for 1 face buckets, as long as this function assumes
 	 * that the point its testing is only every originated from an existing face */
 
-	for (node = ps->bucketFaces[bucket_index]; node; node = node->next) {
-		face_index = GET_INT_FROM_POINTER(node->link);
+	bucket = ps->bucketRect + bucket_index;
+
+	for (i = 0; i < bucket->faces_tot; i++) {
+		face_index = bucket->faces[i];
 		mf = ps->dm_mface + face_index;
 
 		v1 = ps->screenCoords[mf->v1];
@@ -671,11 +722,11 @@ static int project_paint_occlude_ptv_clip(const ProjPaintState *ps, const MFace
 /* Check if a screenspace location is occluded by any other faces
  * check, pixelScreenCo must be in screenspace, its Z-Depth only needs to be used for comparison
  * and doesn't need to be correct in relation to X and Y coords (this is the case in perspective view) */
-static bool project_bucket_point_occluded(const ProjPaintState *ps, LinkNode *bucketFace,
+static bool project_bucket_point_occluded(const ProjPaintState *ps, const ProjPaintBucket *bucket,
                                           const int orig_face, const float pixelScreenCo[4])
 {
 	MFace *mf;
-	int face_index;
+	int face_index, i;
 	int isect_ret;
 	float w[3]; /* not needed when clipping */
 	const short do_clip = ps->rv3d ? ps->rv3d->rflag & RV3D_CLIPPING : 0;
@@ -683,8 +734,8 @@ static bool project_bucket_point_occluded(const ProjPaintState *ps, LinkNode *bu
 	/* we could return 0 for 1 face buckets, as long as this function assumes
 	 * that the point its testing is only every originated from an existing face */
 
-	for (; bucketFace; bucketFace = bucketFace->next) {
-		face_index = GET_INT_FROM_POINTER(bucketFace->link);
+	for (i = 0; i < bucket->faces_tot; i++) {
+		face_index = bucket->faces[i];
 
 		if (orig_face != face_index) {
 			mf = ps->dm_mface + face_index;
@@ -1337,7 +1388,7 @@ static int project_paint_pixel_sizeof(const short tool)
 
 
 /* run this function when we know a bucket's, face's pixel can be initialized,
- * return the ProjPixel which is added to 'ps->bucketRect[bucket_index]' */
+ * return the ProjPixel which is added to the pixels of 'ps->bucketRect[bucket_index]' */
 static ProjPixel *project_paint_uvpixel_init(
         const ProjPaintState *ps,
         MemArena *arena,
@@ -2169,13 +2220,13 @@ static bool IsectPoly2Df_twoside(const float pt[2], float uv[][2], const int tot
 }
 
 /* One of the most important function for projection painting, since it selects the pixels to be added into each bucket.
- * initialize pixels from this face where it intersects with the bucket_index, optionally initialize pixels for removing seams */
-static void project_paint_face_init(const ProjPaintState *ps, const int thread_index, const int bucket_index, const int face_index, const int image_index, rctf *bucket_bounds, const ImBuf *ibuf, const short clamp_u, const short clamp_v)
+ * initialize pixels from this face where it intersects with the bucket_index, optionally initialize pixels for removing seams.
+ * The pixels are prepended to bucketPixelNodes */
+static void project_paint_face_init(const ProjPaintState *ps, const int thread_index, const int bucket_index, LinkNode **bucketPixelNodes, const int face_index, const int image_index, rctf *bucket_bounds, const ImBuf *ibuf, const short clamp_u, const short clamp_v)
 {
 	/* Projection vars, to get the 3D locations into screen space  */
-	MemArena *arena = ps->arena_mt[thread_index];
-	LinkNode **bucketPixelNodes = ps->bucketRect + bucket_index;
-	LinkNode *bucketFaceNodes = ps->bucketFaces[bucket_index];
+	MemArena *arena = ps->arena_bucket_mt[thread_index];
+	const ProjPaintBucket *bucket = ps->bucketRect + bucket_index;
 
 	const MFace *mf = ps->dm_mface + face_index;
 	const MTFace *tf = ps->dm_mtface + face_index;
@@ -2334,7 +2385,7 @@ static void project_paint_face_init(const ProjPaintState *ps, const int thread_i
 						/* project_paint_PickFace is less complex, use for testing */
 						//if (project_paint_PickFace(ps, pixelScreenCo, w, &side) == face_index) {
 						if ((ps->do_occlude == FALSE) ||
-						    !project_bucket_point_occluded(ps, bucketFaceNodes, face_index, pixelScreenCo))
+						    !project_bucket_point_occluded(ps, bucket, face_index, pixelScreenCo))
 						{
 							mask = project_paint_uvpixel_mask(ps, face_index, side, w);
 
@@ -2512,7 +2563,7 @@ static void project_paint_face_init(const ProjPaintState *ps, const int thread_i
 										}
 
 										if ((ps->do_occlude == FALSE) ||
-										    !project_bucket_point_occluded(ps, bucketFaceNodes, face_index, pixelScreenCo))
+										    !project_bucket_point_occluded(ps, bucket, face_index, pixelScreenCo))
 										{
 											/* Only bother calculating the weights if we intersect */
 											if (ps->do_mask_normal || ps->dm_mtface_clone) {
@@ -2625,8 +2676,12 @@ static void project_bucket_bounds(const ProjPaintState *ps, const int bucket_x,
  * have bucket_bounds as an argument so we don't need to give bucket_x/y the rect function needs */
 static void project_bucket_init(const ProjPaintState *ps, const int thread_index, const int bucket_index, rctf *bucket_bounds)
 {
+	MemArena *arena = ps->arena_mt[thread_index];
+	ProjPaintBucket *bucket = ps->bucketRect + bucket_index;
+	LinkNode *pixel_nodes = NULL;
 	LinkNode *node;
-	int face_index, image_index = 0;
+	int face_index, image_index = 0, i;
+	ProjPixel *projPixel;
 	ImBuf *ibuf = NULL;
 	Image *tpage_last = NULL, *tpage;
 	Image *ima = NULL;
@@ -2636,15 +2691,15 @@ static void project_bucket_init(const ProjPaintState *ps, const int thread_index
 		ibuf = ps->projImages[0].ibuf;
 		ima = ps->projImages[0].ima;
 
-		for (node = ps->bucketFaces[bucket_index]; node; node = node->next) {
-			project_paint_face_init(ps, thread_index, bucket_index, GET_INT_FROM_POINTER(node->link), 0, bucket_bounds, ibuf, ima->tpageflag & IMA_CLAMP_U, ima->tpageflag & IMA_CLAMP_V);
+		for (i = 0; i < bucket->faces_tot; i++) {
+			project_paint_face_init(ps, thread_index, bucket_index, &pixel_nodes, bucket->faces[i], 0, bucket_bounds, ibuf, ima->tpageflag & IMA_CLAMP_U, ima->tpageflag & IMA_CLAMP_V);
 		}
 	}
 	else {
 
 		/* More complicated loop, switch between images */
-		for (node = ps->bucketFaces[bucket_index]; node; node = node->next) {
-			face_index = GET_INT_FROM_POINTER(node->link);
+		for (i = 0; i < bucket->faces_tot; i++) {
+			face_index = bucket->faces[i];
 
 			/* Image context switching */
 			tpage = project_paint_face_image(ps, ps->dm_mtface, face_index);
@@ -2661,10 +2716,26 @@ static void project_bucket_init(const ProjPaintState *ps, const int thread_index
 			}
 			/* context switching done */
 
-			project_paint_face_init(ps, thread_index, bucket_index, face_index, image_index, bucket_bounds, ibuf, ima->tpageflag & IMA_CLAMP_U, ima->tpageflag & IMA_CLAMP_V);
+			project_paint_face_init(ps, thread_index, bucket_index, &pixel_nodes, face_index, image_index, bucket_bounds, ibuf, ima->tpageflag & IMA_CLAMP_U, ima->tpageflag & IMA_CLAMP_V);
 		}
 	}
 
+	/* every dab after this one reads the pixels, in the order they were listed,
+	 * the list and the pixels in it were scratch */
+	bucket->pixels_tot = BLI_linklist_length(pixel_nodes);
+	if (bucket->pixels_tot) {
+		bucket->pixels = BLI_memarena_alloc(arena, (size_t)ps->pixel_sizeof * bucket->pixels_tot);
+		bucket->pixels_co = BLI_memarena_alloc(arena, sizeof(*bucket->pixels_co) * bucket->pixels_tot);
+
+		for (node = pixel_nodes, i = 0; node; node = node->next, i++) {
+			projPixel = PROJ_BUCKET_PIXEL(ps, bucket, i);
+			memcpy(projPixel, node->link, ps->pixel_sizeof);
+			copy_v2_v2(bucket->pixels_co[i], projPixel->projCoSS);
+		}
+	}
+
+	BLI_memarena_clear(ps->arena_bucket_mt[thread_index]);
+
 	ps->bucketFlags[bucket_index] |= PROJ_BUCKET_INIT;
 }
 
@@ -2740,15 +2811,14 @@ static bool project_bucket_face_isect(ProjPaintState *ps, int bucket_x, int buck
 	return 0;
 }
 
-/* Add faces to the bucket but don't initialize its pixels
+/* Add faces to the lists of the buckets in bucketFaces but don't initialize their pixels
  * TODO - when painting occluded, sort the faces on their min-Z and only add faces that faces that are not occluded */
-static void project_paint_delayed_face_init(ProjPaintState *ps, const MFace *mf, const int face_index)
+static void project_paint_face_bucket_bin(ProjPaintState *ps, LinkNode **bucketFaces, MemArena *arena, const MFace *mf, const int face_index)
 {
 	float min[2], max[2], *vCoSS;
 	int bucketMin[2], bucketMax[2]; /* for  ps->bucketRect indexing */
 	int fidx, bucket_x, bucket_y;
 	int has_x_isect = -1, has_isect = 0; /* for early loop exit */
-	MemArena *arena = ps->arena_mt[0]; /* just use the first thread arena since threading has not started yet */
 
 	INIT_MINMAX2(min, max);
 
@@ -2766,7 +2836,7 @@ static void project_paint_delayed_face_init(ProjPaintState *ps, const MFace *mf,
 			if (project_bucket_face_isect(ps, bucket_x, bucket_y, mf)) {
 				int bucket_index = bucket_x + (bucket_y * ps->buckets_x);
 				BLI_linklist_prepend_arena(
-				        &ps->bucketFaces[bucket_index],
+				        &bucketFaces[bucket_index],
 				        SET_INT_IN_POINTER(face_index), /* cast to a pointer to shut up the compiler */
 				        arena
 				        );
@@ -2784,7 +2854,10 @@ static void project_paint_delayed_face_init(ProjPaintState *ps, const MFace *mf,
 			break;
 		}
 	}
+}
 
+static void project_paint_delayed_face_init(ProjPaintState *ps, const MFace *mf, const int face_index)
+{
 #ifndef PROJ_DEBUG_NOSEAMBLEED
 	if (ps->seam_bleed_px > 0.0f) {
 		if (!mf->v4) {
@@ -2795,8 +2868,241 @@ static void project_paint_delayed_face_init(ProjPaintState *ps, const MFace *mf,
 #endif
 }
 
-/* run once per stroke before projection painting */
-static void project_paint_begin(ProjPaintState *ps)
+/* the faces still use the vertices they were binned with */
+static bool project_paint_topology_equals(const ProjPaintBucketCache *cache, const MFace *mf, const int totface)
+{
+	int a;
+
+	if (cache->faceVerts == NULL || cache->totface != totface)
+		return false;
+
+	for (a = 0; a < totface; a++, mf++) {
+		if (memcmp(cache->faceVerts[a], &mf->v1, sizeof(*cache->faceVerts)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void project_paint_bucket_cache_free(ProjPaintBucketCache *cache)
+{
+	int bucket_index;
+
+	if (cache->bucketFaces) {
+		for (bucket_index = 0; bucket_index < cache->buckets_x * cache->buckets_y; bucket_index++) {
+			if (cache->bucketFaces[bucket_index]) {
+				MEM_freeN(cache->bucketFaces[bucket_index]);
+			}
+		}
+	}
+
+	MEM_SAFE_FREE(cache->bucketFaces);
+	MEM_SAFE_FREE(cache->bucketFaces_tot);
+	MEM_SAFE_FREE(cache->screenCoords);
+	MEM_SAFE_FREE(cache->faceFlags);
+	MEM_SAFE_FREE(cache->faceVerts);
+	cache->ob = NULL;
+}
+
+/* Fill in the faces of every bucket from the faces tagged PROJ_FACE_BIN.
+ *
+ * The binning is kept in the cache so the next stroke can start from it: when
+ * the topology and the bucket grid are the same, only the faces which moved on
+ * the screen or changed their PROJ_FACE_BIN tag are binned again, and only the
+ * buckets they leave or enter are rebuilt. From an unchanged view nothing is
+ * rebuilt at all. The buckets keep the faces in descending order, the order a
+ * full rebuild gives them. */
+static void project_paint_bucket_faces_init(ProjPaintState *ps, ProjPaintBucketCache *cache, char *faceFlags)
+{
+	const int bucket_tot = ps->buckets_x * ps->buckets_y;
+	MemArena *arena = ps->arena_bucket_mt[0];
+	LinkNode **bucketFaces = NULL; /* the faces binned again, collected per bucket */
+	char *bucketDirty = NULL;
+	const MFace *mf;
+	int a, face_index, bucket_index, changed_tot = 0;
+	bool rebuild;
+
+	rebuild = (cache->bucketFaces == NULL ||
+	           cache->ob != ps->ob ||
+	           cache->totvert != ps->dm_totvert ||
+	           cache->buckets_x != ps->buckets_x ||
+	           cache->buckets_y != ps->buckets_y ||
+	           !equals_v2v2(cache->screenMin, ps->screenMin) ||
+	           !equals_v2v2(cache->screenMax, ps->screenMax) ||
+	           !project_paint_topology_equals(cache, ps->dm_mface, ps->dm_totface));
+
+	if (rebuild == false) {
+		/* find the faces that need binning again, the bins only depend on the 2D screen coords */
+		char *vertChanged = MEM_callocN(sizeof(char) * ps->dm_totvert, "paint-vertChanged");
+
+		for (a = 0; a < ps->dm_totvert; a++) {
+			if (!equals_v2v2(cache->screenCoords[a], ps->screenCoords[a])) {
+				vertChanged[a] = 1;
+			}
+		}
+
+		for (face_index = 0, mf = ps->dm_mface; face_index < ps->dm_totface; face_index++, mf++) {
+			if ((faceFlags[face_index] != cache->faceFlags[face_index]) ||
+			    (faceFlags[face_index] &&
+			     (vertChanged[mf->v1] || vertChanged[mf->v2] || vertChanged[mf->v3] || (mf->v4 && vertChanged[mf->v4]))))
+			{
+				faceFlags[face_index] |= PROJ_FACE_BIN_CHANGED;
+				changed_tot++;
+			}
+		}
+
+		MEM_freeN(vertChanged);
+
+		/* past this a full rebuild is cheaper than merging */
+		if (changed_tot > ps->dm_totface / 4) {
+			rebuild = true;
+		}
+	}
+
+	if (rebuild) {
+		project_paint_bucket_cache_free(cache);
+
+		cache->bucketFaces = MEM_callocN(sizeof(int *) * bucket_tot, "paint-cacheBucketFaces");
+		cache->bucketFaces_tot = MEM_callocN(sizeof(int) * bucket_tot, "paint-cacheBucketFacesTot");
+
+		cache->ob = ps->ob;
+		cache->totvert = ps->dm_totvert;
+		cache->totface = ps->dm_totface;
+		cache->faceVerts = MEM_mallocN(sizeof(*cache->faceVerts) * ps->dm_totface, "paint-cacheFaceVerts");
+		for (face_index = 0, mf = ps->dm_mface; face_index < ps->dm_totface; face_index++, mf++) {
+			memcpy(cache->faceVerts[face_index], &mf->v1, sizeof(*cache->faceVerts));
+		}
+		cache->buckets_x = ps->buckets_x;
+		cache->buckets_y = ps->buckets_y;
+		copy_v2_v2(cache->screenMin, ps->screenMin);
+		copy_v2_v2(cache->screenMax, ps->screenMax);
+	}
+
+	if (rebuild || changed_tot) {
+		bucketFaces = MEM_callocN(sizeof(LinkNode *) * bucket_tot, "paint-bucketFaces");
+
+		if (rebuild == false) {
+			/* the buckets the changed faces were binned into before */
+			bucketDirty = MEM_callocN(sizeof(char) * bucket_tot, "paint-bucketDirty");
+
+			for (face_index = 0, mf = ps->dm_mface; face_index < ps->dm_totface; face_index++, mf++) {
+				if ((faceFlags[face_index] & PROJ_FACE_BIN_CHANGED) && cache->faceFlags[face_index]) {
+					float min[2], max[2];
+					int bucketMin[2], bucketMax[2];
+					int bucket_x, bucket_y;
+
+					INIT_MINMAX2(min, max);
+					minmax_v2v2_v2(min, max, cache->screenCoords[mf->v1]);
+					minmax_v2v2_v2(min, max, cache->screenCoords[mf->v2]);
+					minmax_v2v2_v2(min, max, cache->screenCoords[mf->v3]);
+					if (mf->v4) {
+						minmax_v2v2_v2(min, max, cache->screenCoords[mf->v4]);
+					}
+
+					project_paint_bucket_bounds(ps, min, max, bucketMin, bucketMax);
+
+					for (bucket_y = bucketMin[1]; bucket_y < bucketMax[1]; bucket_y++) {
+						for (bucket_x = bucketMin[0]; bucket_x < bucketMax[0]; bucket_x++) {
+							bucketDirty[bucket_x + (bucket_y * ps->buckets_x)] = 1;
+						}
+					}
+				}
+			}
+		}
+
+		/* bin the faces at their new place */
+		for (face_index = 0, mf = ps->dm_mface; face_index < ps->dm_totface; face_index++, mf++) {
+			if ((faceFlags[face_index] & PROJ_FACE_BIN) &&
+			    (rebuild || (faceFlags[face_index] & PROJ_FACE_BIN_CHANGED)))
+			{
+				project_paint_face_bucket_bin(ps, bucketFaces, arena, mf, face_index);
+			}
+		}
+
+		/* merge the new lists with the cached faces that stay, both are in descending order */
+		for (bucket_index = 0; bucket_index < bucket_tot; bucket_index++) {
+			int *faces_prev, faces_prev_tot, *faces, faces_tot;
+			LinkNode *node;
+			int i, j;
+
+			if (bucketFaces[bucket_index] == NULL && (bucketDirty == NULL || bucketDirty[bucket_index] == 0)) {
+				continue;
+			}
+
+			faces_prev = cache->bucketFaces[bucket_index];
+			faces_prev_tot = cache->bucketFaces_tot[bucket_index];
+
+			faces_tot = BLI_linklist_length(bucketFaces[bucket_index]);
+			for (i = 0; i < faces_prev_tot; i++) {
+				if ((faceFlags[faces_prev[i]] & PROJ_FACE_BIN_CHANGED) == 0) {
+					faces_tot++;
+				}
+			}
+
+			faces = faces_tot ? MEM_mallocN(sizeof(int) * faces_tot, "paint-cacheFaces") : NULL;
+
+			node = bucketFaces[bucket_index];
+			for (i = 0, j = 0; j < faces_tot; j++) {
+				while (i < faces_prev_tot && (faceFlags[faces_prev[i]] & PROJ_FACE_BIN_CHANGED)) {
+					i++;
+				}
+
+				if (node && (i == faces_prev_tot || GET_INT_FROM_POINTER(node->link) > faces_prev[i])) {
+					faces[j] = GET_INT_FROM_POINTER(node->link);
+					node = node->next;
+				}
+				else {
+					faces[j] = faces_prev[i++];
+				}
+			}
+
+			if (faces_prev) {
+				MEM_freeN(faces_prev);
+			}
+			cache->bucketFaces[bucket_index] = faces;
+			cache->bucketFaces_tot[bucket_index] = faces_tot;
+		}
+
+		MEM_freeN(bucketFaces);
+		if (bucketDirty) {
+			MEM_freeN(bucketDirty);
+		}
+		BLI_memarena_clear(arena);
+
+		/* keep what the faces were binned with */
+		if (cache->screenCoords == NULL) {
+			cache->screenCoords = MEM_mallocN(sizeof(float) * ps->dm_totvert * 2, "paint-cacheScreenCoords");
+		}
+		for (a = 0; a < ps->dm_totvert; a++) {
+			copy_v2_v2(cache->screenCoords[a], ps->screenCoords[a]);
+		}
+
+		if (cache->faceFlags == NULL) {
+			cache->faceFlags = MEM_mallocN(sizeof(char) * ps->dm_totface, "paint-cacheFaceFlags");
+		}
+		for (face_index = 0; face_index < ps->dm_totface; face_index++) {
+			cache->faceFlags[face_index] = faceFlags[face_index] & PROJ_FACE_BIN;
+		}
+	}
+
+	/* the buckets borrow the cached arrays for the stroke */
+	for (bucket_index = 0; bucket_index < bucket_tot; bucket_index++) {
+		ps->bucketRect[bucket_index].faces = cache->bucketFaces[bucket_index];
+		ps->bucketRect[bucket_index].faces_tot = cache->bucketFaces_tot[bucket_index];
+	}
+}
+
+/* free the binning kept between strokes */
+void ED_imapaint_proj_cache_free(void)
+{
+	BLI_assert(proj_bucket_cache.in_use == false);
+	project_paint_bucket_cache_free(&proj_bucket_cache);
+}
+
+/* run once per stroke before projection painting. Pending layer transforms
+ * of the painted images are applied in undo steps named "undo_name", so it
+ * runs before the undo push of the stroke */
+static void project_paint_begin(ProjPaintState *ps, const char *undo_name)
 {
 	/* Viewport vars */
 	float mat[3][3];
@@ -2829,6 +3135,8 @@ static void project_paint_begin(ProjPaintState *ps)
 
 	MemArena *arena; /* at the moment this is just ps->arena_mt[0], but use this to show were not multithreading */
 
+	char *faceFlags; /* PROJ_FACE_BIN for the faces to paint on */
+
 	const int diameter = 2 * BKE_brush_size_get(ps->scene, ps->brush);
 
 	bool reset_threads = false;
@@ -3107,8 +3415,9 @@ static void project_paint_begin(ProjPaintState *ps)
 	CLAMP(ps->buckets_x, PROJ_BUCKET_RECT_MIN, PROJ_BUCKET_RECT_MAX);
 	CLAMP(ps->buckets_y, PROJ_BUCKET_RECT_MIN, PROJ_BUCKET_RECT_MAX);
 
-	ps->bucketRect = (LinkNode **)MEM_callocN(sizeof(LinkNode *) * ps->buckets_x * ps->buckets_y, "paint-bucketRect");
-	ps->bucketFaces = (LinkNode **)MEM_callocN(sizeof(LinkNode *) * ps->buckets_x * ps->buckets_y, "paint-bucketFaces");
+	ps->bucketRect = (ProjPaintBucket *)MEM_callocN(sizeof(ProjPaintBucket) * ps->buckets_x * ps->buckets_y, "paint-bucketRect");
+	ps->bucket_order = (int *)MEM_mallocN(sizeof(int) * ps->buckets_x * ps->buckets_y, "paint-bucketOrder");
+	faceFlags = (char *)MEM_callocN(sizeof(char) * ps->dm_totface, "paint-faceFlags");
 
 	ps->bucketFlags = (unsigned char *)MEM_callocN(sizeof(char) * ps->buckets_x * ps->buckets_y, "paint-bucketFaces");
 #ifndef PROJ_DEBUG_NOSEAMBLEED
@@ -3125,7 +3434,7 @@ static void project_paint_begin(ProjPaintState *ps)
 	 * threads is being able to fill in multiple buckets at once.
 	 * Only use threads for bigger brushes. */
 
-	ps->thread_tot = BKE_scene_num_threads(ps->scene);
+	ps->thread_tot = min_ii(BKE_scene_num_threads(ps->scene), BLI_task_scheduler_num_threads(BLI_task_scheduler_get()));
 
 	/* workaround for #35057, disable threading if diameter is less than is possible for
 	 * optimum bucket number generation */
@@ -3134,6 +3443,7 @@ static void project_paint_begin(ProjPaintState *ps)
 
 	for (a = 0; a < ps->thread_tot; a++) {
 		ps->arena_mt[a] = BLI_memarena_new(MEM_SIZE_OPTIMAL(1 << 16), "project paint arena");
+		ps->arena_bucket_mt[a] = BLI_memarena_new(MEM_SIZE_OPTIMAL(1 << 16), "project paint bucket arena");
 	}
 
 	arena = ps->arena_mt[0];
@@ -3281,24 +3591,50 @@ static void project_paint_begin(ProjPaintState *ps)
 
 			if (image_index != -1) {
 				/* Initialize the faces screen pixels */
-				/* Add this to a list to initialize later */
+				/* Tag it to bin into the buckets later */
 				project_paint_delayed_face_init(ps, mf, face_index);
+				faceFlags[face_index] = PROJ_FACE_BIN;
 			}
 		}
 	}
 
+	/* the view can reuse the faces of the last stroke's buckets */
+	if (ps->source == PROJ_SRC_VIEW && proj_bucket_cache.in_use == false) {
+		ps->bucket_cache = &proj_bucket_cache;
+	}
+	else {
+		ps->bucket_cache = MEM_callocN(sizeof(ProjPaintBucketCache), "paint-bucketCache");
+	}
+	ps->bucket_cache->in_use = true;
+
+	project_paint_bucket_faces_init(ps, ps->bucket_cache, faceFlags);
+
+	MEM_freeN(faceFlags);
+
 	/* build an array of images we use*/
 	projIma = ps->projImages = (ProjPaintImage *)BLI_memarena_alloc(arena, sizeof(ProjPaintImage) * ps->image_tot);
 
 	for (node = image_LinkList, i = 0; node; node = node->next, i++, projIma++) {
 		projIma->ima = node->link;
 		projIma->touch = 0;
+
+		/* painting edits the layer as it's shown, like 2D painting does */
+		ED_image_layer_apply_transform(undo_name, projIma->ima);
 		projIma->ibuf = BKE_image_acquire_ibuf(projIma->ima, NULL, NULL, IMA_IBUF_LAYER);
 		projIma->partRedrawRect =  BLI_memarena_calloc(arena, sizeof(ImagePaintPartialRedraw) * PROJ_BOUNDBOX_SQUARED);
 	}
 
 	/* we have built the array, discard the linked list */
 	BLI_linklist_free(image_LinkList, NULL);
+
+	/* the partial redraws of each thread, filled in again with every dab */
+	for (a = 0; a < ps->thread_tot; a++) {
+		ps->projImages_mt[a] = BLI_memarena_alloc(ps->arena_mt[a], sizeof(ProjPaintImage) * ps->image_tot);
+
+		for (i = 0; i < ps->image_tot; i++) {
+			ps->projImages_mt[a][i].partRedrawRect = BLI_memarena_alloc(ps->arena_mt[a], sizeof(ImagePaintPartialRedraw) * PROJ_BOUNDBOX_SQUARED);
+		}
+	}
 }
 
 static void paint_proj_begin_clone(ProjPaintState *ps, const float mouse[2])
@@ -3325,7 +3661,8 @@ static void project_paint_end(ProjPaintState *ps)
 	if (U.uiflag & USER_GLOBALUNDO) {
 		ProjPixel *projPixel;
 		ImBuf *tmpibuf = NULL, *tmpibuf_float = NULL;
-		LinkNode *pixel_node;
+		ProjPaintBucket *bucket;
+		int pixel_index;
 		void *tilerect;
 		MemArena *arena = ps->arena_mt[0]; /* threaded arena re-used for non threaded case */
 
@@ -3347,12 +3684,12 @@ static void project_paint_end(ProjPaintState *ps)
 			last_projIma->ibuf->userflags |= IB_BITMAPDIRTY;
 		}
 
-		for (bucket_index = 0; bucket_index < bucket_tot; bucket_index++) {
+		for (bucket_index = 0, bucket = ps->bucketRect; bucket_index < bucket_tot; bucket_index++, bucket++) {
 			/* loop through all pixels */
-			for (pixel_node = ps->bucketRect[bucket_index]; pixel_node; pixel_node = pixel_node->next) {
+			for (pixel_index = 0; pixel_index < bucket->pixels_tot; pixel_index++) {
 
 				/* ok we have a pixel, was it modified? */
-				projPixel = (ProjPixel *)pixel_node->link;
+				projPixel = PROJ_BUCKET_PIXEL(ps, bucket, pixel_index);
 
 				if (last_image_index != projPixel->image_index) {
 					/* set the context */
@@ -3410,13 +3747,24 @@ static void project_paint_end(ProjPaintState *ps)
 	/* dereference used image buffers */
 	for (a = 0, projIma = ps->projImages; a < ps->image_tot; a++, projIma++) {
 		BKE_image_release_ibuf(projIma->ima, projIma->ibuf, NULL);
+
+		/* a few strokes on a layer leave it mostly uniform, it goes back to its tiles */
+		imalayer_make_sparse(projIma->ima, imalayer_get_current(projIma->ima));
 	}
 
 	BKE_image_release_ibuf(ps->reproject_image, ps->reproject_ibuf, NULL);
 
 	MEM_freeN(ps->screenCoords);
 	MEM_freeN(ps->bucketRect);
-	MEM_freeN(ps->bucketFaces);
+	MEM_freeN(ps->bucket_order);
+
+	if (ps->bucket_cache == &proj_bucket_cache) {
+		ps->bucket_cache->in_use = false;
+	}
+	else {
+		project_paint_bucket_cache_free(ps->bucket_cache);
+		MEM_freeN(ps->bucket_cache);
+	}
 	MEM_freeN(ps->bucketFlags);
 
 #ifndef PROJ_DEBUG_NOSEAMBLEED
@@ -3431,6 +3779,7 @@ static void project_paint_end(ProjPaintState *ps)
 
 	for (a = 0; a < ps->thread_tot; a++) {
 		BLI_memarena_free(ps->arena_mt[a]);
+		BLI_memarena_free(ps->arena_bucket_mt[a]);
 	}
 
 	/* copy for subsurf/multires, so throw away */
@@ -3514,9 +3863,13 @@ static bool project_image_refresh_tagged(ProjPaintState *ps)
 	return redraw;
 }
 
-/* run this per painting onto each mouse location */
+/* run this per painting onto each mouse location, lists the buckets to paint */
 static bool project_bucket_iter_init(ProjPaintState *ps, const float mval_f[2])
 {
+	const int diameter = 2 * BKE_brush_size_get(ps->scene, ps->brush);
+	rctf bucket_bounds;
+	int bucket_x, bucket_y;
+
 	if (ps->source == PROJ_SRC_VIEW) {
 		float min_brush[2], max_brush[2];
 		const float radius = (float)BKE_brush_size_get(ps->scene, ps->brush);
@@ -3537,9 +3890,6 @@ static bool project_bucket_iter_init(ProjPaintState *ps, const float mval_f[2])
 		if (ps->bucketMin[0] == ps->bucketMax[0] || ps->bucketMin[1] == ps->bucketMax[1]) {
 			return 0;
 		}
-
-		ps->context_bucket_x = ps->bucketMin[0];
-		ps->context_bucket_y = ps->bucketMin[1];
 	}
 	else { /* reproject: PROJ_SRC_* */
 		ps->bucketMin[0] = 0;
@@ -3547,47 +3897,42 @@ static bool project_bucket_iter_init(ProjPaintState *ps, const float mval_f[2])
 
 		ps->bucketMax[0] = ps->buckets_x;
 		ps->bucketMax[1] = ps->buckets_y;
-
-		ps->context_bucket_x = 0;
-		ps->context_bucket_y = 0;
 	}
-	return 1;
-}
 
+	ps->bucket_order_tot = 0;
+	ps->bucket_claim = 0;
 
-static bool project_bucket_iter_next(ProjPaintState *ps, int *bucket_index, rctf *bucket_bounds, const float mval[2])
-{
-	const int diameter = 2 * BKE_brush_size_get(ps->scene, ps->brush);
-
-	if (ps->thread_tot > 1)
-		BLI_lock_thread(LOCK_CUSTOM1);
+	for (bucket_y = ps->bucketMin[1]; bucket_y < ps->bucketMax[1]; bucket_y++) {
+		for (bucket_x = ps->bucketMin[0]; bucket_x < ps->bucketMax[0]; bucket_x++) {
 
-	//printf("%d %d\n", ps->context_bucket_x, ps->context_bucket_y);
-
-	for (; ps->context_bucket_y < ps->bucketMax[1]; ps->context_bucket_y++) {
-		for (; ps->context_bucket_x < ps->bucketMax[0]; ps->context_bucket_x++) {
-
-			/* use bucket_bounds for project_bucket_isect_circle and project_bucket_init*/
-			project_bucket_bounds(ps, ps->context_bucket_x, ps->context_bucket_y, bucket_bounds);
+			/* use bucket_bounds for project_bucket_isect_circle */
+			project_bucket_bounds(ps, bucket_x, bucket_y, &bucket_bounds);
 
 			if ((ps->source != PROJ_SRC_VIEW) ||
-			    project_bucket_isect_circle(mval, (float)(diameter * diameter), bucket_bounds))
+			    project_bucket_isect_circle(mval_f, (float)(diameter * diameter), &bucket_bounds))
 			{
-				*bucket_index = ps->context_bucket_x + (ps->context_bucket_y * ps->buckets_x);
-				ps->context_bucket_x++;
-
-				if (ps->thread_tot > 1)
-					BLI_unlock_thread(LOCK_CUSTOM1);
-
-				return 1;
+				ps->bucket_order[ps->bucket_order_tot++] = bucket_x + (bucket_y * ps->buckets_x);
 			}
 		}
-		ps->context_bucket_x = ps->bucketMin[0];
 	}
 
-	if (ps->thread_tot > 1)
-		BLI_unlock_thread(LOCK_CUSTOM1);
-	return 0;
+	return (ps->bucket_order_tot != 0);
+}
+
+/* each call claims the next bucket of the list, no locking needed */
+static bool project_bucket_iter_next(ProjPaintState *ps, int *bucket_index, rctf *bucket_bounds)
+{
+	const unsigned int claim = atomic_add_uint32(&ps->bucket_claim, 1) - 1;
+
+	if (claim >= (unsigned int)ps->bucket_order_tot)
+		return 0;
+
+	*bucket_index = ps->bucket_order[claim];
+
+	/* use bucket_bounds for project_bucket_init */
+	project_bucket_bounds(ps, *bucket_index % ps->buckets_x, *bucket_index / ps->buckets_x, bucket_bounds);
+
+	return 1;
 }
 
 /* Each thread gets one of these, also used as an argument to pass to project_paint_op */
@@ -3807,6 +4152,7 @@ static void *do_projectpaint_thread(void *ph_v)
 	/* Done with args from ProjectHandle */
 
 	LinkNode *node;
+	ProjPaintBucket *bucket;
 	ProjPixel *projPixel;
 	Brush *brush = ps->brush;
 
@@ -3817,7 +4163,7 @@ static void *do_projectpaint_thread(void *ph_v)
 	float dist_nosqrt, dist;
 
 	float falloff;
-	int bucket_index;
+	int bucket_index, pixel_index;
 	bool is_floatbuf = false;
 	const short tool =  ps->tool;
 	rctf bucket_bounds;
@@ -3852,7 +4198,7 @@ static void *do_projectpaint_thread(void *ph_v)
 
 	/* printf("brush bounds %d %d %d %d\n", bucketMin[0], bucketMin[1], bucketMax[0], bucketMax[1]); */
 
-	while (project_bucket_iter_next(ps, &bucket_index, &bucket_bounds, pos)) {
+	while (project_bucket_iter_next(ps, &bucket_index, &bucket_bounds)) {
 
 		/* Check this bucket and its faces are initialized */
 		if (ps->bucketFlags[bucket_index] == PROJ_BUCKET_NULL) {
@@ -3860,12 +4206,14 @@ static void *do_projectpaint_thread(void *ph_v)
 			project_bucket_init(ps, thread_index, bucket_index, &bucket_bounds);
 		}
 
+		bucket = ps->bucketRect + bucket_index;
+
 		if (ps->source != PROJ_SRC_VIEW) {
 
 			/* Re-Projection, simple, no brushes! */
 
-			for (node = ps->bucketRect[bucket_index]; node; node = node->next) {
-				projPixel = (ProjPixel *)node->link;
+			for (pixel_index = 0; pixel_index < bucket->pixels_tot; pixel_index++) {
+				projPixel = PROJ_BUCKET_PIXEL(ps, bucket, pixel_index);
 
 				/* copy of code below */
 				if (last_index != projPixel->image_index) {
@@ -3910,14 +4258,14 @@ static void *do_projectpaint_thread(void *ph_v)
 		else {
 			/* Normal brush painting */
 
-			for (node = ps->bucketRect[bucket_index]; node; node = node->next) {
+			for (pixel_index = 0; pixel_index < bucket->pixels_tot; pixel_index++) {
 
-				projPixel = (ProjPixel *)node->link;
-
-				dist_nosqrt = len_squared_v2v2(projPixel->projCoSS, pos);
+				/* only the coordinates are read for pixels outside the brush */
+				dist_nosqrt = len_squared_v2v2(bucket->pixels_co[pixel_index], pos);
 
 				/*if (dist < radius) {*/ /* correct but uses a sqrtf */
 				if (dist_nosqrt <= brush_radius_sq) {
+					projPixel = PROJ_BUCKET_PIXEL(ps, bucket, pixel_index);
 					dist = sqrtf(dist_nosqrt);
 
 					falloff = BKE_brush_curve_strength_clamp(ps->brush, dist, brush_radius);
@@ -4078,6 +4426,11 @@ static void *do_projectpaint_thread(void *ph_v)
 	return NULL;
 }
 
+static void do_projectpaint_task(TaskPool *UNUSED(pool), void *taskdata, int UNUSED(threadid))
+{
+	do_projectpaint_thread(taskdata);
+}
+
 static bool project_paint_op(void *state, const float lastpos[2], const float pos[2])
 {
 	/* First unpack args from the struct */
@@ -4085,7 +4438,7 @@ static bool project_paint_op(void *state, const float lastpos[2], const float po
 	bool touch_any = false;
 
 	ProjectHandle handles[BLENDER_MAX_THREADS];
-	ListBase threads;
+	int thread_tot;
 	int a, i;
 
 	struct ImagePool *pool;
@@ -4094,52 +4447,52 @@ static bool project_paint_op(void *state, const float lastpos[2], const float po
 		return 0;
 	}
 
-	if (ps->thread_tot > 1)
-		BLI_init_threads(&threads, do_projectpaint_thread, ps->thread_tot);
+	/* threads take the buckets one by one, small brushes don't need them all */
+	thread_tot = min_ii(ps->thread_tot, ps->bucket_order_tot);
 
 	pool = BKE_image_pool_new();
 
-	/* get the threads running */
-	for (a = 0; a < ps->thread_tot; a++) {
-
-		/* set defaults in handles */
-		//memset(&handles[a], 0, sizeof(BakeShade));
-
+	for (a = 0; a < thread_tot; a++) {
 		handles[a].ps = ps;
 		copy_v2_v2(handles[a].mval, pos);
 		copy_v2_v2(handles[a].prevmval, lastpos);
 
 		/* thread specific */
 		handles[a].thread_index = a;
-
-		handles[a].projImages = (ProjPaintImage *)BLI_memarena_alloc(ps->arena_mt[a], ps->image_tot * sizeof(ProjPaintImage));
-
-		memcpy(handles[a].projImages, ps->projImages, ps->image_tot * sizeof(ProjPaintImage));
+		handles[a].projImages = ps->projImages_mt[a];
 
 		/* image bounds */
 		for (i = 0; i < ps->image_tot; i++) {
-			handles[a].projImages[i].partRedrawRect = (ImagePaintPartialRedraw *)BLI_memarena_alloc(ps->arena_mt[a], sizeof(ImagePaintPartialRedraw) * PROJ_BOUNDBOX_SQUARED);
-			memcpy(handles[a].projImages[i].partRedrawRect, ps->projImages[i].partRedrawRect, sizeof(ImagePaintPartialRedraw) * PROJ_BOUNDBOX_SQUARED);
+			ImagePaintPartialRedraw *partRedrawRect = handles[a].projImages[i].partRedrawRect;
+
+			handles[a].projImages[i] = ps->projImages[i];
+			handles[a].projImages[i].partRedrawRect = partRedrawRect;
+			memcpy(partRedrawRect, ps->projImages[i].partRedrawRect, sizeof(ImagePaintPartialRedraw) * PROJ_BOUNDBOX_SQUARED);
 		}
 
 		handles[a].pool = pool;
-
-		if (ps->thread_tot > 1)
-			BLI_insert_thread(&threads, &handles[a]);
 	}
 
-	if (ps->thread_tot > 1) /* wait for everything to be done */
-		BLI_end_threads(&threads);
-	else
-		do_projectpaint_thread(&handles[0]);
+	if (thread_tot > 1) {
+		TaskPool *task_pool = BLI_task_pool_create(BLI_task_scheduler_get(), ps);
+
+		for (a = 0; a < thread_tot; a++)
+			BLI_task_pool_push(task_pool, do_projectpaint_task, &handles[a], false, TASK_PRIORITY_HIGH);
 
+		/* wait for everything to be done */
+		BLI_task_pool_work_and_wait(task_pool);
+		BLI_task_pool_free(task_pool);
+	}
+	else {
+		do_projectpaint_thread(&handles[0]);
+	}
 
 	BKE_image_pool_free(pool);
 
 	/* move threaded bounds back into ps->projectPartialRedraws */
 	for (i = 0; i < ps->image_tot; i++) {
 		int touch = 0;
-		for (a = 0; a < ps->thread_tot; a++) {
+		for (a = 0; a < thread_tot; a++) {
 			touch |= partial_redraw_array_merge(ps->projImages[i].partRedrawRect, handles[a].projImages[i].partRedrawRect, PROJ_BOUNDBOX_SQUARED);
 		}
 
@@ -4272,7 +4625,7 @@ static void project_state_init(bContext *C, Object *ob, ProjPaintState *ps, int
 	return;
 }
 
-void *paint_proj_new_stroke(bContext *C, Object *ob, const float mouse[2], int mode)
+void *paint_proj_new_stroke(bContext *C, wmOperator *op, Object *ob, const float mouse[2], int mode)
 {
 	ProjPaintState *ps = MEM_callocN(sizeof(ProjPaintState), "ProjectionPaintState");
 	project_state_init(C, ob, ps, mode);
@@ -4298,7 +4651,7 @@ void *paint_proj_new_stroke(bContext *C, Object *ob, const float mouse[2], int m
 		BKE_brush_size_set(ps->scene, ps->brush, 2);
 
 	/* allocate and initialize spatial data structures */
-	project_paint_begin(ps);
+	project_paint_begin(ps, op->type->name);
 
 	if (ps->dm == NULL) {
 		MEM_freeN(ps);
@@ -4369,6 +4722,9 @@ static int texture_paint_camera_project_exec(bContext *C, wmOperator *op)
 	}
 
 	ps.reproject_image = image;
+
+	/* the pixels are projected as they're shown */
+	ED_image_layer_apply_transform(op->type->name, image);
 	ps.reproject_ibuf = BKE_image_acquire_ibuf(image, NULL, NULL, IMA_IBUF_LAYER);
 
 	if (ps.reproject_ibuf == NULL || ps.reproject_ibuf->rect == NULL) {
@@ -4413,11 +4769,9 @@ static int texture_paint_camera_project_exec(bContext *C, wmOperator *op)
 
 	scene->toolsettings->imapaint.flag |= IMAGEPAINT_DRAWING;
 
-	ED_undo_paint_push_begin(UNDO_PAINT_IMAGE, op->type->name,
-	                      ED_image_undo_restore, ED_image_undo_free);
-
-	/* allocate and initialize spatial data structures */
-	project_paint_begin(&ps);
+	/* allocate and initialize spatial data structures, layer transforms are
+	 * applied in undo steps of their own first */
+	project_paint_begin(&ps, op->type->name);
 
 	if (ps.dm == NULL) {
 		BKE_brush_size_set(scene, ps.brush, orig_brush_size);
@@ -4428,6 +4782,9 @@ static int texture_paint_camera_project_exec(bContext *C, wmOperator *op)
 		float lastpos[2] = {0.0, 0.0};
 		int a;
 
+		ED_undo_paint_push_begin(UNDO_PAINT_IMAGE, op->type->name,
+		                         ED_image_undo_restore, ED_image_undo_free);
+
 		for (a = 0; a < ps.image_tot; a++)
 			partial_redraw_array_init(ps.projImages[a].partRedrawRect);
 
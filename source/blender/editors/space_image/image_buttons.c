@@ -663,7 +663,7 @@ void uiTemplateImage(uiLayout *layout, bContext *C, PointerRNA *ptr, const char
 			}
 			else if (ima->source != IMA_SRC_GENERATED) {
 				if (compact == 0) {
-					ImBuf *ibuf_l = BKE_image_acquire_ibuf(ima, iuser, &lock, IMA_IBUF_LAYER);
+					ImBuf *ibuf_l = BKE_image_acquire_ibuf(ima, iuser, &lock, IMA_IBUF_IMA);
 					ImBuf *ibuf = ima->ibufs.first;
 					image_info(scene, iuser, ima, ibuf, str, MAX_INFO_LEN);
 					BKE_image_release_ibuf(ima, ibuf_l, lock);
@@ -682,7 +682,7 @@ void uiTemplateImage(uiLayout *layout, bContext *C, PointerRNA *ptr, const char
 
 			if (ima->source != IMA_SRC_GENERATED) {
 				if (compact == 0) { /* background image view doesnt need these */
-					ImBuf *ibuf_l = BKE_image_acquire_ibuf(ima, iuser, NULL, IMA_IBUF_LAYER);
+					ImBuf *ibuf_l = BKE_image_acquire_ibuf(ima, iuser, NULL, IMA_IBUF_IMA);
 					ImBuf *ibuf = ima->ibufs.first;
 					int has_alpha = TRUE;
 
@@ -763,7 +763,9 @@ static unsigned char *get_alpha_clone_image(const bContext *C, Scene *scene, int
 	if (!brush || !brush->clone.image)
 		return NULL;
 	
-	ibuf = BKE_image_acquire_ibuf(brush->clone.image, NULL, NULL, IMA_IBUF_LAYER);
+	/* the image as it's shown, acquiring its layer from a redraw would apply
+	 * a pending transform of it without an undo step */
+	ibuf = BKE_image_acquire_ibuf(brush->clone.image, NULL, NULL, IMA_IBUF_IMA);
 
 	if (!ibuf)
 		return NULL;
@@ -854,6 +856,45 @@ static void layer_draw_boundary(int xmin, int ymin, int xsize, int ysize, float
 	glDisable(GL_LINE_STIPPLE);
 }
 
+/* hidden groups hide their layers */
+static bool layer_is_shown(ImageLayer *layer)
+{
+	for (; layer; layer = imalayer_get_parent(layer)) {
+		if (!(layer->visible & IMA_LAYER_VISIBLE))
+			return false;
+	}
+
+	return true;
+}
+
+/* "ibuf" halved "level" times, NULL when it's already too small for it */
+static ImBuf *layer_draw_reduce(ImBuf *ibuf, int level)
+{
+	ImBuf *result = NULL, *half;
+
+	for (; level > 0 && ibuf->x > 1 && ibuf->y > 1; level--) {
+		half = IMB_onehalf(ibuf);
+		if (result)
+			IMB_freeImBuf(result);
+		ibuf = result = half;
+	}
+
+	return result;
+}
+
+/* a layer operator is showing its result before being applied */
+static bool layer_preview_active(Image *ima)
+{
+	ImageLayer *layer;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (layer->preview_ibuf && (layer->visible & IMA_LAYER_VISIBLE))
+			return true;
+	}
+
+	return false;
+}
+
 /* draw main image area */
 
 void draw_image_main(const bContext *C, ARegion *ar)
@@ -862,7 +903,7 @@ void draw_image_main(const bContext *C, ARegion *ar)
 	Scene *scene = CTX_data_scene(C);
 	Image *ima;
 	ImageLayer *layer = NULL;
-	ImBuf *ibuf, *ibuf_l = NULL, *p_ibuf = NULL;
+	ImBuf *ibuf, *ibuf_l = NULL, *p_ibuf = NULL, *ibuf_t;
 	ImBuf *next_ibuf = NULL, *result_ibuf;
 	float zoomx, zoomy, sp_x, sp_y;
 	bool show_viewer, show_render, show_paint;
@@ -935,19 +976,68 @@ void draw_image_main(const bContext *C, ARegion *ar)
 		background = layer->background;
 
 		if (ima->preview_ibuf) {
+			/* transform previews are made from a proxy of the image */
+			const float scale = (ima->preview_scale > 0.0f) ? ima->preview_scale : 1.0f;
+
 			p_ibuf = ima->preview_ibuf;
 			if ((p_ibuf->channels == 4) || (background & IMA_LAYER_BG_ALPHA)) {
 				UI_view2d_to_region_no_clip(&ar->v2d, 0.0f, 0.0f, &x, &y);
-				fdrawcheckerboard(x, y, x + p_ibuf->x * zoomx, y + p_ibuf->y * zoomy);
+				fdrawcheckerboard(x, y, x + p_ibuf->x * scale * zoomx, y + p_ibuf->y * scale * zoomy);
 			}
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			draw_layer_buffer(C, sima, ar, scene, p_ibuf, 0.0f, 0.0f, zoomx, zoomy);
+			draw_layer_buffer(C, sima, ar, scene, p_ibuf, 0.0f, 0.0f, zoomx * scale, zoomy * scale);
 			glDisable(GL_BLEND);
-			b_x = p_ibuf->x;
-			b_y = p_ibuf->y;
+			b_x = (int)(p_ibuf->x * scale);
+			b_y = (int)(p_ibuf->y * scale);
+		}
+		else if (!layer_preview_active(ima)) {
+			/* in paint mode ibuf is the active layer, the composite of the
+			 * visible layers is acquired on its own, which brings it up to date.
+			 * Its display buffer is only refreshed where the layers changed, so
+			 * redraws don't blend anything. Zoomed out, the mip level of it close
+			 * to the screen size is drawn */
+			ImBuf *comp_ibuf, *mip_ibuf;
+			void *comp_lock;
+
+			comp_ibuf = BKE_image_acquire_ibuf(ima, &sima->iuser, &comp_lock, IMA_IBUF_IMA);
+
+			if (comp_ibuf && (comp_ibuf->rect || comp_ibuf->rect_float)) {
+				mip_ibuf = comp_ibuf;
+				if (!(sima->flag & SI_SHOW_ZBUF))
+					mip_ibuf = imalayer_composite_get_mip(ima, comp_ibuf, imalayer_mip_level_for_zoom(min_ff(zoomx, zoomy)));
+
+				UI_view2d_to_region_no_clip(&ar->v2d, 0.0f, 0.0f, &x, &y);
+				if ((comp_ibuf->channels == 4) || (background & IMA_LAYER_BG_ALPHA))
+					fdrawcheckerboard(x, y, x + comp_ibuf->x * zoomx, y + comp_ibuf->y * zoomy);
+
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+				draw_layer_buffer(C, sima, ar, scene, mip_ibuf, 0.0f, 0.0f,
+				                  zoomx * comp_ibuf->x / mip_ibuf->x, zoomy * comp_ibuf->y / mip_ibuf->y);
+				glDisable(GL_BLEND);
+			}
+
+			BKE_image_release_ibuf(ima, comp_ibuf, comp_lock);
+
+			if (UI_GetThemeValue(TH_SHOW_BOUNDARY_LAYER)) {
+				layer = imalayer_get_current(ima);
+				if (layer && (layer->visible & IMA_LAYER_VISIBLE) && layer->ibufs.first) {
+					/* transformed size, the pixels may still be untransformed */
+					imalayer_transform_get_size(layer, &b_x, &b_y);
+				}
+			}
 		}
 		else {
+			/* a layer operator is previewing, its result isn't in the composite.
+			 * Zoomed out the layers are blended at a mip level */
+			const int level = (sima->flag & SI_SHOW_ZBUF) ? 0 : imalayer_mip_level_for_zoom(min_ff(zoomx, zoomy));
+			const float mip_scale = (float)(1 << level);
+			ImBuf *reduced;
+			int l_x = 0, l_y = 0;
+			bool is_mip;
+
 			for (layer = (ImageLayer*)ima->imlayers.last; layer; layer = layer->prev) {
 				if ((!first) || (layer->preview_ibuf)) {
 					if ((layer->opacity != 1.0f) || (ibuf->channels == 4) || (background & IMA_LAYER_BG_ALPHA)) {
@@ -960,11 +1050,44 @@ void draw_image_main(const bContext *C, ARegion *ar)
 					}
 				}
 
-				if (layer->visible & IMA_LAYER_VISIBLE) {
-					if (layer->preview_ibuf)
+				ibuf_l = ibuf_t = NULL;
+
+				/* groups are drawn flat, their layers blend straight into the image */
+				if (layer_is_shown(layer)) {
+					is_mip = false;
+
+					if (layer->preview_ibuf) {
 						ibuf_l = layer->preview_ibuf;
-					else
-						ibuf_l = (ImBuf*)layer->ibufs.first;
+					}
+					else if (level) {
+						ibuf_l = imalayer_get_mip(layer, level);
+						is_mip = (ibuf_l != NULL);
+					}
+
+					if (ibuf_l == NULL) {
+						ibuf_l = imalayer_get_ibuf_untransformed(layer);
+
+						/* drawing leaves a pending transform as it is */
+						if (ibuf_l && imalayer_transform_is_set(layer))
+							ibuf_l = ibuf_t = imalayer_transform_bake(layer, ibuf_l);
+					}
+
+					if (ibuf_l) {
+						imalayer_transform_get_size(layer, &l_x, &l_y);
+						if (layer->preview_ibuf) {
+							l_x = ibuf_l->x;
+							l_y = ibuf_l->y;
+						}
+					}
+
+					/* previews and transformed layers have no mips */
+					if (ibuf_l && level && !is_mip) {
+						if ((reduced = layer_draw_reduce(ibuf_l, level))) {
+							if (ibuf_t)
+								IMB_freeImBuf(ibuf_t);
+							ibuf_l = ibuf_t = reduced;
+						}
+					}
 
 					if (ibuf_l) {
 						result_ibuf = imalayer_blend(next_ibuf, ibuf_l, layer->opacity, layer->mode, background);
@@ -990,7 +1113,7 @@ void draw_image_main(const bContext *C, ARegion *ar)
 						glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 						glColor4f(1.0f, 1.0f, 1.0f, layer->opacity);
-						draw_layer_buffer(C, sima, ar, scene, result_ibuf, sp_x, sp_y, zoomx, zoomy);
+						draw_layer_buffer(C, sima, ar, scene, result_ibuf, sp_x, sp_y, zoomx * mip_scale, zoomy * mip_scale);
 						glDisable(GL_BLEND);
 
 						if (result_ibuf)
@@ -1001,11 +1124,14 @@ void draw_image_main(const bContext *C, ARegion *ar)
 				if (UI_GetThemeValue(TH_SHOW_BOUNDARY_LAYER)) {
 					if (layer->select & IMA_LAYER_SEL_CURRENT) {
 						if (ibuf_l) {
-							b_x = ibuf_l->x;
-							b_y = ibuf_l->y;
+							b_x = l_x;
+							b_y = l_y;
 						}
 					}
 				}
+
+				if (ibuf_t)
+					IMB_freeImBuf(ibuf_t);
 			}
 		}
 		glDisable(GL_BLEND);
@@ -1032,8 +1158,11 @@ void draw_image_main(const bContext *C, ARegion *ar)
 
 		glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
 
-		if (ima->preview_ibuf)
-			draw_image_buffer(C, sima, ar, scene, ima->preview_ibuf, 0.0f, 0.0f, zoomx, zoomy);
+		if (ima->preview_ibuf) {
+			const float scale = (ima->preview_scale > 0.0f) ? ima->preview_scale : 1.0f;
+
+			draw_image_buffer(C, sima, ar, scene, ima->preview_ibuf, 0.0f, 0.0f, zoomx * scale, zoomy * scale);
+		}
 		else
 			draw_image_buffer(C, sima, ar, scene, ibuf, 0.0f, 0.0f, zoomx, zoomy);
 
@@ -28,17 +28,23 @@
  *  \ingroup spimage
  */
 
+#include "MEM_guardedalloc.h"
+
+#include "DNA_image_types.h"
 #include "DNA_imbuf_types.h"
 #include "DNA_mask_types.h"
 #include "DNA_object_types.h"
 #include "DNA_scene_types.h"
 
+#include "BLI_listbase.h"
 #include "BLI_math.h"
 #include "BLI_rect.h"
 
 #include "BKE_context.h"
 #include "BKE_global.h"
+#include "BKE_icons.h"
 #include "BKE_image.h"
+#include "BKE_layer.h"
 #include "BKE_main.h"
 #include "BKE_editmesh.h"
 #include "BKE_library.h"
@@ -48,6 +54,7 @@
 #include "ED_screen.h"
 #include "ED_uvedit.h"
 
+#include "UI_interface_icons.h"
 #include "UI_view2d.h"
 
 #include "WM_api.h"
@@ -105,15 +112,20 @@ void ED_space_image_set_mask(bContext *C, SpaceImage *sima, Mask *mask)
 
 ImBuf *ED_space_image_acquire_buffer(SpaceImage *sima, void **lock_r)
 {
+	ImageLayer *layer;
 	ImBuf *ibuf;
 
 	if (sima && sima->image) {
+		/* acquiring the layer resamples a pending transform of it, which
+		 * waits for the layer to be edited. Until then the composite shows it */
+		layer = imalayer_get_current(sima->image);
+
 #if 0
 		if (sima->image->type == IMA_TYPE_R_RESULT && BIF_show_render_spare())
 			return BIF_render_spare_imbuf();
 		else
 #endif
-		if (sima->mode == SI_MODE_PAINT)
+		if (sima->mode == SI_MODE_PAINT && !(layer && imalayer_transform_is_set(layer)))
 			ibuf = BKE_image_acquire_ibuf(sima->image, &sima->iuser, lock_r, IMA_IBUF_LAYER);
 		else 
 			ibuf = BKE_image_acquire_ibuf(sima->image, &sima->iuser, lock_r, IMA_IBUF_IMA);
@@ -375,3 +387,167 @@ int ED_space_image_maskedit_mask_poll(bContext *C)
 	return FALSE;
 }
 
+
+/* ******************** layer thumbnails ******************** */
+
+typedef struct ImageLayerThumb {
+	struct ImageLayerThumb *next, *prev;
+	ImageLayer *layer;
+	int generation;			/* of the layer when the source was taken */
+	ImageLayerThumbSource *source;
+	unsigned int *rect[NUM_ICON_SIZES];
+} ImageLayerThumb;
+
+typedef struct ImageLayerThumbJob {
+	Image *ima;
+	ListBase thumbs;
+	bool done;
+} ImageLayerThumbJob;
+
+static int image_layer_thumb_size(int size)
+{
+	return (size == ICON_SIZE_ICON) ? 32 : PREVIEW_DEFAULT_HEIGHT;
+}
+
+static void image_layer_thumbs_startjob(void *tjv, short *stop, short *UNUSED(do_update), float *progress)
+{
+	ImageLayerThumbJob *tj = tjv;
+	ImageLayerThumb *thumb;
+	int sizes[NUM_ICON_SIZES];
+	int a, tot = BLI_countlist(&tj->thumbs), done = 0;
+
+	for (a = 0; a < NUM_ICON_SIZES; a++)
+		sizes[a] = image_layer_thumb_size(a);
+
+	for (thumb = tj->thumbs.first; thumb && !*stop; thumb = thumb->next) {
+		for (a = 0; a < NUM_ICON_SIZES; a++)
+			thumb->rect[a] = MEM_mallocN(sizeof(unsigned int) * sizes[a] * sizes[a], "layer thumb rect");
+
+		if (!imalayer_thumb_render(thumb->source, NUM_ICON_SIZES, sizes, thumb->rect, stop))
+			return;
+
+		*progress = (float)++done / (float)tot;
+	}
+
+	tj->done = !*stop;
+}
+
+/* Main thread: the thumbnails go in the previews of the layers still in the image */
+static void image_layer_thumbs_endjob(void *tjv)
+{
+	ImageLayerThumbJob *tj = tjv;
+	ImageLayerThumb *thumb;
+	ImageLayer *layer;
+	int a;
+
+	if (!tj->done)
+		return;
+
+	for (thumb = tj->thumbs.first; thumb; thumb = thumb->next) {
+		layer = thumb->layer;
+
+		if (BLI_findindex(&tj->ima->imlayers, layer) == -1 || layer->preview == NULL)
+			continue;
+
+		for (a = 0; a < NUM_ICON_SIZES; a++) {
+			if (layer->preview->rect[a])
+				MEM_freeN(layer->preview->rect[a]);
+
+			layer->preview->rect[a] = thumb->rect[a];
+			layer->preview->w[a] = layer->preview->h[a] = image_layer_thumb_size(a);
+			thumb->rect[a] = NULL;
+		}
+
+		/* changed while the job ran: it's made again on next draw */
+		layer->thumb_generation = thumb->generation;
+	}
+}
+
+static void image_layer_thumbs_free(void *tjv)
+{
+	ImageLayerThumbJob *tj = tjv;
+	ImageLayerThumb *thumb;
+	int a;
+
+	for (thumb = tj->thumbs.first; thumb; thumb = thumb->next) {
+		imalayer_thumb_source_free(thumb->source);
+
+		for (a = 0; a < NUM_ICON_SIZES; a++) {
+			if (thumb->rect[a])
+				MEM_freeN(thumb->rect[a]);
+		}
+	}
+
+	BLI_freelistN(&tj->thumbs);
+	MEM_freeN(tj);
+}
+
+static bool image_layer_thumb_is_stale(ImageLayer *layer)
+{
+	return (layer->preview && imalayer_has_pixels(layer) &&
+	        (layer->thumb_generation != layer->generation || layer->preview->rect[ICON_SIZE_ICON] == NULL));
+}
+
+/* One job for all the layers whose pixels changed since their thumbnail was
+ * made. While it runs no other one starts, the layers painted in the meantime
+ * are left for the next one */
+static void image_layer_thumbs_start(const bContext *C, Image *ima)
+{
+	wmWindowManager *wm = CTX_wm_manager(C);
+	ImageLayerThumbJob *tj;
+	ImageLayerThumb *thumb;
+	ImageLayer *layer;
+	wmJob *wm_job;
+
+	if (WM_jobs_test(wm, ima, WM_JOB_TYPE_IMAGE_LAYER_THUMBS))
+		return;
+
+	tj = MEM_callocN(sizeof(ImageLayerThumbJob), "ImageLayerThumbJob");
+	tj->ima = ima;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (!image_layer_thumb_is_stale(layer))
+			continue;
+
+		thumb = MEM_callocN(sizeof(ImageLayerThumb), "ImageLayerThumb");
+		thumb->layer = layer;
+		thumb->generation = layer->generation;
+		thumb->source = imalayer_thumb_source_new(layer, PREVIEW_DEFAULT_HEIGHT);
+
+		if (thumb->source == NULL) {
+			/* nothing to show, keeps an empty thumbnail */
+			layer->thumb_generation = layer->generation;
+			MEM_freeN(thumb);
+			continue;
+		}
+
+		BLI_addtail(&tj->thumbs, thumb);
+	}
+
+	if (tj->thumbs.first == NULL) {
+		image_layer_thumbs_free(tj);
+		return;
+	}
+
+	wm_job = WM_jobs_get(wm, CTX_wm_window(C), ima, "Layer Thumbnails", 0, WM_JOB_TYPE_IMAGE_LAYER_THUMBS);
+	WM_jobs_customdata_set(wm_job, tj, image_layer_thumbs_free);
+	WM_jobs_timer(wm_job, 0.1, 0, NC_IMAGE | ND_DRAW);
+	WM_jobs_callbacks(wm_job, image_layer_thumbs_startjob, NULL, NULL, image_layer_thumbs_endjob);
+
+	WM_jobs_start(wm, wm_job);
+}
+
+int ED_image_layer_icon_get(const bContext *C, Image *ima, ImageLayer *layer)
+{
+	int icon_id;
+
+	if (!imalayer_has_pixels(layer))
+		return 0;
+
+	icon_id = BKE_icon_imalayer_getid(layer);
+
+	if (icon_id && image_layer_thumb_is_stale(layer))
+		image_layer_thumbs_start(C, ima);
+
+	return icon_id;
+}
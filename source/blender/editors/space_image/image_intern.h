@@ -125,6 +125,13 @@ void IMAGE_OT_layer_duplicate(struct wmOperatorType *ot);
 void IMAGE_OT_layer_select(struct wmOperatorType *ot);
 void IMAGE_OT_layer_clean(struct wmOperatorType *ot);
 void IMAGE_OT_layer_merge(struct wmOperatorType *ot);
+void IMAGE_OT_layer_group(struct wmOperatorType *ot);
+void IMAGE_OT_layer_ungroup(struct wmOperatorType *ot);
+void IMAGE_OT_layer_adjustment_add(struct wmOperatorType *ot);
+void IMAGE_OT_layer_mask_add(struct wmOperatorType *ot);
+void IMAGE_OT_layer_mask_remove(struct wmOperatorType *ot);
+void IMAGE_OT_layers_export(struct wmOperatorType *ot);
+void IMAGE_OT_layers_import(struct wmOperatorType *ot);
 void IMAGE_OT_layer_flip(struct wmOperatorType *ot);
 void IMAGE_OT_layer_rotate(struct wmOperatorType *ot);
 void IMAGE_OT_layer_arbitrary_rot(struct wmOperatorType *ot);
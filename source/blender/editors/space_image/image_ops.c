@@ -1951,6 +1951,33 @@ static int image_operator_poll(bContext *C)
 	return BKE_image_has_ibuf(ima, NULL, IMA_IBUF_IMA);
 }
 
+/* in paint mode the operator edits the active layer, a group has no pixels */
+static int image_operator_pixels_poll(bContext *C)
+{
+	SpaceImage *sima = CTX_wm_space_image(C);
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *layer;
+
+	if (!image_operator_poll(C))
+		return FALSE;
+
+	if (sima && sima->mode == SI_MODE_PAINT) {
+		layer = imalayer_get_current(ima);
+		return (layer && imalayer_has_pixels(layer));
+	}
+
+	return TRUE;
+}
+
+/* pixels were edited on the active layer in paint mode, on every layer otherwise */
+static void image_layers_tag_dirty(Image *ima, SpaceImage *sima)
+{
+	if (sima && sima->mode == SI_MODE_PAINT)
+		imalayer_tag_dirty(imalayer_get_current(ima));
+	else
+		imalayer_tag_dirty_all(ima);
+}
+
 static void free_preview(Image *ima, char mode) 
 {
 	ImageLayer *layer;
@@ -1985,6 +2012,402 @@ static void image_preview_cancel(bContext *C, wmOperator *UNUSED(op))
 	}
 }
 
+/************************* Transform previews ************************/
+
+/* Rotate, offset and size preview their result while their popup is open.
+ * The preview is made in a job from proxies of the layers, halved until they
+ * match the zoom of the image editor, so changing a value never transforms
+ * the full resolution pixels; only exec does. The proxies are stacked in an
+ * image of their own and blended by merge_layers_visible_nd(), groups, masks
+ * and adjustments are shown as the editor does. */
+
+#define IMA_PREVIEW_SCALE_MAX	64
+
+enum {
+	IMA_PREVIEW_ROTATE = 1,
+	IMA_PREVIEW_OFFSET,
+	IMA_PREVIEW_SIZE
+};
+
+typedef struct ImagePreviewProxy {
+	struct ImagePreviewProxy *next, *prev;
+	ImageLayer *layer;	/* settings, mask and adjustment of the layer, no pixels */
+	ImBuf *ibuf;		/* full resolution pixels, referenced or owned, NULL without */
+	ImBuf *proxy;		/* ibuf halved down to proxy_scale, NULL at scale 1 */
+	int proxy_scale;	/* 0 until the job made the proxy */
+	short transform;	/* the previewed transform applies to this one */
+	short pad;
+} ImagePreviewProxy;
+
+/* op->customdata of the transform operators while they preview, only
+ * touched by the job once it runs */
+typedef struct ImagePreview {
+	ListBase proxies;	/* ImagePreviewProxy, in the order of the layers */
+} ImagePreview;
+
+typedef struct ImagePreviewJob {
+	Image *ima;
+	ImagePreview *preview;
+	int type;
+	int scale;			/* image pixels per proxy pixel, a power of two */
+
+	/* the transform, in image pixels */
+	float angle;
+	int filter, lock;
+	int x, y, half, wrap;
+	int width, height, centre;
+	float col[4];
+
+	ImBuf *result;
+	bool done;
+} ImagePreviewJob;
+
+/* fill of the masks resampled with their layers, the area a layer grows by
+ * isn't masked */
+static float mask_color[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+
+/* proxy of the image for the zoom of the editor */
+static int image_preview_scale(SpaceImage *sima)
+{
+	int scale = 1;
+
+	while (sima && scale < IMA_PREVIEW_SCALE_MAX && sima->zoom * scale * 2.0f <= 1.0f)
+		scale *= 2;
+
+	return scale;
+}
+
+/* A layer without its pixels and runtime data, for the stack of the preview */
+static ImageLayer *image_preview_layer_copy(const ImageLayer *layer)
+{
+	ImageLayer *copy = MEM_dupallocN(layer);
+
+	copy->next = copy->prev = NULL;
+	copy->preview = NULL;
+	copy->icon_id = 0;
+	copy->ibufs.first = copy->ibufs.last = NULL;
+	copy->preview_ibuf = NULL;
+	copy->storage = NULL;
+	copy->group_cache = NULL;
+	copy->mip = NULL;
+
+	/* pending transforms are resampled into the pixels of the proxy */
+	copy->transform_flag = 0;
+
+	/* the values of an edited mask are in its tiles */
+	copy->mask = imalayer_mask_copy(layer->mask);
+	if (copy->mask)
+		copy->mask->flag &= ~IMA_LAYER_MASK_EDIT;
+	copy->adjustment = imalayer_adjustment_copy(layer->adjustment);
+
+	return copy;
+}
+
+/* The pixels may be shared with a layer of the image, only their reference
+ * is dropped */
+static void image_preview_layer_free(ImageLayer *layer)
+{
+	ImBuf *ibuf;
+
+	while ((ibuf = layer->ibufs.first)) {
+		BLI_remlink(&layer->ibufs, ibuf);
+		IMB_freeImBuf(ibuf);
+	}
+
+	free_image_layer(layer);
+}
+
+/* hidden with one of its groups */
+static bool image_preview_layer_is_shown(ImageLayer *layer)
+{
+	for (; layer; layer = imalayer_get_parent(layer)) {
+		if (!(layer->visible & IMA_LAYER_VISIBLE))
+			return false;
+	}
+
+	return true;
+}
+
+/* The preview of the operator, made on first use from the layers when
+ * "layer" is set (the transform applies to it), from the composite
+ * otherwise */
+static ImagePreview *image_preview_get(wmOperator *op, Image *ima, ImageLayer *layer)
+{
+	ImagePreview *preview = op->customdata;
+	ImagePreviewProxy *pp;
+	ImageLayer *iml;
+	ImBuf *ibuf;
+
+	if (preview)
+		return preview;
+
+	preview = MEM_callocN(sizeof(ImagePreview), "ImagePreview");
+
+	if (layer) {
+		/* the job only reads the pixels, sparse layers are decoded here and
+		 * pending transforms resampled into a copy, the layers keep them */
+		for (iml = ima->imlayers.first; iml; iml = iml->next) {
+			pp = MEM_callocN(sizeof(ImagePreviewProxy), "ImagePreviewProxy");
+			pp->layer = image_preview_layer_copy(iml);
+			pp->transform = (iml == layer);
+			BLI_addtail(&preview->proxies, pp);
+
+			if (!imalayer_has_pixels(iml) || !image_preview_layer_is_shown(iml) ||
+			    !(ibuf = imalayer_get_ibuf_untransformed(iml)))
+			{
+				continue;
+			}
+
+			if (imalayer_transform_is_set(iml))
+				ibuf = imalayer_transform_bake(iml, ibuf);
+			else
+				IMB_refImBuf(ibuf);
+
+			pp->ibuf = ibuf;
+		}
+	}
+	else {
+		ima->use_layers = FALSE;
+		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
+		ima->use_layers = TRUE;
+
+		if (ibuf) {
+			pp = MEM_callocN(sizeof(ImagePreviewProxy), "ImagePreviewProxy");
+			IMB_refImBuf(ibuf);
+			pp->ibuf = ibuf;
+			pp->transform = TRUE;
+
+			/* a single layer showing the composite as it is */
+			pp->layer = MEM_callocN(sizeof(ImageLayer), "ImagePreviewProxy layer");
+			pp->layer->opacity = 1.0f;
+			pp->layer->mode = IMA_LAYER_NORMAL;
+			pp->layer->type = IMA_LAYER_BASE;
+			pp->layer->visible = IMA_LAYER_VISIBLE;
+			pp->layer->background = ((ImageLayer *)ima->imlayers.last)->background;
+
+			BLI_addtail(&preview->proxies, pp);
+		}
+
+		BKE_image_release_ibuf(ima, ibuf, NULL);
+	}
+
+	op->customdata = preview;
+
+	return preview;
+}
+
+/* Stops the preview job and frees the preview, before exec and on cancel */
+static void image_preview_free(bContext *C, wmOperator *op)
+{
+	ImagePreview *preview = op->customdata;
+	ImagePreviewProxy *pp;
+	Image *ima = CTX_data_edit_image(C);
+
+	if (ima) {
+		WM_jobs_kill_type(CTX_wm_manager(C), ima, WM_JOB_TYPE_IMAGE_PREVIEW);
+
+		if (ima->preview_ibuf) {
+			IMB_freeImBuf(ima->preview_ibuf);
+			ima->preview_ibuf = NULL;
+		}
+		ima->preview_scale = 0.0f;
+	}
+
+	if (preview) {
+		for (pp = preview->proxies.first; pp; pp = pp->next) {
+			image_preview_layer_free(pp->layer);
+			if (pp->ibuf)
+				IMB_freeImBuf(pp->ibuf);
+			if (pp->proxy)
+				IMB_freeImBuf(pp->proxy);
+		}
+		BLI_freelistN(&preview->proxies);
+		MEM_freeN(preview);
+		op->customdata = NULL;
+	}
+}
+
+static void image_preview_transform_cancel(bContext *C, wmOperator *op)
+{
+	image_preview_free(C, op);
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
+}
+
+static ImBuf *image_preview_proxy_make(ImBuf *ibuf, int scale, short *stop)
+{
+	ImBuf *proxy = NULL, *half;
+
+	for (; scale > 1 && ibuf->x > 1 && ibuf->y > 1; scale >>= 1) {
+		half = IMB_onehalf(ibuf);
+
+		if (proxy)
+			IMB_freeImBuf(proxy);
+		proxy = ibuf = half;
+
+		if (*stop)
+			break;
+	}
+
+	return proxy;
+}
+
+/* takes "ibuf", a proxy copy, "col" fills what the transform uncovers */
+static ImBuf *image_preview_transform(ImagePreviewJob *pj, ImBuf *ibuf, float col[4])
+{
+	const int scale = pj->scale;
+
+	switch (pj->type) {
+		case IMA_PREVIEW_ROTATE:
+			return IMB_rotation(ibuf, 0.0f, 0.0f, pj->angle, pj->filter, pj->lock, col);
+		case IMA_PREVIEW_OFFSET:
+			return IMB_offset(ibuf, pj->x / scale, pj->y / scale, pj->half, pj->wrap, col);
+		case IMA_PREVIEW_SIZE:
+			return IMB_size(ibuf, max_ii(pj->width / scale, 1), max_ii(pj->height / scale, 1),
+			                pj->x / scale, pj->y / scale, pj->centre, col);
+	}
+
+	return ibuf;
+}
+
+/* The layer of "pp" in the stack of the preview, its pixels and its mask
+ * at the scale of the proxy */
+static ImageLayer *image_preview_layer_get(ImagePreviewJob *pj, ImagePreviewProxy *pp, short *stop)
+{
+	ImageLayer *layer = image_preview_layer_copy(pp->layer);
+	ImBuf *ibuf, *mask_ibuf;
+
+	if (pp->ibuf) {
+		ibuf = pp->proxy ? pp->proxy : pp->ibuf;
+
+		if (pp->transform) {
+			ibuf = image_preview_transform(pj, IMB_dupImBuf(ibuf), pj->col);
+		}
+		else {
+			/* shared, freeing the layer only drops the reference */
+			IMB_refImBuf(ibuf);
+		}
+
+		if (ibuf)
+			BLI_addtail(&layer->ibufs, ibuf);
+	}
+
+	if (layer->mask && pj->scale > 1) {
+		mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+		if (mask_ibuf) {
+			imalayer_mask_from_ibuf(layer, image_preview_proxy_make(mask_ibuf, pj->scale, stop));
+			IMB_freeImBuf(mask_ibuf);
+		}
+	}
+
+	/* the mask follows the layer, see imalayer_mask_transform() */
+	if (layer->mask && pp->transform)
+		imalayer_mask_from_ibuf(layer, image_preview_transform(pj, imalayer_mask_to_ibuf(layer->mask), mask_color));
+
+	return layer;
+}
+
+static void image_preview_startjob(void *pjv, short *stop, short *do_update, float *UNUSED(progress))
+{
+	ImagePreviewJob *pj = pjv;
+	ImagePreviewProxy *pp;
+	ImageLayer *layer;
+	ImBuf *result = NULL;
+	Image ima;
+
+	/* only the layers and the composite of this image are used */
+	memset(&ima, 0, sizeof(ima));
+
+	for (pp = pj->preview->proxies.first; pp && !*stop; pp = pp->next) {
+		if (pp->ibuf && pp->proxy_scale != pj->scale) {
+			if (pp->proxy) {
+				IMB_freeImBuf(pp->proxy);
+				pp->proxy = NULL;
+			}
+
+			pp->proxy = image_preview_proxy_make(pp->ibuf, pj->scale, stop);
+			if (*stop)
+				break;
+			pp->proxy_scale = pj->scale;
+		}
+
+		BLI_addtail(&ima.imlayers, image_preview_layer_get(pj, pp, stop));
+	}
+
+	if (!*stop && ima.imlayers.first) {
+		merge_layers_visible_nd(&ima);
+
+		result = ima.ibufs.first;
+		ima.ibufs.first = ima.ibufs.last = NULL;
+	}
+
+	while ((layer = ima.imlayers.first)) {
+		BLI_remlink(&ima.imlayers, layer);
+		image_preview_layer_free(layer);
+	}
+	imalayer_cache_free(&ima);
+
+	if (*stop) {
+		if (result)
+			IMB_freeImBuf(result);
+		return;
+	}
+
+	pj->result = result;
+	pj->done = true;
+	*do_update = true;
+}
+
+static void image_preview_endjob(void *pjv)
+{
+	ImagePreviewJob *pj = pjv;
+	Image *ima = pj->ima;
+
+	if (pj->done && pj->result) {
+		if (ima->preview_ibuf)
+			IMB_freeImBuf(ima->preview_ibuf);
+
+		ima->preview_ibuf = pj->result;
+		ima->preview_scale = (float)pj->scale;
+		pj->result = NULL;
+	}
+}
+
+static void image_preview_job_free(void *pjv)
+{
+	ImagePreviewJob *pj = pjv;
+
+	if (pj->result)
+		IMB_freeImBuf(pj->result);
+
+	MEM_freeN(pj);
+}
+
+static ImagePreviewJob *image_preview_job_new(bContext *C, wmOperator *op, Image *ima, ImageLayer *layer, int type)
+{
+	ImagePreviewJob *pj = MEM_callocN(sizeof(ImagePreviewJob), "ImagePreviewJob");
+
+	pj->ima = ima;
+	pj->preview = image_preview_get(op, ima, layer);
+	pj->type = type;
+	pj->scale = image_preview_scale(CTX_wm_space_image(C));
+
+	return pj;
+}
+
+/* Starts the job, a running one is stopped and started again with "pj" */
+static void image_preview_job_start(bContext *C, ImagePreviewJob *pj)
+{
+	wmJob *wm_job;
+
+	wm_job = WM_jobs_get(CTX_wm_manager(C), CTX_wm_window(C), pj->ima, "Image Preview", 0,
+	                     WM_JOB_TYPE_IMAGE_PREVIEW);
+	WM_jobs_customdata_set(wm_job, pj, image_preview_job_free);
+	WM_jobs_timer(wm_job, 0.02, 0, NC_IMAGE | ND_DRAW);
+	WM_jobs_callbacks(wm_job, image_preview_startjob, NULL, NULL, image_preview_endjob);
+
+	WM_jobs_start(CTX_wm_manager(C), wm_job);
+}
+
 static int image_invert_exec(bContext *C, wmOperator *op)
 {
 	SpaceImage *sima = CTX_wm_space_image(C);
@@ -1999,8 +2422,11 @@ static int image_invert_exec(bContext *C, wmOperator *op)
 		return OPERATOR_CANCELLED;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2029,12 +2455,16 @@ static int image_invert_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 	
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_invert_channels(ibuf_l, r, g, b, a);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY | IB_DISPLAY_BUFFER_INVALID;
+	image_layers_tag_dirty(ima, sima);
 
 	if (ibuf->mipmap[0])
 		ibuf->userflags |= IB_MIPMAP_INVALID;
@@ -2063,7 +2493,7 @@ void IMAGE_OT_invert(wmOperatorType *ot)
 	
 	/* api callbacks */
 	ot->exec = image_invert_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	
 	/* properties */
 	prop = RNA_def_boolean(ot->srna, "invert_r", 0, "Red", "Invert Red Channel");
@@ -2079,7 +2509,7 @@ void IMAGE_OT_invert(wmOperatorType *ot)
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
 }
 
-static int image_invert_value_exec(bContext *C, wmOperator *UNUSED(op))
+static int image_invert_value_exec(bContext *C, wmOperator *op)
 {
 	SpaceImage *sima = CTX_wm_space_image(C);
 	Image *ima = CTX_data_edit_image(C);
@@ -2089,8 +2519,11 @@ static int image_invert_value_exec(bContext *C, wmOperator *UNUSED(op))
 		return OPERATOR_CANCELLED;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2104,12 +2537,16 @@ static int image_invert_value_exec(bContext *C, wmOperator *UNUSED(op))
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_invert_value(ibuf_l);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | NA_EDITED, ima);
 
@@ -2127,7 +2564,7 @@ void IMAGE_OT_invert_value(wmOperatorType *ot)
 	
 	/* api callbacks */
 	ot->exec = image_invert_value_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -2144,8 +2581,11 @@ static int image_bright_contrast_exec(bContext *C, wmOperator *op)
 		return OPERATOR_CANCELLED;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2166,12 +2606,16 @@ static int image_bright_contrast_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_bright_contrast(ibuf_l, bright, contrast);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
 
@@ -2192,8 +2636,11 @@ static bool image_bright_contrast_check(bContext *C, wmOperator *op)
 		return FALSE;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2236,7 +2683,7 @@ void IMAGE_OT_bright_contrast(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_bright_contrast_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_bright_contrast_check;
 	ot->cancel = image_preview_cancel;
@@ -2261,8 +2708,11 @@ static int image_desaturate_exec(bContext *C, wmOperator *op)
 	type = RNA_enum_get(op->ptr, "type");
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2273,12 +2723,16 @@ static int image_desaturate_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_desaturate(ibuf_l, type);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
 
@@ -2303,7 +2757,7 @@ void IMAGE_OT_desaturate(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_desaturate_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
  
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -2325,8 +2779,11 @@ static int image_posterize_exec(bContext *C, wmOperator *op)
 	levels = RNA_int_get(op->ptr, "levels");
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2339,12 +2796,16 @@ static int image_posterize_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_posterize(ibuf_l, levels);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
 
@@ -2365,8 +2826,11 @@ static bool image_posterize_check(bContext *C, wmOperator *op)
 		return FALSE;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2408,7 +2872,7 @@ void IMAGE_OT_posterize(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_posterize_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_posterize_check;
 	ot->cancel = image_preview_cancel;
@@ -2434,8 +2898,11 @@ static int image_threshold_exec(bContext *C, wmOperator *op)
 	high = RNA_int_get(op->ptr, "high");
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2448,12 +2915,16 @@ static int image_threshold_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_threshold(ibuf_l, low, high);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
 
@@ -2474,8 +2945,11 @@ static bool image_threshold_check(bContext *C, wmOperator *op)
 		return FALSE;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2518,7 +2992,7 @@ void IMAGE_OT_threshold(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_threshold_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_threshold_check;
 	ot->cancel = image_preview_cancel;
@@ -2542,8 +3016,11 @@ static int image_exposure_exec(bContext *C, wmOperator *op)
 		return OPERATOR_CANCELLED;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2565,12 +3042,16 @@ static int image_exposure_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_exposure(ibuf_l, exposure, offset, gamma);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
 
@@ -2591,8 +3072,11 @@ static bool image_exposure_check(bContext *C, wmOperator *op)
 		return FALSE;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2636,7 +3120,7 @@ void IMAGE_OT_exposure(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_exposure_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_exposure_check;
 	ot->cancel = image_preview_cancel;
@@ -2664,8 +3148,11 @@ static int image_colorize_exec(bContext *C, wmOperator *op)
 	lightness = RNA_int_get(op->ptr, "lightness");
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2678,12 +3165,16 @@ static int image_colorize_exec(bContext *C, wmOperator *op)
 		ImBuf *ibuf_l;
 
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			IMB_colorize(ibuf_l, hue, saturation, lightness);
 		}
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	image_layers_tag_dirty(ima, sima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
 
@@ -2704,8 +3195,11 @@ static bool image_colorize_check(bContext *C, wmOperator *op)
 		return FALSE;
 
 	ima->use_layers = FALSE;
-	if (sima->mode == SI_MODE_PAINT)
+	if (sima->mode == SI_MODE_PAINT) {
+		/* the layer is edited as it is shown, with its own undo step */
+		ED_image_layer_apply_transform(op->type->name, ima);
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+	}
 	else 
 		ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
@@ -2749,7 +3243,7 @@ void IMAGE_OT_colorize(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_colorize_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_colorize_check;
 	ot->cancel = image_preview_cancel;
@@ -2783,10 +3277,12 @@ static int image_grayscale_exec(bContext *C, wmOperator *UNUSED(op))
 	IMB_color_to_bw(ibuf);
 
 	for (layer = (ImageLayer *)ima->imlayers.first; layer; layer = layer->next) {
-		IMB_color_to_bw((ImBuf *)layer->ibufs.first);
+		if (imalayer_has_pixels(layer))
+			IMB_color_to_bw(imalayer_get_ibuf(layer));
 	}
 
 	ibuf->userflags |= IB_BITMAPDIRTY;
+	imalayer_tag_dirty_all(ima);
 	if (ibuf->mipmap[0])
 		ibuf->userflags |= IB_MIPMAP_INVALID;
 
@@ -2805,7 +3301,7 @@ void IMAGE_OT_color_space_grayscale(wmOperatorType *ot)
 	
 	/* api callbacks */
 	ot->exec = image_grayscale_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	
 	/* flags */
 	ot->flag = OPTYPE_REGISTER;
@@ -2829,7 +3325,7 @@ void IMAGE_OT_color_space_rgb(wmOperatorType *ot)
 	
 	/* api callbacks */
 	ot->exec = image_rgb_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	
 	/* flags */
 	ot->flag = OPTYPE_REGISTER;
@@ -2893,7 +3389,7 @@ void IMAGE_OT_duplicate(wmOperatorType *ot)
 static int image_flip_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
-	ImBuf *ibuf;
+	ImBuf *ibuf, *mask_ibuf;
 	ImageLayer *layer;
 	int type;
 
@@ -2908,15 +3404,32 @@ static int image_flip_exec(bContext *C, wmOperator *op)
 
 	if (type == 1) { /* Flip Horizontally */
 		IMB_flipx(ibuf);
-		for (layer = ima->imlayers.first; layer; layer = layer->next)
-			IMB_flipx((ImBuf *)layer->ibufs.first);
+		for (layer = ima->imlayers.first; layer; layer = layer->next) {
+			if (layer->mask) {
+				mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+				IMB_flipx(mask_ibuf);
+				imalayer_mask_from_ibuf(layer, mask_ibuf);
+			}
+
+			if (imalayer_has_pixels(layer))
+				IMB_flipx(imalayer_get_ibuf(layer));
+		}
 	}
 	else if (type == 2) { /* Flip Vertically */
 		IMB_flipy(ibuf);
-		for (layer = ima->imlayers.first; layer; layer = layer->next)
-			IMB_flipy((ImBuf *)layer->ibufs.first);
+		for (layer = ima->imlayers.first; layer; layer = layer->next) {
+			if (layer->mask) {
+				mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+				IMB_flipy(mask_ibuf);
+				imalayer_mask_from_ibuf(layer, mask_ibuf);
+			}
+
+			if (imalayer_has_pixels(layer))
+				IMB_flipy(imalayer_get_ibuf(layer));
+		}
 	}
-	
+	imalayer_tag_dirty_all(ima);
+
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
 
 	BKE_image_release_ibuf(ima, ibuf, NULL);
@@ -2939,7 +3452,7 @@ void IMAGE_OT_flip(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_flip_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
  
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -2952,7 +3465,7 @@ static int image_rotate_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	ImBuf *ibuf, *ibuf_l;
+	ImBuf *ibuf, *ibuf_l, *mask_ibuf;
 	int type;
 	static float col[4] = {0.0f, 0.0f, 0.0f, 0.0f};
  
@@ -2968,7 +3481,15 @@ static int image_rotate_exec(bContext *C, wmOperator *op)
 	if (type == 1) { /* ROT_90 */
 		ibuf = IMB_rotation(ibuf, 0.0, 0.0, DEG2RADF(-90.0), 2, 0, col);
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (layer->mask) {
+				mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+				imalayer_mask_from_ibuf(layer, IMB_rotation(mask_ibuf, 0.0, 0.0, DEG2RADF(-90.0), 2, 0, mask_color));
+			}
+
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			layer->ibufs.first = NULL;
 			layer->ibufs.last = NULL;
 			BLI_addtail(&layer->ibufs, IMB_rotation(ibuf_l, 0.0, 0.0, DEG2RADF(-90.0), 2, 0, col));
@@ -2977,7 +3498,15 @@ static int image_rotate_exec(bContext *C, wmOperator *op)
 	else if (type == 2) { /* ROT_90A */
 		ibuf = IMB_rotation(ibuf, 0.0, 0.0, DEG2RADF(90.0), 2, 0, col);
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (layer->mask) {
+				mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+				imalayer_mask_from_ibuf(layer, IMB_rotation(mask_ibuf, 0.0, 0.0, DEG2RADF(90.0), 2, 0, mask_color));
+			}
+
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			layer->ibufs.first = NULL;
 			layer->ibufs.last = NULL;
 			BLI_addtail(&layer->ibufs, IMB_rotation(ibuf_l, 0.0, 0.0, DEG2RADF(90.0), 2, 0, col));
@@ -2986,7 +3515,15 @@ static int image_rotate_exec(bContext *C, wmOperator *op)
 	else if (type == 3) { /* ROT_180 */
 		ibuf = IMB_rotation(ibuf, 0.0, 0.0, DEG2RADF(180.0), 2, 0, col);
 		for (layer = ima->imlayers.first; layer; layer = layer->next) {
-			ibuf_l = (ImBuf *)layer->ibufs.first;
+			if (layer->mask) {
+				mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+				imalayer_mask_from_ibuf(layer, IMB_rotation(mask_ibuf, 0.0, 0.0, DEG2RADF(180.0), 2, 0, mask_color));
+			}
+
+			if (!imalayer_has_pixels(layer))
+				continue;
+
+			ibuf_l = imalayer_get_ibuf(layer);
 			layer->ibufs.first = NULL;
 			layer->ibufs.last = NULL;
 			BLI_addtail(&layer->ibufs, IMB_rotation(ibuf_l, 0.0, 0.0, DEG2RADF(180.0), 2, 0, col));
@@ -3016,7 +3553,7 @@ void IMAGE_OT_rotate(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_rotate_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
  
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -3029,7 +3566,7 @@ static int image_arbitrary_rot_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	ImBuf *ibuf, *ibuf_l;
+	ImBuf *ibuf, *ibuf_l, *mask_ibuf;
 	float angle;
 	float col[4];
 	short type;
@@ -3042,10 +3579,7 @@ static int image_arbitrary_rot_exec(bContext *C, wmOperator *op)
 	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
 
-	if (ima->preview_ibuf) {
-		IMB_freeImBuf(ima->preview_ibuf);
-		ima->preview_ibuf = NULL;
-	}
+	image_preview_free(C, op);
 
 	type = RNA_enum_get(op->ptr, "type");
 	angle = RNA_float_get(op->ptr, "angle");
@@ -3057,7 +3591,15 @@ static int image_arbitrary_rot_exec(bContext *C, wmOperator *op)
 
 	ibuf = IMB_rotation(ibuf, 0.0, 0.0, angle, type, lock, col);
 	for (layer = ima->imlayers.first; layer; layer = layer->next) {
-		ibuf_l = (ImBuf *)layer->ibufs.first;
+		if (layer->mask) {
+			mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+			imalayer_mask_from_ibuf(layer, IMB_rotation(mask_ibuf, 0.0, 0.0, angle, type, lock, mask_color));
+		}
+
+		if (!imalayer_has_pixels(layer))
+			continue;
+
+		ibuf_l = imalayer_get_ibuf(layer);
 		layer->ibufs.first = NULL;
 		layer->ibufs.last = NULL;
 		BLI_addtail(&layer->ibufs, IMB_rotation(ibuf_l, 0.0, 0.0, angle, type, lock, col));
@@ -3073,36 +3615,19 @@ static int image_arbitrary_rot_exec(bContext *C, wmOperator *op)
 static bool image_arbitrary_rot_check(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
-	ImBuf *ibuf;
-	float col[4];
-	float angle;
-	short type;
-	int lock;
+	ImagePreviewJob *pj;
 
 	if (!ima)
 		return FALSE;
 
-	ima->use_layers = FALSE;
-	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
-	ima->use_layers = TRUE;
+	pj = image_preview_job_new(C, op, ima, NULL, IMA_PREVIEW_ROTATE);
+	pj->filter = RNA_enum_get(op->ptr, "type");
+	pj->angle = -RNA_float_get(op->ptr, "angle");
+	pj->lock = RNA_boolean_get(op->ptr, "lock_size");
+	get_color_background_layer(pj->col, (ImageLayer*)ima->imlayers.last);
 
-	type = RNA_enum_get(op->ptr, "type");
-	angle = RNA_float_get(op->ptr, "angle");
-	lock = RNA_boolean_get(op->ptr, "lock_size");
-	get_color_background_layer(col, (ImageLayer*)ima->imlayers.last);
+	image_preview_job_start(C, pj);
 
-	angle = angle * (-1);
-
-	if (ima->preview_ibuf) {
-		IMB_freeImBuf(ima->preview_ibuf);
-		ima->preview_ibuf = NULL;
-	}
-
-	ima->preview_ibuf = IMB_dupImBuf(ibuf);
-
-	ima->preview_ibuf = IMB_rotation(ima->preview_ibuf, 0.0, 0.0, angle, type, lock, col);
-
-	BKE_image_release_ibuf(ima, ibuf, NULL);
 	return TRUE;
 }
 
@@ -3124,10 +3649,10 @@ void IMAGE_OT_arbitrary_rot(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_arbitrary_rot_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_arbitrary_rot_check;
-	ot->cancel = image_preview_cancel;
+	ot->cancel = image_preview_transform_cancel;
  
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -3144,7 +3669,7 @@ static int image_offset_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	struct ImBuf *ibuf, *ibuf_l;
+	struct ImBuf *ibuf, *ibuf_l, *mask_ibuf;
 	int x, y, half, wrap;
 	float col[4];
 	
@@ -3155,10 +3680,7 @@ static int image_offset_exec(bContext *C, wmOperator *op)
 	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 	ima->use_layers = TRUE;
 
-	if (ima->preview_ibuf) {
-		IMB_freeImBuf(ima->preview_ibuf);
-		ima->preview_ibuf = NULL;
-	}
+	image_preview_free(C, op);
 
 	x = RNA_int_get(op->ptr, "off_x");
 	y = RNA_int_get(op->ptr, "off_y");
@@ -3181,7 +3703,15 @@ static int image_offset_exec(bContext *C, wmOperator *op)
 
 	ibuf = IMB_offset(ibuf, x, y, half, wrap, col);
 	for (layer = ima->imlayers.first; layer; layer = layer->next) {
-		ibuf_l = (ImBuf *)layer->ibufs.first;
+		if (layer->mask) {
+			mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+			imalayer_mask_from_ibuf(layer, IMB_offset(mask_ibuf, x, y, half, wrap, mask_color));
+		}
+
+		if (!imalayer_has_pixels(layer))
+			continue;
+
+		ibuf_l = imalayer_get_ibuf(layer);
 		layer->ibufs.first = NULL;
 		layer->ibufs.last = NULL;
 		BLI_addtail(&layer->ibufs, IMB_offset(ibuf_l, x, y, half, wrap, col));
@@ -3197,50 +3727,31 @@ static int image_offset_exec(bContext *C, wmOperator *op)
 static bool image_offset_check(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
-	ImBuf *ibuf;
-	float col[4];
-	int x, y, half, wrap;
+	ImagePreviewJob *pj;
+	ImagePreviewProxy *pp;
 
 	if (!ima)
 		return FALSE;
 
-	ima->use_layers = FALSE;
-	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
-	ima->use_layers = TRUE;
-
-	x = RNA_int_get(op->ptr, "off_x");
-	y = RNA_int_get(op->ptr, "off_y");
-	half = RNA_boolean_get(op->ptr, "half");
-	wrap = RNA_boolean_get(op->ptr, "wrap");
-
-	if (abs(x) > ibuf->x) {
-		if (x > 0)
-			x = ibuf->x;
-		else
-			x = - ibuf->x;
+	pj = image_preview_job_new(C, op, ima, NULL, IMA_PREVIEW_OFFSET);
+	if (!(pp = pj->preview->proxies.first)) {
+		image_preview_job_free(pj);
+		return FALSE;
 	}
 
-	if (abs(y) > ibuf->y) {
-		if (y > 0)
-			y = ibuf->y;
-		else
-			y = - ibuf->y;
-	}
+	pj->x = RNA_int_get(op->ptr, "off_x");
+	pj->y = RNA_int_get(op->ptr, "off_y");
+	pj->half = RNA_boolean_get(op->ptr, "half");
+	pj->wrap = RNA_boolean_get(op->ptr, "wrap");
 
-	if (!wrap) {
-		get_color_background_layer(col, (ImageLayer*)ima->imlayers.last);
-	}
+	CLAMP(pj->x, -pp->ibuf->x, pp->ibuf->x);
+	CLAMP(pj->y, -pp->ibuf->y, pp->ibuf->y);
 
-	if (ima->preview_ibuf) {
-		IMB_freeImBuf(ima->preview_ibuf);
-		ima->preview_ibuf = NULL;
-	}
-
-	ima->preview_ibuf = IMB_dupImBuf(ibuf);
+	if (!pj->wrap)
+		get_color_background_layer(pj->col, (ImageLayer*)ima->imlayers.last);
 
-	ima->preview_ibuf = IMB_offset(ima->preview_ibuf, x, y, half, wrap, col);
+	image_preview_job_start(C, pj);
 
-	BKE_image_release_ibuf(ima, ibuf, NULL);
 	return TRUE;
 }
 
@@ -3253,10 +3764,10 @@ void IMAGE_OT_offset(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_offset_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_offset_check;
-	ot->cancel = image_preview_cancel;
+	ot->cancel = image_preview_transform_cancel;
 
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -3272,7 +3783,7 @@ static int image_scale_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	struct ImBuf *ibuf, *ibuf_l;
+	struct ImBuf *ibuf, *ibuf_l, *mask_ibuf;
 	int width, height, proportions;
 	float props;
 	
@@ -3310,7 +3821,15 @@ static int image_scale_exec(bContext *C, wmOperator *op)
 
 	IMB_scaleImBuf(ibuf, width, height);
 	for (layer = ima->imlayers.first; layer; layer = layer->next) {
-		ibuf_l = (ImBuf *)layer->ibufs.first;
+		if (layer->mask) {
+			mask_ibuf = imalayer_mask_to_ibuf(layer->mask);
+			imalayer_mask_from_ibuf(layer, IMB_scaleImBuf(mask_ibuf, width, height));
+		}
+
+		if (!imalayer_has_pixels(layer))
+			continue;
+
+		ibuf_l = imalayer_get_ibuf(layer);
 		layer->ibufs.first = NULL;
 		layer->ibufs.last = NULL;
 		BLI_addtail(&layer->ibufs, IMB_scaleImBuf(ibuf_l, width, height));
@@ -3332,7 +3851,7 @@ void IMAGE_OT_scale(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_scale_exec;
-	ot->poll = image_operator_poll;
+	ot->poll = image_operator_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 
 	/* flags */
@@ -3356,6 +3875,10 @@ static int image_merge_exec(bContext *C, wmOperator *op)
 
 	discard = RNA_boolean_get(op->ptr, "discard");
 
+	/* groups merge as their composite, adjustments into what's below them */
+	image_merge_layer_groups(ima);
+	image_merge_layer_adjustments(ima);
+
 	for (layer = (ImageLayer *)ima->imlayers.first; layer; layer = layer->next) {
 		if (layer->visible & IMA_LAYER_VISIBLE) {
 			flag = 1;
@@ -3435,6 +3958,9 @@ static int image_flatten_exec(bContext *C, wmOperator *op)
 	if (!ima)
 		return OPERATOR_CANCELLED;
 
+	image_merge_layer_groups(ima);
+	image_merge_layer_adjustments(ima);
+
 	for (layer = (ImageLayer *)ima->imlayers.first; layer; layer = layer->next) {
 		if (layer->visible & IMA_LAYER_VISIBLE) {
 			flag = 1;
@@ -3474,8 +4000,11 @@ static int image_flatten_exec(bContext *C, wmOperator *op)
 		get_color_background_layer(col, prec);
 
 		ima->use_layers = FALSE;
-		if (sima->mode == SI_MODE_PAINT)
+		if (sima->mode == SI_MODE_PAINT) {
+			/* the layer is edited as it is shown, with its own undo step */
+			ED_image_layer_apply_transform(op->type->name, ima);
 			ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
+		}
 		else 
 			ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_IMA);
 		ima->use_layers = TRUE;
@@ -3487,7 +4016,7 @@ static int image_flatten_exec(bContext *C, wmOperator *op)
 		if (sima->mode != SI_MODE_PAINT) {
 			ImBuf *ibuf_l;
 
-			ibuf_l = (ImBuf *)prec->ibufs.first;
+			ibuf_l = imalayer_get_ibuf(prec);
 			if (ibuf_l->rect)
 				IMB_alpha_under_color_byte((unsigned char *)ibuf_l->rect, ibuf_l->x, ibuf_l->y, col);
 			else if (ibuf_l->rect_float)
@@ -3495,6 +4024,7 @@ static int image_flatten_exec(bContext *C, wmOperator *op)
 		}
 
 		ibuf->userflags |= IB_BITMAPDIRTY;
+		image_layers_tag_dirty(ima, sima);
 		BKE_image_release_ibuf(ima, ibuf, NULL);
 	}
 	else
@@ -3530,22 +4060,18 @@ static int image_layer_poll(bContext *C)
 	else
 		return 0;
 }
- 
-static void image_layer_preview_cancel(bContext *C, wmOperator *UNUSED(op))
+
+static int image_layer_pixels_poll(bContext *C)
 {
-	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
 
-	layer = imalayer_get_current(ima);
-	if (layer) {
-		if (layer->preview_ibuf) {
-			IMB_freeImBuf(layer->preview_ibuf);
-			layer->preview_ibuf = NULL;
-			WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
-		}
-	}
-}
+	if (!image_layer_poll(C))
+		return 0;
 
+	layer = imalayer_get_current(CTX_data_edit_image(C));
+	return (layer && imalayer_has_pixels(layer));
+}
+ 
 static int image_layer_add_exec(bContext *C, wmOperator *op)
 {	
 	char name[22];
@@ -3756,11 +4282,23 @@ void IMAGE_OT_layer_remove(wmOperatorType *ot)
 	RNA_def_enum(ot->srna, "action", select_all_actions, IMA_LAYER_DEL_SELECTED, "Action", "Selection action to execute");
 }
 
+static bool image_layers_have_groups(Image *ima)
+{
+	ImageLayer *layer;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (imalayer_is_group(layer))
+			return true;
+	}
+
+	return false;
+}
+
 static int image_layer_move_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
-	ImageLayer *layer, *tmp;
-	int type, layerID;
+	ImageLayer *layer, *tmp, *parent, *last;
+	int type;
  
 	if (!ima)
 		return OPERATOR_CANCELLED;
@@ -3771,56 +4309,35 @@ static int image_layer_move_exec(bContext *C, wmOperator *op)
 		return OPERATOR_CANCELLED;
  
 	type = RNA_enum_get(op->ptr, "type");
-	layerID = imalayer_get_current_act(ima);
 	
+	/* groups move with their layers and layers stay in their group */
+	parent = imalayer_get_parent(layer);
+	last = imalayer_group_last(parent ? parent : (ImageLayer *)ima->imlayers.last);
+
 	if (!(layer->type & IMA_LAYER_BASE)) {
 		if (type == -1) { /* Move direction: Up */
-			if (layerID > 0) {
-				tmp = layer->prev;
-				BLI_remlink(&ima->imlayers, layer);
-				layer->next = layer->prev = NULL;
+			for (tmp = layer->prev; tmp && tmp->depth > layer->depth; tmp = tmp->prev) ;
 
-				if (tmp)
-					BLI_insertlinkbefore(&ima->imlayers, tmp, layer);
-				else
-					BLI_addhead(&ima->imlayers, layer);
-
-				imalayer_set_current_act(ima, layerID - 1);
-			}
+			if (tmp && tmp != parent)
+				imalayer_move_block(ima, layer, tmp);
 		}
 		else if (type == 1){ /* Move direction: Down */
-			if (layerID < (ima->Count_Layers - 1)) {
-				tmp = layer->next;
-				if (!(tmp->type & IMA_LAYER_BASE)) {
-					BLI_remlink(&ima->imlayers, layer);
-					layer->next = layer->prev = NULL;
+			tmp = imalayer_group_last(layer)->next;
 
-					if (tmp)
-						BLI_insertlinkafter(&ima->imlayers, tmp, layer);
-					else
-						BLI_addtail(&ima->imlayers, layer);
-
-					imalayer_set_current_act(ima, layerID+1);
-				}
-			}
+			if (tmp && tmp->depth == layer->depth && !(tmp->type & IMA_LAYER_BASE))
+				imalayer_move_block(ima, layer, imalayer_group_last(tmp)->next);
 		}
 		else if (type == -2) {  /* Move direction: Top */
-			BLI_remlink(&ima->imlayers, layer);
-			layer->next = layer->prev = NULL;
-			BLI_addhead(&ima->imlayers, layer);
-			ima->Act_Layers = 0;
+			imalayer_move_block(ima, layer, parent ? parent->next : (ImageLayer *)ima->imlayers.first);
 		}
 		else if (type == 2) {  /* Move direction: Bottom */
-			BLI_remlink(&ima->imlayers, layer);
-			layer->next = layer->prev = NULL;
-			if (((ImageLayer *)ima->imlayers.last)->type & IMA_LAYER_BASE) {
-				BLI_insertlinkafter(&ima->imlayers,((ImageLayer *)ima->imlayers.last)->prev, layer);
-				ima->Act_Layers = ima->Count_Layers - 2;
-			}
-			else {
-				BLI_addtail(&ima->imlayers, layer);
-				ima->Act_Layers = ima->Count_Layers - 1;
-			}
+			if (!parent && (last->type & IMA_LAYER_BASE))
+				imalayer_move_block(ima, layer, last);
+			else
+				imalayer_move_block(ima, layer, last->next);
+		}
+		else if (type == 3 && image_layers_have_groups(ima)) {  /* Move direction: Invert */
+			BKE_report(op->reports, RPT_INFO, "It can not invert the layers of groups");
 		}
 		else if (type == 3) {  /* Move direction: Invert */
 			int i = 0, lim;
@@ -3861,6 +4378,8 @@ static int image_layer_move_exec(bContext *C, wmOperator *op)
 			}
 		}
 	}
+	imalayer_set_current_act(ima, imalayer_get_index_layer(ima, layer));
+
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
  
 	return OPERATOR_FINISHED;
@@ -3959,6 +4478,23 @@ void IMAGE_OT_layer_select(wmOperatorType *ot)
 	RNA_def_enum(ot->srna, "action", select_all_actions, IMA_LAYER_SEL_NEXT, "Action", "Selection action to execute");
 }
 
+static void image_layer_undo_push_all(Image *ima)
+{
+	ImageLayer *layer;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next)
+		ED_image_layer_undo_push_layer(ima, layer);
+}
+
+/* the layer, with its layers for a group */
+static void image_layer_undo_push_block(Image *ima, ImageLayer *layer)
+{
+	ImageLayer *last = imalayer_group_last(layer);
+
+	for (; layer != last->next; layer = layer->next)
+		ED_image_layer_undo_push_layer(ima, layer);
+}
+
 static int image_layer_merge_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
@@ -3978,12 +4514,30 @@ static int image_layer_merge_exec(bContext *C, wmOperator *op)
 		if (!(layer->type & IMA_LAYER_BASE)) {
 			ImageLayer *next;
 			
-			next = layer->next;
-			if ((next->visible & IMA_LAYER_VISIBLE) && (!(next->locked & IMA_LAYER_LOCK))) {
-				merge_layers(ima, layer, next);
+			/* the layer below in the same group, groups merge as their composite */
+			next = imalayer_group_last(layer)->next;
+			if (next == NULL || next->depth != layer->depth)
+				BKE_report(op->reports, RPT_INFO, "It can not merge the layers, because the layer is the last of its group");
+			else if (imalayer_is_adjustment(next))
+				BKE_report(op->reports, RPT_INFO, "It can not merge the layers, because the next layer is an adjustment layer");
+			else if ((next->visible & IMA_LAYER_VISIBLE) && (!(next->locked & IMA_LAYER_LOCK))) {
+				ED_image_layer_undo_push_begin(op->type->name, ima);
+				image_layer_undo_push_block(ima, layer);
+				image_layer_undo_push_block(ima, next);
+
+				if (imalayer_is_group(layer))
+					layer = image_merge_layer_group(ima, layer);
+				if (imalayer_is_group(next))
+					next = image_merge_layer_group(ima, next);
+
+				if (layer && next) {
+					merge_layers(ima, layer, next);
+
+					imalayer_set_current_act(ima, imalayer_get_current_act(ima));
+					ima->Count_Layers--;
+				}
 
-				imalayer_set_current_act(ima, imalayer_get_current_act(ima));
-				ima->Count_Layers--;
+				ED_image_layer_undo_push_end(ima);
 			}
 			else
 				if (!(next->visible & IMA_LAYER_VISIBLE))
@@ -4002,6 +4556,18 @@ static int image_layer_merge_exec(bContext *C, wmOperator *op)
 			}
 		}
 		if (i == 1) {
+			ED_image_layer_undo_push_begin(op->type->name, ima);
+			image_layer_undo_push_all(ima);
+
+			/* groups become layers of their composite first, adjustments
+			 * get baked into what's below them */
+			image_merge_layer_groups(ima);
+			image_merge_layer_adjustments(ima);
+			for (layer = (ImageLayer *)ima->imlayers.first; layer; layer = layer->next) {
+				if (layer->visible & IMA_LAYER_VISIBLE)
+					break;
+			}
+
 			next = layer;
 			while ((next != NULL) && (layer->type != IMA_LAYER_BASE)) {
 				next = layer->next;
@@ -4014,6 +4580,8 @@ static int image_layer_merge_exec(bContext *C, wmOperator *op)
 				}
 			}
 			imalayer_set_current_act(ima,imalayer_get_current_act(ima));
+
+			ED_image_layer_undo_push_end(ima);
 		}
 		else
 			BKE_report(op->reports, RPT_INFO, "It can not merge the layers, because the layers are hidden");
@@ -4022,6 +4590,12 @@ static int image_layer_merge_exec(bContext *C, wmOperator *op)
 		ImageLayer *next, *app;
 		static float white_color[4] = {1.0f, 1.0f, 1.0f, 1.0f};
 
+		ED_image_layer_undo_push_begin(op->type->name, ima);
+		image_layer_undo_push_all(ima);
+
+		image_merge_layer_groups(ima);
+		image_merge_layer_adjustments(ima);
+
 		for (layer = (ImageLayer *)ima->imlayers.first; layer; layer = layer->next) {
 			if (layer->visible & IMA_LAYER_VISIBLE) {
 				break;
@@ -4059,7 +4633,7 @@ static int image_layer_merge_exec(bContext *C, wmOperator *op)
 				strcpy(layer->name, "Background");
 				layer->background = IMA_LAYER_BG_WHITE;
 				copy_v4_v4(layer->default_color, white_color);
-				base = (ImBuf *)layer->ibufs.first;
+				base = imalayer_get_ibuf(layer);
 				if (base->rect_float) {
 					float *fp_b = (float *)base->rect_float;
 					for (i = base->x * base->y; i > 0; i--, fp_b += 4) {
@@ -4094,6 +4668,8 @@ static int image_layer_merge_exec(bContext *C, wmOperator *op)
 			copy_v4_v4(layer->default_color, white_color);
 			imalayer_fill_color(ima, white_color);
 		}
+
+		ED_image_layer_undo_push_end(ima);
 	}
 	
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
@@ -4120,26 +4696,410 @@ void IMAGE_OT_layer_merge(wmOperatorType *ot)
 	ot->poll = image_layer_poll;
  
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
  
 	/* properties */
 	RNA_def_enum(ot->srna, "type", slot_merge, 0, "Type", "");
 }
 
-static int image_layer_clean_exec(bContext *C, wmOperator *UNUSED(op))
+static int image_layer_group_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *layer, *group;
+
+	if (!ima || !(layer = imalayer_get_current(ima)))
+		return OPERATOR_CANCELLED;
+
+	if (layer->type & IMA_LAYER_BASE) {
+		BKE_report(op->reports, RPT_INFO, "The background layer can not be put in a group");
+		return OPERATOR_CANCELLED;
+	}
+
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	image_layer_undo_push_block(ima, layer);
+
+	group = image_add_layer_group(ima);
+
+	ED_image_layer_undo_push_end(ima);
+
+	if (!group)
+		return OPERATOR_CANCELLED;
+
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
+
+	return OPERATOR_FINISHED;
+}
+
+void IMAGE_OT_layer_group(wmOperatorType *ot)
+{
+	/* identifiers */
+	ot->name = "Group Layer";
+	ot->idname = "IMAGE_OT_layer_group";
+	ot->description = "Put the selected image layer in a new group";
+
+	/* api callbacks */
+	ot->exec = image_layer_group_exec;
+	ot->poll = image_layer_poll;
+
+	/* flags */
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
+}
+
+static int image_layer_ungroup_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *group;
+	int ok;
+
+	if (!ima || !(group = imalayer_get_current(ima)) || !imalayer_is_group(group))
+		return OPERATOR_CANCELLED;
+
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	image_layer_undo_push_block(ima, group);
+
+	ok = image_ungroup_layer(ima, group);
+
+	ED_image_layer_undo_push_end(ima);
+
+	if (!ok)
+		return OPERATOR_CANCELLED;
+
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
+
+	return OPERATOR_FINISHED;
+}
+
+static int image_layer_ungroup_poll(bContext *C)
+{
+	ImageLayer *layer;
+
+	if (!image_layer_poll(C))
+		return 0;
+
+	layer = imalayer_get_current(CTX_data_edit_image(C));
+	return (layer && imalayer_is_group(layer));
+}
+
+void IMAGE_OT_layer_ungroup(wmOperatorType *ot)
+{
+	/* identifiers */
+	ot->name = "Ungroup Layers";
+	ot->idname = "IMAGE_OT_layer_ungroup";
+	ot->description = "Remove the selected group, its image layers stay";
+
+	/* api callbacks */
+	ot->exec = image_layer_ungroup_exec;
+	ot->poll = image_layer_ungroup_poll;
+
+	/* flags */
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
+}
+
+static int image_layer_adjustment_add_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *layer;
+
+	if (!ima || !imalayer_get_current(ima))
+		return OPERATOR_CANCELLED;
+
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+
+	layer = image_add_layer_adjustment(ima, RNA_enum_get(op->ptr, "type"));
+
+	ED_image_layer_undo_push_end(ima);
+
+	if (!layer)
+		return OPERATOR_CANCELLED;
+
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
+
+	return OPERATOR_FINISHED;
+}
+
+void IMAGE_OT_layer_adjustment_add(wmOperatorType *ot)
+{
+	/* identifiers */
+	ot->name = "Add Adjustment Layer";
+	ot->idname = "IMAGE_OT_layer_adjustment_add";
+	ot->description = "Add a layer changing the colors of the image layers below it";
+
+	/* api callbacks */
+	ot->exec = image_layer_adjustment_add_exec;
+	ot->invoke = WM_menu_invoke;
+	ot->poll = image_layer_poll;
+
+	/* flags */
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
+
+	/* properties */
+	ot->prop = RNA_def_enum(ot->srna, "type", image_layer_adjustment_type_items, IMA_LAYER_ADJUST_CURVES, "Type", "");
+}
+
+static int image_layer_mask_add_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *layer;
+	int type = RNA_enum_get(op->ptr, "type");
+	bool ok;
+
+	if (!ima || !(layer = imalayer_get_current(ima)) || layer->mask)
+		return OPERATOR_CANCELLED;
+
+	if (layer->type & IMA_LAYER_BASE) {
+		BKE_report(op->reports, RPT_INFO, "The background layer can not have a mask");
+		return OPERATOR_CANCELLED;
+	}
+
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	ok = imalayer_mask_add(ima, layer, type);
+
+	ED_image_layer_undo_push_end(ima);
+
+	if (!ok)
+		return OPERATOR_CANCELLED;
+
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
+
+	return OPERATOR_FINISHED;
+}
+
+static int image_layer_mask_add_poll(bContext *C)
+{
+	ImageLayer *layer;
+
+	if (!image_layer_poll(C))
+		return 0;
+
+	layer = imalayer_get_current(CTX_data_edit_image(C));
+	return (layer && !layer->mask && !(layer->type & IMA_LAYER_BASE));
+}
+
+void IMAGE_OT_layer_mask_add(wmOperatorType *ot)
+{
+	static EnumPropertyItem mask_type_items[] = {
+		{IMA_LAYER_MASK_WHITE, "WHITE", 0, "White", "Show the whole layer"},
+		{IMA_LAYER_MASK_BLACK, "BLACK", 0, "Black", "Hide the whole layer"},
+		{IMA_LAYER_MASK_FROM_ALPHA, "ALPHA", 0, "Layer Alpha", "Start from the alpha of the layer"},
+		{0, NULL, 0, NULL, NULL}
+	};
+
+	/* identifiers */
+	ot->name = "Add Layer Mask";
+	ot->idname = "IMAGE_OT_layer_mask_add";
+	ot->description = "Add a greyscale mask to the selected image layer";
+
+	/* api callbacks */
+	ot->exec = image_layer_mask_add_exec;
+	ot->invoke = WM_menu_invoke;
+	ot->poll = image_layer_mask_add_poll;
+
+	/* flags */
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
+
+	/* properties */
+	ot->prop = RNA_def_enum(ot->srna, "type", mask_type_items, IMA_LAYER_MASK_WHITE, "Type", "");
+}
+
+static int image_layer_mask_remove_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *layer;
+
+	if (!ima || !(layer = imalayer_get_current(ima)) || !layer->mask)
+		return OPERATOR_CANCELLED;
+
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	imalayer_mask_remove(layer, RNA_boolean_get(op->ptr, "apply"));
+
+	ED_image_layer_undo_push_end(ima);
+
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
+
+	return OPERATOR_FINISHED;
+}
+
+static int image_layer_mask_remove_poll(bContext *C)
+{
+	ImageLayer *layer;
+
+	if (!image_layer_poll(C))
+		return 0;
+
+	layer = imalayer_get_current(CTX_data_edit_image(C));
+	return (layer && layer->mask);
+}
+
+void IMAGE_OT_layer_mask_remove(wmOperatorType *ot)
+{
+	/* identifiers */
+	ot->name = "Remove Layer Mask";
+	ot->idname = "IMAGE_OT_layer_mask_remove";
+	ot->description = "Remove the mask of the selected image layer";
+
+	/* api callbacks */
+	ot->exec = image_layer_mask_remove_exec;
+	ot->poll = image_layer_mask_remove_poll;
+
+	/* flags */
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
+
+	/* properties */
+	RNA_def_boolean(ot->srna, "apply", 0, "Apply", "Keep the masked pixels transparent in the layer");
+}
+
+static int image_layers_export_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	char filepath[FILE_MAX];
+	int compress;
+
+	if (!ima || !RNA_struct_property_is_set(op->ptr, "filepath"))
+		return OPERATOR_CANCELLED;
+
+	RNA_string_get(op->ptr, "filepath", filepath);
+	BLI_path_abs(filepath, G.main->name);
+	BLI_ensure_extension(filepath, sizeof(filepath), ".exr");
+
+	compress = RNA_boolean_get(op->ptr, "use_compression") ? R_IMF_EXR_CODEC_ZIP : R_IMF_EXR_CODEC_NONE;
+
+	WM_cursor_wait(1);
+	if (!image_save_layers_exr(ima, filepath, compress, op->reports)) {
+		WM_cursor_wait(0);
+		return OPERATOR_CANCELLED;
+	}
+	WM_cursor_wait(0);
+
+	return OPERATOR_FINISHED;
+}
+
+static int image_layers_export_invoke(bContext *C, wmOperator *op, const wmEvent *UNUSED(event))
+{
+	Image *ima = CTX_data_edit_image(C);
+	char filepath[FILE_MAX];
+
+	if (!ima)
+		return OPERATOR_CANCELLED;
+
+	if (RNA_struct_property_is_set(op->ptr, "filepath"))
+		return image_layers_export_exec(C, op);
+
+	BLI_strncpy(filepath, ima->name[0] ? ima->name : ima->id.name + 2, sizeof(filepath));
+	BLI_path_abs(filepath, G.main->name);
+	BLI_replace_extension(filepath, sizeof(filepath), ".exr");
+
+	image_filesel(C, op, filepath);
+
+	return OPERATOR_RUNNING_MODAL;
+}
+
+void IMAGE_OT_layers_export(wmOperatorType *ot)
+{
+	/* identifiers */
+	ot->name = "Export Layers";
+	ot->idname = "IMAGE_OT_layers_export";
+	ot->description = "Save the image layers in a tiled multilayer OpenEXR file";
+
+	/* api callbacks */
+	ot->exec = image_layers_export_exec;
+	ot->invoke = image_layers_export_invoke;
+	ot->poll = image_layer_poll;
+
+	/* properties */
+	WM_operator_properties_filesel(ot, FOLDERFILE | IMAGEFILE, FILE_SPECIAL, FILE_SAVE,
+	                               WM_FILESEL_FILEPATH | WM_FILESEL_RELPATH, FILE_DEFAULTDISPLAY);
+	RNA_def_boolean(ot->srna, "use_compression", 1, "Compression", "Compress the tiles of the file (ZIP)");
+}
+
+static int image_layers_import_exec(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	char filepath[FILE_MAX];
+	int totlayer;
+
+	if (!ima || !RNA_struct_property_is_set(op->ptr, "filepath"))
+		return OPERATOR_CANCELLED;
+
+	RNA_string_get(op->ptr, "filepath", filepath);
+	BLI_path_abs(filepath, G.main->name);
+
+	WM_cursor_wait(1);
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+
+	totlayer = image_import_layers_exr(ima, filepath, op->reports);
+
+	ED_image_layer_undo_push_end(ima);
+	WM_cursor_wait(0);
+
+	if (totlayer == 0)
+		return OPERATOR_CANCELLED;
+
+	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, ima);
+
+	return OPERATOR_FINISHED;
+}
+
+static int image_layers_import_invoke(bContext *C, wmOperator *op, const wmEvent *UNUSED(event))
+{
+	Image *ima = CTX_data_edit_image(C);
+	char filepath[FILE_MAX];
+
+	if (!ima)
+		return OPERATOR_CANCELLED;
+
+	if (RNA_struct_property_is_set(op->ptr, "filepath"))
+		return image_layers_import_exec(C, op);
+
+	BLI_strncpy(filepath, ima->name, sizeof(filepath));
+	BLI_path_abs(filepath, G.main->name);
+
+	image_filesel(C, op, filepath);
+
+	return OPERATOR_RUNNING_MODAL;
+}
+
+void IMAGE_OT_layers_import(wmOperatorType *ot)
+{
+	/* identifiers */
+	ot->name = "Import Layers";
+	ot->idname = "IMAGE_OT_layers_import";
+	ot->description = "Add the image layers of a multilayer OpenEXR file saved with Export Layers";
+
+	/* api callbacks */
+	ot->exec = image_layers_import_exec;
+	ot->invoke = image_layers_import_invoke;
+	ot->poll = image_layer_poll;
+
+	/* flags */
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
+
+	/* properties */
+	WM_operator_properties_filesel(ot, FOLDERFILE | IMAGEFILE, FILE_SPECIAL, FILE_OPENFILE,
+	                               WM_FILESEL_FILEPATH | WM_FILESEL_RELPATH, FILE_DEFAULTDISPLAY);
+}
+
+static int image_layer_clean_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
 	static float alpha_color[4] = {0.0f, 0.0f, 0.0f, 0.0f};
 	static float white_color[4] = {1.0f, 1.0f, 1.0f, 1.0f};
 
+	/* imalayer_fill_color() acquires the layer, which is not done while a
+	 * transform is pending */
+	ED_image_layer_apply_transform(op->type->name, ima);
+
 	layer = imalayer_get_current(ima);
 
 	if (layer->background & IMA_LAYER_BG_IMAGE) {
 		int flag;
 		struct ImBuf *ibuf;
 
-		ibuf = layer->ibufs.first;
+		ibuf = imalayer_get_ibuf(layer);
 		BLI_remlink(&layer->ibufs, ibuf);
 		IMB_freeImBuf(ibuf);
 
@@ -4172,7 +5132,7 @@ void IMAGE_OT_layer_clean(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_clean_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
  
 	/* flags */
 	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
@@ -4193,10 +5153,13 @@ static int image_layer_flip_exec(bContext *C, wmOperator *op)
 	if (!layer)
 			return OPERATOR_CANCELLED;
 	
-	if (type == 1) /* Flip Horizontally */
-		IMB_flipx((ImBuf *)layer->ibufs.first);
-	else if (type == 2) /* Flip Vertically */
-		IMB_flipy((ImBuf *)layer->ibufs.first);
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	/* Flip Horizontally, Flip Vertically */
+	imalayer_transform_flip(layer, type == 1, type == 2);
+
+	ED_image_layer_undo_push_end(ima);
 	
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
  
@@ -4218,10 +5181,10 @@ void IMAGE_OT_layer_flip(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_flip_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
  
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
  
 	/* properties */
 	RNA_def_enum(ot->srna, "type", slot_flip, 0, "Type", "");
@@ -4231,7 +5194,6 @@ static int image_layer_rotate_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	ImBuf *ibuf;
 	int type;
 	float col[4];
  
@@ -4246,22 +5208,17 @@ static int image_layer_rotate_exec(bContext *C, wmOperator *op)
 	
 	get_color_background_layer(col, layer);
 
-	ibuf = (ImBuf*)((ImageLayer*)layer->ibufs.first);
-	if (type == 1) { /* ROT_90 */
-		layer->ibufs.first = NULL;
-		layer->ibufs.last = NULL;
-		BLI_addtail(&layer->ibufs, IMB_rotation(ibuf, 0.0, 0.0, DEG2RADF(-90.0), 2, 0, col));
-	}
-	else if (type == 2) { /* ROT_90A */
-		layer->ibufs.first = NULL;
-		layer->ibufs.last = NULL;
-		BLI_addtail(&layer->ibufs, IMB_rotation(ibuf, 0.0, 0.0, DEG2RADF(90.0), 2, 0, col));
-	}
-	else if (type == 3) { /* ROT_180 */
-		layer->ibufs.first = NULL;
-		layer->ibufs.last = NULL;
-		BLI_addtail(&layer->ibufs, IMB_rotation(ibuf, 0.0, 0.0, DEG2RADF(180.0), 2, 0, col));
-	}
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	if (type == 1) /* ROT_90 */
+		imalayer_transform_rotate(layer, DEG2RADF(-90.0f), false, IMA_LAYER_FILTER_BICUBIC, col);
+	else if (type == 2) /* ROT_90A */
+		imalayer_transform_rotate(layer, DEG2RADF(90.0f), false, IMA_LAYER_FILTER_BICUBIC, col);
+	else if (type == 3) /* ROT_180 */
+		imalayer_transform_rotate(layer, DEG2RADF(180.0f), false, IMA_LAYER_FILTER_BICUBIC, col);
+
+	ED_image_layer_undo_push_end(ima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
  
@@ -4284,10 +5241,10 @@ void IMAGE_OT_layer_rotate(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_rotate_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
  
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
  
 	/* properties */
 	RNA_def_enum(ot->srna, "type", slot_rot, 0, "Type", "");
@@ -4297,7 +5254,6 @@ static int image_layer_arbitrary_rot_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	ImBuf *ibuf;
 	float angle;
 	float col[4];
 	short type;
@@ -4305,19 +5261,12 @@ static int image_layer_arbitrary_rot_exec(bContext *C, wmOperator *op)
 	
 	if (!ima)
 		return OPERATOR_CANCELLED;
-	
-	ima->use_layers = FALSE;
-	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
-	ima->use_layers = TRUE;
 
 	layer = imalayer_get_current(ima);
 	if (!layer)
 			return OPERATOR_CANCELLED;
 
-	if (layer->preview_ibuf) {
-		IMB_freeImBuf(layer->preview_ibuf);
-		layer->preview_ibuf = NULL;
-	}
+	image_preview_free(C, op);
 
 	type = RNA_enum_get(op->ptr, "type");
 	angle = RNA_float_get(op->ptr, "angle");
@@ -4326,12 +5275,12 @@ static int image_layer_arbitrary_rot_exec(bContext *C, wmOperator *op)
 
 	angle = angle * (-1);
 
-	ibuf = (ImBuf *)layer->ibufs.first;
-	layer->ibufs.first = NULL;
-	layer->ibufs.last = NULL;
-	BLI_addtail(&layer->ibufs, IMB_rotation(ibuf, 0.0, 0.0, angle, type, lock, col));
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
 
-	BKE_image_release_ibuf(ima, ibuf, NULL);
+	imalayer_transform_rotate(layer, angle, lock, type, col);
+
+	ED_image_layer_undo_push_end(ima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
 
@@ -4342,38 +5291,19 @@ static bool image_layer_arbitrary_rot_check(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	ImBuf *ibuf;
-	float angle;
-	float col[4];
-	short type;
-	int lock;
+	ImagePreviewJob *pj;
 
-	if (!ima)
+	if (!ima || !(layer = imalayer_get_current(ima)))
 		return FALSE;
-	
-	ima->use_layers = FALSE;
-	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
-	ima->use_layers = TRUE;
 
-	layer = imalayer_get_current(ima);
-	type = RNA_enum_get(op->ptr, "type");
-	angle = RNA_float_get(op->ptr, "angle");
-	lock = RNA_boolean_get(op->ptr, "lock_size");
-
-	get_color_background_layer(col, layer);
-
-	angle = angle * (-1);
+	pj = image_preview_job_new(C, op, ima, layer, IMA_PREVIEW_ROTATE);
+	pj->filter = RNA_enum_get(op->ptr, "type");
+	pj->angle = -RNA_float_get(op->ptr, "angle");
+	pj->lock = RNA_boolean_get(op->ptr, "lock_size");
+	get_color_background_layer(pj->col, layer);
 
-	if (layer->preview_ibuf) {
-		IMB_freeImBuf(layer->preview_ibuf);
-		layer->preview_ibuf = NULL;
-	}
+	image_preview_job_start(C, pj);
 
-	layer->preview_ibuf = IMB_dupImBuf(ibuf);
-
-	layer->preview_ibuf = IMB_rotation(layer->preview_ibuf, 0.0, 0.0, angle, type, lock, col);
-	
-	BKE_image_release_ibuf(ima, ibuf, NULL);
 	return TRUE;
 }
 
@@ -4395,13 +5325,13 @@ void IMAGE_OT_layer_arbitrary_rot(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_arbitrary_rot_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_layer_arbitrary_rot_check;
-	ot->cancel = image_layer_preview_cancel;
+	ot->cancel = image_preview_transform_cancel;
  
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
  
 	/* properties */
 	RNA_def_enum(ot->srna, "type", rotate_items, 0, "Type", "");
@@ -4415,19 +5345,20 @@ static int image_layer_offset_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	struct ImBuf *ibuf;
-	int x, y, half, wrap;
-	float col[4];
+	int x, y, half, wrap, layer_x, layer_y;
+	float col[4] = {0.0f, 0.0f, 0.0f, 0.0f};
 	
 	if (!ima)
 		return OPERATOR_CANCELLED;
-	
+
+	image_preview_free(C, op);
+
 	layer = imalayer_get_current(ima);
 	if (!layer)
 			return OPERATOR_CANCELLED;
 
-	ibuf = (ImBuf *)layer->ibufs.first;
-	if (!ibuf)
+	imalayer_transform_get_size(layer, &layer_x, &layer_y);
+	if (layer_x == 0)
 			return OPERATOR_CANCELLED;
 	
 	x = RNA_int_get(op->ptr, "off_x");
@@ -4435,12 +5366,12 @@ static int image_layer_offset_exec(bContext *C, wmOperator *op)
 	half = RNA_boolean_get(op->ptr, "half");
 	wrap = RNA_boolean_get(op->ptr, "wrap");
 		
-	if (abs(x) > ibuf->x) {
+	if (abs(x) > layer_x) {
 		BKE_report(op->reports, RPT_WARNING, "The offset can not be larger than the image.");
 		return OPERATOR_CANCELLED;
 	}
 
-	if (abs(y) > ibuf->y) {
+	if (abs(y) > layer_y) {
 		BKE_report(op->reports, RPT_WARNING, "The offset can not be larger than the image.");
 		return OPERATOR_CANCELLED;
 	}
@@ -4448,9 +5379,12 @@ static int image_layer_offset_exec(bContext *C, wmOperator *op)
 	if (!wrap)
 		get_color_background_layer(col, layer);
 
-	layer->ibufs.first = NULL;
-	layer->ibufs.last = NULL;
-	BLI_addtail(&layer->ibufs, IMB_offset(ibuf, x, y, half, wrap, col));
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	imalayer_transform_offset(layer, x, y, half, wrap, col);
+
+	ED_image_layer_undo_push_end(ima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
  
@@ -4461,51 +5395,30 @@ static bool image_layer_offset_check(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	ImBuf *ibuf;
-	float col[4];
-	int x, y, half, wrap;
+	ImagePreviewJob *pj;
+	int layer_x, layer_y;
 
-	if (!ima)
+	if (!ima || !(layer = imalayer_get_current(ima)))
 		return FALSE;
 
-	ima->use_layers = FALSE;
-	ibuf = BKE_image_acquire_ibuf(ima, NULL, NULL, IMA_IBUF_LAYER);
-	ima->use_layers = TRUE;
-
-	layer = imalayer_get_current(ima);
-	x = RNA_int_get(op->ptr, "off_x");
-	y = RNA_int_get(op->ptr, "off_y");
-	half = RNA_boolean_get(op->ptr, "half");
-	wrap = RNA_boolean_get(op->ptr, "wrap");
-
-	if (abs(x) > ibuf->x) {
-		if (x > 0)
-			x = ibuf->x;
-		else
-			x = - ibuf->x;
-	}
+	imalayer_transform_get_size(layer, &layer_x, &layer_y);
+	if (layer_x == 0)
+		return FALSE;
 
-	if (abs(y) > ibuf->y) {
-		if (y > 0)
-			y = ibuf->y;
-		else
-			y = - ibuf->y;
-	}
+	pj = image_preview_job_new(C, op, ima, layer, IMA_PREVIEW_OFFSET);
+	pj->x = RNA_int_get(op->ptr, "off_x");
+	pj->y = RNA_int_get(op->ptr, "off_y");
+	pj->half = RNA_boolean_get(op->ptr, "half");
+	pj->wrap = RNA_boolean_get(op->ptr, "wrap");
 
-	if (!wrap) {
-		get_color_background_layer(col, layer);
-	}
+	CLAMP(pj->x, -layer_x, layer_x);
+	CLAMP(pj->y, -layer_y, layer_y);
 
-	if (layer->preview_ibuf) {
-		IMB_freeImBuf(layer->preview_ibuf);
-		layer->preview_ibuf = NULL;
-	}
+	if (!pj->wrap)
+		get_color_background_layer(pj->col, layer);
 
-	layer->preview_ibuf = IMB_dupImBuf(ibuf);
+	image_preview_job_start(C, pj);
 
-	layer->preview_ibuf = IMB_offset(layer->preview_ibuf, x, y, half, wrap, col);
-
-	BKE_image_release_ibuf(ima, ibuf, NULL);
 	return TRUE;
 }
 
@@ -4518,13 +5431,13 @@ void IMAGE_OT_layer_offset(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_offset_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 	ot->check = image_layer_offset_check;
-	ot->cancel = image_layer_preview_cancel;
+	ot->cancel = image_preview_transform_cancel;
 
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
 
 	/* properties */
 	RNA_def_int(ot->srna, "off_x", 0, INT_MIN, INT_MAX, "X", "Offset X", -16384, 16384);
@@ -4537,8 +5450,7 @@ static int image_layer_scale_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	struct ImBuf *ibuf;
-	int width, height, proportions;
+	int width, height, proportions, layer_x, layer_y;
 	float props;
 	
 	if (!ima)
@@ -4548,8 +5460,8 @@ static int image_layer_scale_exec(bContext *C, wmOperator *op)
 	if (!layer)
 			return OPERATOR_CANCELLED;
 
-	ibuf = (ImBuf *)layer->ibufs.first;
-	if (!ibuf)
+	imalayer_transform_get_size(layer, &layer_x, &layer_y);
+	if (layer_x == 0)
 			return OPERATOR_CANCELLED;
 	
 	width = RNA_int_get(op->ptr, "width");
@@ -4567,17 +5479,22 @@ static int image_layer_scale_exec(bContext *C, wmOperator *op)
 
 		if ((width == 0) || (height == 0)) {
 			if (width == 0) {
-				props = (float)ibuf->y / ibuf->x;
+				props = (float)layer_y / layer_x;
 				width = (int)floor((float)height / props);
 			}
 			else {
-				props = (float)ibuf->x / ibuf->y;
+				props = (float)layer_x / layer_y;
 				height = (int)floor((float)width / props);
 			}
 		}
 	}
 
-	IMB_scaleImBuf(ibuf, width, height);
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	imalayer_transform_scale(layer, width, height);
+
+	ED_image_layer_undo_push_end(ima);
 
 	WM_event_add_notifier(C, NC_IMAGE | ND_DRAW, NULL);
  
@@ -4593,11 +5510,11 @@ void IMAGE_OT_layer_scale(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_scale_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
 
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
 
 	/* properties */
 	RNA_def_int(ot->srna, "width", 0, 0, INT_MAX, "Width", "Width", 0, 16384);
@@ -4609,20 +5526,21 @@ static int image_layer_size_exec(bContext *C, wmOperator *op)
 {
 	Image *ima = CTX_data_edit_image(C);
 	ImageLayer *layer;
-	struct ImBuf *ibuf;
-	int width, height, off_x, off_y, proportions, centre;
+	int width, height, off_x, off_y, proportions, centre, layer_x, layer_y;
 	float props;
 	float col[4];
 	
 	if (!ima)
 		return OPERATOR_CANCELLED;
-	
+
+	image_preview_free(C, op);
+
 	layer = imalayer_get_current(ima);
 	if (!layer)
 			return OPERATOR_CANCELLED;
 
-	ibuf = (ImBuf *)layer->ibufs.first;
-	if (!ibuf)
+	imalayer_transform_get_size(layer, &layer_x, &layer_y);
+	if (layer_x == 0)
 			return OPERATOR_CANCELLED;
 	
 	width = RNA_int_get(op->ptr, "width");
@@ -4644,17 +5562,17 @@ static int image_layer_size_exec(bContext *C, wmOperator *op)
 
 		if ((width == 0) || (height == 0)) {
 			if (width == 0) {
-				props = (float)ibuf->y / ibuf->x;
+				props = (float)layer_y / layer_x;
 				width = (int)floor((float)height / props);
 			}
 			else {
-				props = (float)ibuf->x / ibuf->y;
+				props = (float)layer_x / layer_y;
 				height = (int)floor((float)width / props);
 			}
 		}
 	}
 
-	if (width > ibuf->x) {
+	if (width > layer_x) {
 		if (off_x < 0) {
 			BKE_report(op->reports, RPT_WARNING, "The offset must be greater than 0.");
 			return OPERATOR_CANCELLED;
@@ -4667,7 +5585,7 @@ static int image_layer_size_exec(bContext *C, wmOperator *op)
 		}
 	}
 
-	if (height > ibuf->y) {
+	if (height > layer_y) {
 		if (off_y < 0) {
 			BKE_report(op->reports, RPT_WARNING, "The offset must be greater than 0.");
 			return OPERATOR_CANCELLED;
@@ -4681,15 +5599,62 @@ static int image_layer_size_exec(bContext *C, wmOperator *op)
 	}
 
 	get_color_background_layer(col, layer);
-	layer->ibufs.first = NULL;
-	layer->ibufs.last = NULL;
-	BLI_addtail(&layer->ibufs, IMB_size(ibuf, width, height, off_x, off_y, centre, col));
+
+	ED_image_layer_undo_push_begin(op->type->name, ima);
+	ED_image_layer_undo_push_layer(ima, layer);
+
+	imalayer_transform_size(layer, width, height, off_x, off_y, centre, col);
+
+	ED_image_layer_undo_push_end(ima);
 
 	WM_event_add_notifier(C, NC_IMAGE|ND_DRAW, NULL);
  
 	return OPERATOR_FINISHED;
 }
 
+static bool image_layer_size_check(bContext *C, wmOperator *op)
+{
+	Image *ima = CTX_data_edit_image(C);
+	ImageLayer *layer;
+	ImagePreviewJob *pj;
+	int width, height, layer_x, layer_y;
+
+	if (!ima || !(layer = imalayer_get_current(ima)))
+		return FALSE;
+
+	imalayer_transform_get_size(layer, &layer_x, &layer_y);
+	if (layer_x == 0)
+		return FALSE;
+
+	width = RNA_int_get(op->ptr, "width");
+	height = RNA_int_get(op->ptr, "height");
+
+	if ((width == 0) && (height == 0))
+		return FALSE;
+
+	if (RNA_boolean_get(op->ptr, "proportions")) {
+		if (width == 0)
+			width = (int)floor((float)height / ((float)layer_y / layer_x));
+		else if (height == 0)
+			height = (int)floor((float)width / ((float)layer_x / layer_y));
+	}
+
+	if ((width == 0) || (height == 0))
+		return FALSE;
+
+	pj = image_preview_job_new(C, op, ima, layer, IMA_PREVIEW_SIZE);
+	pj->width = width;
+	pj->height = height;
+	pj->x = RNA_int_get(op->ptr, "off_x");
+	pj->y = RNA_int_get(op->ptr, "off_y");
+	pj->centre = RNA_boolean_get(op->ptr, "centre");
+	get_color_background_layer(pj->col, layer);
+
+	image_preview_job_start(C, pj);
+
+	return TRUE;
+}
+
 void IMAGE_OT_layer_size(wmOperatorType *ot)
 {
 	/* identifiers */
@@ -4699,11 +5664,13 @@ void IMAGE_OT_layer_size(wmOperatorType *ot)
  
 	/* api callbacks */
 	ot->exec = image_layer_size_exec;
-	ot->poll = image_layer_poll;
+	ot->poll = image_layer_pixels_poll;
 	ot->invoke = image_op_layer_invoke;
+	ot->check = image_layer_size_check;
+	ot->cancel = image_preview_transform_cancel;
 
 	/* flags */
-	ot->flag = OPTYPE_REGISTER | OPTYPE_UNDO;
+	ot->flag = OPTYPE_REGISTER;  /* undo is pushed on the image paint stack */
 
 	/* properties */
 	RNA_def_int(ot->srna, "width", 0, 0, INT_MAX, "Width", "Width", 0, 16384);
@@ -287,6 +287,13 @@ static void image_operatortypes(void)
 	WM_operatortype_append(IMAGE_OT_layer_select);
 	WM_operatortype_append(IMAGE_OT_layer_clean);
 	WM_operatortype_append(IMAGE_OT_layer_merge);
+	WM_operatortype_append(IMAGE_OT_layer_group);
+	WM_operatortype_append(IMAGE_OT_layer_ungroup);
+	WM_operatortype_append(IMAGE_OT_layer_adjustment_add);
+	WM_operatortype_append(IMAGE_OT_layer_mask_add);
+	WM_operatortype_append(IMAGE_OT_layer_mask_remove);
+	WM_operatortype_append(IMAGE_OT_layers_export);
+	WM_operatortype_append(IMAGE_OT_layers_import);
 	WM_operatortype_append(IMAGE_OT_layer_flip);
 	WM_operatortype_append(IMAGE_OT_layer_rotate);
 	WM_operatortype_append(IMAGE_OT_layer_arbitrary_rot);
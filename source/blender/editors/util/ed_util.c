@@ -113,6 +113,7 @@ void ED_editors_exit(bContext *C)
 	/* frees all editmode undos */
 	undo_editmode_clear();
 	ED_undo_paint_free();
+	ED_imapaint_proj_cache_free();
 	
 	for (sce = bmain->scene.first; sce; sce = sce->id.next) {
 		if (sce->obedit) {
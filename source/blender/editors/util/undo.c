@@ -146,6 +146,7 @@ static int ed_undo_step(bContext *C, int step, const char *undoname)
 			r_undo_paint = ED_undo_paint_step(C, UNDO_PAINT_IMAGE, step, undoname);
 			if (!r_undo_paint && undoname) {
 				if (U.uiflag & USER_GLOBALUNDO) {
+					ED_imapaint_proj_cache_free();
 					ED_viewport_render_kill_jobs(C, true);
 					BKE_undo_name(C, undoname);
 				}
@@ -153,6 +154,7 @@ static int ed_undo_step(bContext *C, int step, const char *undoname)
 			if (r_undo_paint == 2) {
 				if (U.uiflag & USER_GLOBALUNDO) {
 					undo_editmode_clear();
+					ED_imapaint_proj_cache_free();
 					ED_viewport_render_kill_jobs(C, true);
 					if (undoname)
 						BKE_undo_name(C, undoname);
@@ -208,6 +210,8 @@ static int ed_undo_step(bContext *C, int step, const char *undoname)
 			/* for global undo/redo we should just clear the editmode stack */
 			/* for example, texface stores image pointers */
 			undo_editmode_clear();
+			/* the objects are read again, the binning of projection paint refers to them */
+			ED_imapaint_proj_cache_free();
 			
 			ED_viewport_render_kill_jobs(C, true);
 
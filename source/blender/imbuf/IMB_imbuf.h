@@ -325,6 +325,7 @@ void IMB_filtery(struct ImBuf *ibuf);
  * \attention Defined in scaling.c
  */
 struct ImBuf *IMB_onehalf(struct ImBuf *ibuf1);
+void IMB_onehalf_rect(struct ImBuf *ibuf2, struct ImBuf *ibuf1, int xmin, int ymin, int xmax, int ymax);
 
 /**
  *
@@ -483,6 +484,32 @@ void IMB_flipx(struct ImBuf *ibuf);
 void IMB_flipy(struct ImBuf *ibuf);
 struct ImBuf *IMB_rotation(struct ImBuf *ibuf, float x, float y, float angle, int filter_type, int lock, float default_color[4]);
 
+/**
+ * Affine resampling, "mat" maps the center of a destination pixel to
+ * a position in the source pixels, pixel i covering i..i+1.
+ *
+ * \attention Defined in transform.c
+ */
+enum {
+	IMB_FILTER_NEAREST = 0,
+	IMB_FILTER_BILINEAR = 1,
+	IMB_FILTER_BICUBIC = 2
+};
+
+/* what's sampled outside the source pixels */
+enum {
+	IMB_TRANSFORM_FILL = 0,   /* the given color */
+	IMB_TRANSFORM_WRAP = 1,   /* the source repeated */
+	IMB_TRANSFORM_EXTEND = 2  /* whatever the filter gives near the edges */
+};
+
+void IMB_transform_rotation_matrix(int width, int height, float angle, bool lock,
+                                   float r_mat[2][3], int *r_width, int *r_height);
+void IMB_transform_sample_row(const struct ImBuf *ibuf, bool is_float, const float mat[2][3], int filter,
+                              int extend, const void *fill, int x, int y, int len, void *r_row);
+void IMB_transform(struct ImBuf *dst, const struct ImBuf *src, const float mat[2][3], int filter,
+                   int extend, const float fill[4]);
+
 /* Premultiply alpha */
 
 void IMB_premultiply_alpha(struct ImBuf *ibuf);
@@ -540,6 +567,8 @@ void IMB_processor_apply_threaded(int buffer_lines, int handle_size, void *init_
                                   void (init_handle) (void *handle, int start_line, int tot_line,
                                                       void *customdata),
                                   void *(do_thread) (void *));
+void IMB_processor_apply_rows(int buffer_lines, int line_pixels, void *userdata,
+                              void (do_rows) (void *userdata, int start_line, int tot_line));
 
 /* ffmpeg */
 void IMB_ffmpeg_init(void);
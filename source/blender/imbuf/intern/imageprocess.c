@@ -41,6 +41,7 @@
 #include "MEM_guardedalloc.h"
 
 #include "BLI_utildefines.h"
+#include "BLI_task.h"
 #include "BLI_threads.h"
 #include "BLI_listbase.h"
 #include "BLI_math.h"
@@ -332,6 +333,58 @@ void IMB_processor_apply_threaded(int buffer_lines, int handle_size, void *init_
 	MEM_freeN(handles);
 }
 
+/* below this many pixels the rows are done on the calling thread */
+#define PROCESSOR_ROWS_THREADED_MIN		(64 * 1024)
+
+typedef struct ProcessorRows {
+	void (*do_rows)(void *userdata, int start_line, int tot_line);
+	void *userdata;
+	int buffer_lines;
+	int band_lines;
+} ProcessorRows;
+
+static void processor_rows_task(TaskPool *pool, void *taskdata, int UNUSED(threadid))
+{
+	ProcessorRows *rows = BLI_task_pool_userdata(pool);
+	int start_line = GET_INT_FROM_POINTER(taskdata);
+
+	rows->do_rows(rows->userdata, start_line, min_ii(rows->band_lines, rows->buffer_lines - start_line));
+}
+
+/* Like IMB_processor_apply_threaded(), but "do_rows" is run on bands of a few
+ * lines from the task scheduler, so threads that finish early take more of them
+ * and it can be used from within other tasks */
+void IMB_processor_apply_rows(int buffer_lines, int line_pixels, void *userdata,
+                              void (do_rows) (void *userdata, int start_line, int tot_line))
+{
+	TaskScheduler *task_scheduler = BLI_task_scheduler_get();
+	TaskPool *task_pool;
+	ProcessorRows rows;
+	int num_threads = BLI_task_scheduler_num_threads(task_scheduler);
+	int start_line;
+
+	if (buffer_lines <= 0)
+		return;
+
+	if (num_threads < 2 || (size_t)buffer_lines * (size_t)line_pixels < PROCESSOR_ROWS_THREADED_MIN) {
+		do_rows(userdata, 0, buffer_lines);
+		return;
+	}
+
+	rows.do_rows = do_rows;
+	rows.userdata = userdata;
+	rows.buffer_lines = buffer_lines;
+	rows.band_lines = max_ii(1, (buffer_lines + num_threads * 4 - 1) / (num_threads * 4));
+
+	task_pool = BLI_task_pool_create(task_scheduler, &rows);
+
+	for (start_line = 0; start_line < buffer_lines; start_line += rows.band_lines)
+		BLI_task_pool_push(task_pool, processor_rows_task, SET_INT_IN_POINTER(start_line), false, TASK_PRIORITY_LOW);
+
+	BLI_task_pool_work_and_wait(task_pool);
+	BLI_task_pool_free(task_pool);
+}
+
 /* Alpha-under */
 
 void IMB_alpha_under_color_float(float *rect_float, int x, int y, float backcol[3])
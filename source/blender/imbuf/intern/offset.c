@@ -47,13 +47,12 @@
 
 #include "IMB_allocimbuf.h"
 
+/* Moves the pixels by x, y, the ones moved out come back on the other side
+ * with "wrap", otherwise "default_color" fills what they left */
 struct ImBuf *IMB_offset(struct ImBuf *ibuf, float x, float y, int half, int wrap, float default_color[4])
 {
-	int i, j, x1, y1;
 	struct ImBuf *ibuf_2;
-	unsigned char ccol[4];
-	unsigned char *col_d, *col_s;
-	float *f_col_d, *f_col_s;
+	float mat[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
 
 	if (ibuf == NULL) return NULL;
 
@@ -66,95 +65,12 @@ struct ImBuf *IMB_offset(struct ImBuf *ibuf, float x, float y, int half, int wra
 		x = (int)(ibuf->x / 2);
 	}
 
-	if ((x != 0) || (y != 0)) {
-		
-		if (ibuf->rect) {
-			if (!wrap)
-				rgba_float_to_uchar(ccol, default_color);
-		}
+	mat[0][2] = -(int)x;
+	mat[1][2] = -(int)y;
 
-		for (j = 0; j < ibuf->y; j++) {
-			for (i = 0; i < ibuf->x; i++) {
-
-				if (x != 0) {
-					x1 = i + x;
-					if (x > 0) {
-						if (x1 >= ibuf_2->x)
-							x1 = x1 - ibuf->x;
-					}
-					else {
-						if (x1 < 0)
-							x1 = x1 + ibuf->x;
-					}
-				}
-				else
-					x1 = i;
-
-				if (y != 0) {
-					y1 = j + y;
-					if (y > 0) {
-						if (y1 >= ibuf_2->y)
-							y1 = y1 - ibuf->y;
-					}
-					else {
-						if (y1 < 0)
-							y1 = y1 + ibuf->y;
-
-					}
-				}
-				else
-					y1 = j;
-				
-				if (ibuf->rect) {
-					col_d = NULL;
-					col_s = NULL;
-					col_d = (unsigned char *)ibuf_2->rect + ibuf_2->x * y1 * 4 + 4 * x1;
-					col_s = (unsigned char *)ibuf->rect + ibuf->x * j * 4 + 4 * i;
-				}
-
-				if (ibuf->rect_float) {
-					f_col_d = NULL;
-					f_col_s = NULL;
-					f_col_d = ibuf_2->rect_float + ibuf_2->x * y1 * 4 + 4 * x1;
-					f_col_s = ibuf->rect_float + ibuf->x * j * 4 + 4 * i;
-				}
-
-				if (wrap) {
-					if (ibuf->rect) {
-						col_d[0] = col_s[0];
-						col_d[1] = col_s[1];
-						col_d[2] = col_s[2];
-						col_d[3] = col_s[3];
-					}
-					if (ibuf->rect_float)
-						copy_v4_v4(f_col_d, f_col_s);
-				}
-				else {
-					if ((((i + x) >= 0) && ((i + x) < ibuf->x)) &&
-					    (((j + y) >= 0) && ((j + y) < ibuf->y))) {
-						if (ibuf->rect) {
-							col_d[0] = col_s[0];
-							col_d[1] = col_s[1];
-							col_d[2] = col_s[2];
-							col_d[3] = col_s[3];
-						}
-						if (ibuf->rect_float)
-							copy_v4_v4(f_col_d, f_col_s);
-						}
-					else {
-						if (ibuf->rect) {
-							col_d[0] = ccol[0];
-							col_d[1] = ccol[1];
-							col_d[2] = ccol[2];
-							col_d[3] = ccol[3];
-						}
-						if (ibuf->rect_float)
-							copy_v4_v4(f_col_d, default_color);
-					}
-				}
-			}
-		}
-	}
+	if ((mat[0][2] != 0.0f) || (mat[1][2] != 0.0f))
+		IMB_transform(ibuf_2, ibuf, mat, IMB_FILTER_NEAREST, wrap ? IMB_TRANSFORM_WRAP : IMB_TRANSFORM_FILL,
+		              default_color);
 
 	IMB_freeImBuf(ibuf);
 	return ibuf_2;
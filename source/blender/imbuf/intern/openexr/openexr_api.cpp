@@ -83,9 +83,13 @@ _CRTIMP void __cdecl _invalid_parameter_noinfo(void)
 #include <ImfPixelType.h>
 #include <ImfInputFile.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledInputFile.h>
+#include <ImfTiledOutputFile.h>
 #include <ImfCompression.h>
 #include <ImfCompressionAttribute.h>
 #include <ImfStringAttribute.h>
+#include <ImfIntAttribute.h>
+#include <ImfFloatAttribute.h>
 #include <ImfStandardAttributes.h>
 
 using namespace Imf;
@@ -500,6 +504,7 @@ typedef struct ExrHandle {
 
 	IFileStream *ifile_stream;
 	InputFile *ifile;
+	TiledInputFile *tifile;
 
 	OFileStream *ofile_stream;
 	TiledOutputFile *tofile;
@@ -511,8 +516,20 @@ typedef struct ExrHandle {
 
 	ListBase channels;  /* flattened out, ExrChannel */
 	ListBase layers;    /* hierarchical, pointing in end to ExrChannel */
+	ListBase attributes;  /* ExrAttribute, written in the header */
 } ExrHandle;
 
+/* header attribute of a file to write */
+typedef struct ExrAttribute {
+	struct ExrAttribute *next, *prev;
+
+	char name[EXR_TOT_MAXNAME + 1];
+	char type;                       /* 'i', 'f' or 's' */
+	int ivalue;
+	float fvalue;
+	char svalue[EXR_TOT_MAXNAME + 1];
+} ExrAttribute;
+
 /* flattened out channel */
 typedef struct ExrChannel {
 	struct ExrChannel *next, *prev;
@@ -577,6 +594,95 @@ void IMB_exr_add_channel(void *handle, const char *layname, const char *passname
 	BLI_addtail(&data->channels, echan);
 }
 
+static ExrAttribute *imb_exr_attribute_add(ExrHandle *data, const char *name, char type)
+{
+	ExrAttribute *attr = (ExrAttribute *)MEM_callocN(sizeof(ExrAttribute), "exr attribute");
+
+	BLI_strncpy(attr->name, name, sizeof(attr->name));
+	attr->type = type;
+	BLI_addtail(&data->attributes, attr);
+
+	return attr;
+}
+
+void IMB_exr_add_attribute_int(void *handle, const char *name, int value)
+{
+	imb_exr_attribute_add((ExrHandle *)handle, name, 'i')->ivalue = value;
+}
+
+void IMB_exr_add_attribute_float(void *handle, const char *name, float value)
+{
+	imb_exr_attribute_add((ExrHandle *)handle, name, 'f')->fvalue = value;
+}
+
+void IMB_exr_add_attribute_string(void *handle, const char *name, const char *value)
+{
+	ExrAttribute *attr = imb_exr_attribute_add((ExrHandle *)handle, name, 's');
+
+	BLI_strncpy(attr->svalue, value, sizeof(attr->svalue));
+}
+
+static void imb_exr_header_attributes(Header *header, ExrHandle *data)
+{
+	ExrAttribute *attr;
+
+	for (attr = (ExrAttribute *)data->attributes.first; attr; attr = attr->next) {
+		if (attr->type == 'i')
+			header->insert(attr->name, IntAttribute(attr->ivalue));
+		else if (attr->type == 'f')
+			header->insert(attr->name, FloatAttribute(attr->fvalue));
+		else
+			header->insert(attr->name, StringAttribute(attr->svalue));
+	}
+}
+
+/* header of the file being read */
+static const Header *imb_exr_read_header(ExrHandle *data)
+{
+	if (data->tifile)
+		return &data->tifile->header();
+	if (data->ifile)
+		return &data->ifile->header();
+
+	return NULL;
+}
+
+int IMB_exr_get_attribute_int(void *handle, const char *name, int *r_value)
+{
+	const Header *header = imb_exr_read_header((ExrHandle *)handle);
+	const IntAttribute *attr = header ? header->findTypedAttribute <IntAttribute> (name) : NULL;
+
+	if (attr == NULL)
+		return 0;
+
+	*r_value = attr->value();
+	return 1;
+}
+
+int IMB_exr_get_attribute_float(void *handle, const char *name, float *r_value)
+{
+	const Header *header = imb_exr_read_header((ExrHandle *)handle);
+	const FloatAttribute *attr = header ? header->findTypedAttribute <FloatAttribute> (name) : NULL;
+
+	if (attr == NULL)
+		return 0;
+
+	*r_value = attr->value();
+	return 1;
+}
+
+int IMB_exr_get_attribute_string(void *handle, const char *name, char *r_value, int maxlen)
+{
+	const Header *header = imb_exr_read_header((ExrHandle *)handle);
+	const StringAttribute *attr = header ? header->findTypedAttribute <StringAttribute> (name) : NULL;
+
+	if (attr == NULL)
+		return 0;
+
+	BLI_strncpy(r_value, attr->value().c_str(), maxlen);
+	return 1;
+}
+
 /* only used for writing temp. render results (not image files) */
 int IMB_exr_begin_write(void *handle, const char *filename, int width, int height, int compress)
 {
@@ -591,6 +697,7 @@ int IMB_exr_begin_write(void *handle, const char *filename, int width, int heigh
 		header.channels().insert(echan->name, Channel(Imf::FLOAT));
 
 	openexr_header_compression(&header, compress);
+	imb_exr_header_attributes(&header, data);
 	// openexr_header_metadata(&header, ibuf); // no imbuf. cant write
 	/* header.lineOrder() = DECREASING_Y; this crashes in windows for file read! */
 
@@ -633,6 +740,7 @@ void IMB_exrtile_begin_write(void *handle, const char *filename, int mipmap, int
 	header.setTileDescription(TileDescription(tilex, tiley, (mipmap) ? MIPMAP_LEVELS : ONE_LEVEL));
 	header.lineOrder() = RANDOM_Y;
 	header.compression() = RLE_COMPRESSION;
+	imb_exr_header_attributes(&header, data);
 
 	header.insert("BlenderMultiChannel", StringAttribute("Blender V2.43"));
 
@@ -651,6 +759,86 @@ void IMB_exrtile_begin_write(void *handle, const char *filename, int mipmap, int
 	}
 }
 
+/* Tiled image file. Unlike IMB_exrtile_begin_write() the tiles aren't
+ * flipped: they're written with their rows going down, as in the file */
+int IMB_exrtile_begin_write_image(void *handle, const char *filename, int width, int height, int tilex, int tiley,
+                                  int compress)
+{
+	ExrHandle *data = (ExrHandle *)handle;
+	Header header(width, height);
+	ExrChannel *echan;
+
+	data->tilex = tilex;
+	data->tiley = tiley;
+	data->width = width;
+	data->height = height;
+	data->mipmap = 0;
+
+	for (echan = (ExrChannel *)data->channels.first; echan; echan = echan->next)
+		header.channels().insert(echan->name, Channel(Imf::FLOAT));
+
+	header.setTileDescription(TileDescription(tilex, tiley, ONE_LEVEL));
+	header.lineOrder() = RANDOM_Y;
+	openexr_header_compression(&header, compress);
+	imb_exr_header_attributes(&header, data);
+
+	header.insert("BlenderMultiChannel", StringAttribute("Blender V2.55.1 and newer"));
+
+	/* avoid crash/abort when we don't have permission to write here */
+	/* manually create ofstream, so we can handle utf-8 filepaths on windows */
+	try {
+		data->ofile_stream = new OFileStream(filename);
+		data->tofile = new TiledOutputFile(*(data->ofile_stream), header);
+	}
+	catch (const std::exception &exc) {
+		std::cerr << "IMB_exrtile_begin_write_image: ERROR: " << exc.what() << std::endl;
+
+		delete data->tofile;
+		delete data->ofile_stream;
+
+		data->tofile = NULL;
+		data->ofile_stream = NULL;
+	}
+
+	return (data->tofile != NULL);
+}
+
+/* read tiles from file, fails for scanline files */
+int IMB_exrtile_begin_read(void *handle, const char *filename, int *width, int *height)
+{
+	ExrHandle *data = (ExrHandle *)handle;
+
+	if (BLI_exists(filename) && BLI_file_size(filename) > 32) {   /* 32 is arbitrary, but zero length files crashes exr */
+		try {
+			data->ifile_stream = new IFileStream(filename);
+			data->tifile = new TiledInputFile(*(data->ifile_stream));
+		}
+		catch (const std::exception &) {
+			delete data->tifile;
+			delete data->ifile_stream;
+
+			data->tifile = NULL;
+			data->ifile_stream = NULL;
+		}
+
+		if (data->tifile) {
+			Box2i dw = data->tifile->header().dataWindow();
+			data->width = *width  = dw.max.x - dw.min.x + 1;
+			data->height = *height = dw.max.y - dw.min.y + 1;
+			data->tilex = data->tifile->tileXSize();
+			data->tiley = data->tifile->tileYSize();
+
+			const ChannelList &channels = data->tifile->header().channels();
+
+			for (ChannelList::ConstIterator i = channels.begin(); i != channels.end(); ++i)
+				IMB_exr_add_channel(data, NULL, i.name(), 0, 0, NULL);
+
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /* read from file */
 int IMB_exr_begin_read(void *handle, const char *filename, int *width, int *height)
 {
@@ -744,6 +932,72 @@ void IMB_exrtile_write_channels(void *handle, int partx, int party, int level)
 	}
 }
 
+/* Reads the pixels x..x + width, y..y + height of the channels with a rect
+ * set, rows going up as in ImBufs. Only the tiles they're in are decoded */
+void IMB_exrtile_read_channels(void *handle, int x, int y, int width, int height)
+{
+	ExrHandle *data = (ExrHandle *)handle;
+	FrameBuffer frameBuffer;
+	ExrChannel *echan;
+	/* rows of the file go down */
+	const int ymin = data->height - y - height;
+	const int ymax = data->height - y - 1;
+	const int dx1 = x / data->tilex, dx2 = (x + width - 1) / data->tilex;
+	const int dy1 = ymin / data->tiley, dy2 = ymax / data->tiley;
+	/* whole tiles are read, in a buffer starting at the first one */
+	const int bx = dx1 * data->tilex, by = dy1 * data->tiley;
+	const int bw = (dx2 + 1) * data->tilex - bx, bh = (dy2 + 1) * data->tiley - by;
+	const size_t buf_size = (size_t)bw * bh;
+	float *buf;
+	int totchan = 0, c, i, j;
+
+	if (data->tifile == NULL || width <= 0 || height <= 0)
+		return;
+
+	for (echan = (ExrChannel *)data->channels.first; echan; echan = echan->next)
+		if (echan->rect)
+			totchan++;
+
+	if (totchan == 0)
+		return;
+
+	buf = (float *)MEM_mapallocN(sizeof(float) * buf_size * totchan, "exr tiles");
+
+	for (echan = (ExrChannel *)data->channels.first, c = 0; echan; echan = echan->next) {
+		if (echan->rect) {
+			char *base = (char *)(buf + buf_size * c) - (bx + (size_t)by * bw) * sizeof(float);
+
+			frameBuffer.insert(echan->name, Slice(Imf::FLOAT, base, sizeof(float), sizeof(float) * bw));
+			c++;
+		}
+	}
+
+	try {
+		data->tifile->setFrameBuffer(frameBuffer);
+		data->tifile->readTiles(dx1, dx2, dy1, dy2);
+	}
+	catch (const std::exception &exc) {
+		std::cerr << "OpenEXR-readTiles: ERROR: " << exc.what() << std::endl;
+	}
+
+	for (echan = (ExrChannel *)data->channels.first, c = 0; echan; echan = echan->next) {
+		if (echan->rect) {
+			const float *chan_buf = buf + buf_size * c;
+
+			for (j = 0; j < height; j++) {
+				const float *from = chan_buf + (size_t)(data->height - 1 - (y + j) - by) * bw + (x - bx);
+				float *to = echan->rect + j * echan->ystride;
+
+				for (i = 0; i < width; i++, to += echan->xstride)
+					*to = from[i];
+			}
+			c++;
+		}
+	}
+
+	MEM_freeN(buf);
+}
+
 void IMB_exr_write_channels(void *handle)
 {
 	ExrHandle *data = (ExrHandle *)handle;
@@ -839,18 +1093,21 @@ void IMB_exr_close(void *handle)
 	ExrPass *pass;
 
 	delete data->ifile;
+	delete data->tifile;
 	delete data->ifile_stream;
 	delete data->ofile;
 	delete data->tofile;
 	delete data->ofile_stream;
 
 	data->ifile = NULL;
+	data->tifile = NULL;
 	data->ifile_stream = NULL;
 	data->ofile = NULL;
 	data->tofile = NULL;
 	data->ofile_stream = NULL;
 
 	BLI_freelistN(&data->channels);
+	BLI_freelistN(&data->attributes);
 
 	for (lay = (ExrLayer *)data->layers.first; lay; lay = lay->next) {
 		for (pass = (ExrPass *)lay->passes.first; pass; pass = pass->next)
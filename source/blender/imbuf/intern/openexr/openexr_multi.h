@@ -53,12 +53,24 @@ void    IMB_exr_add_channel(void *handle, const char *layname, const char *passn
 int     IMB_exr_begin_read(void *handle, const char *filename, int *width, int *height);
 int     IMB_exr_begin_write(void *handle, const char *filename, int width, int height, int compress);
 void    IMB_exrtile_begin_write(void *handle, const char *filename, int mipmap, int width, int height, int tilex, int tiley);
+int     IMB_exrtile_begin_write_image(void *handle, const char *filename, int width, int height, int tilex, int tiley,
+                                      int compress);
+int     IMB_exrtile_begin_read(void *handle, const char *filename, int *width, int *height);
+
+/* header attributes, added before writing and looked up after reading */
+void    IMB_exr_add_attribute_int(void *handle, const char *name, int value);
+void    IMB_exr_add_attribute_float(void *handle, const char *name, float value);
+void    IMB_exr_add_attribute_string(void *handle, const char *name, const char *value);
+int     IMB_exr_get_attribute_int(void *handle, const char *name, int *r_value);
+int     IMB_exr_get_attribute_float(void *handle, const char *name, float *r_value);
+int     IMB_exr_get_attribute_string(void *handle, const char *name, char *r_value, int maxlen);
 
 void    IMB_exr_set_channel(void *handle, const char *layname, const char *passname, int xstride, int ystride, float *rect);
 
 void    IMB_exr_read_channels(void *handle);
 void    IMB_exr_write_channels(void *handle);
 void    IMB_exrtile_write_channels(void *handle, int partx, int party, int level);
+void    IMB_exrtile_read_channels(void *handle, int x, int y, int width, int height);
 void    IMB_exrtile_clear_channels(void *handle);
 
 void    IMB_exr_multilayer_convert(void *handle, void *base,
@@ -39,12 +39,22 @@ void    IMB_exr_add_channel         (void *handle, const char *layname, const ch
 int     IMB_exr_begin_read          (void *handle, const char *filename, int *width, int *height) { (void)handle; (void)filename; (void)width; (void)height; return 0;}
 int     IMB_exr_begin_write         (void *handle, const char *filename, int width, int height, int compress) { (void)handle; (void)filename; (void)width; (void)height; (void)compress; return 0;}
 void    IMB_exrtile_begin_write     (void *handle, const char *filename, int mipmap, int width, int height, int tilex, int tiley) { (void)handle; (void)filename; (void)mipmap; (void)width; (void)height; (void)tilex; (void)tiley; }
+int     IMB_exrtile_begin_write_image(void *handle, const char *filename, int width, int height, int tilex, int tiley, int compress) { (void)handle; (void)filename; (void)width; (void)height; (void)tilex; (void)tiley; (void)compress; return 0; }
+int     IMB_exrtile_begin_read      (void *handle, const char *filename, int *width, int *height) { (void)handle; (void)filename; (void)width; (void)height; return 0; }
+
+void    IMB_exr_add_attribute_int   (void *handle, const char *name, int value) { (void)handle; (void)name; (void)value; }
+void    IMB_exr_add_attribute_float (void *handle, const char *name, float value) { (void)handle; (void)name; (void)value; }
+void    IMB_exr_add_attribute_string(void *handle, const char *name, const char *value) { (void)handle; (void)name; (void)value; }
+int     IMB_exr_get_attribute_int   (void *handle, const char *name, int *r_value) { (void)handle; (void)name; (void)r_value; return 0; }
+int     IMB_exr_get_attribute_float (void *handle, const char *name, float *r_value) { (void)handle; (void)name; (void)r_value; return 0; }
+int     IMB_exr_get_attribute_string(void *handle, const char *name, char *r_value, int maxlen) { (void)handle; (void)name; (void)r_value; (void)maxlen; return 0; }
 
 void    IMB_exr_set_channel         (void *handle, const char *layname, const char *channame, int xstride, int ystride, float *rect) { (void)handle; (void)layname; (void)channame; (void)xstride; (void)ystride; (void)rect; }
 
 void    IMB_exr_read_channels       (void *handle) { (void)handle; }
 void    IMB_exr_write_channels      (void *handle) { (void)handle; }
 void    IMB_exrtile_write_channels  (void *handle, int partx, int party, int level) { (void)handle; (void)partx; (void)party; (void)level; }
+void    IMB_exrtile_read_channels   (void *handle, int x, int y, int width, int height) { (void)handle; (void)x; (void)y; (void)width; (void)height; }
 void    IMB_exrtile_clear_channels  (void *handle) { (void)handle; }
 
 void    IMB_exr_multilayer_convert  (void *handle, void *base,
@@ -33,6 +33,8 @@
 
 #include <stdlib.h>
 
+#include "MEM_guardedalloc.h"
+
 #include "BLI_utildefines.h"
 #include "BLI_math_base.h"
 #include "BLI_math_color.h"
@@ -47,6 +49,11 @@
 #include "IMB_allocimbuf.h"
 #include "IMB_colormanagement.h"
 
+#ifdef WITH_RECTBLEND_SIMD
+#  include "BLI_cpu.h"
+#  include "rectop_blend_simd.h"
+#endif
+
 void IMB_blend_color_byte(unsigned char dst[4], unsigned char src1[4], unsigned char src2[4], IMB_BlendMode mode)
 {
 	switch (mode) {
@@ -233,16 +240,251 @@ void IMB_rectcpy(ImBuf *dbuf, ImBuf *sbuf, int destx,
 typedef void (*IMB_blend_func)(unsigned char *dst, const unsigned char *src1, const unsigned char *src2);
 typedef void (*IMB_blend_func_float)(float *dst, const float *src1, const float *src2);
 
+/* Blends one row of "len" pixels, the scalar code of IMB_rectblend() and the
+ * reference of the kernels in rectop_blend_kernel.h. "dmr" and "smr" are the
+ * masks for painting, NULL for regular blending. */
+static void rectblend_row_byte_ref(unsigned int *dr, const unsigned int *or, const unsigned int *sr,
+                                   unsigned short *dmr, const unsigned short *smr, unsigned short mask_max,
+                                   int len, IMB_blend_func func, short lock_alpha)
+{
+	int x;
+
+	if (dmr && smr) {
+		/* mask accumulation for painting */
+		for (x = len; x > 0; x--, dr++, or++, sr++, dmr++, smr++) {
+			const unsigned char *src = (const unsigned char *)sr;
+
+			if (!((lock_alpha & IMA_LAYER_LOCK_ALPHA) && (pixel_is_transparent((const unsigned char *)or)))) {
+				if (src[3] && *smr) {
+					unsigned short mask = *dmr + (((mask_max - *dmr) * (*smr)) / 65535);
+
+					if (mask > *dmr) {
+						unsigned char mask_src[4];
+
+						*dmr = mask;
+
+						mask_src[0] = src[0];
+						mask_src[1] = src[1];
+						mask_src[2] = src[2];
+						mask_src[3] = divide_round_i(src[3] * mask, 65535);
+
+						func((unsigned char *)dr, (const unsigned char *)or, mask_src);
+					}
+				}
+			}
+		}
+	}
+	else {
+		/* regular blending */
+		for (x = len; x > 0; x--, dr++, or++, sr++) {
+			if (((const unsigned char *)sr)[3])
+				func((unsigned char *)dr, (const unsigned char *)or, (const unsigned char *)sr);
+		}
+	}
+}
+
+static void rectblend_row_float_ref(float *drf, const float *orf, const float *srf,
+                                    unsigned short *dmr, const unsigned short *smr, unsigned short mask_max,
+                                    int len, IMB_blend_func_float func_float)
+{
+	int x;
+
+	if (dmr && smr) {
+		/* mask accumulation for painting */
+		for (x = len; x > 0; x--, drf += 4, orf += 4, srf += 4, dmr++, smr++) {
+			if (srf[3] != 0 && *smr) {
+				unsigned short mask = *dmr + (((mask_max - *dmr) * (*smr)) / 65535);
+
+				if (mask > *dmr) {
+					float mask_srf[4];
+
+					*dmr = mask;
+					mul_v4_v4fl(mask_srf, srf, mask * (1.0f / 65535.0f));
+
+					func_float(drf, orf, mask_srf);
+				}
+			}
+		}
+	}
+	else {
+		/* regular blending */
+		for (x = len; x > 0; x--, drf += 4, orf += 4, srf += 4) {
+			if (srf[3] != 0)
+				func_float(drf, orf, srf);
+		}
+	}
+}
+
+#ifdef WITH_RECTBLEND_SIMD
+typedef struct RectBlendKernel {
+	IMBRectBlendRowByte row_byte;
+	IMBRectBlendRowFloat row_float;
+} RectBlendKernel;
+
+/* widest kernel this CPU runs, NULL to use the scalar code only */
+static const RectBlendKernel *rectblend_kernel_get(void)
+{
+	static const RectBlendKernel kernel_sse2 = {imb_rectblend_row_byte_sse2, imb_rectblend_row_float_sse2};
+	static const RectBlendKernel kernel_sse41 = {imb_rectblend_row_byte_sse41, imb_rectblend_row_float_sse41};
+	static const RectBlendKernel kernel_avx2 = {imb_rectblend_row_byte_avx2, imb_rectblend_row_float_avx2};
+	static const RectBlendKernel *kernel = NULL;
+	static bool initialized = false;
+
+	/* the result is the same for every thread, no need to lock */
+	if (!initialized) {
+		if (BLI_cpu_support_avx2())
+			kernel = &kernel_avx2;
+		else if (BLI_cpu_support_sse41())
+			kernel = &kernel_sse41;
+		else if (BLI_cpu_support_sse2())
+			kernel = &kernel_sse2;
+		initialized = true;
+	}
+
+	return kernel;
+}
+#endif  /* WITH_RECTBLEND_SIMD */
+
+/* The rows of one IMB_rectblend() call, blended apart on threads when no row
+ * reads pixels another one writes */
+typedef struct RectBlendRows {
+	unsigned int *drect;
+	const unsigned int *orect, *srect;
+	float *drectf;
+	const float *orectf, *srectf;
+	/* NULL without masks */
+	unsigned short *dmask;
+	const unsigned short *smask;
+	unsigned short mask_max;
+	short lock_alpha;
+	int destskip, origskip, srcskip, width;
+	int mode;
+	IMB_blend_func func;
+	IMB_blend_func_float func_float;
+	bool do_char, do_float;
+} RectBlendRows;
+
+/* Debug builds check every kernel row against the scalar reference, "ref"
+ * holds copies of the destination row and mask taken before the kernel ran */
+#if defined(WITH_RECTBLEND_SIMD) && !defined(NDEBUG)
+#  define RECTBLEND_VERIFY
+#endif
+
+static void rectblend_row(const RectBlendRows *rows, int y, void *ref)
+{
+	unsigned short *dmr = NULL;
+	const unsigned short *smr = NULL;
+	const size_t dest = (size_t)y * rows->destskip, orig = (size_t)y * rows->origskip, src = (size_t)y * rows->srcskip;
+	const int len = rows->width;
+#ifdef WITH_RECTBLEND_SIMD
+	const RectBlendKernel *kernel = rectblend_kernel_get();
+#endif
+
+	if (rows->dmask) {
+		dmr = rows->dmask + orig;
+		smr = rows->smask + src;
+	}
+
+	if (rows->do_char) {
+		unsigned int *dr = rows->drect + dest;
+		const unsigned int *or = rows->orect + orig, *sr = rows->srect + src;
+		int done = 0;
+
+#ifdef WITH_RECTBLEND_SIMD
+		if (kernel) {
+#ifdef RECTBLEND_VERIFY
+			unsigned int *ref_d = ref;
+			unsigned short *ref_dm = (unsigned short *)((float *)ref + len * 4);
+			memcpy(ref_d, dr, len * sizeof(*dr));
+			if (dmr)
+				memcpy(ref_dm, dmr, len * sizeof(*dmr));
+#endif
+
+			done = kernel->row_byte(dr, or, sr, dmr, smr, rows->mask_max, len, rows->mode, rows->lock_alpha);
+
+#ifdef RECTBLEND_VERIFY
+			rectblend_row_byte_ref(ref_d, (or == dr) ? ref_d : or, sr, dmr ? ref_dm : NULL, smr,
+			                       rows->mask_max, done, rows->func, rows->lock_alpha);
+			BLI_assert(memcmp(dr, ref_d, done * sizeof(*dr)) == 0);
+			BLI_assert(dmr == NULL || memcmp(dmr, ref_dm, done * sizeof(*dmr)) == 0);
+#endif
+		}
+#endif
+
+		if (done < len) {
+			rectblend_row_byte_ref(dr + done, or + done, sr + done, dmr ? dmr + done : NULL, smr ? smr + done : NULL,
+			                       rows->mask_max, len - done, rows->func, rows->lock_alpha);
+		}
+	}
+
+	if (rows->do_float) {
+		float *drf = rows->drectf + dest * 4;
+		const float *orf = rows->orectf + orig * 4, *srf = rows->srectf + src * 4;
+		int done = 0;
+
+#ifdef WITH_RECTBLEND_SIMD
+		if (kernel) {
+#ifdef RECTBLEND_VERIFY
+			float *ref_d = ref;
+			unsigned short *ref_dm = (unsigned short *)((float *)ref + len * 4);
+			int i;
+			memcpy(ref_d, drf, len * sizeof(float[4]));
+			if (dmr)
+				memcpy(ref_dm, dmr, len * sizeof(*dmr));
+#endif
+
+			done = kernel->row_float(drf, orf, srf, dmr, smr, rows->mask_max, len, rows->mode);
+
+#ifdef RECTBLEND_VERIFY
+			rectblend_row_float_ref(ref_d, (orf == drf) ? ref_d : orf, srf, dmr ? ref_dm : NULL, smr,
+			                        rows->mask_max, done, rows->func_float);
+			/* NaN may come out with either sign, the compiler is free to swap operands */
+			for (i = 0; i < done * 4; i++) {
+				BLI_assert(memcmp(&drf[i], &ref_d[i], sizeof(float)) == 0 ||
+				           (isnan(drf[i]) && isnan(ref_d[i])));
+			}
+			BLI_assert(dmr == NULL || memcmp(dmr, ref_dm, done * sizeof(*dmr)) == 0);
+#endif
+		}
+#endif
+
+		if (done < len) {
+			rectblend_row_float_ref(drf + done * 4, orf + done * 4, srf + done * 4,
+			                        dmr ? dmr + done : NULL, smr ? smr + done : NULL,
+			                        rows->mask_max, len - done, rows->func_float);
+		}
+	}
+
+	(void)ref;
+}
+
+static void rectblend_rows(void *userdata, int start_line, int tot_line)
+{
+	const RectBlendRows *rows = userdata;
+	void *ref = NULL;
+	int y;
+
+#ifdef RECTBLEND_VERIFY
+	ref = MEM_mallocN(rows->width * (sizeof(float[4]) + sizeof(unsigned short)), "rectblend verify");
+#endif
+
+	for (y = start_line; y < start_line + tot_line; y++)
+		rectblend_row(rows, y, ref);
+
+	if (ref)
+		MEM_freeN(ref);
+}
+
 
 void IMB_rectblend(ImBuf *dbuf, ImBuf *obuf, ImBuf *sbuf, unsigned short *dmask,
                    unsigned short *smask, unsigned short mask_max,
                    int destx,  int desty, int origx, int origy, int srcx, int srcy, int width, int height,
                    IMB_BlendMode mode, short lock_alpha)
 {
-	unsigned int *drect = NULL, *orect, *srect = NULL, *dr, *or, *sr;
-	float *drectf = NULL, *orectf, *srectf = NULL, *drf, *orf, *srf;
-	unsigned short *smaskrect = smask, *smr;
-	unsigned short *dmaskrect = dmask, *dmr;
+	unsigned int *drect = NULL, *orect, *srect = NULL, *dr, *sr;
+	float *drectf = NULL, *orectf, *srectf = NULL, *drf, *srf;
+	unsigned short *smaskrect = smask;
+	unsigned short *dmaskrect = dmask;
 	int do_float, do_char, srcskip, destskip, origskip, x;
 	IMB_blend_func func = NULL;
 	IMB_blend_func_float func_float = NULL;
@@ -393,49 +635,49 @@ void IMB_rectblend(ImBuf *dbuf, ImBuf *obuf, ImBuf *sbuf, unsigned short *dmask,
 				break;
 		}
 
+		/* Rows go on threads and through the kernels when each one only reads
+		 * what it writes or pixels nobody writes. Painting on a buffer with both
+		 * byte and float pixels shares the mask between them, kept in order. */
+		if ((obuf != dbuf || (origx == destx && origy == desty)) &&
+		    (sbuf != dbuf || (srcx == destx && srcy == desty)) &&
+		    !(dmaskrect && smaskrect && do_char && do_float))
+		{
+			RectBlendRows rows;
+
+			rows.drect = drect;
+			rows.orect = orect;
+			rows.srect = srect;
+			rows.drectf = drectf;
+			rows.orectf = orectf;
+			rows.srectf = srectf;
+			rows.dmask = (dmaskrect && smaskrect) ? dmaskrect : NULL;
+			rows.smask = (dmaskrect && smaskrect) ? smaskrect : NULL;
+			rows.mask_max = mask_max;
+			rows.lock_alpha = lock_alpha;
+			rows.destskip = destskip;
+			rows.origskip = origskip;
+			rows.srcskip = srcskip;
+			rows.width = width;
+			rows.mode = mode;
+			rows.func = func;
+			rows.func_float = func_float;
+			rows.do_char = do_char;
+			rows.do_float = do_float;
+
+			IMB_processor_apply_rows(height, width, &rows, rectblend_rows);
+			return;
+		}
+
 		/* blend */
 		for (; height > 0; height--) {
 			if (do_char) {
-				dr = drect;
-				or = orect;
-				sr = srect;
-
 				if (dmaskrect && smaskrect) {
-					/* mask accumulation for painting */
-					dmr = dmaskrect;
-					smr = smaskrect;
-
-					for (x = width; x > 0; x--, dr++, or++, sr++, dmr++, smr++) {
-						unsigned char *src = (unsigned char *)sr;
-						
-						if (!((lock_alpha & IMA_LAYER_LOCK_ALPHA) && (pixel_is_transparent((unsigned char *)or)))) {
-							if (src[3] && *smr) {
-								unsigned short mask = *dmr + (((mask_max - *dmr) * (*smr)) / 65535);
-							
-								if (mask > *dmr) {
-									unsigned char mask_src[4];
-
-									*dmr = mask;
-
-									mask_src[0] = src[0];
-									mask_src[1] = src[1];
-									mask_src[2] = src[2];
-									mask_src[3] = divide_round_i(src[3] * mask, 65535);
-
-									func((unsigned char *)dr, (unsigned char *)or, mask_src);
-								}
-							}
-						}
-					}
+					rectblend_row_byte_ref(drect, orect, srect, dmaskrect, smaskrect, mask_max, width, func, lock_alpha);
 					dmaskrect += origskip;
 					smaskrect += srcskip;
 				}
 				else {
-					/* regular blending */
-					for (x = width; x > 0; x--, dr++, or++, sr++) {
-						if (((unsigned char *)sr)[3])
-							func((unsigned char *)dr, (unsigned char *)or, (unsigned char *)sr);
-					}
+					rectblend_row_byte_ref(drect, orect, srect, NULL, NULL, mask_max, width, func, lock_alpha);
 				}
 
 				drect += destskip;
@@ -444,39 +686,13 @@ void IMB_rectblend(ImBuf *dbuf, ImBuf *obuf, ImBuf *sbuf, unsigned short *dmask,
 			}
 
 			if (do_float) {
-				drf = drectf;
-				orf = orectf;
-				srf = srectf;
-
 				if (dmaskrect && smaskrect) {
-					/* mask accumulation for painting */
-					dmr = dmaskrect;
-					smr = smaskrect;
-
-					for (x = width; x > 0; x--, drf += 4, orf += 4, srf += 4, dmr++, smr++) {
-						if (srf[3] != 0 && *smr) {
-							unsigned short mask = *dmr + (((mask_max - *dmr) * (*smr)) / 65535);
-
-							if (mask > *dmr) {
-								float mask_srf[4];
-
-								*dmr = mask;
-								mul_v4_v4fl(mask_srf, srf, mask * (1.0f / 65535.0f));
-
-								func_float(drf, orf, mask_srf);
-							}
-						}
-					}
-
+					rectblend_row_float_ref(drectf, orectf, srectf, dmaskrect, smaskrect, mask_max, width, func_float);
 					dmaskrect += origskip;
 					smaskrect += srcskip;
 				}
 				else {
-					/* regular blending */
-					for (x = width; x > 0; x--, drf += 4, orf += 4, srf += 4) {
-						if (srf[3] != 0)
-							func_float(drf, orf, srf);
-					}
+					rectblend_row_float_ref(drectf, orectf, srectf, NULL, NULL, mask_max, width, func_float);
 				}
 
 				drectf += destskip * 4;
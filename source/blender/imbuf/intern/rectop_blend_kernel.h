@@ -0,0 +1,572 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/imbuf/intern/rectop_blend_kernel.h
+ *  \ingroup imbuf
+ *
+ * IMB_rectblend() row kernel, included once per instruction set by
+ * rectop_blend_sse2.c, rectop_blend_sse41.c and rectop_blend_avx2.c which
+ * define one of RECTOP_BLEND_SSE2, RECTOP_BLEND_SSE41 or RECTOP_BLEND_AVX2
+ * first.
+ *
+ * Every mode repeats blend_color_*_byte() and blend_color_*_float() of
+ * BLI_math_color_blend.h operation by operation, and the mask accumulation of
+ * IMB_rectblend() with it, so the output is bit-exact:
+ * - byte modes use 32 bit integers, the divisions take a float quotient
+ *   and correct it with the remainder,
+ * - the accumulated mask wraps around like the int product of the scalar code,
+ * - float modes use no reciprocals or fused multiply-add, and comparisons +
+ *   selects instead of min/max, so NaN takes the same branch.
+ *
+ * One loop is made per mode, with and without masks, so nothing is decided
+ * per pixel.
+ */
+
+#include <string.h>
+
+#include "DNA_image_types.h"
+
+#include "BLI_utildefines.h"
+
+#include "IMB_imbuf.h"
+
+#include "rectop_blend_simd.h"
+
+#if defined(RECTOP_BLEND_AVX2)
+#  include <immintrin.h>
+#  define KERNEL_SUFFIX avx2
+#  define VEC_WIDTH 8
+typedef __m256 vfloat;
+typedef __m256i vint;
+#  define vf_set1 _mm256_set1_ps
+#  define vf_zero _mm256_setzero_ps
+#  define vf_add _mm256_add_ps
+#  define vf_sub _mm256_sub_ps
+#  define vf_mul _mm256_mul_ps
+#  define vf_div _mm256_div_ps
+#  define vf_and _mm256_and_ps
+#  define vf_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#  define vf_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#  define vf_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#  define vf_ge(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#  define vf_neq(a, b) _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#  define vf_select(m, a, b) _mm256_blendv_ps(b, a, m)
+#  define vf_unpacklo _mm256_unpacklo_ps
+#  define vf_unpackhi _mm256_unpackhi_ps
+#  define vf_shuffle _mm256_shuffle_ps
+#  define vf_to_vi _mm256_cvttps_epi32
+#  define vi_to_vf _mm256_cvtepi32_ps
+#  define vf_as_vi _mm256_castps_si256
+#  define vi_as_vf _mm256_castsi256_ps
+#  define vi_set1 _mm256_set1_epi32
+#  define vi_zero _mm256_setzero_si256
+#  define vi_add _mm256_add_epi32
+#  define vi_sub _mm256_sub_epi32
+#  define vi_mullo _mm256_mullo_epi32
+#  define vi_and _mm256_and_si256
+#  define vi_or _mm256_or_si256
+#  define vi_andnot _mm256_andnot_si256
+#  define vi_slli _mm256_slli_epi32
+#  define vi_srli _mm256_srli_epi32
+#  define vi_eq _mm256_cmpeq_epi32
+#  define vi_gt _mm256_cmpgt_epi32
+/* masks are whole lanes, the float blend doesn't depend on the signedness of char */
+#  define vi_select(m, a, b) \
+	_mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), _mm256_castsi256_ps(m)))
+#  define vi_abs _mm256_abs_epi32
+#  define vi_any(m) _mm256_movemask_epi8(m)
+#  define vi_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#  define vi_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#  define vi_load_u16(p) _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(p)))
+/* lanes hold 0..65535 */
+#  define vi_store_u16(p, v) \
+	_mm_storeu_si128((__m128i *)(p), _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)))
+#elif defined(RECTOP_BLEND_SSE2) || defined(RECTOP_BLEND_SSE41)
+#  ifdef RECTOP_BLEND_SSE41
+#    include <smmintrin.h>
+#    define KERNEL_SUFFIX sse41
+#  else
+#    include <emmintrin.h>
+#    define KERNEL_SUFFIX sse2
+#  endif
+#  define VEC_WIDTH 4
+typedef __m128 vfloat;
+typedef __m128i vint;
+#  define vf_set1 _mm_set1_ps
+#  define vf_zero _mm_setzero_ps
+#  define vf_add _mm_add_ps
+#  define vf_sub _mm_sub_ps
+#  define vf_mul _mm_mul_ps
+#  define vf_div _mm_div_ps
+#  define vf_and _mm_and_ps
+#  define vf_lt _mm_cmplt_ps
+#  define vf_le _mm_cmple_ps
+#  define vf_gt _mm_cmpgt_ps
+#  define vf_ge _mm_cmpge_ps
+#  define vf_neq _mm_cmpneq_ps
+#  define vf_unpacklo _mm_unpacklo_ps
+#  define vf_unpackhi _mm_unpackhi_ps
+#  define vf_shuffle _mm_shuffle_ps
+#  define vf_to_vi _mm_cvttps_epi32
+#  define vi_to_vf _mm_cvtepi32_ps
+#  define vf_as_vi _mm_castps_si128
+#  define vi_as_vf _mm_castsi128_ps
+#  define vi_set1 _mm_set1_epi32
+#  define vi_zero _mm_setzero_si128
+#  define vi_add _mm_add_epi32
+#  define vi_sub _mm_sub_epi32
+#  define vi_and _mm_and_si128
+#  define vi_or _mm_or_si128
+#  define vi_andnot _mm_andnot_si128
+#  define vi_slli _mm_slli_epi32
+#  define vi_srli _mm_srli_epi32
+#  define vi_eq _mm_cmpeq_epi32
+#  define vi_gt _mm_cmpgt_epi32
+#  define vi_any(m) _mm_movemask_epi8(m)
+#  define vi_load(p) _mm_loadu_si128((const __m128i *)(p))
+#  define vi_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#  define vi_load_u16(p) _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(p)), _mm_setzero_si128())
+#  ifdef RECTOP_BLEND_SSE41
+#    define vf_select(m, a, b) _mm_blendv_ps(b, a, m)
+/* masks are whole lanes, the float blend doesn't depend on the signedness of char */
+#    define vi_select(m, a, b) \
+	_mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(b), _mm_castsi128_ps(a), _mm_castsi128_ps(m)))
+#    define vi_abs _mm_abs_epi32
+#    define vi_mullo _mm_mullo_epi32
+/* lanes hold 0..65535 */
+#    define vi_store_u16(p, v) _mm_storel_epi64((__m128i *)(p), _mm_packus_epi32(v, v))
+#  else
+#    define vf_select(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#    define vi_select(m, a, b) _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b))
+BLI_INLINE __m128i vi_abs(__m128i a)
+{
+	__m128i sign = _mm_srai_epi32(a, 31);
+	return _mm_sub_epi32(_mm_xor_si128(a, sign), sign);
+}
+/* low 32 bits of the products, the even and odd lanes are multiplied apart */
+BLI_INLINE __m128i vi_mullo(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+	                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+/* lanes hold 0..65535, moved into the signed range for the saturating pack */
+BLI_INLINE void vi_store_u16(unsigned short *p, __m128i v)
+{
+	__m128i packed = _mm_packs_epi32(_mm_sub_epi32(v, _mm_set1_epi32(0x8000)), _mm_setzero_si128());
+
+	_mm_storel_epi64((__m128i *)p, _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000)));
+}
+#  endif
+#else
+#  error "define the instruction set before including rectop_blend_kernel.h"
+#endif
+
+#define KERNEL_FUNC_EX(name, suffix) name ## _ ## suffix
+#define KERNEL_FUNC_EXPAND(name, suffix) KERNEL_FUNC_EX(name, suffix)
+#define KERNEL_FUNC(name) KERNEL_FUNC_EXPAND(name, KERNEL_SUFFIX)
+
+#define vi_lt(a, b) vi_gt(b, a)
+#define vi_min(a, b) vi_select(vi_lt(a, b), a, b)
+#define vi_max(a, b) vi_select(vi_gt(a, b), a, b)
+
+/* num / den like the C division, for 0 <= num < 2^31, den > 0 and quotients
+ * below 2^20. The quotient from the float reciprocal is at most one off then,
+ * the remainder tells which way. Lanes out of range give garbage, not traps. */
+BLI_INLINE vint vi_div(vint num, vint den)
+{
+	const vint one = vi_set1(1);
+	vint q = vf_to_vi(vf_mul(vi_to_vf(num), vf_div(vf_set1(1.0f), vi_to_vf(den))));
+	vint r = vi_sub(num, vi_mullo(q, den));
+	vint low = vi_lt(r, vi_zero());
+
+	q = vi_sub(q, vi_and(low, one));
+	r = vi_add(r, vi_and(low, den));
+
+	return vi_add(q, vi_andnot(vi_lt(r, den), one));
+}
+
+/* divide_round_i(a, b) for a >= 0 */
+BLI_INLINE vint vi_divide_round(vint a, vint b)
+{
+	return vi_div(vi_add(vi_add(a, a), b), vi_add(b, b));
+}
+
+/* The mask accumulation of IMB_rectblend(), as unsigned short:
+ *   dmask + ((mask_max - dmask) * smask) / 65535
+ * the int product overflows for large masks, it's wrapped the same way. */
+BLI_INLINE vint vi_mask_accumulate(vint dm, vint sm, vint mask_max)
+{
+	vint p = vi_mullo(vi_sub(mask_max, dm), sm);
+	/* the product never is INT_MIN, its absolute value fits */
+	vint q = vi_div(vi_abs(p), vi_set1(65535));
+	vint neg = vi_lt(p, vi_zero());
+
+	q = vi_select(neg, vi_sub(vi_zero(), q), q);
+
+	return vi_and(vi_add(dm, q), vi_set1(0xffff));
+}
+
+BLI_INLINE vint vi_channel(vint px, int shift)
+{
+	return vi_and(vi_srli(px, shift), vi_set1(0xff));
+}
+
+BLI_INLINE vint vi_pack(const vint c[4])
+{
+	const vint byte = vi_set1(0xff);
+
+	return vi_or(vi_or(vi_and(c[0], byte), vi_slli(vi_and(c[1], byte), 8)),
+	             vi_or(vi_slli(vi_and(c[2], byte), 16), vi_slli(c[3], 24)));
+}
+
+/* blend_color_*_byte() where src2[3] != 0, channels 0..255 */
+BLI_INLINE void vi_blend_byte(const int mode, const vint s1[4], const vint s2[4], vint r[4])
+{
+	const vint c255 = vi_set1(255);
+	const vint t = s2[3];
+	const vint mt = vi_sub(c255, t);
+	vint a, b, tmp;
+	int i;
+
+	switch (mode) {
+		case IMB_BLEND_MIX:
+			a = vi_mullo(mt, s1[3]);
+			b = vi_mullo(t, c255);
+			tmp = vi_add(a, b);
+			for (i = 0; i < 3; i++)
+				r[i] = vi_divide_round(vi_add(vi_mullo(a, s1[i]), vi_mullo(b, s2[i])), tmp);
+			r[3] = vi_divide_round(tmp, c255);
+			return;
+		case IMB_BLEND_ADD:
+			for (i = 0; i < 3; i++)
+				r[i] = vi_min(vi_divide_round(vi_add(vi_mullo(s1[i], c255), vi_mullo(s2[i], t)), c255), c255);
+			break;
+		case IMB_BLEND_SUB:
+			/* divide_round_i() of negative values truncates to 0 or less, made 0 by max_ii() */
+			for (i = 0; i < 3; i++) {
+				tmp = vi_sub(vi_mullo(s1[i], c255), vi_mullo(s2[i], t));
+				tmp = vi_add(vi_add(tmp, tmp), c255);
+				tmp = vi_max(tmp, vi_zero());
+				r[i] = vi_div(tmp, vi_set1(2 * 255));
+			}
+			break;
+		case IMB_BLEND_MUL:
+			for (i = 0; i < 3; i++) {
+				tmp = vi_add(vi_mullo(vi_mullo(mt, s1[i]), c255), vi_mullo(vi_mullo(t, s1[i]), s2[i]));
+				r[i] = vi_divide_round(tmp, vi_set1(255 * 255));
+			}
+			break;
+		case IMB_BLEND_LIGHTEN:
+			for (i = 0; i < 3; i++)
+				r[i] = vi_divide_round(vi_add(vi_mullo(mt, s1[i]), vi_mullo(t, vi_max(s1[i], s2[i]))), c255);
+			break;
+		case IMB_BLEND_DARKEN:
+			for (i = 0; i < 3; i++)
+				r[i] = vi_divide_round(vi_add(vi_mullo(mt, s1[i]), vi_mullo(t, vi_min(s1[i], s2[i]))), c255);
+			break;
+		case IMB_BLEND_ERASE_ALPHA:
+			for (i = 0; i < 3; i++)
+				r[i] = s1[i];
+			r[3] = vi_max(vi_sub(s1[3], vi_divide_round(vi_mullo(t, s2[3]), c255)), vi_zero());
+			return;
+		case IMB_BLEND_ADD_ALPHA:
+			for (i = 0; i < 3; i++)
+				r[i] = s1[i];
+			r[3] = vi_min(vi_add(s1[3], vi_divide_round(vi_mullo(t, s2[3]), c255)), c255);
+			return;
+	}
+
+	r[3] = s1[3];
+}
+
+/* "masked" accumulates the mask of the stroke, "lock" keeps transparent
+ * original pixels as they are. Both are constants, the branches go away. */
+BLI_INLINE int rectblend_row_byte(unsigned int *drect, const unsigned int *orect, const unsigned int *srect,
+                                  unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                  int len, const int mode, const bool masked, const bool lock)
+{
+	const vint zero = vi_zero();
+	const vint vmask_max = vi_set1(mask_max);
+	int x, i;
+
+	for (x = 0; x + VEC_WIDTH <= len; x += VEC_WIDTH) {
+		vint px_o = vi_load(orect + x), px_s = vi_load(srect + x), px_d;
+		vint s1[4], s2[4], r[4];
+		vint skip, apply, keep;
+
+		s2[3] = vi_channel(px_s, 24);
+		skip = vi_eq(s2[3], zero);
+
+		if (masked) {
+			vint dm = vi_load_u16(dmask + x), sm = vi_load_u16(smask + x);
+			vint mask;
+
+			skip = vi_or(skip, vi_eq(sm, zero));
+			if (lock)
+				skip = vi_or(skip, vi_eq(px_o, zero));
+
+			mask = vi_mask_accumulate(dm, sm, vmask_max);
+			apply = vi_andnot(skip, vi_gt(mask, dm));
+			if (!vi_any(apply))
+				continue;
+
+			vi_store_u16(dmask + x, vi_select(apply, mask, dm));
+			s2[3] = vi_divide_round(vi_mullo(s2[3], mask), vi_set1(65535));
+		}
+		else {
+			apply = vi_andnot(skip, vi_set1(-1));
+			if (!vi_any(apply))
+				continue;
+		}
+
+		for (i = 0; i < 3; i++) {
+			s1[i] = vi_channel(px_o, i * 8);
+			s2[i] = vi_channel(px_s, i * 8);
+		}
+		s1[3] = vi_channel(px_o, 24);
+
+		vi_blend_byte(mode, s1, s2, r);
+
+		/* the mask can take the alpha of the brush down to 0, the modes copy
+		 * the original pixel then */
+		keep = vi_eq(s2[3], zero);
+		px_d = vi_select(keep, px_o, vi_pack(r));
+		px_d = vi_select(apply, px_d, vi_load(drect + x));
+		vi_store(drect + x, px_d);
+	}
+
+	return x;
+}
+
+/* blend_color_*_float(), "r_op" are the lanes that take the result, the
+ * others stay the same as src1 */
+BLI_INLINE void vf_blend_float(const int mode, const vfloat s1[4], const vfloat s2[4], vfloat r[4], vfloat *r_op)
+{
+	const vfloat zero = vf_zero();
+	const vfloat one = vf_set1(1.0f);
+	const vfloat t = s2[3];
+	const vfloat mt = vf_sub(one, t);
+	vfloat alpha, map_alpha, m;
+	int i;
+
+	*r_op = vf_neq(t, zero);
+
+	switch (mode) {
+		case IMB_BLEND_MIX:
+			for (i = 0; i < 3; i++)
+				r[i] = vf_add(vf_mul(mt, s1[i]), s2[i]);
+			r[3] = vf_add(vf_mul(mt, s1[3]), t);
+			return;
+		case IMB_BLEND_ADD:
+			for (i = 0; i < 3; i++)
+				r[i] = vf_add(s1[i], vf_mul(s2[i], s1[3]));
+			break;
+		case IMB_BLEND_SUB:
+			for (i = 0; i < 3; i++) {
+				m = vf_sub(s1[i], vf_mul(s2[i], s1[3]));
+				r[i] = vf_select(vf_gt(m, zero), m, zero);
+			}
+			break;
+		case IMB_BLEND_MUL:
+			for (i = 0; i < 3; i++)
+				r[i] = vf_add(vf_mul(mt, s1[i]), vf_mul(vf_mul(s1[i], s2[i]), s1[3]));
+			break;
+		case IMB_BLEND_LIGHTEN:
+			map_alpha = vf_div(s1[3], t);
+			for (i = 0; i < 3; i++) {
+				m = vf_mul(s2[i], map_alpha);
+				r[i] = vf_add(vf_mul(mt, s1[i]), vf_mul(t, vf_select(vf_gt(s1[i], m), s1[i], m)));
+			}
+			break;
+		case IMB_BLEND_DARKEN:
+			map_alpha = vf_div(s1[3], t);
+			for (i = 0; i < 3; i++) {
+				m = vf_mul(s2[i], map_alpha);
+				r[i] = vf_add(vf_mul(mt, s1[i]), vf_mul(t, vf_select(vf_lt(s1[i], m), s1[i], m)));
+			}
+			break;
+		case IMB_BLEND_ERASE_ALPHA:
+			*r_op = vf_and(*r_op, vf_gt(s1[3], zero));
+			alpha = vf_sub(s1[3], t);
+			alpha = vf_select(vf_gt(alpha, zero), alpha, zero);
+			alpha = vf_select(vf_le(alpha, vf_set1(0.0005f)), zero, alpha);
+			map_alpha = vf_div(alpha, s1[3]);
+			for (i = 0; i < 3; i++)
+				r[i] = vf_mul(s1[i], map_alpha);
+			r[3] = alpha;
+			return;
+		case IMB_BLEND_ADD_ALPHA:
+			*r_op = vf_and(*r_op, vf_lt(s1[3], one));
+			alpha = vf_add(s1[3], t);
+			alpha = vf_select(vf_lt(alpha, one), alpha, one);
+			alpha = vf_select(vf_ge(alpha, vf_set1(1.0f - 0.0005f)), one, alpha);
+			map_alpha = vf_select(vf_gt(s1[3], zero), vf_div(alpha, s1[3]), one);
+			for (i = 0; i < 3; i++)
+				r[i] = vf_mul(s1[i], map_alpha);
+			r[3] = alpha;
+			return;
+	}
+
+	r[3] = s1[3];
+}
+
+/* 4x4 transposes within each 128 bit lane, RGBA pixels <-> channels */
+#define VF_TRANSPOSE4(v)  {                                                   \
+	vfloat t0_ = vf_unpacklo(v[0], v[1]), t1_ = vf_unpackhi(v[0], v[1]);      \
+	vfloat t2_ = vf_unpacklo(v[2], v[3]), t3_ = vf_unpackhi(v[2], v[3]);      \
+	v[0] = vf_shuffle(t0_, t2_, _MM_SHUFFLE(1, 0, 1, 0));                     \
+	v[1] = vf_shuffle(t0_, t2_, _MM_SHUFFLE(3, 2, 3, 2));                     \
+	v[2] = vf_shuffle(t1_, t3_, _MM_SHUFFLE(1, 0, 1, 0));                     \
+	v[3] = vf_shuffle(t1_, t3_, _MM_SHUFFLE(3, 2, 3, 2));                     \
+} (void)0
+
+#ifdef RECTOP_BLEND_AVX2
+/* lane 0 holds pixels 0..3, lane 1 pixels 4..7 */
+#  define VF_LOAD_PIXEL(p, i) \
+	_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps((p) + (i) * 4)), _mm_loadu_ps((p) + (i) * 4 + 16), 1)
+#  define VF_STORE_PIXEL(p, i, v) { \
+	_mm_storeu_ps((p) + (i) * 4, _mm256_castps256_ps128(v)); \
+	_mm_storeu_ps((p) + (i) * 4 + 16, _mm256_extractf128_ps(v, 1)); \
+} (void)0
+#else
+#  define VF_LOAD_PIXEL(p, i) _mm_loadu_ps((p) + (i) * 4)
+#  define VF_STORE_PIXEL(p, i, v) _mm_storeu_ps((p) + (i) * 4, v)
+#endif
+
+BLI_INLINE void vf_load_channels(const float *p, vfloat c[4])
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		c[i] = VF_LOAD_PIXEL(p, i);
+	VF_TRANSPOSE4(c);
+}
+
+/* same as rectblend_row_byte(), the scalar code has no alpha lock for floats */
+BLI_INLINE int rectblend_row_float(float *drectf, const float *orectf, const float *srectf,
+                                   unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                   int len, const int mode, const bool masked)
+{
+	const vfloat zero = vf_zero();
+	const vint vmask_max = vi_set1(mask_max);
+	int x, i;
+
+	for (x = 0; x + VEC_WIDTH <= len; x += VEC_WIDTH) {
+		vfloat s1[4], s2[4], r[4], d[4];
+		vfloat apply, op;
+
+		vf_load_channels(srectf + x * 4, s2);
+
+		apply = vf_neq(s2[3], zero);
+
+		if (masked) {
+			vint dm = vi_load_u16(dmask + x), sm = vi_load_u16(smask + x);
+			vint mask, iapply;
+			vfloat fac;
+
+			mask = vi_mask_accumulate(dm, sm, vmask_max);
+			iapply = vi_andnot(vi_eq(sm, vi_zero()), vi_and(vf_as_vi(apply), vi_gt(mask, dm)));
+			if (!vi_any(iapply))
+				continue;
+
+			vi_store_u16(dmask + x, vi_select(iapply, mask, dm));
+			apply = vi_as_vf(iapply);
+
+			/* mul_v4_v4fl(mask_srf, srf, mask * (1.0f / 65535.0f)) */
+			fac = vf_mul(vi_to_vf(mask), vf_set1(1.0f / 65535.0f));
+			for (i = 0; i < 4; i++)
+				s2[i] = vf_mul(s2[i], fac);
+		}
+		else if (!vi_any(vf_as_vi(apply))) {
+			continue;
+		}
+
+		vf_load_channels(orectf + x * 4, s1);
+		vf_load_channels(drectf + x * 4, d);
+
+		vf_blend_float(mode, s1, s2, r, &op);
+
+		for (i = 0; i < 4; i++)
+			d[i] = vf_select(apply, vf_select(op, r[i], s1[i]), d[i]);
+
+		VF_TRANSPOSE4(d);
+		for (i = 0; i < 4; i++)
+			VF_STORE_PIXEL(drectf + x * 4, i, d[i]);
+	}
+
+	return x;
+}
+
+#define ROW_BYTE(m) \
+	(!masked ? rectblend_row_byte(drect, orect, srect, NULL, NULL, 0, len, m, false, false) : \
+	 lock ? rectblend_row_byte(drect, orect, srect, dmask, smask, mask_max, len, m, true, true) : \
+	        rectblend_row_byte(drect, orect, srect, dmask, smask, mask_max, len, m, true, false))
+
+int KERNEL_FUNC(imb_rectblend_row_byte)(unsigned int *drect, const unsigned int *orect, const unsigned int *srect,
+                                        unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                        int len, int mode, short lock_alpha)
+{
+	const bool masked = (dmask && smask);
+	const bool lock = (lock_alpha & IMA_LAYER_LOCK_ALPHA) != 0;
+
+	switch (mode) {
+		case IMB_BLEND_MIX: return ROW_BYTE(IMB_BLEND_MIX);
+		case IMB_BLEND_ADD: return ROW_BYTE(IMB_BLEND_ADD);
+		case IMB_BLEND_SUB: return ROW_BYTE(IMB_BLEND_SUB);
+		case IMB_BLEND_MUL: return ROW_BYTE(IMB_BLEND_MUL);
+		case IMB_BLEND_LIGHTEN: return ROW_BYTE(IMB_BLEND_LIGHTEN);
+		case IMB_BLEND_DARKEN: return ROW_BYTE(IMB_BLEND_DARKEN);
+		case IMB_BLEND_ERASE_ALPHA: return ROW_BYTE(IMB_BLEND_ERASE_ALPHA);
+		case IMB_BLEND_ADD_ALPHA: return ROW_BYTE(IMB_BLEND_ADD_ALPHA);
+	}
+
+	return 0;
+}
+
+#undef ROW_BYTE
+
+#define ROW_FLOAT(m) \
+	(!masked ? rectblend_row_float(drectf, orectf, srectf, NULL, NULL, 0, len, m, false) : \
+	           rectblend_row_float(drectf, orectf, srectf, dmask, smask, mask_max, len, m, true))
+
+int KERNEL_FUNC(imb_rectblend_row_float)(float *drectf, const float *orectf, const float *srectf,
+                                         unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                         int len, int mode)
+{
+	const bool masked = (dmask && smask);
+
+	switch (mode) {
+		case IMB_BLEND_MIX: return ROW_FLOAT(IMB_BLEND_MIX);
+		case IMB_BLEND_ADD: return ROW_FLOAT(IMB_BLEND_ADD);
+		case IMB_BLEND_SUB: return ROW_FLOAT(IMB_BLEND_SUB);
+		case IMB_BLEND_MUL: return ROW_FLOAT(IMB_BLEND_MUL);
+		case IMB_BLEND_LIGHTEN: return ROW_FLOAT(IMB_BLEND_LIGHTEN);
+		case IMB_BLEND_DARKEN: return ROW_FLOAT(IMB_BLEND_DARKEN);
+		case IMB_BLEND_ERASE_ALPHA: return ROW_FLOAT(IMB_BLEND_ERASE_ALPHA);
+		case IMB_BLEND_ADD_ALPHA: return ROW_FLOAT(IMB_BLEND_ADD_ALPHA);
+	}
+
+	return 0;
+}
+
+#undef ROW_FLOAT
@@ -0,0 +1,60 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef __RECTOP_BLEND_SIMD_H__
+#define __RECTOP_BLEND_SIMD_H__
+
+/** \file blender/imbuf/intern/rectop_blend_simd.h
+ *  \ingroup imbuf
+ *
+ * Row kernels of IMB_rectblend(), see rectop_blend_kernel.h. They blend the
+ * first pixels of the row, a multiple of the vector width, and return how
+ * many. The rest is left to the scalar code.
+ */
+
+typedef int (*IMBRectBlendRowByte)(unsigned int *drect, const unsigned int *orect, const unsigned int *srect,
+                                   unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                   int len, int mode, short lock_alpha);
+typedef int (*IMBRectBlendRowFloat)(float *drectf, const float *orectf, const float *srectf,
+                                    unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                    int len, int mode);
+
+int imb_rectblend_row_byte_sse2(unsigned int *drect, const unsigned int *orect, const unsigned int *srect,
+                                unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                int len, int mode, short lock_alpha);
+int imb_rectblend_row_float_sse2(float *drectf, const float *orectf, const float *srectf,
+                                 unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                 int len, int mode);
+
+int imb_rectblend_row_byte_sse41(unsigned int *drect, const unsigned int *orect, const unsigned int *srect,
+                                 unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                 int len, int mode, short lock_alpha);
+int imb_rectblend_row_float_sse41(float *drectf, const float *orectf, const float *srectf,
+                                  unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                  int len, int mode);
+
+int imb_rectblend_row_byte_avx2(unsigned int *drect, const unsigned int *orect, const unsigned int *srect,
+                                unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                int len, int mode, short lock_alpha);
+int imb_rectblend_row_float_avx2(float *drectf, const float *orectf, const float *srectf,
+                                 unsigned short *dmask, const unsigned short *smask, unsigned short mask_max,
+                                 int len, int mode);
+
+#endif  /* __RECTOP_BLEND_SIMD_H__ */
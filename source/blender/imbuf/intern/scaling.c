@@ -324,25 +324,22 @@ MINLINE void premul_ushort_to_straight_uchar(unsigned char *result, const unsign
 	}
 }
 
-/* result in ibuf2, scaling should be done correctly */
-void imb_onehalf_no_alloc(struct ImBuf *ibuf2, struct ImBuf *ibuf1)
+/* Pixels xmin..xmax, ymin..ymax of ibuf2 from the 2x2 pixels under them in
+ * ibuf1, for the buffers both of them have */
+void IMB_onehalf_rect(struct ImBuf *ibuf2, struct ImBuf *ibuf1, int xmin, int ymin, int xmax, int ymax)
 {
 	int x, y;
-	const short do_rect = (ibuf1->rect != NULL);
+	const short do_rect = (ibuf1->rect != NULL) && (ibuf2->rect != NULL);
 	const short do_float = (ibuf1->rect_float != NULL) && (ibuf2->rect_float != NULL);
 
-	if (do_rect && (ibuf2->rect == NULL)) {
-		imb_addrectImBuf(ibuf2);
-	}
-
 	if (do_rect) {
 		unsigned char *cp1, *cp2, *dest;
 		
-		cp1 = (unsigned char *) ibuf1->rect;
-		dest = (unsigned char *) ibuf2->rect;
-		for (y = ibuf2->y; y > 0; y--) {
+		for (y = ymin; y < ymax; y++) {
+			cp1 = (unsigned char *) (ibuf1->rect + ((size_t)(2 * y) * ibuf1->x + 2 * xmin));
 			cp2 = cp1 + (ibuf1->x << 2);
-			for (x = ibuf2->x; x > 0; x--) {
+			dest = (unsigned char *) (ibuf2->rect + ((size_t)y * ibuf2->x + xmin));
+			for (x = xmin; x < xmax; x++) {
 				unsigned short p1i[8], p2i[8], desti[4];
 
 				straight_uchar_to_premul_ushort(p1i, cp1);
@@ -361,19 +358,17 @@ void imb_onehalf_no_alloc(struct ImBuf *ibuf2, struct ImBuf *ibuf1)
 				cp2 += 8;
 				dest += 4;
 			}
-			cp1 = cp2;
-			if (ibuf1->x & 1) cp1 += 4;
 		}
 	}
 	
 	if (do_float) {
 		float *p1f, *p2f, *destf;
 		
-		p1f = ibuf1->rect_float;
-		destf = ibuf2->rect_float;
-		for (y = ibuf2->y; y > 0; y--) {
+		for (y = ymin; y < ymax; y++) {
+			p1f = ibuf1->rect_float + ((size_t)(2 * y) * ibuf1->x + 2 * xmin) * 4;
 			p2f = p1f + (ibuf1->x << 2);
-			for (x = ibuf2->x; x > 0; x--) {
+			destf = ibuf2->rect_float + ((size_t)y * ibuf2->x + xmin) * 4;
+			for (x = xmin; x < xmax; x++) {
 				destf[0] = 0.25f * (p1f[0] + p2f[0] + p1f[4] + p2f[4]);
 				destf[1] = 0.25f * (p1f[1] + p2f[1] + p1f[5] + p2f[5]);
 				destf[2] = 0.25f * (p1f[2] + p2f[2] + p1f[6] + p2f[6]);
@@ -382,12 +377,20 @@ void imb_onehalf_no_alloc(struct ImBuf *ibuf2, struct ImBuf *ibuf1)
 				p2f += 8;
 				destf += 4;
 			}
-			p1f = p2f;
-			if (ibuf1->x & 1) p1f += 4;
 		}
 	}
 }
 
+/* result in ibuf2, scaling should be done correctly */
+void imb_onehalf_no_alloc(struct ImBuf *ibuf2, struct ImBuf *ibuf1)
+{
+	if ((ibuf1->rect != NULL) && (ibuf2->rect == NULL)) {
+		imb_addrectImBuf(ibuf2);
+	}
+
+	IMB_onehalf_rect(ibuf2, ibuf1, 0, 0, ibuf2->x, ibuf2->y);
+}
+
 ImBuf *IMB_onehalf(struct ImBuf *ibuf1)
 {
 	struct ImBuf *ibuf2;
@@ -1607,97 +1610,32 @@ struct ImBuf *IMB_scalefastImBuf(struct ImBuf *ibuf, unsigned int newx, unsigned
 
 /* ******** threaded scaling ******** */
 
-typedef struct ScaleTreadInitData {
-	ImBuf *ibuf;
-
-	unsigned int newx;
-	unsigned int newy;
-
-	unsigned char *byte_buffer;
-	float *float_buffer;
-} ScaleTreadInitData;
-
-typedef struct ScaleThreadData {
-	ImBuf *ibuf;
-
-	unsigned int newx;
-	unsigned int newy;
-
-	int start_line;
-	int tot_line;
-
-	unsigned char *byte_buffer;
-	float *float_buffer;
-} ScaleThreadData;
-
-static void scale_thread_init(void *data_v, int start_line, int tot_line, void *init_data_v)
-{
-	ScaleThreadData *data = (ScaleThreadData *) data_v;
-	ScaleTreadInitData *init_data = (ScaleTreadInitData *) init_data_v;
-
-	data->ibuf = init_data->ibuf;
-
-	data->newx = init_data->newx;
-	data->newy = init_data->newy;
-
-	data->start_line = start_line;
-	data->tot_line = tot_line;
-
-	data->byte_buffer = init_data->byte_buffer;
-	data->float_buffer = init_data->float_buffer;
-}
-
-static void *do_scale_thread(void *data_v)
-{
-	ScaleThreadData *data = (ScaleThreadData *) data_v;
-	ImBuf *ibuf = data->ibuf;
-	int i;
-	float factor_x = (float) ibuf->x / data->newx;
-	float factor_y = (float) ibuf->y / data->newy;
-
-	for (i = 0; i < data->tot_line; i++) {
-		int y = data->start_line + i;
-		int x;
-
-		for (x = 0; x < data->newx; x++) {
-			float u = (float) x * factor_x;
-			float v = (float) y * factor_y;
-			int offset = y * data->newx + x;
-
-			if (data->byte_buffer) {
-				unsigned char *pixel = data->byte_buffer + 4 * offset;
-				BLI_bilinear_interpolation_char((unsigned char *) ibuf->rect, pixel, ibuf->x, ibuf->y, 4, u, v);
-			}
-
-			if (data->float_buffer) {
-				float *pixel = data->float_buffer + ibuf->channels * offset;
-				BLI_bilinear_interpolation_fl(ibuf->rect_float, pixel, ibuf->x, ibuf->y, ibuf->channels, u, v);
-			}
-		}
-	}
-
-	return NULL;
-}
-
 void IMB_scaleImBuf_threaded(ImBuf *ibuf, unsigned int newx, unsigned int newy)
 {
-	ScaleTreadInitData init_data = {NULL};
-
-	/* prepare initialization data */
-	init_data.ibuf = ibuf;
-
-	init_data.newx = newx;
-	init_data.newy = newy;
+	ImBuf scaled = {NULL};
+	float factor_x = (float) ibuf->x / newx;
+	float factor_y = (float) ibuf->y / newy;
+	/* pixel x samples at x * factor_x, like it always did */
+	float mat[2][3] = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+
+	mat[0][0] = factor_x;
+	mat[0][2] = 0.5f - 0.5f * factor_x;
+	mat[1][1] = factor_y;
+	mat[1][2] = 0.5f - 0.5f * factor_y;
+
+	/* prepare the scaled buffers */
+	scaled.x = newx;
+	scaled.y = newy;
+	scaled.channels = ibuf->channels;
 
 	if (ibuf->rect)
-		init_data.byte_buffer = MEM_mallocN(4 * newx * newy * sizeof(char), "threaded scale byte buffer");
+		scaled.rect = MEM_mallocN(4 * newx * newy * sizeof(char), "threaded scale byte buffer");
 
 	if (ibuf->rect_float)
-		init_data.float_buffer = MEM_mallocN(ibuf->channels * newx * newy * sizeof(float), "threaded scale float buffer");
+		scaled.rect_float = MEM_mallocN(ibuf->channels * newx * newy * sizeof(float), "threaded scale float buffer");
 
 	/* actual scaling threads */
-	IMB_processor_apply_threaded(newy, sizeof(ScaleThreadData), &init_data,
-	                             scale_thread_init, do_scale_thread);
+	IMB_transform(&scaled, ibuf, mat, IMB_FILTER_BILINEAR, IMB_TRANSFORM_EXTEND, NULL);
 
 	/* alter image buffer */
 	ibuf->x = newx;
@@ -1706,12 +1644,12 @@ void IMB_scaleImBuf_threaded(ImBuf *ibuf, unsigned int newx, unsigned int newy)
 	if (ibuf->rect) {
 		imb_freerectImBuf(ibuf);
 		ibuf->mall |= IB_rect;
-		ibuf->rect = (unsigned int *) init_data.byte_buffer;
+		ibuf->rect = scaled.rect;
 	}
 
 	if (ibuf->rect_float) {
 		imb_freerectfloatImBuf(ibuf);
 		ibuf->mall |= IB_rectfloat;
-		ibuf->rect_float = init_data.float_buffer;
+		ibuf->rect_float = scaled.rect_float;
 	}
 }
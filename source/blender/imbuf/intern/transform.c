@@ -0,0 +1,345 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+/** \file blender/imbuf/intern/transform.c
+ *  \ingroup imbuf
+ *
+ * Affine resampling. The source position of the first pixel of a row is
+ * computed once, the others step along the first column of the matrix, and
+ * only the pixels landing outside the source are checked for it. Rows are
+ * done in bands on the task scheduler, see IMB_processor_apply_rows().
+ *
+ * IMB_rotation(), IMB_offset(), IMB_scaleImBuf_threaded() and the image
+ * layer transforms all resample through here.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "BLI_utildefines.h"
+#include "BLI_math.h"
+
+#include "imbuf.h"
+#include "DNA_imbuf_types.h"
+#include "IMB_imbuf.h"
+
+/* sines and cosines this close to whole numbers are snapped, so quarter
+ * turns done with sinf() and cosf() move whole pixels */
+#define TRANSFORM_EPSILON		1e-5f
+
+static float transform_snap(float value)
+{
+	const float value_round = floorf(value + 0.5f);
+
+	return (fabsf(value - value_round) < TRANSFORM_EPSILON) ? value_round : value;
+}
+
+/* Whole pixels map to whole pixels: flips, offsets and quarter turns.
+ * Those are copied as they are, whatever the filter */
+static bool transform_is_exact(const float mat[2][3])
+{
+	int r;
+
+	for (r = 0; r < 2; r++) {
+		if (fabsf(mat[r][0]) + fabsf(mat[r][1]) != 1.0f || (mat[r][0] != 0.0f && mat[r][1] != 0.0f))
+			return false;
+		if (mat[r][2] != floorf(mat[r][2]))
+			return false;
+	}
+
+	/* not both from the same axis */
+	return ((mat[0][0] != 0.0f) != (mat[1][0] != 0.0f));
+}
+
+/* The matrix turning a width x height buffer by "angle", the way IMB_rotation()
+ * always did. With "lock" it turns around the center and keeps its size,
+ * otherwise the result grows to hold all of it */
+void IMB_transform_rotation_matrix(int width, int height, float angle, bool lock,
+                                   float r_mat[2][3], int *r_width, int *r_height)
+{
+	const float cosine = transform_snap(cosf(angle));
+	const float sine = transform_snap(sinf(angle));
+	const float w = width, h = height;
+	float px, py, minx, miny, maxx, maxy;
+
+	r_mat[0][0] = cosine;
+	r_mat[0][1] = sine;
+	r_mat[1][0] = -sine;
+	r_mat[1][1] = cosine;
+
+	if (lock) {
+		px = w * 0.5f;
+		py = h * 0.5f;
+
+		r_mat[0][2] = px - cosine * px - sine * py;
+		r_mat[1][2] = py + sine * px - cosine * py;
+
+		*r_width = width;
+		*r_height = height;
+	}
+	else {
+		/* bounds of the corners turned by the angle */
+		minx = min_ff(min_ff(0.0f, cosine * w), min_ff(-sine * h, cosine * w - sine * h));
+		maxx = max_ff(max_ff(0.0f, cosine * w), max_ff(-sine * h, cosine * w - sine * h));
+		miny = min_ff(min_ff(0.0f, sine * w), min_ff(cosine * h, sine * w + cosine * h));
+		maxy = max_ff(max_ff(0.0f, sine * w), max_ff(cosine * h, sine * w + cosine * h));
+
+		r_mat[0][2] = cosine * minx + sine * miny;
+		r_mat[1][2] = cosine * miny - sine * minx;
+
+		*r_width = (int)(maxx - minx + 0.5f);
+		*r_height = (int)(maxy - miny + 0.5f);
+	}
+}
+
+/* One pixel at u, v of "ibuf", nearest is clamped to the edges */
+BLI_INLINE void transform_sample(const ImBuf *ibuf, bool is_float, int filter, float u, float v, void *r_pixel)
+{
+	int x, y;
+
+	switch (filter) {
+		case IMB_FILTER_BILINEAR:
+			if (is_float)
+				BLI_bilinear_interpolation_fl(ibuf->rect_float, r_pixel, ibuf->x, ibuf->y, ibuf->channels,
+				                              u - 0.5f, v - 0.5f);
+			else
+				BLI_bilinear_interpolation_char((unsigned char *)ibuf->rect, r_pixel, ibuf->x, ibuf->y, 4,
+				                                u - 0.5f, v - 0.5f);
+			break;
+		case IMB_FILTER_BICUBIC:
+			if (is_float)
+				BLI_bicubic_interpolation_fl(ibuf->rect_float, r_pixel, ibuf->x, ibuf->y, ibuf->channels,
+				                             u - 0.5f, v - 0.5f);
+			else
+				BLI_bicubic_interpolation_char((unsigned char *)ibuf->rect, r_pixel, ibuf->x, ibuf->y, 4,
+				                               u - 0.5f, v - 0.5f);
+			break;
+		default:
+			x = CLAMPIS((int)floorf(u), 0, ibuf->x - 1);
+			y = CLAMPIS((int)floorf(v), 0, ibuf->y - 1);
+
+			if (is_float)
+				memcpy(r_pixel, ibuf->rect_float + ((size_t)y * ibuf->x + x) * ibuf->channels,
+				       sizeof(float) * ibuf->channels);
+			else
+				*(unsigned int *)r_pixel = ibuf->rect[(size_t)y * ibuf->x + x];
+			break;
+	}
+}
+
+BLI_INLINE float transform_wrap(float value, float size)
+{
+	value = fmodf(value, size);
+
+	return (value < 0.0f) ? value + size : value;
+}
+
+/* Narrows start..end to the pixels whose position u0 + (x + i) * du is inside 0..size */
+static void transform_row_clip(float u0, float du, int x, float size, int *r_start, int *r_end)
+{
+	float a, b;
+
+	if (du == 0.0f) {
+		if (!(u0 >= 0.0f && u0 < size))
+			*r_end = *r_start;
+		return;
+	}
+
+	a = -u0 / du - x;
+	b = (size - u0) / du - x;
+	if (du < 0.0f)
+		SWAP(float, a, b);
+
+	/* a pixel wider, the exact ends are found below with the same
+	 * arithmetic the row uses */
+	a = max_ff(a - 1.0f, (float)*r_start);
+	b = min_ff(b + 1.0f, (float)*r_end);
+
+	if (a >= b) {
+		*r_end = *r_start;
+		return;
+	}
+
+	*r_start = (int)a;
+	*r_end = (int)ceilf(b);
+
+#define INSIDE(i) ((u0 + (x + (i)) * du) >= 0.0f && (u0 + (x + (i)) * du) < size)
+	while (*r_start < *r_end && !INSIDE(*r_start))
+		(*r_start)++;
+	while (*r_end > *r_start && !INSIDE(*r_end - 1))
+		(*r_end)--;
+#undef INSIDE
+}
+
+/* Samples "len" pixels of the row "y" of the transformed buffer, starting
+ * at "x", into "r_row". The float buffer is sampled with "is_float", the
+ * byte one otherwise, "fill" is a pixel of the same kind */
+void IMB_transform_sample_row(const ImBuf *ibuf, bool is_float, const float mat[2][3], int filter,
+                              int extend, const void *fill, int x, int y, int len, void *r_row)
+{
+	const size_t pixel_size = is_float ? sizeof(float) * ibuf->channels : sizeof(char[4]);
+	const float w = ibuf->x, h = ibuf->y;
+	const float du = mat[0][0], dv = mat[1][0];
+	/* position of the first pixel of the row, the others are steps along it. Pixels
+	 * are stepped to from there whatever "x" is, so parts of a row match the row */
+	const float u0 = mat[0][0] * 0.5f + mat[0][1] * (y + 0.5f) + mat[0][2];
+	const float v0 = mat[1][0] * 0.5f + mat[1][1] * (y + 0.5f) + mat[1][2];
+	char *pixel = r_row;
+	float u, v;
+	int i, r, start, end, outside[2][2];
+
+	if (transform_is_exact(mat))
+		filter = IMB_FILTER_NEAREST;
+
+	if (extend == IMB_TRANSFORM_WRAP) {
+		u = transform_wrap(u0 + x * du, w);
+		v = transform_wrap(v0 + x * dv, h);
+
+		if (filter == IMB_FILTER_NEAREST && du == 1.0f && dv == 0.0f) {
+			/* plain offsets, the row is copied in runs up to the source edge */
+			const char *src_row = is_float ? (const char *)(ibuf->rect_float + (size_t)(int)v * ibuf->x * ibuf->channels) :
+			                                 (const char *)(ibuf->rect + (size_t)(int)v * ibuf->x);
+			int src_x = min_ii((int)u, ibuf->x - 1), run;
+
+			for (i = 0; i < len; i += run, src_x = 0) {
+				run = min_ii(len - i, ibuf->x - src_x);
+				memcpy(pixel + pixel_size * i, src_row + pixel_size * src_x, pixel_size * run);
+			}
+			return;
+		}
+
+		for (i = 0; i < len; i++, pixel += pixel_size) {
+			u = u0 + (x + i) * du;
+			v = v0 + (x + i) * dv;
+			if (u < 0.0f || u >= w)
+				u = transform_wrap(u, w);
+			if (v < 0.0f || v >= h)
+				v = transform_wrap(v, h);
+
+			transform_sample(ibuf, is_float, filter, u, v, pixel);
+		}
+		return;
+	}
+
+	start = 0;
+	end = len;
+	transform_row_clip(u0, du, x, w, &start, &end);
+	transform_row_clip(v0, dv, x, h, &start, &end);
+
+	/* pixels before and after the source */
+	outside[0][0] = 0;
+	outside[0][1] = start;
+	outside[1][0] = end;
+	outside[1][1] = len;
+
+	for (r = 0; r < 2; r++) {
+		pixel = (char *)r_row + pixel_size * outside[r][0];
+
+		for (i = outside[r][0]; i < outside[r][1]; i++, pixel += pixel_size) {
+			if (extend == IMB_TRANSFORM_FILL)
+				memcpy(pixel, fill, pixel_size);
+			else
+				transform_sample(ibuf, is_float, filter, u0 + (x + i) * du, v0 + (x + i) * dv, pixel);
+		}
+	}
+
+	/* pixels inside, nearest needs no clamping there */
+	pixel = (char *)r_row + pixel_size * start;
+
+	if (filter != IMB_FILTER_NEAREST) {
+		for (i = start; i < end; i++, pixel += pixel_size)
+			transform_sample(ibuf, is_float, filter, u0 + (x + i) * du, v0 + (x + i) * dv, pixel);
+	}
+	else if (du == 1.0f && dv == 0.0f) {
+		const size_t offset = (size_t)(int)v0 * ibuf->x + (int)(u0 + (x + start) * du);
+
+		if (is_float)
+			memcpy(pixel, ibuf->rect_float + offset * ibuf->channels, pixel_size * (end - start));
+		else
+			memcpy(pixel, ibuf->rect + offset, pixel_size * (end - start));
+	}
+	else if (is_float) {
+		for (i = start; i < end; i++, pixel += pixel_size) {
+			const size_t offset = (size_t)(int)(v0 + (x + i) * dv) * ibuf->x + (int)(u0 + (x + i) * du);
+			memcpy(pixel, ibuf->rect_float + offset * ibuf->channels, pixel_size);
+		}
+	}
+	else {
+		unsigned int *pixel_byte = (unsigned int *)pixel;
+
+		for (i = start; i < end; i++, pixel_byte++)
+			*pixel_byte = ibuf->rect[(size_t)(int)(v0 + (x + i) * dv) * ibuf->x + (int)(u0 + (x + i) * du)];
+	}
+}
+
+/* ******** threaded resampling ******** */
+
+typedef struct TransformRows {
+	ImBuf *dst;
+	const ImBuf *src;
+	const float (*mat)[3];
+	int filter;
+	int extend;
+	float fill[4];
+	unsigned char fill_byte[4];
+} TransformRows;
+
+static void transform_rows(void *userdata, int start_line, int tot_line)
+{
+	TransformRows *data = userdata;
+	ImBuf *dst = data->dst;
+	const ImBuf *src = data->src;
+	int y;
+
+	for (y = start_line; y < start_line + tot_line; y++) {
+		if (dst->rect && src->rect) {
+			IMB_transform_sample_row(src, false, data->mat, data->filter, data->extend, data->fill_byte,
+			                         0, y, dst->x, dst->rect + (size_t)y * dst->x);
+		}
+
+		if (dst->rect_float && src->rect_float) {
+			IMB_transform_sample_row(src, true, data->mat, data->filter, data->extend, data->fill,
+			                         0, y, dst->x, dst->rect_float + (size_t)y * dst->x * src->channels);
+		}
+	}
+}
+
+/* Resamples "src" into all of "dst", every buffer they both have. Float
+ * buffers of "dst" have the channels of "src". "fill" is the color outside
+ * the source with IMB_TRANSFORM_FILL, transparent when it's NULL */
+void IMB_transform(ImBuf *dst, const ImBuf *src, const float mat[2][3], int filter,
+                   int extend, const float fill[4])
+{
+	TransformRows data;
+
+	data.dst = dst;
+	data.src = src;
+	data.mat = mat;
+	data.filter = filter;
+	data.extend = extend;
+
+	if (fill)
+		copy_v4_v4(data.fill, fill);
+	else
+		zero_v4(data.fill);
+	rgba_float_to_uchar(data.fill_byte, data.fill);
+
+	IMB_processor_apply_rows(dst->y, dst->x, &data, transform_rows);
+}
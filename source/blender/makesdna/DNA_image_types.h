@@ -46,6 +46,8 @@ struct anim;
 struct ImBuf;
 struct RenderResult;
 struct GPUTexture;
+struct ImageLayerCache;
+struct ImageLayerMip;
 
 
 /* ImageUser is in Texture, in Nodes, Background Image, Image Window, .... */
@@ -76,7 +78,7 @@ typedef struct ImageUser {
 typedef struct ImageLayer {
 	struct ImageLayer *next, *prev;
 	//ID id;
-	//struct PreviewImage * preview;
+	struct PreviewImage *preview;	/* thumbnail for the layer list, runtime */
 	char name[64];
 	char file_path[1024];
 	float opacity;
@@ -86,14 +88,100 @@ typedef struct ImageLayer {
 	short visible;
 	short select;
 	short locked;
-	int pad1;
-	//int icon_id;
+	int generation;		/* changes whenever the pixels change, see imalayer_tag_dirty() */
+	int icon_id;		/* of the preview, runtime */
+	int thumb_generation;	/* generation the preview was made of, runtime */
 	float default_color[4];
-	int pad2;
+	short transform_flag;
+	short transform_filter;
+	/* non destructive transform, see layer_transform.c. Maps the centers of
+	 * the pixels of the transformed layer to the pixels in ibufs */
+	float transform[2][3];
+	int transform_x, transform_y;	/* size of the transformed layer */
+	float transform_color[4];		/* of the pixels outside the untransformed ones */
+	/* nesting level: the layers following a group (IMA_LAYER_GROUP) with a
+	 * higher depth are in it */
+	short depth;
+	short flag;
+	short pad3[2];
 	ListBase ibufs;
 	struct ImBuf *preview_ibuf;
+	struct ImageLayerStorage *storage;	/* compressed pixels, see imalayer_storage_ensure() */
+	struct ImageLayerCache *group_cache;	/* composite of the layers of a group, runtime */
+	struct ImageLayerMask *mask;		/* scales the alpha of the layer, see layer_mask.c */
+	struct ImageLayerAdjustment *adjustment;	/* of IMA_LAYER_ADJUSTMENT layers, see layer_adjustment.c */
+	struct ImageLayerMip *mip;			/* halved copies for zoomed out views, runtime */
 }ImageLayer;
 
+/* Pixels of an ImageLayer in files, in tiles of IMA_LAYER_TILE_SIZE.
+ * Uniform tiles (empty ones included) only store their pixel, the other
+ * ones are compressed separately so they can be decoded one by one */
+typedef struct ImageLayerTile {
+	int flag;
+	int size;			/* bytes in data */
+	char uniform[16];	/* byte, float or half RGBA pixel of an uniform tile */
+	void *data;
+} ImageLayerTile;
+
+typedef struct ImageLayerStorage {
+	int x, y;
+	int xtiles, ytiles;
+	int generation;		/* ImageLayer.generation the tiles match, runtime */
+	int flag;
+	struct ImageLayerTile *rect;		/* tiles of ImBuf.rect, NULL when there was none */
+	struct ImageLayerTile *rect_float;	/* tiles of ImBuf.rect_float */
+	char *dirty;		/* tiles painted since generation, packed again alone, runtime */
+} ImageLayerStorage;
+
+/* ImageLayerTile.flag */
+#define IMA_LAYER_TILE_UNIFORM	(1<<0)
+#define IMA_LAYER_TILE_LZO		(1<<1)
+
+/* ImageLayerStorage.flag */
+#define IMA_LAYER_STORAGE_HALF	(1<<0)	/* rect_float tiles hold RGBA half floats */
+
+/* Greyscale mask of an ImageLayer in tiles of IMA_LAYER_TILE_SIZE 8 bit
+ * values. Tiles of a single value (IMA_LAYER_TILE_UNIFORM) only store it */
+typedef struct ImageLayerMaskTile {
+	int flag;
+	char uniform, pad[3];
+	unsigned char *data;	/* IMA_LAYER_TILE_SIZE rows of IMA_LAYER_TILE_SIZE values */
+} ImageLayerMaskTile;
+
+typedef struct ImageLayerMask {
+	int x, y;
+	int xtiles, ytiles;
+	int flag;
+	int generation;		/* changes whenever the values change, runtime */
+	struct ImageLayerMaskTile *tiles;
+	struct ImBuf *ibuf;	/* the mask as a grey image while it's edited, runtime */
+} ImageLayerMask;
+
+/* ImageLayerMask.flag */
+#define IMA_LAYER_MASK_DISABLED	(1<<0)
+#define IMA_LAYER_MASK_EDIT		(1<<1)
+
+/* Colour correction an adjustment layer does to the layers below it. Only
+ * the settings of "type" are used */
+typedef struct ImageLayerAdjustment {
+	int type;
+	int pad;
+	struct CurveMapping *curve;
+	float levels_in[2];		/* black and white input points */
+	float levels_out[2];	/* black and white output points */
+	float levels_gamma;
+	float hue, saturation, value;
+	float exposure;			/* stops */
+	float offset;
+	struct ImageLayerAdjustmentLUT *lut;	/* runtime, made again when the settings change */
+} ImageLayerAdjustment;
+
+/* ImageLayerAdjustment.type */
+#define IMA_LAYER_ADJUST_CURVES			0
+#define IMA_LAYER_ADJUST_LEVELS			1
+#define IMA_LAYER_ADJUST_HUE_SATURATION	2
+#define IMA_LAYER_ADJUST_EXPOSURE		3
+
 /* **************** IMAGE LAYER********************* */
 #define IMA_LAYER_MAX_LEN	64
 
@@ -253,6 +341,8 @@ int32 Color_HlsToRgb(float64 Hue, float64 Lumination, float64 Saturation, uint8
 /* ImageLayer.type */
 #define IMA_LAYER_BASE		(1<<0)
 #define IMA_LAYER_LAYER		(1<<1)
+#define IMA_LAYER_GROUP		(1<<2)
+#define IMA_LAYER_ADJUSTMENT	(1<<3)
 
 /* ImageLayer.visible */
 #define IMA_LAYER_VISIBLE	(1<<0)
@@ -264,10 +354,22 @@ int32 Color_HlsToRgb(float64 Hue, float64 Lumination, float64 Saturation, uint8
 #define IMA_LAYER_SEL_TOP		(1<<3)
 #define IMA_LAYER_SEL_BOTTOM	(1<<4)
 
+/* ImageLayer.flag */
+#define IMA_LAYER_HALF_FLOAT	(1<<0)	/* float pixels are kept as half floats, see layer_storage.c */
+
 /* ImageLayer.locked */
 #define IMA_LAYER_LOCK			1
 #define IMA_LAYER_LOCK_ALPHA	2
 
+/* ImageLayer.transform_flag */
+#define IMA_LAYER_TRANSFORM			(1<<0)
+#define IMA_LAYER_TRANSFORM_WRAP	(1<<1)	/* the pixels repeat outside */
+
+/* ImageLayer.transform_filter */
+#define IMA_LAYER_FILTER_NEAREST	0
+#define IMA_LAYER_FILTER_BILINEAR	1
+#define IMA_LAYER_FILTER_BICUBIC	2
+
 /* Option for delete the layer*/
 #define IMA_LAYER_DEL_SELECTED	(1<<0)
 #define IMA_LAYER_DEL_HIDDEN	(1<<1)
@@ -331,8 +433,9 @@ typedef struct Image {
 	int Count_Layers;
 	short use_layers;
 	short color_space;
-	int pad4;
+	float preview_scale;	/* image pixels per preview_ibuf pixel, 0 is 1, runtime */
 	struct ListBase imlayers;
+	struct ImageLayerCache *layer_cache;	/* composite of imlayers, not written in file */
 } Image;
 
 
@@ -67,6 +67,7 @@ extern EnumPropertyItem image_type_items[];
 extern EnumPropertyItem image_color_mode_items[];
 extern EnumPropertyItem image_depth_mode_items[];
 extern EnumPropertyItem image_generated_type_items[];
+extern EnumPropertyItem image_layer_adjustment_type_items[];
 
 extern EnumPropertyItem color_sets_items[];
 
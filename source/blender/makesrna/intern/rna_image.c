@@ -87,6 +87,14 @@ EnumPropertyItem image_layer_mode_items[] = {
 	{IMA_LAYER_SOFT_BURN, "SOFT_BURN", 0, "Soft Burn", ""},
 	{0, NULL, 0, NULL, NULL}};
 
+EnumPropertyItem image_layer_adjustment_type_items[] = {
+	{IMA_LAYER_ADJUST_CURVES, "CURVES", 0, "Curves", "Map the channels through curves"},
+	{IMA_LAYER_ADJUST_LEVELS, "LEVELS", 0, "Levels", "Remap the black and white points with a gamma"},
+	{IMA_LAYER_ADJUST_HUE_SATURATION, "HUE_SATURATION", 0, "Hue/Saturation", "Shift the hue, scale saturation and value"},
+	{IMA_LAYER_ADJUST_EXPOSURE, "EXPOSURE", 0, "Exposure", "Scale the colors by stops and add an offset"},
+	{0, NULL, 0, NULL, NULL}
+};
+
 #ifdef RNA_RUNTIME
 
 #include "IMB_imbuf.h"
@@ -361,8 +369,10 @@ static void rna_Image_active_image_layer_set(PointerRNA *ptr, PointerRNA value)
 	Image *ima = (Image*)ptr->data;
 	ImageLayer *layer = (ImageLayer*)value.data;
 	const int index = BLI_findindex(&ima->imlayers, layer);
-	if (index != -1)
+	if (index != -1) {
 		imalayer_set_current_act(ima, index);
+		imalayer_storage_compact_inactive(ima);
+	}
 }
 
 static void rna_Image_layers_begin(CollectionPropertyIterator *iter, PointerRNA *ptr)
@@ -388,6 +398,7 @@ static void rna_Image_active_image_layer_index_set(PointerRNA *ptr, int value)
 	Image *ima = (Image*)ptr->data;
 
 	imalayer_set_current_act(ima, value);
+	imalayer_storage_compact_inactive(ima);
 }
  
 static void rna_Image_active_image_layer_index_range(PointerRNA *ptr, int *min, int *max, int *softmin, int *softmax)
@@ -402,6 +413,71 @@ static void rna_Image_active_image_layer_index_range(PointerRNA *ptr, int *min,
 	*softmax = *max;
 }
 
+static void rna_ImageLayerAdjustment_update(Main *UNUSED(bmain), Scene *UNUSED(scene), PointerRNA *ptr)
+{
+	Image *ima = (Image *)ptr->id.data;
+	ImageLayer *layer;
+
+	if (ima == NULL)
+		return;
+
+	for (layer = ima->imlayers.first; layer; layer = layer->next) {
+		if (layer->adjustment == ptr->data) {
+			imalayer_adjustment_tag_dirty(ima, layer);
+			break;
+		}
+	}
+}
+
+static void rna_ImageLayer_use_half_float_set(PointerRNA *ptr, int value)
+{
+	imalayer_set_half_float(ptr->id.data, ptr->data, value != 0);
+}
+
+static int rna_ImageLayer_has_mask_get(PointerRNA *ptr)
+{
+	ImageLayer *layer = (ImageLayer *)ptr->data;
+	return (layer->mask != NULL);
+}
+
+static int rna_ImageLayer_use_mask_get(PointerRNA *ptr)
+{
+	ImageLayer *layer = (ImageLayer *)ptr->data;
+	return (imalayer_mask_used(layer) != NULL);
+}
+
+static void rna_ImageLayer_use_mask_set(PointerRNA *ptr, int value)
+{
+	ImageLayer *layer = (ImageLayer *)ptr->data;
+
+	if (layer->mask == NULL)
+		return;
+
+	if (value)
+		layer->mask->flag &= ~IMA_LAYER_MASK_DISABLED;
+	else
+		layer->mask->flag |= IMA_LAYER_MASK_DISABLED;
+}
+
+static int rna_ImageLayer_edit_mask_get(PointerRNA *ptr)
+{
+	ImageLayer *layer = (ImageLayer *)ptr->data;
+	return imalayer_mask_is_edited(layer);
+}
+
+static void rna_ImageLayer_edit_mask_set(PointerRNA *ptr, int value)
+{
+	ImageLayer *layer = (ImageLayer *)ptr->data;
+
+	if (layer->mask == NULL)
+		return;
+
+	if (value)
+		layer->mask->flag |= IMA_LAYER_MASK_EDIT;
+	else
+		imalayer_mask_end_edit(layer->mask);
+}
+
 static int rna_Image_pixels_get_length(PointerRNA *ptr, int length[RNA_MAX_ARRAY_DIMENSION])
 {
 	Image *ima = ptr->id.data;
@@ -578,6 +654,8 @@ static void rna_def_image_layer_common(StructRNA *srna)
 	static EnumPropertyItem prop_type_items[] = {
 		{IMA_LAYER_BASE, "BASE", 0, "Base", ""},
 		{IMA_LAYER_LAYER, "LAYER", 0, "Layer", ""},
+		{IMA_LAYER_GROUP, "GROUP", 0, "Group", "Blends the layers following it as one layer"},
+		{IMA_LAYER_ADJUSTMENT, "ADJUSTMENT", 0, "Adjustment", "Changes the colors of the layers below it"},
 		{0, NULL, 0, NULL, NULL}};
 
 	static EnumPropertyItem prop_background_items[] = {
@@ -634,7 +712,113 @@ static void rna_def_image_layer_common(StructRNA *srna)
 	//RNA_def_property_boolean_sdna(prop, NULL, "type", IMA_LAYER_BASE);
 	RNA_def_property_enum_sdna(prop, NULL, "type");
 	RNA_def_property_enum_items(prop, prop_type_items);
+	/* groups are made by the operators, with their layers */
+	RNA_def_property_clear_flag(prop, PROP_EDITABLE);
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, NULL);
+
+	prop = RNA_def_property(srna, "depth", PROP_INT, PROP_UNSIGNED);
+	RNA_def_property_int_sdna(prop, NULL, "depth");
+	RNA_def_property_clear_flag(prop, PROP_EDITABLE);
+	RNA_def_property_ui_text(prop, "Depth", "Number of groups the layer is in");
+
+	prop = RNA_def_property(srna, "use_half_float", PROP_BOOLEAN, PROP_NONE);
+	RNA_def_property_boolean_sdna(prop, NULL, "flag", IMA_LAYER_HALF_FLOAT);
+	RNA_def_property_boolean_funcs(prop, NULL, "rna_ImageLayer_use_half_float_set");
+	RNA_def_property_ui_text(prop, "Half Float", "Keep the float pixels of the layer as 16 bit half floats, "
+	                         "only the active layer has full float pixels while it's painted");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, NULL);
+
+	prop = RNA_def_property(srna, "has_mask", PROP_BOOLEAN, PROP_NONE);
+	RNA_def_property_boolean_funcs(prop, "rna_ImageLayer_has_mask_get", NULL);
+	RNA_def_property_clear_flag(prop, PROP_EDITABLE);
+	RNA_def_property_ui_text(prop, "Has Mask", "The layer has a greyscale mask");
+
+	prop = RNA_def_property(srna, "use_mask", PROP_BOOLEAN, PROP_NONE);
+	RNA_def_property_boolean_funcs(prop, "rna_ImageLayer_use_mask_get", "rna_ImageLayer_use_mask_set");
+	RNA_def_property_ui_text(prop, "Use Mask", "Scale the alpha of the layer by its mask");
 	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, NULL);
+
+	prop = RNA_def_property(srna, "edit_mask", PROP_BOOLEAN, PROP_NONE);
+	RNA_def_property_boolean_funcs(prop, "rna_ImageLayer_edit_mask_get", "rna_ImageLayer_edit_mask_set");
+	RNA_def_property_ui_text(prop, "Edit Mask", "Paint on the mask of the layer instead of its pixels");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, NULL);
+
+	prop = RNA_def_property(srna, "adjustment", PROP_POINTER, PROP_NONE);
+	RNA_def_property_pointer_sdna(prop, NULL, "adjustment");
+	RNA_def_property_struct_type(prop, "ImageLayerAdjustment");
+	RNA_def_property_ui_text(prop, "Adjustment", "Color correction of an adjustment layer, None for other layers");
+}
+
+static void rna_def_image_layer_adjustment(BlenderRNA *brna)
+{
+	StructRNA *srna;
+	PropertyRNA *prop;
+
+	srna = RNA_def_struct(brna, "ImageLayerAdjustment", NULL);
+	RNA_def_struct_ui_text(srna, "Image Layer Adjustment", "Color correction of the layers below an adjustment layer");
+
+	prop = RNA_def_property(srna, "type", PROP_ENUM, PROP_NONE);
+	RNA_def_property_enum_sdna(prop, NULL, "type");
+	RNA_def_property_enum_items(prop, image_layer_adjustment_type_items);
+	RNA_def_property_ui_text(prop, "Type", "");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "curve", PROP_POINTER, PROP_NONE);
+	RNA_def_property_pointer_sdna(prop, NULL, "curve");
+	RNA_def_property_struct_type(prop, "CurveMapping");
+	RNA_def_property_flag(prop, PROP_NEVER_NULL);
+	RNA_def_property_ui_text(prop, "Curve", "");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "levels_in", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "levels_in");
+	RNA_def_property_array(prop, 2);
+	RNA_def_property_range(prop, 0.0f, 1.0f);
+	RNA_def_property_ui_text(prop, "Input Levels", "Black and white input points");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "levels_out", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "levels_out");
+	RNA_def_property_array(prop, 2);
+	RNA_def_property_range(prop, 0.0f, 1.0f);
+	RNA_def_property_ui_text(prop, "Output Levels", "Black and white output points");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "levels_gamma", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "levels_gamma");
+	RNA_def_property_range(prop, 0.01f, 10.0f);
+	RNA_def_property_ui_text(prop, "Gamma", "Gamma of the values between the input points");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "hue", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "hue");
+	RNA_def_property_range(prop, -0.5f, 0.5f);
+	RNA_def_property_ui_text(prop, "Hue", "Shift of the hue");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "saturation", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "saturation");
+	RNA_def_property_range(prop, 0.0f, 2.0f);
+	RNA_def_property_ui_text(prop, "Saturation", "");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "value", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "value");
+	RNA_def_property_range(prop, 0.0f, 2.0f);
+	RNA_def_property_ui_text(prop, "Value", "");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "exposure", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "exposure");
+	RNA_def_property_range(prop, -10.0f, 10.0f);
+	RNA_def_property_ui_text(prop, "Exposure", "Exposure change in stops");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
+
+	prop = RNA_def_property(srna, "offset", PROP_FLOAT, PROP_NONE);
+	RNA_def_property_float_sdna(prop, NULL, "offset");
+	RNA_def_property_range(prop, -1.0f, 1.0f);
+	RNA_def_property_ui_text(prop, "Offset", "Value added to the colors after the exposure");
+	RNA_def_property_update(prop, NC_IMAGE | ND_DISPLAY, "rna_ImageLayerAdjustment_update");
 }
 
 static void rna_def_image_layer(BlenderRNA *brna)
@@ -975,6 +1159,7 @@ static void rna_def_image(BlenderRNA *brna)
 
 void RNA_def_image(BlenderRNA *brna)
 {
+	rna_def_image_layer_adjustment(brna);
 	rna_def_image_layer(brna);
 	rna_def_imbuf(brna);
 	rna_def_image(brna);
@@ -374,6 +374,8 @@ enum {
 	WM_JOB_TYPE_CLIP_SOLVE_CAMERA,
 	WM_JOB_TYPE_CLIP_PREFETCH,
 	WM_JOB_TYPE_SEQ_BUILD_PROXY,
+	WM_JOB_TYPE_IMAGE_PREVIEW,
+	WM_JOB_TYPE_IMAGE_LAYER_THUMBS,
 	/* add as needed, screencast, seq proxy build
 	 * if having hard coded values is a problem */
 };